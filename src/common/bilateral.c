@@ -18,6 +18,7 @@
 
 #include "common/bilateral.h"
 #include "common/darktable.h" // for CLAMPS, dt_alloc_align, dt_free_align
+#include "common/threadpool.h"
 #include <glib.h>             // for MIN, MAX
 #include <math.h>             // for roundf
 #include <stdlib.h>           // for size_t, free, malloc, NULL
@@ -120,16 +121,39 @@ dt_bilateral_t *dt_bilateral_init(const int width,     // width of input image
   return b;
 }
 
-void dt_bilateral_splat(dt_bilateral_t *b, const float *const in)
+typedef struct _bilateral_pass_t
+{
+  const dt_bilateral_t *b;
+  const float *in;
+  float *out;
+  float norm;
+} _bilateral_pass_t;
+
+typedef struct _bilateral_blur_t
+{
+  float *buf;
+  int offset1, offset2, offset3;
+  int size2, size3;
+} _bilateral_blur_t;
+
+// the grid is a lot coarser than the image, so the threads keep adding to the same cells
+static inline void _atomic_add(float *var, const float x)
+{
+  float old = *var, sum;
+  do
+    sum = old + x;
+  while(!__atomic_compare_exchange(var, &old, &sum, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void _splat_rows(void *data, size_t begin, size_t end, int thread)
 {
+  const _bilateral_pass_t *const p = (const _bilateral_pass_t *)data;
+  const dt_bilateral_t *const b = p->b;
+  const float *const in = p->in;
   const int ox = 1;
   const int oy = b->size_x;
   const int oz = b->size_y * b->size_x;
-// splat into downsampled grid
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(b)
-#endif
-  for(int j = 0; j < b->height; j++)
+  for(int j = begin; j < end; j++)
   {
     size_t index = 4 * j * b->width;
     for(int i = 0; i < b->width; i++)
@@ -154,25 +178,29 @@ void dt_bilateral_splat(dt_bilateral_t *b, const float *const in)
         const size_t ii = grid_index + ((k & 1) ? ox : 0) + ((k & 2) ? oy : 0) + ((k & 4) ? oz : 0);
         const float contrib = ((k & 1) ? xf : (1.0f - xf)) * ((k & 2) ? yf : (1.0f - yf))
                               * ((k & 4) ? zf : (1.0f - zf)) * 100.0f / (b->sigma_s * b->sigma_s);
-#ifdef _OPENMP
-#pragma omp atomic
-#endif
-        b->buf[ii] += contrib;
+        _atomic_add(b->buf + ii, contrib);
       }
       index += 4;
     }
   }
 }
 
-static void blur_line_z(float *buf, const int offset1, const int offset2, const int offset3, const int size1,
-                        const int size2, const int size3)
+void dt_bilateral_splat(dt_bilateral_t *b, const float *const in)
+{
+  // splat into downsampled grid
+  _bilateral_pass_t p = { .b = b, .in = in };
+  dt_threadpool_for(b->height, 4, _splat_rows, &p);
+}
+
+static void _blur_lines_z(void *data, size_t begin, size_t end, int thread)
 {
+  const _bilateral_blur_t *const p = (const _bilateral_blur_t *)data;
+  float *const buf = p->buf;
+  const int offset1 = p->offset1, offset2 = p->offset2, offset3 = p->offset3;
+  const int size2 = p->size2, size3 = p->size3;
   const float w1 = 4.f / 16.f;
   const float w2 = 2.f / 16.f;
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(buf)
-#endif
-  for(int k = 0; k < size1; k++)
+  for(int k = begin; k < end; k++)
   {
     size_t index = (size_t)k * offset1;
     for(int j = 0; j < size2; j++)
@@ -201,16 +229,16 @@ static void blur_line_z(float *buf, const int offset1, const int offset2, const
   }
 }
 
-static void blur_line(float *buf, const int offset1, const int offset2, const int offset3, const int size1,
-                      const int size2, const int size3)
+static void _blur_lines(void *data, size_t begin, size_t end, int thread)
 {
+  const _bilateral_blur_t *const p = (const _bilateral_blur_t *)data;
+  float *const buf = p->buf;
+  const int offset1 = p->offset1, offset2 = p->offset2, offset3 = p->offset3;
+  const int size2 = p->size2, size3 = p->size3;
   const float w0 = 6.f / 16.f;
   const float w1 = 4.f / 16.f;
   const float w2 = 1.f / 16.f;
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(buf)
-#endif
-  for(int k = 0; k < size1; k++)
+  for(int k = begin; k < end; k++)
   {
     size_t index = (size_t)k * offset1;
     for(int j = 0; j < size2; j++)
@@ -240,6 +268,20 @@ static void blur_line(float *buf, const int offset1, const int offset2, const in
   }
 }
 
+static void blur_line_z(float *buf, const int offset1, const int offset2, const int offset3, const int size1,
+                        const int size2, const int size3)
+{
+  _bilateral_blur_t p = { buf, offset1, offset2, offset3, size2, size3 };
+  dt_threadpool_for(size1, 1, _blur_lines_z, &p);
+}
+
+static void blur_line(float *buf, const int offset1, const int offset2, const int offset3, const int size1,
+                      const int size2, const int size3)
+{
+  _bilateral_blur_t p = { buf, offset1, offset2, offset3, size2, size3 };
+  dt_threadpool_for(size1, 1, _blur_lines, &p);
+}
+
 
 void dt_bilateral_blur(dt_bilateral_t *b)
 {
@@ -252,17 +294,17 @@ void dt_bilateral_blur(dt_bilateral_t *b)
 }
 
 
-void dt_bilateral_slice(const dt_bilateral_t *const b, const float *const in, float *out, const float detail)
+static void _slice_rows(void *data, size_t begin, size_t end, int thread)
 {
-  // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
-  const float norm = -detail * b->sigma_r * 0.04f;
+  const _bilateral_pass_t *const p = (const _bilateral_pass_t *)data;
+  const dt_bilateral_t *const b = p->b;
+  const float *const in = p->in;
+  float *const out = p->out;
+  const float norm = p->norm;
   const int ox = 1;
   const int oy = b->size_x;
   const int oz = b->size_y * b->size_x;
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(out)
-#endif
-  for(int j = 0; j < b->height; j++)
+  for(int j = begin; j < end; j++)
   {
     size_t index = 4 * j * b->width;
     for(int i = 0; i < b->width; i++)
@@ -297,18 +339,24 @@ void dt_bilateral_slice(const dt_bilateral_t *const b, const float *const in, fl
   }
 }
 
-void dt_bilateral_slice_to_output(const dt_bilateral_t *const b, const float *const in, float *out,
-                                  const float detail)
+void dt_bilateral_slice(const dt_bilateral_t *const b, const float *const in, float *out, const float detail)
 {
   // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
-  const float norm = -detail * b->sigma_r * 0.04f;
+  _bilateral_pass_t p = { .b = b, .in = in, .out = out, .norm = -detail * b->sigma_r * 0.04f };
+  dt_threadpool_for(b->height, 4, _slice_rows, &p);
+}
+
+static void _slice_rows_to_output(void *data, size_t begin, size_t end, int thread)
+{
+  const _bilateral_pass_t *const p = (const _bilateral_pass_t *)data;
+  const dt_bilateral_t *const b = p->b;
+  const float *const in = p->in;
+  float *const out = p->out;
+  const float norm = p->norm;
   const int ox = 1;
   const int oy = b->size_x;
   const int oz = b->size_y * b->size_x;
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(out)
-#endif
-  for(int j = 0; j < b->height; j++)
+  for(int j = begin; j < end; j++)
   {
     size_t index = 4 * j * b->width;
     for(int i = 0; i < b->width; i++)
@@ -338,6 +386,14 @@ void dt_bilateral_slice_to_output(const dt_bilateral_t *const b, const float *co
   }
 }
 
+void dt_bilateral_slice_to_output(const dt_bilateral_t *const b, const float *const in, float *out,
+                                  const float detail)
+{
+  // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
+  _bilateral_pass_t p = { .b = b, .in = in, .out = out, .norm = -detail * b->sigma_r * 0.04f };
+  dt_threadpool_for(b->height, 4, _slice_rows_to_output, &p);
+}
+
 void dt_bilateral_free(dt_bilateral_t *b)
 {
   if(!b) return;
@@ -17,6 +17,7 @@
 */
 
 #include "common/collection.h"
+#include "common/database.h"
 #include "common/debug.h"
 #include "common/image.h"
 #include "common/imageio_rawspeed.h"
@@ -55,10 +56,13 @@ static const char *comparators[] = {
 static int _dt_collection_store(const dt_collection_t *collection, gchar *query);
 /* Counts the number of images in the current collection */
 static uint32_t _dt_collection_compute_count(const dt_collection_t *collection);
+/* fills memory.collected_images with the current query, returns the number of images */
+static uint32_t _dt_collection_materialize(const dt_collection_t *collection);
 /* signal handlers to update the cached count when something interesting might have happened.
  * we need 2 different since there are different kinds of signals we need to listen to. */
 static void _dt_collection_recount_callback_1(gpointer instace, gpointer user_data);
 static void _dt_collection_recount_callback_2(gpointer instance, uint8_t id, gpointer user_data);
+static void _dt_collection_tag_changed_callback(gpointer instance, gpointer user_data);
 
 /* determine image offset of specified imgid for the given collection */
 static int dt_collection_image_offset_with_collection(const dt_collection_t *collection, int imgid);
@@ -74,16 +78,18 @@ const dt_collection_t *dt_collection_new(const dt_collection_t *clone)
     memcpy(&collection->store, &clone->store, sizeof(dt_collection_params_t));
     collection->where_ext = g_strdupv(clone->where_ext);
     collection->query = g_strdup(clone->query);
+    collection->where = g_strdup(clone->where);
     collection->clone = 1;
     collection->count = clone->count;
   }
   else /* else we just initialize using the reset */
     dt_collection_reset(collection);
 
-  /* connect to all the signals that might indicate that the count of images matching the collection changed
-   */
+  /* connect to all the signals that might indicate that the count of images matching the collection changed.
+   * changes of ratings, color labels and attached tags go through dt_collection_update_images(). renamed or
+   * deleted tags can still change which images a tag filter matches. */
   dt_control_signal_connect(darktable.signals, DT_SIGNAL_TAG_CHANGED,
-                            G_CALLBACK(_dt_collection_recount_callback_1), collection);
+                            G_CALLBACK(_dt_collection_tag_changed_callback), collection);
   dt_control_signal_connect(darktable.signals, DT_SIGNAL_FILMROLLS_CHANGED,
                             G_CALLBACK(_dt_collection_recount_callback_1), collection);
   dt_control_signal_connect(darktable.signals, DT_SIGNAL_FILMROLLS_REMOVED,
@@ -103,8 +109,11 @@ void dt_collection_free(const dt_collection_t *collection)
                                (gpointer)collection);
   dt_control_signal_disconnect(darktable.signals, G_CALLBACK(_dt_collection_recount_callback_2),
                                (gpointer)collection);
+  dt_control_signal_disconnect(darktable.signals, G_CALLBACK(_dt_collection_tag_changed_callback),
+                               (gpointer)collection);
 
   g_free(collection->query);
+  g_free(collection->where);
   g_strfreev(collection->where_ext);
   g_free((dt_collection_t *)collection);
 }
@@ -172,6 +181,11 @@ int dt_collection_update(const dt_collection_t *collection)
     wq = dt_util_dstrcat(wq, " AND (group_id = id OR group_id = %d)", darktable.gui->expanded_group_id);
   }
 
+  /* keep the filter on main.images around to re-evaluate single images, see dt_collection_update_images() */
+  g_free(collection->where);
+  ((dt_collection_t *)collection)->where
+      = (collection->params.query_flags & COLLECTION_QUERY_USE_ONLY_WHERE_EXT) ? NULL : g_strdup(wq);
+
   /* build select part includes where */
   if(collection->params.sort == DT_COLLECTION_SORT_COLOR
      && (collection->params.query_flags & COLLECTION_QUERY_USE_SORT))
@@ -209,9 +223,12 @@ int dt_collection_update(const dt_collection_t *collection)
   g_free(selq);
   g_free(query);
 
-  /* update the cached count. collection isn't a real const anyway, we are writing to it in
-   * _dt_collection_store, too. */
-  ((dt_collection_t *)collection)->count = _dt_collection_compute_count(collection);
+  /* clones are only used for their query, they count lazily in dt_collection_get_count() */
+  if(collection->clone) return result;
+
+  /* materialize the collection and update the cached count from it. collection isn't a real const anyway, we
+   * are writing to it in _dt_collection_store, too. */
+  ((dt_collection_t *)collection)->count = _dt_collection_materialize(collection);
   dt_collection_hint_message(collection);
 
   return result;
@@ -506,8 +523,36 @@ static uint32_t _dt_collection_compute_count(const dt_collection_t *collection)
   return count;
 }
 
+static uint32_t _dt_collection_materialize(const dt_collection_t *collection)
+{
+  sqlite3_stmt *stmt = NULL;
+  uint32_t count = 0;
+  const gchar *query = dt_collection_get_query(collection);
+  if(!query) return 0;
+
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "DELETE FROM memory.collected_images", NULL, NULL,
+                        NULL);
+  // reset autoincrement, rowids start at 1 again. the lighttable relies on that.
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "DELETE FROM memory.sqlite_sequence WHERE "
+                                                       "name='collected_images'", NULL, NULL, NULL);
+
+  // the query selects distinct ids, so the number of inserted rows is the count of the collection
+  gchar *ins_query = dt_util_dstrcat(NULL, "INSERT INTO memory.collected_images (imgid) %s", query);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), ins_query, -1, &stmt, NULL);
+  if(collection->params.query_flags & COLLECTION_QUERY_USE_LIMIT)
+  {
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, 0);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, -1);
+  }
+  if(sqlite3_step(stmt) == SQLITE_DONE) count = sqlite3_changes(dt_database_get(darktable.db));
+  sqlite3_finalize(stmt);
+  g_free(ins_query);
+  return count;
+}
+
 uint32_t dt_collection_get_count(const dt_collection_t *collection)
 {
+  if(collection->clone) ((dt_collection_t *)collection)->count = _dt_collection_compute_count(collection);
   return collection->count;
 }
 
@@ -515,10 +560,10 @@ uint32_t dt_collection_get_selected_count(const dt_collection_t *collection)
 {
   sqlite3_stmt *stmt = NULL;
   uint32_t count = 0;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "SELECT COUNT(*) FROM main.selected_images", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db), "SELECT COUNT(*) FROM main.selected_images",
+                                  &stmt);
   if(sqlite3_step(stmt) == SQLITE_ROW) count = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  DT_DEBUG_SQLITE3_RELEASE(stmt);
   return count;
 }
 
@@ -848,6 +893,64 @@ gchar *dt_collection_get_makermodel(const char *exif_maker, const char *exif_mod
   return makermodel;
 }
 
+/* turns a LIKE pattern into a query for the trigram search index: every run of at least three characters
+ * between the wildcards has to occur as a phrase. the result is escaped for use in a sql string literal.
+ * returns NULL if the index is missing or there is no such run, LIKE has to scan everything then. */
+static gchar *_get_search_match(const char *column, const gchar *pattern)
+{
+  if(!pattern || !dt_database_has_search_index(darktable.db)) return NULL;
+
+  gchar *match = NULL;
+  gchar **runs = g_strsplit_set(pattern, "%_", -1);
+  for(gchar **run = runs; *run; run++)
+  {
+    if(g_utf8_strlen(*run, -1) < 3) continue;
+    gchar **parts = g_strsplit(*run, "\"", -1);
+    gchar *phrase = g_strjoinv("\"\"", parts);
+    match = dt_util_dstrcat(match, "%s%s : \"%s\"", match ? " AND " : "", column, phrase);
+    g_free(phrase);
+    g_strfreev(parts);
+  }
+  g_strfreev(runs);
+  if(!match) return NULL;
+
+  char *escaped = sqlite3_mprintf("%q", match);
+  gchar *result = g_strdup(escaped);
+  sqlite3_free(escaped);
+  g_free(match);
+  return result;
+}
+
+static gchar *_get_meta_data_query(const int key, const gchar *text, const char *escaped_text)
+{
+  gchar *match = _get_search_match("value", text);
+  gchar *query = NULL;
+  if(match)
+    query = dt_util_dstrcat(query, "(id IN (SELECT rowid >> %d FROM main.meta_data_fts WHERE meta_data_fts "
+                                   "MATCH '%s' AND (rowid & %d) = %d AND value LIKE '%%%s%%'))",
+                            DT_DATABASE_SEARCH_KEY_BITS, match, (1 << DT_DATABASE_SEARCH_KEY_BITS) - 1, key,
+                            escaped_text);
+  else
+    query = dt_util_dstrcat(query, "(id IN (SELECT id FROM main.meta_data WHERE key = %d AND value "
+                                   "LIKE '%%%s%%'))", key, escaped_text);
+  g_free(match);
+  return query;
+}
+
+static gchar *_get_images_text_query(const char *column, const gchar *text, const char *escaped_text)
+{
+  gchar *match = _get_search_match(column, text);
+  gchar *query = NULL;
+  if(match)
+    query = dt_util_dstrcat(query, "(id IN (SELECT rowid FROM main.images_fts WHERE images_fts MATCH '%s') "
+                                   "AND %s LIKE '%%%s%%')",
+                            match, column, escaped_text);
+  else
+    query = dt_util_dstrcat(query, "(%s LIKE '%%%s%%')", column, escaped_text);
+  g_free(match);
+  return query;
+}
+
 static gchar *get_query_string(const dt_collection_properties_t property, const gchar *text)
 {
   char *escaped_text = sqlite3_mprintf("%q", text);
@@ -942,27 +1045,22 @@ static gchar *get_query_string(const dt_collection_properties_t property, const
     // TODO: How to handle images without metadata? In the moment they are not shown.
     // TODO: Autogenerate this code?
     case DT_COLLECTION_PROP_TITLE: // title
-      query = dt_util_dstrcat(query, "(id IN (SELECT id FROM main.meta_data WHERE key = %d AND value "
-                                     "LIKE '%%%s%%'))", DT_METADATA_XMP_DC_TITLE, escaped_text);
+      query = _get_meta_data_query(DT_METADATA_XMP_DC_TITLE, text, escaped_text);
       break;
     case DT_COLLECTION_PROP_DESCRIPTION: // description
-      query = dt_util_dstrcat(query, "(id IN (SELECT id FROM main.meta_data WHERE key = %d AND value "
-                                     "LIKE '%%%s%%'))", DT_METADATA_XMP_DC_DESCRIPTION, escaped_text);
+      query = _get_meta_data_query(DT_METADATA_XMP_DC_DESCRIPTION, text, escaped_text);
       break;
     case DT_COLLECTION_PROP_CREATOR: // creator
-      query = dt_util_dstrcat(query, "(id IN (SELECT id FROM main.meta_data WHERE key = %d AND value "
-                                     "LIKE '%%%s%%'))", DT_METADATA_XMP_DC_CREATOR, escaped_text);
+      query = _get_meta_data_query(DT_METADATA_XMP_DC_CREATOR, text, escaped_text);
       break;
     case DT_COLLECTION_PROP_PUBLISHER: // publisher
-      query = dt_util_dstrcat(query, "(id IN (SELECT id FROM main.meta_data WHERE key = %d AND value "
-                                     "LIKE '%%%s%%'))", DT_METADATA_XMP_DC_PUBLISHER, escaped_text);
+      query = _get_meta_data_query(DT_METADATA_XMP_DC_PUBLISHER, text, escaped_text);
       break;
     case DT_COLLECTION_PROP_RIGHTS: // rights
-      query = dt_util_dstrcat(query, "(id IN (SELECT id FROM main.meta_data WHERE key = %d AND value "
-                                     "LIKE '%%%s%%'))", DT_METADATA_XMP_DC_RIGHTS, escaped_text);
+      query = _get_meta_data_query(DT_METADATA_XMP_DC_RIGHTS, text, escaped_text);
       break;
     case DT_COLLECTION_PROP_LENS: // lens
-      query = dt_util_dstrcat(query, "(lens LIKE '%%%s%%')", escaped_text);
+      query = _get_images_text_query("lens", text, escaped_text);
       break;
 
     case DT_COLLECTION_PROP_FOCAL_LENGTH: // focal length
@@ -1036,7 +1134,7 @@ static gchar *get_query_string(const dt_collection_properties_t property, const
     break;
 
     case DT_COLLECTION_PROP_FILENAME: // filename
-      query = dt_util_dstrcat(query, "(filename LIKE '%%%s%%')", escaped_text);
+      query = _get_images_text_query("filename", text, escaped_text);
       break;
 
     case DT_COLLECTION_PROP_DAY:
@@ -1219,7 +1317,14 @@ void dt_collection_update_query(const dt_collection_t *collection)
   sqlite3_stmt *stmt = NULL;
   const gchar *cquery = dt_collection_get_query(collection);
   gchar *complete_query = NULL;
-  if(cquery && cquery[0] != '\0')
+  if(!collection->clone)
+  {
+    // the original collection has just been materialized
+    DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "DELETE FROM main.selected_images WHERE imgid NOT IN "
+                                                         "(SELECT imgid FROM memory.collected_images)",
+                          NULL, NULL, NULL);
+  }
+  else if(cquery && cquery[0] != '\0')
   {
     complete_query
         = dt_util_dstrcat(complete_query, "DELETE FROM main.selected_images WHERE imgid NOT IN (%s)", cquery);
@@ -1287,7 +1392,18 @@ static int dt_collection_image_offset_with_collection(const dt_collection_t *col
   int offset = 0;
   sqlite3_stmt *stmt;
 
-  if(qin)
+  if(!collection->clone)
+  {
+    // rowids of memory.collected_images follow the query order, a missing image yields offset 0
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "SELECT COUNT(*) FROM memory.collected_images WHERE rowid < "
+                                "(SELECT rowid FROM memory.collected_images WHERE imgid = ?1)",
+                                -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+    if(sqlite3_step(stmt) == SQLITE_ROW) offset = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+  }
+  else if(qin)
   {
     DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), qin, -1, &stmt, NULL);
 
@@ -1323,28 +1439,173 @@ int dt_collection_image_offset(int imgid)
   return dt_collection_image_offset_with_collection(darktable.collection, imgid);
 }
 
+/* only the original collection is materialized. if the sort order depends on rating or color labels the
+ * changed images might have to move, so these rerun the full query, too. */
+static gboolean _can_update_images(const dt_collection_t *collection)
+{
+  const gboolean sort_on_flags = (collection->params.query_flags & COLLECTION_QUERY_USE_SORT)
+                                 && (collection->params.sort == DT_COLLECTION_SORT_RATING
+                                     || collection->params.sort == DT_COLLECTION_SORT_COLOR);
+  return !collection->clone && collection->where && !sort_on_flags;
+}
+
+/* re-evaluates the images stmt yields, with their id and their rowid in memory.collected_images or NULL.
+ * images which stopped matching are removed, their neighbours keep their order. an image which starts
+ * matching needs its place in the sort order, we leave that to the full query and return FALSE. */
+static gboolean _update_images(const dt_collection_t *collection, sqlite3_stmt *stmt)
+{
+  dt_collection_t *c = (dt_collection_t *)collection;
+  sqlite3_stmt *match_stmt;
+  gchar *match_query
+      = dt_util_dstrcat(NULL, "SELECT 1 FROM main.images WHERE id = ?1 AND (%s)", collection->where);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), match_query, -1, &match_stmt, NULL);
+  g_free(match_query);
+
+  GList *removed = NULL;
+  gboolean full = FALSE;
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const int id = sqlite3_column_int(stmt, 0);
+    const gboolean collected = sqlite3_column_type(stmt, 1) != SQLITE_NULL;
+
+    DT_DEBUG_SQLITE3_BIND_INT(match_stmt, 1, id);
+    const gboolean match = sqlite3_step(match_stmt) == SQLITE_ROW;
+    DT_DEBUG_SQLITE3_RESET(match_stmt);
+
+    if(match && !collected)
+    {
+      full = TRUE;
+      break;
+    }
+    if(!match && collected) removed = g_list_prepend(removed, GINT_TO_POINTER(id));
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_finalize(match_stmt);
+
+  if(full)
+  {
+    g_list_free(removed);
+    return FALSE;
+  }
+
+  if(removed)
+  {
+    sqlite3_stmt *sel_stmt;
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "DELETE FROM memory.collected_images WHERE imgid = ?1", -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "DELETE FROM main.selected_images WHERE imgid = ?1", -1, &sel_stmt, NULL);
+    for(GList *iter = removed; iter; iter = g_list_next(iter))
+    {
+      DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, GPOINTER_TO_INT(iter->data));
+      sqlite3_step(stmt);
+      DT_DEBUG_SQLITE3_RESET(stmt);
+      DT_DEBUG_SQLITE3_BIND_INT(sel_stmt, 1, GPOINTER_TO_INT(iter->data));
+      sqlite3_step(sel_stmt);
+      DT_DEBUG_SQLITE3_RESET(sel_stmt);
+      c->count--;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_finalize(sel_stmt);
+    g_list_free(removed);
+
+    dt_collection_hint_message(collection);
+  }
+  return TRUE;
+}
+
+void dt_collection_update_images(const dt_collection_t *collection, const int imgid)
+{
+  if(!_can_update_images(collection))
+  {
+    dt_collection_update_query(collection);
+    return;
+  }
+
+  sqlite3_stmt *stmt;
+  if(imgid > 0)
+  {
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "SELECT ?1, (SELECT rowid FROM memory.collected_images WHERE imgid = ?1)", -1,
+                                &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  }
+  else
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "SELECT s.imgid, c.rowid FROM main.selected_images AS s "
+                                "LEFT JOIN memory.collected_images AS c ON c.imgid = s.imgid",
+                                -1, &stmt, NULL);
+
+  if(!_update_images(collection, stmt))
+  {
+    dt_collection_update_query(collection);
+    return;
+  }
+  dt_control_signal_raise(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED);
+}
+
+void dt_collection_update_image_list(const dt_collection_t *collection, const GList *imgs)
+{
+  if(!imgs) return;
+  if(!_can_update_images(collection))
+  {
+    dt_collection_update_query(collection);
+    return;
+  }
+
+  // memory.image_list is shared, keep it to ourselves until we are done with it
+  sqlite3_stmt *stmt;
+  dt_database_start_transaction(darktable.db);
+  dt_image_list_to_memory(imgs);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "SELECT l.imgid, c.rowid FROM memory.image_list AS l "
+                              "LEFT JOIN memory.collected_images AS c ON c.imgid = l.imgid",
+                              -1, &stmt, NULL);
+  const gboolean updated = _update_images(collection, stmt);
+  dt_database_release_transaction(darktable.db);
+
+  if(!updated)
+  {
+    dt_collection_update_query(collection);
+    return;
+  }
+  dt_control_signal_raise(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED);
+}
+
 static void _dt_collection_recount_callback_1(gpointer instace, gpointer user_data)
 {
   dt_collection_t *collection = (dt_collection_t *)user_data;
+  if(collection->clone) return;
+
   int old_count = collection->count;
-  collection->count = _dt_collection_compute_count(collection);
-  if(!collection->clone)
-  {
-    if(old_count != collection->count) dt_collection_hint_message(collection);
-    dt_control_signal_raise(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED);
-  }
+  collection->count = _dt_collection_materialize(collection);
+  if(old_count != collection->count) dt_collection_hint_message(collection);
+  dt_control_signal_raise(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED);
 }
 
 static void _dt_collection_recount_callback_2(gpointer instance, uint8_t id, gpointer user_data)
 {
   dt_collection_t *collection = (dt_collection_t *)user_data;
+  if(collection->clone) return;
+
   int old_count = collection->count;
-  collection->count = _dt_collection_compute_count(collection);
-  if(!collection->clone)
-  {
-    if(old_count != collection->count) dt_collection_hint_message(collection);
-    dt_control_signal_raise(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED);
-  }
+  collection->count = _dt_collection_materialize(collection);
+  if(old_count != collection->count) dt_collection_hint_message(collection);
+  dt_control_signal_raise(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED);
+}
+
+static void _dt_collection_tag_changed_callback(gpointer instance, gpointer user_data)
+{
+  dt_collection_t *collection = (dt_collection_t *)user_data;
+  if(collection->clone) return;
+
+  // attaching and detaching tags is taken care of already, only a query on tag names can change here
+  if(!collection->query || !strstr(collection->query, "data.tags")) return;
+
+  int old_count = collection->count;
+  collection->count = _dt_collection_materialize(collection);
+  if(old_count != collection->count) dt_collection_hint_message(collection);
+  dt_control_signal_raise(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED);
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
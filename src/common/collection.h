@@ -130,6 +130,7 @@ typedef struct dt_collection_t
 {
   int clone;
   gchar *query;
+  gchar *where; // filter part of query, NULL if images can't be re-evaluated one by one
   gchar **where_ext;
   unsigned int count;
   dt_collection_params_t params;
@@ -204,6 +205,12 @@ uint32_t dt_collection_get_selected_count(const dt_collection_t *collection);
 
 /** update query by conf vars */
 void dt_collection_update_query(const dt_collection_t *collection);
+/** re-evaluates the image (or the selection for imgid <= 0) after its rating, color labels or tags changed.
+ * the materialized collection and the count are patched in place, the full query only runs again if that
+ * isn't possible. */
+void dt_collection_update_images(const dt_collection_t *collection, const int imgid);
+/** the same for a list of image ids */
+void dt_collection_update_image_list(const dt_collection_t *collection, const GList *imgs);
 
 /** updates the hint message for collection */
 void dt_collection_hint_message(const dt_collection_t *collection);
@@ -35,6 +35,9 @@ void dt_colorlabels_remove_labels_selection()
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
                         "DELETE FROM main.color_labels WHERE imgid IN (SELECT imgid FROM main.selected_images)",
                         NULL, NULL, NULL);
+
+  dt_image_synch_xmp(-1);
+  dt_collection_update_images(darktable.collection, -1);
 }
 
 void dt_colorlabels_remove_labels(const int imgid)
@@ -73,6 +76,7 @@ void dt_colorlabels_toggle_label_selection(const int color)
 {
   sqlite3_stmt *stmt, *stmt2;
 
+  dt_database_start_transaction(darktable.db);
   // check if all images in selection have that color label, i.e. try to get those which do not have the label
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT imgid FROM main.selected_images WHERE imgid "
                                                              "NOT IN (SELECT a.imgid FROM main.selected_images AS "
@@ -103,7 +107,10 @@ void dt_colorlabels_toggle_label_selection(const int color)
     sqlite3_finalize(stmt2);
   }
   sqlite3_finalize(stmt);
+  dt_database_release_transaction(darktable.db);
 
+  dt_image_synch_xmp(-1);
+  dt_collection_update_images(darktable.collection, -1);
   dt_collection_hint_message(darktable.collection);
 }
 
@@ -201,11 +208,11 @@ gboolean dt_colorlabels_key_accel_callback(GtkAccelGroup *accel_group, GObject *
         dt_colorlabels_remove_labels(selected);
         break;
     }
+    // synch to file, the selection functions do that themselves:
+    // TODO: move color labels to image_t cache and sync via write_get!
+    dt_image_synch_xmp(selected);
+    dt_collection_update_images(darktable.collection, selected);
   }
-  // synch to file:
-  // TODO: move color labels to image_t cache and sync via write_get!
-  dt_image_synch_xmp(selected);
-  dt_control_signal_raise(darktable.signals, DT_SIGNAL_FILMROLLS_CHANGED);
   dt_control_queue_redraw_center();
   return TRUE;
 }
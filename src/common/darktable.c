@@ -35,6 +35,8 @@
 #include "common/pwstorage/pwstorage.h"
 #include "common/selection.h"
 #include "common/system_signal_handling.h"
+#include "common/threadpool.h"
+#include "common/trace.h"
 #ifdef HAVE_GPHOTO2
 #include "common/camera_control.h"
 #endif
@@ -44,6 +46,7 @@
 #include "common/grealpath.h"
 #include "common/image.h"
 #include "common/image_cache.h"
+#include "common/image_source.h"
 #include "common/imageio_module.h"
 #include "common/l10n.h"
 #include "common/mipmap_cache.h"
@@ -77,6 +80,11 @@
 #include <unistd.h>
 #include <locale.h>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #if defined(__SSE__)
 #include <xmmintrin.h>
 #endif
@@ -115,7 +123,7 @@ static int usage(const char *argv0)
   printf("  --conf <key>=<value>\n");
   printf("  --configdir <user config directory>\n");
   printf("  -d {all,cache,camctl,camsupport,control,dev,fswatch,input,lighttable,\n");
-  printf("      lua, masks,memory,nan,opencl,perf,pwstorage,print,sql}\n");
+  printf("      lua, masks,memory,nan,opencl,perf,pwstorage,print,sql,trace}\n");
   printf("  --datadir <data directory>\n");
 #ifdef HAVE_OPENCL
   printf("  --disable-opencl\n");
@@ -330,6 +338,121 @@ static void dt_codepaths_init()
   }
 }
 
+#define DT_LARGE_ALLOC_MIN ((size_t)4 << 20)
+#define DT_HUGE_PAGE_SIZE ((size_t)2 << 20)
+// from linux/mempolicy.h, we don't want to depend on libnuma for one syscall
+#define DT_MPOL_INTERLEAVE 3
+
+typedef enum dt_alloc_numa_t
+{
+  DT_ALLOC_NUMA_NONE = 0,
+  DT_ALLOC_NUMA_FIRST_TOUCH,
+  DT_ALLOC_NUMA_INTERLEAVE
+} dt_alloc_numa_t;
+
+// the policy is only set up in dt_init(), large buffers allocated before that just get posix_memalign
+static struct
+{
+  int hugepages;
+  dt_alloc_numa_t numa;
+  int nodes;
+  unsigned long node_mask;
+  size_t page_size;
+  long remote_start;
+  size_t count, bytes;
+} _large_alloc = { 0 };
+
+#ifdef __linux__
+// parses a sysfs node list like "0-1,4" into a mask, returns the number of nodes
+static int _numa_node_mask(unsigned long *mask)
+{
+  *mask = 0;
+  gchar *list = NULL;
+  if(!g_file_get_contents("/sys/devices/system/node/online", &list, NULL, NULL)) return 1;
+
+  int nodes = 0;
+  for(char *c = list; *c && *c != '\n';)
+  {
+    char *end;
+    const long first = strtol(c, &end, 10);
+    long last = first;
+    if(end == c) break;
+    if(*end == '-') last = strtol(end + 1, &end, 10);
+    for(long n = first; n <= last && n < (long)(8 * sizeof(unsigned long)); n++, nodes++) *mask |= 1ul << n;
+    c = (*end == ',') ? end + 1 : end;
+  }
+  g_free(list);
+  return MAX(nodes, 1);
+}
+
+// pages the kernel had to place on another node than the one asked for, summed over all nodes. that's what
+// numastat calls other_node: it counts for the whole system, but on a workstation that's mostly us.
+static long _numa_remote_pages()
+{
+  long remote = 0;
+  for(int n = 0; n < (int)(8 * sizeof(unsigned long)); n++)
+  {
+    if(!(_large_alloc.node_mask & (1ul << n))) continue;
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/numastat", n);
+    FILE *f = g_fopen(path, "rb");
+    if(!f) continue;
+    char name[32];
+    long value;
+    while(fscanf(f, "%31s %ld", name, &value) == 2)
+      if(!strcmp(name, "other_node")) remote += value;
+    fclose(f);
+  }
+  return remote;
+}
+#endif
+
+static void _init_large_alloc()
+{
+#ifdef __linux__
+  _large_alloc.page_size = MAX(sysconf(_SC_PAGESIZE), 4096);
+  _large_alloc.nodes = _numa_node_mask(&_large_alloc.node_mask);
+  _large_alloc.hugepages = dt_conf_get_bool("memory_hugepages");
+
+  // with a single node there's nothing to place, so don't pay for touching pages up front
+  gchar *numa = dt_conf_get_string("memory_numa_policy");
+  if(_large_alloc.nodes > 1 && numa && !strcmp(numa, "first touch"))
+    _large_alloc.numa = DT_ALLOC_NUMA_FIRST_TOUCH;
+  else if(_large_alloc.nodes > 1 && numa && !strcmp(numa, "interleave"))
+    _large_alloc.numa = DT_ALLOC_NUMA_INTERLEAVE;
+  g_free(numa);
+
+  _large_alloc.remote_start = _large_alloc.nodes > 1 ? _numa_remote_pages() : 0;
+
+  dt_print(DT_DEBUG_PERF, "[memory] large buffers: %s huge pages, %d numa node%s, %s\n",
+           _large_alloc.hugepages ? "transparent" : "no", _large_alloc.nodes, _large_alloc.nodes > 1 ? "s" : "",
+           _large_alloc.numa == DT_ALLOC_NUMA_FIRST_TOUCH  ? "parallel first touch"
+           : _large_alloc.numa == DT_ALLOC_NUMA_INTERLEAVE ? "interleaved"
+                                                           : "default placement");
+#endif
+}
+
+static void _cleanup_large_alloc()
+{
+  if(!(darktable.unmuted & DT_DEBUG_PERF)) return;
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  long remote = -1;
+#ifdef __linux__
+  if(_large_alloc.nodes > 1) remote = _numa_remote_pages() - _large_alloc.remote_start;
+#endif
+  if(remote >= 0)
+    dt_print(DT_DEBUG_PERF,
+             "[memory] %zu large buffers (%.1f MB), %ld minor and %ld major page faults, %ld pages placed on a "
+             "remote node\n",
+             _large_alloc.count, _large_alloc.bytes / (1024.0 * 1024.0), (long)ru.ru_minflt, (long)ru.ru_majflt,
+             remote);
+  else
+    dt_print(DT_DEBUG_PERF, "[memory] %zu large buffers (%.1f MB), %ld minor and %ld major page faults\n",
+             _large_alloc.count, _large_alloc.bytes / (1024.0 * 1024.0), (long)ru.ru_minflt, (long)ru.ru_majflt);
+}
+
 int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load_data, lua_State *L)
 {
   double start_wtime = dt_get_wtime();
@@ -629,6 +752,8 @@ int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load
           darktable.unmuted |= DT_DEBUG_PRINT; // print errors are reported on console
         else if(!strcmp(argv[k + 1], "camsupport"))
           darktable.unmuted |= DT_DEBUG_CAMERA_SUPPORT; // camera support warnings are reported on console
+        else if(!strcmp(argv[k + 1], "trace"))
+          darktable.unmuted |= DT_DEBUG_TRACE; // timeline of pipe, tiling and job spans as chrome trace json
         else
           return usage(argv[0]);
         k++;
@@ -719,6 +844,8 @@ int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load
     dt_print_mem_usage();
   }
 
+  dt_trace_init();
+
   if(init_gui)
   {
     // I doubt that connecting to dbus for darktable-cli makes sense
@@ -731,6 +858,7 @@ int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load
 #ifdef _OPENMP
   omp_set_num_threads(darktable.num_openmp_threads);
 #endif
+  dt_threadpool_init();
   dt_loc_init_datadir(datadir_from_command);
   dt_loc_init_plugindir(moduledir_from_command);
   dt_loc_init_localedir(localedir_from_command);
@@ -748,6 +876,7 @@ int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load
 
   // thread-safe init:
   dt_exif_init();
+  dt_image_source_init();
   char datadir[PATH_MAX] = { 0 };
   dt_loc_get_user_config_dir(datadir, sizeof(datadir));
   char darktablerc[PATH_MAX] = { 0 };
@@ -758,6 +887,9 @@ int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load
   dt_conf_init(darktable.conf, darktablerc, config_override);
   g_slist_free_full(config_override, g_free);
 
+  // large image buffers are placed according to the memory preferences
+  _init_large_alloc();
+
   // set the interface language and prepare selection for prefs
   darktable.l10n = dt_l10n_init(init_gui);
 
@@ -898,6 +1030,7 @@ int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load
   // image dimensions stored in here:
   darktable.image_cache = (dt_image_cache_t *)calloc(1, sizeof(dt_image_cache_t));
   dt_image_cache_init(darktable.image_cache);
+  dt_image_sidecar_writer_init();
 
   darktable.mipmap_cache = (dt_mipmap_cache_t *)calloc(1, sizeof(dt_mipmap_cache_t));
   dt_mipmap_cache_init(darktable.mipmap_cache);
@@ -1071,6 +1204,8 @@ void dt_cleanup()
     free(darktable.imageio);
     free(darktable.gui);
   }
+  // still needs the image cache for the queued writes
+  dt_image_sidecar_writer_cleanup();
   dt_image_cache_cleanup(darktable.image_cache);
   free(darktable.image_cache);
   dt_mipmap_cache_cleanup(darktable.mipmap_cache);
@@ -1114,7 +1249,12 @@ void dt_cleanup()
   dt_pthread_mutex_destroy(&(darktable.capabilities_threadsafe));
   dt_pthread_mutex_destroy(&(darktable.exiv2_threadsafe));
 
+  dt_image_source_cleanup();
   dt_exif_cleanup();
+
+  dt_threadpool_cleanup();
+  _cleanup_large_alloc();
+  dt_trace_cleanup();
 }
 
 void dt_print(dt_debug_thread_t thread, const char *msg, ...)
@@ -1147,10 +1287,13 @@ void *dt_alloc_align(size_t alignment, size_t size)
 #if defined(__FreeBSD_version) && __FreeBSD_version < 700013
   return malloc(size);
 #elif defined(_WIN32)
-  return _aligned_malloc(size, alignment);
+  void *ptr = _aligned_malloc(size, alignment);
+  if(ptr && dt_trace_enabled()) dt_trace_alloc(size);
+  return ptr;
 #else
   void *ptr = NULL;
   if(posix_memalign(&ptr, alignment, size)) return NULL;
+  if(dt_trace_enabled()) dt_trace_alloc(size);
   return ptr;
 #endif
 }
@@ -1162,6 +1305,51 @@ void dt_free_align(void *mem)
 }
 #endif
 
+#ifdef __linux__
+// touch one byte per page in the same static schedule the pixel loops use, so the thread which will process a
+// band of rows is the one faulting its pages in, on its own node.
+static void _first_touch(void *ptr, const size_t size)
+{
+  const size_t page = _large_alloc.page_size;
+  const size_t pages = (size + page - 1) / page;
+  char *const buf = (char *)ptr;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(size_t k = 0; k < pages; k++) buf[k * page] = 0;
+}
+#endif
+
+void *dt_alloc_large(size_t size)
+{
+#ifdef __linux__
+  if(size < DT_LARGE_ALLOC_MIN || !_large_alloc.page_size) return dt_alloc_align(64, size);
+
+  // align to the huge page size so the kernel can back the whole buffer with them
+  void *ptr = NULL;
+  if(posix_memalign(&ptr, _large_alloc.hugepages ? DT_HUGE_PAGE_SIZE : _large_alloc.page_size, size))
+    return NULL;
+  if(dt_trace_enabled()) dt_trace_alloc(size);
+
+  // all of this is best effort: a buffer recycled from the heap may already be backed by pages
+  const size_t len = size & ~(_large_alloc.page_size - 1);
+#ifdef MADV_HUGEPAGE
+  if(_large_alloc.hugepages && len) madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+#ifdef SYS_mbind
+  if(_large_alloc.numa == DT_ALLOC_NUMA_INTERLEAVE && len)
+    syscall(SYS_mbind, ptr, len, DT_MPOL_INTERLEAVE, &_large_alloc.node_mask, 8 * sizeof(unsigned long), 0);
+#endif
+  if(_large_alloc.numa == DT_ALLOC_NUMA_FIRST_TOUCH) _first_touch(ptr, size);
+
+  __sync_add_and_fetch(&_large_alloc.count, 1);
+  __sync_add_and_fetch(&_large_alloc.bytes, size);
+  return ptr;
+#else
+  return dt_alloc_align(64, size);
+#endif
+}
+
 void dt_show_times(const dt_times_t *start, const char *prefix, const char *suffix, ...)
 {
   dt_times_t end;
@@ -1172,8 +1360,8 @@ void dt_show_times(const dt_times_t *start, const char *prefix, const char *suff
   if(darktable.unmuted & DT_DEBUG_PERF)
   {
     dt_get_times(&end);
-    i = snprintf(buf, sizeof(buf), "%s took %.3f secs (%.3f CPU)", prefix, end.clock - start->clock,
-                 end.user - start->user);
+    i = snprintf(buf, sizeof(buf), "%s took %.3f secs (%.3f CPU, %ld page faults)", prefix,
+                 end.clock - start->clock, end.user - start->user, end.faults - start->faults);
     if(suffix != NULL)
     {
       va_list ap;
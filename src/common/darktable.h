@@ -183,6 +183,7 @@ typedef enum dt_debug_thread_t
   DT_DEBUG_INPUT = 1 << 14,
   DT_DEBUG_PRINT = 1 << 15,
   DT_DEBUG_CAMERA_SUPPORT = 1 << 16,
+  DT_DEBUG_TRACE = 1 << 17,
 } dt_debug_thread_t;
 
 typedef struct dt_codepath_t
@@ -243,6 +244,7 @@ typedef struct
 {
   double clock;
   double user;
+  long faults;
 } dt_times_t;
 
 extern darktable_t darktable;
@@ -253,6 +255,11 @@ void dt_print(dt_debug_thread_t thread, const char *msg, ...) __attribute__((for
 void dt_gettime_t(char *datetime, size_t datetime_len, time_t t);
 void dt_gettime(char *datetime, size_t datetime_len);
 void *dt_alloc_align(size_t alignment, size_t size);
+/** allocate a large image buffer, such as a full mipmap or a pixelpipe cache line, which the openmp loops will
+ * stream through. depending on the memory policy it gets transparent huge pages and is either interleaved
+ * over the numa nodes or first touched in parallel, so each page lands on the node of the thread a static
+ * schedule hands it to. free with dt_free_align(). */
+void *dt_alloc_large(size_t size);
 #ifdef _WIN32
 void dt_free_align(void *mem);
 #else
@@ -283,6 +290,7 @@ static inline void dt_get_times(dt_times_t *t)
   getrusage(RUSAGE_SELF, &ru);
   t->clock = dt_get_wtime();
   t->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * (1.0 / 1000000.0);
+  t->faults = ru.ru_minflt + ru.ru_majflt;
 }
 
 void dt_show_times(const dt_times_t *start, const char *prefix, const char *suffix, ...) __attribute__((format(printf, 3, 4)));
@@ -53,6 +53,21 @@ typedef struct dt_database_t
   /* ondisk DB */
   sqlite3 *handle;
 
+  /* fts5 index for the text filters of collections, see _create_search_index() */
+  gboolean search_index;
+
+  /* read-only connections for worker threads are possible, see dt_database_get_reader(). only with wal
+   * journals, which are opt-in. */
+  gboolean wal;
+  pthread_t owner;
+
+  /* transactions on handle are taken in turns, in the order they were asked for. transaction_next is the
+   * ticket of the next one asking, transaction_serving the one of the thread having its turn now. see
+   * dt_database_start_transaction(), how deep they nest is kept per thread. */
+  dt_pthread_mutex_t transaction_lock;
+  pthread_cond_t transaction_turn;
+  unsigned int transaction_next, transaction_serving;
+
   gchar *error_message, *error_dbfilename;
 } dt_database_t;
 
@@ -1170,7 +1185,11 @@ static void _create_memory_schema(dt_database_t *db)
       db->handle,
       "CREATE TABLE memory.collected_images (rowid INTEGER PRIMARY KEY AUTOINCREMENT, imgid INTEGER)", NULL,
       NULL, NULL);
+  sqlite3_exec(db->handle, "CREATE INDEX memory.collected_images_imgid_index ON collected_images (imgid)", NULL,
+               NULL, NULL);
   sqlite3_exec(db->handle, "CREATE TABLE memory.tmp_selection (imgid INTEGER)", NULL, NULL, NULL);
+  // image ids for set based statements on many images, see dt_image_list_to_memory()
+  sqlite3_exec(db->handle, "CREATE TABLE memory.image_list (imgid INTEGER PRIMARY KEY)", NULL, NULL, NULL);
   sqlite3_exec(db->handle, "CREATE TABLE memory.tagq (tmpid INTEGER PRIMARY KEY, id INTEGER)", NULL, NULL, NULL);
   sqlite3_exec(db->handle, "CREATE TABLE memory.taglist "
                            "(tmpid INTEGER PRIMARY KEY, id INTEGER UNIQUE ON CONFLICT IGNORE, count INTEGER)",
@@ -1190,6 +1209,196 @@ static void _create_memory_schema(dt_database_t *db)
       NULL, NULL, NULL);
 }
 
+// fts5 tokenizer splitting text into overlapping trigrams of utf-8 characters. a phrase query then matches
+// any substring of at least three characters, which is what the LIKE '%...%' filters of collections need.
+// like sqlite's LIKE we only fold the case of ascii characters.
+#if SQLITE_VERSION_NUMBER >= 3020000
+static char _trigram_tokenizer_instance;
+
+static int _trigram_create(void *ctx, const char **argv, int argc, Fts5Tokenizer **out)
+{
+  *out = (Fts5Tokenizer *)&_trigram_tokenizer_instance;
+  return SQLITE_OK;
+}
+
+static void _trigram_delete(Fts5Tokenizer *tokenizer)
+{
+}
+
+static int _trigram_tokenize(Fts5Tokenizer *tokenizer, void *ctx, int flags, const char *text, int len,
+                             int (*token)(void *, int, const char *, int, int, int))
+{
+  int start[3] = { 0 }; // byte offsets of the last three characters
+  int n = 0;
+  for(int i = 0; i < len;)
+  {
+    const unsigned char c = text[i];
+    int clen = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 1;
+    clen = MIN(clen, len - i);
+
+    start[0] = start[1];
+    start[1] = start[2];
+    start[2] = i;
+    i += clen;
+    if(++n < 3) continue;
+
+    char buf[12];
+    const int blen = i - start[0];
+    for(int k = 0; k < blen; k++) buf[k] = g_ascii_tolower(text[start[0] + k]);
+    const int rc = token(ctx, 0, buf, blen, start[0], i);
+    if(rc != SQLITE_OK) return rc;
+  }
+  return SQLITE_OK;
+}
+
+static gboolean _register_trigram_tokenizer(sqlite3 *handle)
+{
+  fts5_api *api = NULL;
+  sqlite3_stmt *stmt;
+  // fails if sqlite was built without fts5
+  if(sqlite3_prepare_v2(handle, "SELECT fts5(?1)", -1, &stmt, NULL) != SQLITE_OK) return FALSE;
+  sqlite3_bind_pointer(stmt, 1, (void *)&api, "fts5_api_ptr", NULL);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if(!api || api->iVersion < 2) return FALSE;
+
+  fts5_tokenizer tokenizer = { _trigram_create, _trigram_delete, _trigram_tokenize };
+  return api->xCreateTokenizer(api, "dt_trigram", NULL, &tokenizer, NULL) == SQLITE_OK;
+}
+#else
+static gboolean _register_trigram_tokenizer(sqlite3 *handle)
+{
+  return FALSE;
+}
+#endif
+
+// the text searched by collection filters is mirrored into two fts5 tables. main.images_fts has the rowid
+// of the image and the columns lens and filename, main.meta_data_fts has one row per meta data entry with
+// rowid (id << DT_DATABASE_SEARCH_KEY_BITS) | key. both tables can only be read with our tokenizer, so the
+// triggers keeping them in sync are temporary ones: other programs writing to the library don't need it.
+// plain triggers count every change of the mirrored columns up in main.search_index_state, the temporary
+// ones count them down again. whatever is left was written without updating the index, by another program
+// or an older darktable, and the index is rebuilt at the next start.
+static void _create_search_index(dt_database_t *db)
+{
+  sqlite3_stmt *stmt;
+  db->search_index = FALSE;
+  if(!_register_trigram_tokenizer(db->handle))
+  {
+    dt_print(DT_DEBUG_SQL, "[init] sqlite has no fts5 support, collections use plain LIKE filters\n");
+    return;
+  }
+
+  if(sqlite3_exec(db->handle, "CREATE VIRTUAL TABLE IF NOT EXISTS main.images_fts USING "
+                              "fts5(lens, filename, tokenize = 'dt_trigram')",
+                  NULL, NULL, NULL) != SQLITE_OK
+     || sqlite3_exec(db->handle, "CREATE VIRTUAL TABLE IF NOT EXISTS main.meta_data_fts USING "
+                                 "fts5(value, tokenize = 'dt_trigram')",
+                     NULL, NULL, NULL) != SQLITE_OK)
+  {
+    fprintf(stderr, "[init] can't create the search index: %s\n", sqlite3_errmsg(db->handle));
+    return;
+  }
+
+  // a library without the state table, e.g. one indexed before it existed, gets rebuilt once
+  if(sqlite3_exec(db->handle, "CREATE TABLE IF NOT EXISTS main.search_index_state (unindexed INTEGER);"
+                              "INSERT INTO main.search_index_state (unindexed) SELECT 1 WHERE NOT EXISTS "
+                              "  (SELECT * FROM main.search_index_state);"
+                              "CREATE TRIGGER IF NOT EXISTS main.search_index_images_insert AFTER INSERT ON "
+                              "  main.images BEGIN"
+                              "  UPDATE search_index_state SET unindexed = unindexed + 1;"
+                              "END;"
+                              "CREATE TRIGGER IF NOT EXISTS main.search_index_images_update AFTER UPDATE OF "
+                              "  id, lens, filename ON main.images WHEN old.id != new.id OR "
+                              "  old.lens IS NOT new.lens OR old.filename IS NOT new.filename BEGIN"
+                              "  UPDATE search_index_state SET unindexed = unindexed + 1;"
+                              "END;"
+                              "CREATE TRIGGER IF NOT EXISTS main.search_index_images_delete AFTER DELETE ON "
+                              "  main.images BEGIN"
+                              "  UPDATE search_index_state SET unindexed = unindexed + 1;"
+                              "END;"
+                              "CREATE TRIGGER IF NOT EXISTS main.search_index_meta_data_insert AFTER INSERT ON "
+                              "  main.meta_data BEGIN"
+                              "  UPDATE search_index_state SET unindexed = unindexed + 1;"
+                              "END;"
+                              "CREATE TRIGGER IF NOT EXISTS main.search_index_meta_data_update AFTER UPDATE ON "
+                              "  main.meta_data BEGIN"
+                              "  UPDATE search_index_state SET unindexed = unindexed + 1;"
+                              "END;"
+                              "CREATE TRIGGER IF NOT EXISTS main.search_index_meta_data_delete AFTER DELETE ON "
+                              "  main.meta_data BEGIN"
+                              "  UPDATE search_index_state SET unindexed = unindexed + 1;"
+                              "END",
+                   NULL, NULL, NULL) != SQLITE_OK)
+  {
+    fprintf(stderr, "[init] can't create the search index state: %s\n", sqlite3_errmsg(db->handle));
+    return;
+  }
+
+  gboolean in_sync = FALSE;
+  sqlite3_prepare_v2(db->handle, "SELECT unindexed = 0 FROM main.search_index_state", -1, &stmt, NULL);
+  if(sqlite3_step(stmt) == SQLITE_ROW) in_sync = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  if(!in_sync)
+  {
+    dt_print(DT_DEBUG_SQL, "[init] rebuilding the search index\n");
+    gchar *query = g_strdup_printf("BEGIN;"
+                                   "DELETE FROM main.images_fts;"
+                                   "DELETE FROM main.meta_data_fts;"
+                                   "INSERT INTO main.images_fts (rowid, lens, filename) "
+                                   "  SELECT id, lens, filename FROM main.images;"
+                                   "INSERT OR REPLACE INTO main.meta_data_fts (rowid, value) "
+                                   "  SELECT (id << %d) | key, value FROM main.meta_data;"
+                                   "UPDATE main.search_index_state SET unindexed = 0;"
+                                   "COMMIT",
+                                   DT_DATABASE_SEARCH_KEY_BITS);
+    if(sqlite3_exec(db->handle, query, NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf(stderr, "[init] can't build the search index: %s\n", sqlite3_errmsg(db->handle));
+      sqlite3_exec(db->handle, "ROLLBACK", NULL, NULL, NULL);
+      g_free(query);
+      return;
+    }
+    g_free(query);
+  }
+
+  gchar *triggers = g_strdup_printf(
+      "CREATE TEMP TRIGGER images_fts_insert AFTER INSERT ON main.images BEGIN"
+      "  INSERT OR REPLACE INTO images_fts (rowid, lens, filename) VALUES (new.id, new.lens, new.filename);"
+      "  UPDATE search_index_state SET unindexed = unindexed - 1;"
+      "END;"
+      "CREATE TEMP TRIGGER images_fts_update AFTER UPDATE OF id, lens, filename ON main.images"
+      "  WHEN old.id != new.id OR old.lens IS NOT new.lens OR old.filename IS NOT new.filename BEGIN"
+      "  DELETE FROM images_fts WHERE rowid = old.id;"
+      "  INSERT OR REPLACE INTO images_fts (rowid, lens, filename) VALUES (new.id, new.lens, new.filename);"
+      "  UPDATE search_index_state SET unindexed = unindexed - 1;"
+      "END;"
+      "CREATE TEMP TRIGGER images_fts_delete AFTER DELETE ON main.images BEGIN"
+      "  DELETE FROM images_fts WHERE rowid = old.id;"
+      "  UPDATE search_index_state SET unindexed = unindexed - 1;"
+      "END;"
+      "CREATE TEMP TRIGGER meta_data_fts_insert AFTER INSERT ON main.meta_data BEGIN"
+      "  INSERT OR REPLACE INTO meta_data_fts (rowid, value) VALUES ((new.id << %1$d) | new.key, new.value);"
+      "  UPDATE search_index_state SET unindexed = unindexed - 1;"
+      "END;"
+      "CREATE TEMP TRIGGER meta_data_fts_update AFTER UPDATE ON main.meta_data BEGIN"
+      "  DELETE FROM meta_data_fts WHERE rowid = (old.id << %1$d) | old.key;"
+      "  INSERT OR REPLACE INTO meta_data_fts (rowid, value) VALUES ((new.id << %1$d) | new.key, new.value);"
+      "  UPDATE search_index_state SET unindexed = unindexed - 1;"
+      "END;"
+      "CREATE TEMP TRIGGER meta_data_fts_delete AFTER DELETE ON main.meta_data BEGIN"
+      "  DELETE FROM meta_data_fts WHERE rowid = (old.id << %1$d) | old.key;"
+      "  UPDATE search_index_state SET unindexed = unindexed - 1;"
+      "END",
+      DT_DATABASE_SEARCH_KEY_BITS);
+  if(sqlite3_exec(db->handle, triggers, NULL, NULL, NULL) != SQLITE_OK)
+    fprintf(stderr, "[init] can't create the search index triggers: %s\n", sqlite3_errmsg(db->handle));
+  else
+    db->search_index = TRUE;
+  g_free(triggers);
+}
+
 static void _sanitize_db(dt_database_t *db)
 {
   sqlite3_stmt *stmt, *innerstmt;
@@ -1482,6 +1691,34 @@ lock_again:
   return lock_acquired;
 }
 
+static gboolean _set_journal_mode_wal(sqlite3 *handle, const char *schema)
+{
+  sqlite3_stmt *stmt;
+  gboolean wal = FALSE;
+  gchar *query = g_strdup_printf("PRAGMA %s.journal_mode = WAL", schema);
+  // returns the new mode, which stays the old one where wal isn't possible, e.g. on some network file systems
+  if(sqlite3_prepare_v2(handle, query, -1, &stmt, NULL) == SQLITE_OK)
+  {
+    if(sqlite3_step(stmt) == SQLITE_ROW)
+      wal = !g_ascii_strcasecmp((const char *)sqlite3_column_text(stmt, 0), "wal");
+    sqlite3_finalize(stmt);
+  }
+  g_free(query);
+  if(!wal) fprintf(stderr, "[init] can't use a write ahead log for the %s database\n", schema);
+  return wal;
+}
+
+// wal needs shared memory next to the database, which network file systems don't reliably provide
+static gboolean _is_local_file(const char *filename)
+{
+  GFile *file = g_file_new_for_path(filename);
+  GFileInfo *info = g_file_query_filesystem_info(file, G_FILE_ATTRIBUTE_FILESYSTEM_REMOTE, NULL, NULL);
+  const gboolean local = info && !g_file_info_get_attribute_boolean(info, G_FILE_ATTRIBUTE_FILESYSTEM_REMOTE);
+  if(info) g_object_unref(info);
+  g_object_unref(file);
+  return local;
+}
+
 static gboolean _lock_databases(dt_database_t *db)
 {
   if(!_lock_single_database(db, db->dbfilename_data, &db->lockfile_data))
@@ -1495,6 +1732,115 @@ static gboolean _lock_databases(dt_database_t *db)
   return TRUE;
 }
 
+/* cache of prepared statements for hot paths, one per connection and keyed by the sql text. a statement is
+ * handed out to one caller at a time, a second caller asking for the same text while it's busy gets a fresh
+ * one which is finalized again when it is released. */
+typedef struct dt_database_cached_statement_t
+{
+  sqlite3_stmt *stmt;
+  gboolean busy;
+} dt_database_cached_statement_t;
+
+static struct
+{
+  dt_pthread_mutex_t lock;
+  GHashTable *connections; // sqlite3 * -> (sql text -> dt_database_cached_statement_t *)
+  uint64_t hits, misses;
+} _statements = { .connections = NULL };
+
+static void _cached_statement_free(dt_database_cached_statement_t *entry)
+{
+  sqlite3_finalize(entry->stmt);
+  g_free(entry);
+}
+
+static void _statement_cache_init()
+{
+  dt_pthread_mutex_init(&_statements.lock, NULL);
+  _statements.connections = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                                  (GDestroyNotify)g_hash_table_destroy);
+}
+
+// has to be called before sqlite3_close(), which fails as long as statements of the connection are around
+static void _statement_cache_drop(sqlite3 *handle)
+{
+  dt_pthread_mutex_lock(&_statements.lock);
+  g_hash_table_remove(_statements.connections, handle);
+  dt_pthread_mutex_unlock(&_statements.lock);
+}
+
+static void _statement_cache_cleanup()
+{
+  dt_print(DT_DEBUG_SQL, "[sql] statement cache: %" G_GUINT64_FORMAT " prepares avoided, %" G_GUINT64_FORMAT
+                         " statements prepared\n",
+           _statements.hits, _statements.misses);
+  g_hash_table_destroy(_statements.connections);
+  _statements.connections = NULL;
+  dt_pthread_mutex_destroy(&_statements.lock);
+}
+
+int dt_database_prepare_cached(sqlite3 *handle, const char *sql, sqlite3_stmt **stmt)
+{
+  *stmt = NULL;
+  if(!_statements.connections) return sqlite3_prepare_v2(handle, sql, -1, stmt, NULL);
+
+  dt_pthread_mutex_lock(&_statements.lock);
+  GHashTable *cache = g_hash_table_lookup(_statements.connections, handle);
+  if(!cache)
+  {
+    cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)_cached_statement_free);
+    g_hash_table_insert(_statements.connections, handle, cache);
+  }
+  dt_database_cached_statement_t *entry = g_hash_table_lookup(cache, sql);
+  if(entry && !entry->busy)
+  {
+    entry->busy = TRUE;
+    _statements.hits++;
+    dt_pthread_mutex_unlock(&_statements.lock);
+    *stmt = entry->stmt;
+    return SQLITE_OK;
+  }
+  _statements.misses++;
+  dt_pthread_mutex_unlock(&_statements.lock);
+
+  const int rc = sqlite3_prepare_v2(handle, sql, -1, stmt, NULL);
+  if(rc != SQLITE_OK || entry) return rc;
+
+  // somebody else might have been faster, then this one stays uncached
+  dt_pthread_mutex_lock(&_statements.lock);
+  if(!g_hash_table_contains(cache, sql))
+  {
+    entry = (dt_database_cached_statement_t *)g_malloc(sizeof(dt_database_cached_statement_t));
+    entry->stmt = *stmt;
+    entry->busy = TRUE;
+    g_hash_table_insert(cache, g_strdup(sql), entry);
+  }
+  dt_pthread_mutex_unlock(&_statements.lock);
+  return rc;
+}
+
+void dt_database_release_cached(sqlite3_stmt *stmt)
+{
+  if(!stmt) return;
+
+  if(_statements.connections)
+  {
+    dt_pthread_mutex_lock(&_statements.lock);
+    GHashTable *cache = g_hash_table_lookup(_statements.connections, sqlite3_db_handle(stmt));
+    dt_database_cached_statement_t *entry = cache ? g_hash_table_lookup(cache, sqlite3_sql(stmt)) : NULL;
+    if(entry && entry->stmt == stmt)
+    {
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      entry->busy = FALSE;
+      dt_pthread_mutex_unlock(&_statements.lock);
+      return;
+    }
+    dt_pthread_mutex_unlock(&_statements.lock);
+  }
+  sqlite3_finalize(stmt);
+}
+
 dt_database_t *dt_database_init(const char *alternative, const gboolean load_data)
 {
   sqlite3_initialize();
@@ -1545,6 +1891,10 @@ start:
   dt_database_t *db = (dt_database_t *)g_malloc0(sizeof(dt_database_t));
   db->dbfilename_data = g_strdup(dbfilename_data);
   db->dbfilename_library = g_strdup(dbfilename_library);
+  db->owner = pthread_self();
+  dt_pthread_mutex_init(&db->transaction_lock, NULL);
+  pthread_cond_init(&db->transaction_turn, NULL);
+  _statement_cache_init();
 
   /* make sure the folder exists. this might not be the case for new databases */
   char *data_path = g_path_get_dirname(db->dbfilename_data);
@@ -1614,6 +1964,17 @@ start:
   sqlite3_exec(db->handle, "PRAGMA journal_mode = MEMORY", NULL, NULL, NULL);
   sqlite3_exec(db->handle, "PRAGMA page_size = 32768", NULL, NULL, NULL);
 
+  // with a write ahead log background jobs can read through their own connections while we write. the mode
+  // sticks to the files, so it is only used when asked for and turned off again otherwise.
+  if(load_data && strcmp(db->dbfilename_library, ":memory:") && dt_conf_get_bool("database_write_ahead_log"))
+  {
+    if(_is_local_file(db->dbfilename_library) && _is_local_file(dbfilename_data))
+      db->wal = _set_journal_mode_wal(db->handle, "main") && _set_journal_mode_wal(db->handle, "data");
+    else
+      fprintf(stderr, "[init] not using a write ahead log for databases on a network file system\n");
+  }
+  if(!db->wal) sqlite3_exec(db->handle, "PRAGMA journal_mode = MEMORY", NULL, NULL, NULL);
+
   /* now that we got functional databases that are locked for us we can make sure that the schema is set up */
 
   // first we update the data database to the latest version so that we can potentially move data from the library
@@ -1812,6 +2173,9 @@ start:
   // create the in-memory tables
   _create_memory_schema(db);
 
+  // text index for collection filters
+  _create_search_index(db);
+
   // create a table legacy_presets with all the presets from pre-auto-apply-cleanup darktable.
   dt_legacy_presets_create(db);
 
@@ -1836,8 +2200,38 @@ error:
   return db;
 }
 
+// read-only connections of worker threads, closed when their thread exits or with the database
+static GMutex _readers_lock;
+static GList *_readers = NULL;
+
+static void _close_reader(gpointer data)
+{
+  sqlite3 *handle = (sqlite3 *)data;
+  g_mutex_lock(&_readers_lock);
+  GList *l = g_list_find(_readers, handle);
+  if(l)
+  {
+    _readers = g_list_delete_link(_readers, l);
+    _statement_cache_drop(handle);
+    sqlite3_close(handle);
+  }
+  g_mutex_unlock(&_readers_lock);
+}
+
+static GPrivate _reader_handle = G_PRIVATE_INIT(_close_reader);
+
 void dt_database_destroy(const dt_database_t *db)
 {
+  // threads still around don't use them anymore, those exiting later find nothing left to close
+  g_mutex_lock(&_readers_lock);
+  for(GList *iter = _readers; iter; iter = g_list_next(iter)) _statement_cache_drop((sqlite3 *)iter->data);
+  g_list_free_full(_readers, (GDestroyNotify)sqlite3_close);
+  _readers = NULL;
+  g_mutex_unlock(&_readers_lock);
+  pthread_cond_destroy(&((dt_database_t *)db)->transaction_turn);
+  dt_pthread_mutex_destroy(&((dt_database_t *)db)->transaction_lock);
+  _statement_cache_drop(db->handle);
+  _statement_cache_cleanup();
   sqlite3_close(db->handle);
   if (db->lockfile_data)
   {
@@ -1861,6 +2255,124 @@ sqlite3 *dt_database_get(const dt_database_t *db)
   return db ? db->handle : NULL;
 }
 
+static sqlite3 *_open_reader(dt_database_t *db)
+{
+  sqlite3 *handle = NULL;
+  sqlite3_stmt *stmt;
+
+  // the connection never leaves its thread, so it doesn't need sqlite's mutex
+  if(sqlite3_open_v2(db->dbfilename_library, &handle, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL)
+     != SQLITE_OK)
+  {
+    fprintf(stderr, "[sql] can't open a read-only connection: %s\n", sqlite3_errmsg(handle));
+    sqlite3_close(handle);
+    return NULL;
+  }
+  sqlite3_prepare_v2(handle, "ATTACH DATABASE ?1 AS data", -1, &stmt, NULL);
+  sqlite3_bind_text(stmt, 1, db->dbfilename_data, -1, SQLITE_TRANSIENT);
+  const int rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if(rc != SQLITE_DONE)
+  {
+    fprintf(stderr, "[sql] can't attach `%s' to a read-only connection\n", db->dbfilename_data);
+    sqlite3_close(handle);
+    return NULL;
+  }
+  sqlite3_exec(handle, "PRAGMA query_only = 1", NULL, NULL, NULL);
+  sqlite3_busy_timeout(handle, 1000);
+  if(db->search_index) _register_trigram_tokenizer(handle);
+
+  g_mutex_lock(&_readers_lock);
+  _readers = g_list_prepend(_readers, handle);
+  g_mutex_unlock(&_readers_lock);
+
+  dt_print(DT_DEBUG_SQL, "[sql] opened a read-only connection for a worker thread\n");
+  return handle;
+}
+
+sqlite3 *dt_database_get_reader(const dt_database_t *db)
+{
+  if(!db) return NULL;
+
+  // the gui thread stays on the main connection. readers only see committed data, so while the main
+  // connection has a transaction open (e.g. during import) everybody has to go through it.
+  if(!db->wal || pthread_equal(pthread_self(), db->owner) || !sqlite3_get_autocommit(db->handle))
+    return db->handle;
+
+  sqlite3 *handle = g_private_get(&_reader_handle);
+  if(!handle)
+  {
+    handle = _open_reader((dt_database_t *)db);
+    g_private_set(&_reader_handle, handle);
+  }
+  return handle ? handle : db->handle;
+}
+
+// how deep the transactions of the calling thread are nested, 0 if it has none
+static GPrivate _transaction_depth;
+
+void dt_database_start_transaction(const struct dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  const int depth = GPOINTER_TO_INT(g_private_get(&_transaction_depth));
+
+  // the outermost transaction waits for its turn, after everybody who asked before. inner ones are savepoints
+  // in the transaction the thread already has.
+  if(!depth)
+  {
+    dt_pthread_mutex_lock(&d->transaction_lock);
+    const unsigned int ticket = d->transaction_next++;
+    while(ticket != d->transaction_serving) dt_pthread_cond_wait(&d->transaction_turn, &d->transaction_lock);
+    dt_pthread_mutex_unlock(&d->transaction_lock);
+  }
+  g_private_set(&_transaction_depth, GINT_TO_POINTER(depth + 1));
+
+  char *err = NULL;
+  if(sqlite3_exec(d->handle, "SAVEPOINT dt_transaction", NULL, NULL, &err) != SQLITE_OK)
+  {
+    fprintf(stderr, "[sql] can't start a transaction: %s\n", err);
+    sqlite3_free(err);
+  }
+}
+
+void dt_database_release_transaction(const struct dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  const int depth = GPOINTER_TO_INT(g_private_get(&_transaction_depth));
+  if(!depth)
+  {
+    fprintf(stderr, "[sql] releasing a transaction this thread didn't start\n");
+    return;
+  }
+
+  char *err = NULL;
+  if(sqlite3_exec(d->handle, "RELEASE SAVEPOINT dt_transaction", NULL, NULL, &err) != SQLITE_OK)
+  {
+    fprintf(stderr, "[sql] can't commit a transaction: %s\n", err);
+    sqlite3_free(err);
+  }
+  g_private_set(&_transaction_depth, GINT_TO_POINTER(depth - 1));
+
+  // committed, the next one in line gets its turn
+  if(depth == 1)
+  {
+    dt_pthread_mutex_lock(&d->transaction_lock);
+    d->transaction_serving++;
+    pthread_cond_broadcast(&d->transaction_turn);
+    dt_pthread_mutex_unlock(&d->transaction_lock);
+  }
+}
+
+gboolean dt_database_transaction_waiting(const struct dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  dt_pthread_mutex_lock(&d->transaction_lock);
+  // the ticket being served is the caller's own
+  const gboolean waiting = d->transaction_next - d->transaction_serving > 1;
+  dt_pthread_mutex_unlock(&d->transaction_lock);
+  return waiting;
+}
+
 const gchar *dt_database_get_path(const struct dt_database_t *db)
 {
   return db->dbfilename_library;
@@ -1921,6 +2433,11 @@ gboolean dt_database_get_lock_acquired(const dt_database_t *db)
   return db->lock_acquired;
 }
 
+gboolean dt_database_has_search_index(const dt_database_t *db)
+{
+  return db->search_index;
+}
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
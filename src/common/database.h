@@ -22,14 +22,36 @@
 
 struct dt_database_t;
 
+/** main.meta_data_fts uses (id << DT_DATABASE_SEARCH_KEY_BITS) | key as rowid */
+#define DT_DATABASE_SEARCH_KEY_BITS 4
+
 /** allocates and initializes database */
 struct dt_database_t *dt_database_init(const char *alternative, const gboolean load_data);
 /** closes down database and frees memory */
 void dt_database_destroy(const struct dt_database_t *);
 /** get handle */
 struct sqlite3 *dt_database_get(const struct dt_database_t *);
+/** get a read-only connection of the calling worker thread, for lookups in main and data which shouldn't wait
+ * for writes of the gui. it can't see the memory tables nor uncommitted changes, falls back to the main handle
+ * on the gui thread, without a write ahead log or while a transaction is open. */
+struct sqlite3 *dt_database_get_reader(const struct dt_database_t *db);
+/** prepare sql from a per connection cache, the statement has to be given back with
+ * dt_database_release_cached(). use DT_DEBUG_SQLITE3_PREPARE_CACHED() for hot paths. */
+int dt_database_prepare_cached(struct sqlite3 *handle, const char *sql, struct sqlite3_stmt **stmt);
+/** reset a statement from dt_database_prepare_cached() and put it back, or finalize it if it isn't cached */
+void dt_database_release_cached(struct sqlite3_stmt *stmt);
+/** group many small writes into one transaction, e.g. while importing. transactions belong to the calling
+ * thread: they nest there as savepoints, other threads wait for their turn until the outermost one is
+ * released, in the order they asked. */
+void dt_database_start_transaction(const struct dt_database_t *db);
+/** release the innermost transaction opened by dt_database_start_transaction(), the outermost one commits */
+void dt_database_release_transaction(const struct dt_database_t *db);
+/** test if other threads wait for a transaction, long running ones should commit and give them their turn */
+gboolean dt_database_transaction_waiting(const struct dt_database_t *db);
 /** Returns database path */
 const gchar *dt_database_get_path(const struct dt_database_t *db);
+/** test if the fts5 search index over lens, filename and meta data is available */
+gboolean dt_database_has_search_index(const struct dt_database_t *db);
 /** test if database was already locked by another instance */
 gboolean dt_database_get_lock_acquired(const struct dt_database_t *db);
 /** show an error popup. this has to be postponed until after we tried using dbus to reach another instance */
@@ -99,6 +99,19 @@
     __DT_DEBUG_SQL_QUERY__(b)                                                                                     \
   } while(0)
 
+// like DT_DEBUG_SQLITE3_PREPARE_V2(), but takes the statement from the cache of the connection. it has to be
+// given back with DT_DEBUG_SQLITE3_RELEASE() instead of sqlite3_finalize(), which also resets its bindings.
+#define DT_DEBUG_SQLITE3_PREPARE_CACHED(a, b, c)                                                                  \
+  do                                                                                                              \
+  {                                                                                                               \
+    dt_print(DT_DEBUG_SQL, "[sql] %s:%d, function %s(): prepare cached \"%s\"\n", __FILE__, __LINE__,             \
+             __FUNCTION__, (b));                                                                                  \
+    __DT_DEBUG_ASSERT_WITH_QUERY__(dt_database_prepare_cached(a, b, c), (b));                                     \
+    __DT_DEBUG_SQL_QUERY__(b)                                                                                     \
+  } while(0)
+
+#define DT_DEBUG_SQLITE3_RELEASE(a) dt_database_release_cached(a)
+
 #define DT_DEBUG_SQLITE3_BIND_INT(a, b, c) __DT_DEBUG_ASSERT__(sqlite3_bind_int(a, b, c))
 #define DT_DEBUG_SQLITE3_BIND_DOUBLE(a, b, c) __DT_DEBUG_ASSERT__(sqlite3_bind_double(a, b, c))
 #define DT_DEBUG_SQLITE3_BIND_TEXT(a, b, c, d, e) __DT_DEBUG_ASSERT__(sqlite3_bind_text(a, b, c, d, e))
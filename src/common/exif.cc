@@ -26,6 +26,7 @@ extern "C" {
 #endif
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <sqlite3.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -38,6 +39,7 @@ extern "C" {
 #include <cmath>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <string>
 
@@ -87,6 +89,35 @@ public:
 
 static void _exif_import_tags(dt_image_t *img, Exiv2::XmpData::iterator &pos);
 
+// images with metadata already read by dt_exif_prefetch(), waiting to be picked up by _exif_open()
+static std::map<std::string, std::unique_ptr<Exiv2::Image>> _prefetched;
+static dt_pthread_mutex_t _prefetched_mutex;
+
+// open the file and read its metadata, or take what dt_exif_prefetch() has prepared. with data the file
+// isn't read again but parsed from there. throws like exiv2.
+static std::unique_ptr<Exiv2::Image> _exif_open(const char *path, const uint8_t *data = NULL, size_t size = 0)
+{
+  dt_pthread_mutex_lock(&_prefetched_mutex);
+  if(!_prefetched.empty())
+  {
+    auto it = _prefetched.find(path);
+    if(it != _prefetched.end())
+    {
+      std::unique_ptr<Exiv2::Image> image = std::move(it->second);
+      _prefetched.erase(it);
+      dt_pthread_mutex_unlock(&_prefetched_mutex);
+      return image;
+    }
+  }
+  dt_pthread_mutex_unlock(&_prefetched_mutex);
+
+  std::unique_ptr<Exiv2::Image> image(data ? Exiv2::ImageFactory::open(data, size)
+                                           : Exiv2::ImageFactory::open(WIDEN(path)));
+  assert(image.get() != 0);
+  read_metadata_threadsafe(image);
+  return image;
+}
+
 // this array should contain all XmpBag and XmpSeq keys used by dt
 const char *dt_xmp_keys[]
     = { "Xmp.dc.subject", "Xmp.lr.hierarchicalSubject", "Xmp.darktable.colorlabels", "Xmp.darktable.history",
@@ -970,10 +1001,17 @@ int dt_exif_read_from_blob(dt_image_t *img, uint8_t *blob, const int size)
  * Get the largest possible thumbnail from the image
  */
 int dt_exif_get_thumbnail(const char *path, uint8_t **buffer, size_t *size, char **mime_type)
+{
+  return dt_exif_get_thumbnail_from_data(path, NULL, 0, buffer, size, mime_type);
+}
+
+int dt_exif_get_thumbnail_from_data(const char *path, const uint8_t *data, const size_t data_size,
+                                    uint8_t **buffer, size_t *size, char **mime_type)
 {
   try
   {
-    std::unique_ptr<Exiv2::Image> image(Exiv2::ImageFactory::open(WIDEN(path)));
+    std::unique_ptr<Exiv2::Image> image(data ? Exiv2::ImageFactory::open(data, data_size)
+                                             : Exiv2::ImageFactory::open(WIDEN(path)));
     assert(image.get() != 0);
     read_metadata_threadsafe(image);
 
@@ -1021,6 +1059,11 @@ int dt_exif_get_thumbnail(const char *path, uint8_t **buffer, size_t *size, char
  * XMP data trumps IPTC data trumps EXIF data
  */
 int dt_exif_read(dt_image_t *img, const char *path)
+{
+  return dt_exif_read_from_data(img, path, NULL, 0);
+}
+
+int dt_exif_read_from_data(dt_image_t *img, const char *path, const uint8_t *data, const size_t size)
 {
   // at least set datetime taken to something useful in case there is no exif data in this file (pfm, png,
   // ...)
@@ -1034,9 +1077,7 @@ int dt_exif_read(dt_image_t *img, const char *path)
 
   try
   {
-    std::unique_ptr<Exiv2::Image> image(Exiv2::ImageFactory::open(WIDEN(path)));
-    assert(image.get() != 0);
-    read_metadata_threadsafe(image);
+    std::unique_ptr<Exiv2::Image> image = _exif_open(path, data, size);
     bool res = true;
 
     // EXIF metadata
@@ -1073,53 +1114,86 @@ int dt_exif_read(dt_image_t *img, const char *path)
   }
 }
 
-int dt_exif_write_blob(uint8_t *blob, uint32_t size, const char *path, const int compressed)
+void dt_exif_prefetch(const char *path)
 {
   try
   {
+    // the file is opened and probed outside of the exiv2 lock, only the parsing is serialized
     std::unique_ptr<Exiv2::Image> image(Exiv2::ImageFactory::open(WIDEN(path)));
     assert(image.get() != 0);
     read_metadata_threadsafe(image);
-    Exiv2::ExifData &imgExifData = image->exifData();
-    Exiv2::ExifData blobExifData;
-    Exiv2::ExifParser::decode(blobExifData, blob + 6, size);
-    Exiv2::ExifData::const_iterator end = blobExifData.end();
-    Exiv2::ExifData::iterator it;
-    for(Exiv2::ExifData::const_iterator i = blobExifData.begin(); i != end; ++i)
-    {
-      // add() does not override! we need to delete existing key first.
-      Exiv2::ExifKey key(i->key());
-      if((it = imgExifData.findKey(key)) != imgExifData.end()) imgExifData.erase(it);
 
-      imgExifData.add(Exiv2::ExifKey(i->key()), &i->value());
-    }
+    dt_pthread_mutex_lock(&_prefetched_mutex);
+    _prefetched[path] = std::move(image);
+    dt_pthread_mutex_unlock(&_prefetched_mutex);
+  }
+  catch(Exiv2::AnyError &e)
+  {
+    // leave it to the real read to complain
+  }
+}
 
-    {
-      // Remove thumbnail
-      static const char *keys[] = {
-        "Exif.Thumbnail.Compression",
-        "Exif.Thumbnail.XResolution",
-        "Exif.Thumbnail.YResolution",
-        "Exif.Thumbnail.ResolutionUnit",
-        "Exif.Thumbnail.JPEGInterchangeFormat",
-        "Exif.Thumbnail.JPEGInterchangeFormatLength"
-      };
-      static const guint n_keys = G_N_ELEMENTS(keys);
-      dt_remove_exif_keys(imgExifData, keys, n_keys);
-    }
+void dt_exif_prefetch_discard(const char *path)
+{
+  dt_pthread_mutex_lock(&_prefetched_mutex);
+  _prefetched.erase(path);
+  dt_pthread_mutex_unlock(&_prefetched_mutex);
+}
 
-    // only compressed images may set PixelXDimension and PixelYDimension
-    if(!compressed)
-    {
-      static const char *keys[] = {
-        "Exif.Photo.PixelXDimension",
-        "Exif.Photo.PixelYDimension"
-      };
-      static const guint n_keys = G_N_ELEMENTS(keys);
-      dt_remove_exif_keys(imgExifData, keys, n_keys);
-    }
+// merge the exif blob into the metadata of image, which has been read already
+static void _exif_merge_blob(std::unique_ptr<Exiv2::Image> &image, uint8_t *blob, uint32_t size,
+                             const int compressed)
+{
+  Exiv2::ExifData &imgExifData = image->exifData();
+  Exiv2::ExifData blobExifData;
+  Exiv2::ExifParser::decode(blobExifData, blob + 6, size);
+  Exiv2::ExifData::const_iterator end = blobExifData.end();
+  Exiv2::ExifData::iterator it;
+  for(Exiv2::ExifData::const_iterator i = blobExifData.begin(); i != end; ++i)
+  {
+    // add() does not override! we need to delete existing key first.
+    Exiv2::ExifKey key(i->key());
+    if((it = imgExifData.findKey(key)) != imgExifData.end()) imgExifData.erase(it);
+
+    imgExifData.add(Exiv2::ExifKey(i->key()), &i->value());
+  }
+
+  {
+    // Remove thumbnail
+    static const char *keys[] = {
+      "Exif.Thumbnail.Compression",
+      "Exif.Thumbnail.XResolution",
+      "Exif.Thumbnail.YResolution",
+      "Exif.Thumbnail.ResolutionUnit",
+      "Exif.Thumbnail.JPEGInterchangeFormat",
+      "Exif.Thumbnail.JPEGInterchangeFormatLength"
+    };
+    static const guint n_keys = G_N_ELEMENTS(keys);
+    dt_remove_exif_keys(imgExifData, keys, n_keys);
+  }
 
-    imgExifData.sortByTag();
+  // only compressed images may set PixelXDimension and PixelYDimension
+  if(!compressed)
+  {
+    static const char *keys[] = {
+      "Exif.Photo.PixelXDimension",
+      "Exif.Photo.PixelYDimension"
+    };
+    static const guint n_keys = G_N_ELEMENTS(keys);
+    dt_remove_exif_keys(imgExifData, keys, n_keys);
+  }
+
+  imgExifData.sortByTag();
+}
+
+int dt_exif_write_blob(uint8_t *blob, uint32_t size, const char *path, const int compressed)
+{
+  try
+  {
+    std::unique_ptr<Exiv2::Image> image(Exiv2::ImageFactory::open(WIDEN(path)));
+    assert(image.get() != 0);
+    read_metadata_threadsafe(image);
+    _exif_merge_blob(image, blob, size, compressed);
     image->writeMetadata();
   }
   catch(Exiv2::AnyError &e)
@@ -1131,6 +1205,42 @@ int dt_exif_write_blob(uint8_t *blob, uint32_t size, const char *path, const int
   return 1;
 }
 
+int dt_exif_write_blob_to_file(uint8_t *blob, uint32_t size, const uint8_t *data, const size_t data_size,
+                               const char *path, const int compressed)
+{
+  int res = 1;
+  Exiv2::DataBuf merged;
+  try
+  {
+    std::unique_ptr<Exiv2::Image> image(Exiv2::ImageFactory::open(data, data_size));
+    assert(image.get() != 0);
+    read_metadata_threadsafe(image);
+    _exif_merge_blob(image, blob, size, compressed);
+    image->writeMetadata();
+
+    // the memory io now holds the whole file including the new metadata
+    Exiv2::BasicIo &io = image->io();
+    io.open();
+    merged = io.read(io.size());
+    io.close();
+  }
+  catch(Exiv2::AnyError &e)
+  {
+    std::string s(e.what());
+    std::cerr << "[exiv2] " << path << ": " << s << std::endl;
+    res = 0;
+  }
+
+  // write the encoded image even if the metadata couldn't be added
+  const uint8_t *out = res ? merged.pData_ : data;
+  const size_t out_size = res ? merged.size_ : data_size;
+  FILE *f = g_fopen(path, "wb");
+  if(!f) return 0;
+  const size_t written = fwrite(out, 1, out_size, f);
+  if(fclose(f) || written != out_size) return 0;
+  return res;
+}
+
 int dt_exif_read_blob(uint8_t **buf, const char *path, const int imgid, const int sRGB, const int out_width,
                       const int out_height, const int dng_mode)
 {
@@ -2110,9 +2220,7 @@ int dt_exif_xmp_read(dt_image_t *img, const char *filename, const int history_on
   try
   {
     // read xmp sidecar
-    std::unique_ptr<Exiv2::Image> image(Exiv2::ImageFactory::open(WIDEN(filename)));
-    assert(image.get() != 0);
-    read_metadata_threadsafe(image);
+    std::unique_ptr<Exiv2::Image> image = _exif_open(filename);
     Exiv2::XmpData &xmpData = image->xmpData();
 
     sqlite3_stmt *stmt;
@@ -2679,6 +2787,46 @@ char *dt_exif_xmp_read_string(const int imgid)
   }
 }
 
+// add what we have in the sidecar and in the DB to the xmp data an exported image gets from its input image
+static void _exif_xmp_export_data(const int imgid, Exiv2::XmpData &xmpData)
+{
+  char input_filename[PATH_MAX] = { 0 };
+  gboolean from_cache = TRUE;
+  dt_image_full_path(imgid, input_filename, sizeof(input_filename), &from_cache);
+
+  // now add whatever we have in the sidecar XMP. this overwrites stuff from the source image
+  dt_image_path_append_version(imgid, input_filename, sizeof(input_filename));
+  g_strlcat(input_filename, ".xmp", sizeof(input_filename));
+  if(g_file_test(input_filename, G_FILE_TEST_EXISTS))
+  {
+    Exiv2::XmpData sidecarXmpData;
+    std::string xmpPacket;
+
+    Exiv2::DataBuf buf = Exiv2::readFile(WIDEN(input_filename));
+    xmpPacket.assign(reinterpret_cast<char *>(buf.pData_), buf.size_);
+    Exiv2::XmpParser::decode(sidecarXmpData, xmpPacket);
+
+    for(Exiv2::XmpData::const_iterator it = sidecarXmpData.begin(); it != sidecarXmpData.end(); ++it)
+      xmpData.add(*it);
+  }
+
+  dt_remove_known_keys(xmpData); // is this needed?
+
+  {
+    // We also want to make sure to not have some tags that might
+    // have come in from XMP files created by digikam or similar
+    static const char *keys[] = {
+      "Xmp.tiff.Orientation"
+    };
+    static const guint n_keys = G_N_ELEMENTS(keys);
+    dt_remove_xmp_keys(xmpData, keys, n_keys);
+  }
+
+  // last but not least attach what we have in DB to the XMP. in theory that should be
+  // the same as what we just copied over from the sidecar file, but you never know ...
+  dt_exif_xmp_read_data(xmpData, imgid);
+}
+
 int dt_exif_xmp_attach(const int imgid, const char *filename)
 {
   try
@@ -2709,50 +2857,74 @@ int dt_exif_xmp_attach(const int imgid, const char *filename)
       std::cerr << "[xmp_attach] " << input_filename << ": caught exiv2 exception '" << e << "'\n";
     }
 
-    Exiv2::XmpData &xmpData = img->xmpData();
+    _exif_xmp_export_data(imgid, img->xmpData());
 
-    // now add whatever we have in the sidecar XMP. this overwrites stuff from the source image
-    dt_image_path_append_version(imgid, input_filename, sizeof(input_filename));
-    g_strlcat(input_filename, ".xmp", sizeof(input_filename));
-    if(g_file_test(input_filename, G_FILE_TEST_EXISTS))
-    {
-      Exiv2::XmpData sidecarXmpData;
-      std::string xmpPacket;
+    img->writeMetadata();
+    return 0;
+  }
+  catch(Exiv2::AnyError &e)
+  {
+    std::cerr << "[xmp_attach] " << filename << ": caught exiv2 exception '" << e << "'\n";
+    return -1;
+  }
+}
 
-      Exiv2::DataBuf buf = Exiv2::readFile(WIDEN(input_filename));
-      xmpPacket.assign(reinterpret_cast<char *>(buf.pData_), buf.size_);
-      Exiv2::XmpParser::decode(sidecarXmpData, xmpPacket);
+char *dt_exif_xmp_export_packet(const int imgid, int *len)
+{
+  *len = 0;
+  try
+  {
+    char input_filename[PATH_MAX] = { 0 };
+    gboolean from_cache = TRUE;
+    dt_image_full_path(imgid, input_filename, sizeof(input_filename), &from_cache);
 
-      for(Exiv2::XmpData::const_iterator it = sidecarXmpData.begin(); it != sidecarXmpData.end(); ++it)
-        xmpData.add(*it);
+    Exiv2::XmpData xmpData;
+    try
+    {
+      // start with the XMP of the original file. there is no IPTC block in the packet, the IPTC data of the
+      // original file goes in as the XMP properties it maps to, unless the XMP has them already.
+      std::unique_ptr<Exiv2::Image> input_image(Exiv2::ImageFactory::open(WIDEN(input_filename)));
+      if(input_image.get() != 0)
+      {
+        read_metadata_threadsafe(input_image);
+        Exiv2::copyIptcToXmp(input_image->iptcData(), xmpData);
+        const Exiv2::XmpData &inputXmpData = input_image->xmpData();
+        for(Exiv2::XmpData::const_iterator it = inputXmpData.begin(); it != inputXmpData.end(); ++it)
+        {
+          Exiv2::XmpData::iterator pos = xmpData.findKey(Exiv2::XmpKey(it->key()));
+          if(pos != xmpData.end()) xmpData.erase(pos);
+          xmpData.add(*it);
+        }
+      }
     }
-
-    dt_remove_known_keys(xmpData); // is this needed?
-
+    catch(Exiv2::AnyError &e)
     {
-      // We also want to make sure to not have some tags that might
-      // have come in from XMP files created by digikam or similar
-      static const char *keys[] = {
-        "Xmp.tiff.Orientation"
-      };
-      static const guint n_keys = G_N_ELEMENTS(keys);
-      dt_remove_xmp_keys(xmpData, keys, n_keys);
+      std::cerr << "[xmp_export_packet] " << input_filename << ": caught exiv2 exception '" << e << "'\n";
     }
 
-    // last but not least attach what we have in DB to the XMP. in theory that should be
-    // the same as what we just copied over from the sidecar file, but you never know ...
-    dt_exif_xmp_read_data(xmpData, imgid);
+    _exif_xmp_export_data(imgid, xmpData);
 
-    img->writeMetadata();
-    return 0;
+    // with the packet wrapper, like exiv2 writes it into images
+    std::string xmpPacket;
+    if(Exiv2::XmpParser::encode(xmpPacket, xmpData, Exiv2::XmpParser::useCompactFormat) != 0)
+    {
+      throw Exiv2::Error(1, "[xmp_export_packet] failed to serialize xmp data");
+    }
+    *len = xmpPacket.size();
+    return g_strdup(xmpPacket.c_str());
   }
   catch(Exiv2::AnyError &e)
   {
-    std::cerr << "[xmp_attach] " << filename << ": caught exiv2 exception '" << e << "'\n";
-    return -1;
+    std::cerr << "[xmp_export_packet] " << imgid << ": caught exiv2 exception '" << e << "'\n";
+    *len = 0;
+    return NULL;
   }
 }
 
+// numbers the temporary files of dt_exif_xmp_write(), so that writers of the same sidecar running at the same
+// time (the background sidecar writer, jobs, the copy exporter) don't share one
+static gint _xmp_write_tmp_count = 0;
+
 // write xmp sidecar file:
 int dt_exif_xmp_write(const int imgid, const char *filename)
 {
@@ -2826,14 +2998,26 @@ int dt_exif_xmp_write(const int imgid, const char *filename)
 
     if(write_sidecar)
     {
+      // write to a temporary file next to it and rename that, so that a crash or a full disk never leaves
+      // a truncated sidecar behind.
       // using std::ofstream isn't possible here -- on Windows it doesn't support Unicode filenames with mingw
-      FILE *fout = g_fopen(filename, "wb");
-      if(fout)
+      gchar *tmpname
+          = g_strdup_printf("%s.%u.tmp", filename, (guint)g_atomic_int_add(&_xmp_write_tmp_count, 1));
+      FILE *fout = g_fopen(tmpname, "wb");
+      if(!fout)
+      {
+        g_free(tmpname);
+        return 1;
+      }
+      const gboolean written = fprintf(fout, "%s", xml_header) >= 0 && fprintf(fout, "%s", xmpPacket.c_str()) >= 0;
+      if(fclose(fout) != 0 || !written || g_rename(tmpname, filename) != 0)
       {
-        fprintf(fout, "%s", xml_header);
-        fprintf(fout, "%s", xmpPacket.c_str());
-        fclose(fout);
+        std::cerr << "[xmp_write] " << filename << ": can't write the sidecar file\n";
+        g_unlink(tmpname);
+        g_free(tmpname);
+        return 1;
       }
+      g_free(tmpname);
     }
 
     return 0;
@@ -2944,6 +3128,8 @@ void dt_exif_init()
   // preface the exiv2 messages with "[exiv2] "
   Exiv2::LogMsg::setHandler(&dt_exif_log_handler);
 
+  dt_pthread_mutex_init(&_prefetched_mutex, NULL);
+
   Exiv2::XmpParser::initialize();
   // this has to stay with the old url (namespace already propagated outside dt)
   Exiv2::XmpProperties::registerNs("http://darktable.sf.net/", "darktable");
@@ -2953,6 +3139,8 @@ void dt_exif_init()
 
 void dt_exif_cleanup()
 {
+  _prefetched.clear();
+  dt_pthread_mutex_destroy(&_prefetched_mutex);
   Exiv2::XmpParser::terminate();
 }
 
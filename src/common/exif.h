@@ -29,6 +29,15 @@ extern "C" {
 /** read metadata from file with full path name, XMP data trumps IPTC data trumps EXIF data, store to image
  * struct. returns 0 on success. */
 int dt_exif_read(dt_image_t *img, const char *path);
+/** like dt_exif_read(), but parses the contents of path which the caller has in memory already */
+int dt_exif_read_from_data(dt_image_t *img, const char *path, const uint8_t *data, const size_t size);
+
+/** parse the metadata of the file ahead of time, so that the next dt_exif_read() or dt_exif_xmp_read() of
+ * exactly this path doesn't have to touch the disk. can be called from any thread, used by the importer. */
+void dt_exif_prefetch(const char *path);
+
+/** forget metadata prefetched for path which hasn't been used. */
+void dt_exif_prefetch_discard(const char *path);
 
 /** read exif data to image struct from given data blob, wherever you got it from. */
 int dt_exif_read_from_blob(dt_image_t *img, uint8_t *blob, const int size);
@@ -41,12 +50,21 @@ int dt_exif_read_blob(uint8_t **blob, const char *path, const int imgid, const i
 /** write blob to file exif. merges with existing exif information.*/
 int dt_exif_write_blob(uint8_t *blob, uint32_t size, const char *path, const int compressed);
 
+/** merge blob into the exif of an image encoded to memory and write the result to path in one go.
+ * the image is written without the blob if that can't be merged, in which case 0 is returned. */
+int dt_exif_write_blob_to_file(uint8_t *blob, uint32_t size, const uint8_t *data, const size_t data_size,
+                               const char *path, const int compressed);
+
 /** write xmp sidecar file. */
 int dt_exif_xmp_write(const int imgid, const char *filename);
 
 /** write xmp packet inside an image. */
 int dt_exif_xmp_attach(const int imgid, const char *filename);
 
+/** the xmp packet dt_exif_xmp_attach() would write, for formats which embed it while encoding. len is set to
+ * its length in bytes without the terminating 0. to be freed with g_free(), NULL on failure. */
+char *dt_exif_xmp_export_packet(const int imgid, int *len);
+
 /** get the xmp blob for imgid. */
 char *dt_exif_xmp_read_string(const int imgid);
 
@@ -55,6 +73,9 @@ int dt_exif_xmp_read(dt_image_t *img, const char *filename, const int history_on
 
 /** fetch largest exif thumbnail jpg bytestream into buffer*/
 int dt_exif_get_thumbnail(const char *path, uint8_t **buffer, size_t *size, char **mime_type);
+/** same as dt_exif_get_thumbnail() for the contents of path, already in memory */
+int dt_exif_get_thumbnail_from_data(const char *path, const uint8_t *data, const size_t data_size,
+                                    uint8_t **buffer, size_t *size, char **mime_type);
 
 /** thread safe init and cleanup. */
 void dt_exif_init();
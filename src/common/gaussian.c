@@ -24,6 +24,7 @@
 #endif
 #include "common/gaussian.h"
 #include "common/opencl.h"
+#include "common/threadpool.h"
 
 #define CLAMPF(a, mn, mx) ((a) < (mn) ? (mn) : ((a) > (mx) ? (mx) : (a)))
 
@@ -113,13 +114,8 @@ size_t dt_gaussian_singlebuffer_size(const int width,    // width of input image
 }
 
 
-dt_gaussian_t *dt_gaussian_init(const int width,    // width of input image
-                                const int height,   // height of input image
-                                const int channels, // channels per pixel
-                                const float *max,   // maximum allowed values per channel for clamping
-                                const float *min,   // minimum allowed values per channel for clamping
-                                const float sigma,  // gaussian sigma
-                                const int order)    // order of gaussian blur
+static dt_gaussian_t *_gaussian_init(const int width, const int height, const int channels, const float *max,
+                                     const float *min, const float sigma, const int order, float *buf)
 {
   dt_gaussian_t *g = (dt_gaussian_t *)malloc(sizeof(dt_gaussian_t));
   if(!g) return NULL;
@@ -129,7 +125,8 @@ dt_gaussian_t *dt_gaussian_init(const int width,    // width of input image
   g->channels = channels;
   g->sigma = sigma;
   g->order = order;
-  g->buf = NULL;
+  g->buf = buf;
+  g->own_buf = buf == NULL;
   g->max = (float *)calloc(channels, sizeof(float));
   g->min = (float *)calloc(channels, sizeof(float));
 
@@ -141,42 +138,66 @@ dt_gaussian_t *dt_gaussian_init(const int width,    // width of input image
     g->min[k] = min[k];
   }
 
-  g->buf = dt_alloc_align(64, (size_t)width * height * channels * sizeof(float));
+  if(g->own_buf) g->buf = dt_alloc_align(64, (size_t)width * height * channels * sizeof(float));
   if(!g->buf) goto error;
 
   return g;
 
 error:
-  dt_free_align(g->buf);
+  if(g->own_buf) dt_free_align(g->buf);
   free(g->max);
   free(g->min);
   free(g);
   return NULL;
 }
 
+dt_gaussian_t *dt_gaussian_init(const int width,    // width of input image
+                                const int height,   // height of input image
+                                const int channels, // channels per pixel
+                                const float *max,   // maximum allowed values per channel for clamping
+                                const float *min,   // minimum allowed values per channel for clamping
+                                const float sigma,  // gaussian sigma
+                                const int order)    // order of gaussian blur
+{
+  return _gaussian_init(width, height, channels, max, min, sigma, order, NULL);
+}
 
-void dt_gaussian_blur(dt_gaussian_t *g, const float *const in, float *const out)
+dt_gaussian_t *dt_gaussian_init_buffer(const int width, const int height, const int channels, const float *max,
+                                       const float *min, const float sigma, const int order, float *buf)
 {
+  if(!buf) return NULL;
+  return _gaussian_init(width, height, channels, max, min, sigma, order, buf);
+}
 
-  const int width = g->width;
-  const int height = g->height;
-  const int ch = MIN(4, g->channels); // just to appease zealous compiler warnings about stack usage
 
+typedef struct _gaussian_pass_t
+{
+  const float *in;
+  float *temp;
+  float *out;
+  int width;
+  int height;
+  int ch;
+  const float *max;
+  const float *min;
   float a0, a1, a2, a3, b1, b2, coefp, coefn;
-
-  compute_gauss_params(g->sigma, g->order, &a0, &a1, &a2, &a3, &b1, &b2, &coefp, &coefn);
-
-  float *temp = g->buf;
-
-  float *Labmax = g->max;
-  float *Labmin = g->min;
+} _gaussian_pass_t;
 
 // vertical blur column by column
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(temp, Labmin, Labmax, a0, a1, a2, a3, b1, b2, coefp,           \
-                                              coefn) schedule(static)
-#endif
-  for(int i = 0; i < width; i++)
+static void _blur_columns(void *data, size_t begin, size_t end, int thread)
+{
+  const _gaussian_pass_t *const p = (const _gaussian_pass_t *)data;
+  const float *const in = p->in;
+  float *const temp = p->temp;
+  const int height = p->height;
+  const int width = p->width;
+  const int ch = p->ch;
+  const float *const Labmax = p->max;
+  const float *const Labmin = p->min;
+  const float a0 = p->a0, a1 = p->a1, a2 = p->a2, a3 = p->a3, b1 = p->b1, b2 = p->b2;
+  const float coefp = p->coefp, coefn = p->coefn;
+
+  for(int i = begin; i < end; i++)
   {
     float xp[4] = {0.0f};
     float yb[4] = {0.0f};
@@ -242,13 +263,22 @@ void dt_gaussian_blur(dt_gaussian_t *g, const float *const in, float *const out)
       }
     }
   }
+}
 
 // horizontal blur line by line
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(temp, Labmin, Labmax, a0, a1, a2, a3, b1, b2, coefp,           \
-                                              coefn) schedule(static)
-#endif
-  for(int j = 0; j < height; j++)
+static void _blur_rows(void *data, size_t begin, size_t end, int thread)
+{
+  const _gaussian_pass_t *const p = (const _gaussian_pass_t *)data;
+  const float *const temp = p->temp;
+  float *const out = p->out;
+  const int width = p->width;
+  const int ch = p->ch;
+  const float *const Labmax = p->max;
+  const float *const Labmin = p->min;
+  const float a0 = p->a0, a1 = p->a1, a2 = p->a2, a3 = p->a3, b1 = p->b1, b2 = p->b2;
+  const float coefp = p->coefp, coefn = p->coefn;
+
+  for(int j = begin; j < end; j++)
   {
     float xp[4] = {0.0f};
     float yb[4] = {0.0f};
@@ -316,33 +346,37 @@ void dt_gaussian_blur(dt_gaussian_t *g, const float *const in, float *const out)
   }
 }
 
-
-
-#if defined(__SSE__)
-static void dt_gaussian_blur_4c_sse(dt_gaussian_t *g, const float *const in, float *const out)
+void dt_gaussian_blur(dt_gaussian_t *g, const float *const in, float *const out)
 {
+  _gaussian_pass_t p = { .in = in, .temp = g->buf, .out = out, .width = g->width, .height = g->height,
+                         .ch = MIN(4, g->channels), // just to appease zealous compiler warnings about stack usage
+                         .max = g->max, .min = g->min };
 
-  const int width = g->width;
-  const int height = g->height;
-  const int ch = 4;
-
-  assert(g->channels == 4);
-
-  float a0, a1, a2, a3, b1, b2, coefp, coefn;
-
-  compute_gauss_params(g->sigma, g->order, &a0, &a1, &a2, &a3, &b1, &b2, &coefp, &coefn);
+  compute_gauss_params(g->sigma, g->order, &p.a0, &p.a1, &p.a2, &p.a3, &p.b1, &p.b2, &p.coefp, &p.coefn);
 
-  const __m128 Labmax = _mm_set_ps(g->max[3], g->max[2], g->max[1], g->max[0]);
-  const __m128 Labmin = _mm_set_ps(g->min[3], g->min[2], g->min[1], g->min[0]);
+  // neighbouring columns share cache lines, so hand them out in bunches
+  dt_threadpool_for(p.width, 16, _blur_columns, &p);
+  dt_threadpool_for(p.height, 4, _blur_rows, &p);
+}
 
-  float *temp = g->buf;
 
 
+#if defined(__SSE__)
 // vertical blur column by column
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(temp, a0, a1, a2, a3, b1, b2, coefp, coefn) schedule(static)
-#endif
-  for(int i = 0; i < width; i++)
+static void _blur_columns_4c_sse(void *data, size_t begin, size_t end, int thread)
+{
+  const _gaussian_pass_t *const p = (const _gaussian_pass_t *)data;
+  const float *const in = p->in;
+  float *const temp = p->temp;
+  const int height = p->height;
+  const int width = p->width;
+  const int ch = 4;
+  const __m128 Labmax = _mm_set_ps(p->max[3], p->max[2], p->max[1], p->max[0]);
+  const __m128 Labmin = _mm_set_ps(p->min[3], p->min[2], p->min[1], p->min[0]);
+  const float a0 = p->a0, a1 = p->a1, a2 = p->a2, a3 = p->a3, b1 = p->b1, b2 = p->b2;
+  const float coefp = p->coefp, coefn = p->coefn;
+
+  for(int i = begin; i < end; i++)
   {
     __m128 xp = _mm_setzero_ps();
     __m128 yb = _mm_setzero_ps();
@@ -405,12 +439,22 @@ static void dt_gaussian_blur_4c_sse(dt_gaussian_t *g, const float *const in, flo
       _mm_store_ps(temp + offset, _mm_add_ps(_mm_load_ps(temp + offset), yc));
     }
   }
+}
 
 // horizontal blur line by line
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(temp, a0, a1, a2, a3, b1, b2, coefp, coefn) schedule(static)
-#endif
-  for(size_t j = 0; j < height; j++)
+static void _blur_rows_4c_sse(void *data, size_t begin, size_t end, int thread)
+{
+  const _gaussian_pass_t *const p = (const _gaussian_pass_t *)data;
+  const float *const temp = p->temp;
+  float *const out = p->out;
+  const int width = p->width;
+  const int ch = 4;
+  const __m128 Labmax = _mm_set_ps(p->max[3], p->max[2], p->max[1], p->max[0]);
+  const __m128 Labmin = _mm_set_ps(p->min[3], p->min[2], p->min[1], p->min[0]);
+  const float a0 = p->a0, a1 = p->a1, a2 = p->a2, a3 = p->a3, b1 = p->b1, b2 = p->b2;
+  const float coefp = p->coefp, coefn = p->coefn;
+
+  for(size_t j = begin; j < end; j++)
   {
     __m128 xp = _mm_setzero_ps();
     __m128 yb = _mm_setzero_ps();
@@ -474,6 +518,19 @@ static void dt_gaussian_blur_4c_sse(dt_gaussian_t *g, const float *const in, flo
     }
   }
 }
+
+static void dt_gaussian_blur_4c_sse(dt_gaussian_t *g, const float *const in, float *const out)
+{
+  assert(g->channels == 4);
+
+  _gaussian_pass_t p = { .in = in, .temp = g->buf, .out = out, .width = g->width, .height = g->height,
+                         .ch = 4, .max = g->max, .min = g->min };
+
+  compute_gauss_params(g->sigma, g->order, &p.a0, &p.a1, &p.a2, &p.a3, &p.b1, &p.b2, &p.coefp, &p.coefn);
+
+  dt_threadpool_for(p.width, 16, _blur_columns_4c_sse, &p);
+  dt_threadpool_for(p.height, 4, _blur_rows_4c_sse, &p);
+}
 #endif
 
 void dt_gaussian_blur_4c(dt_gaussian_t *g, const float *const in, float *const out)
@@ -490,7 +547,7 @@ void dt_gaussian_blur_4c(dt_gaussian_t *g, const float *const in, float *const o
 void dt_gaussian_free(dt_gaussian_t *g)
 {
   if(!g) return;
-  dt_free_align(g->buf);
+  if(g->own_buf) dt_free_align(g->buf);
   free(g->min);
   free(g->max);
   free(g);
@@ -38,11 +38,17 @@ typedef struct dt_gaussian_t
   float *max;
   float *min;
   float *buf;
+  int own_buf;
 } dt_gaussian_t;
 
 dt_gaussian_t *dt_gaussian_init(const int width, const int height, const int channels, const float *max,
                                 const float *min, const float sigma, const int order);
 
+// like dt_gaussian_init() but working in buf, which holds width * height * channels floats and still belongs
+// to the caller after dt_gaussian_free()
+dt_gaussian_t *dt_gaussian_init_buffer(const int width, const int height, const int channels, const float *max,
+                                       const float *min, const float sigma, const int order, float *buf);
+
 size_t dt_gaussian_memory_use(const int width, const int height, const int channels);
 
 size_t dt_gaussian_singlebuffer_size(const int width, const int height, const int channels);
@@ -28,6 +28,7 @@
 #include "common/imageio_rawspeed.h"
 #include "common/mipmap_cache.h"
 #include "common/tags.h"
+#include "common/trace.h"
 #include "control/conf.h"
 #include "control/control.h"
 #include "control/jobs.h"
@@ -190,16 +191,16 @@ gboolean dt_image_safe_remove(const int32_t imgid)
 void dt_image_full_path(const int imgid, char *pathname, size_t pathname_len, gboolean *from_cache)
 {
   sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "SELECT folder || '" G_DIR_SEPARATOR_S "' || filename FROM main.images i, main.film_rolls f WHERE "
-                              "i.film_id = f.id and i.id = ?1",
-                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get_reader(darktable.db),
+                                  "SELECT folder || '" G_DIR_SEPARATOR_S "' || filename FROM main.images i, "
+                                  "main.film_rolls f WHERE i.film_id = f.id and i.id = ?1",
+                                  &stmt);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
   if(sqlite3_step(stmt) == SQLITE_ROW)
   {
     g_strlcpy(pathname, (char *)sqlite3_column_text(stmt, 0), pathname_len);
   }
-  sqlite3_finalize(stmt);
+  DT_DEBUG_SQLITE3_RELEASE(stmt);
 
   if(*from_cache)
   {
@@ -218,7 +219,7 @@ static void _image_local_copy_full_path(const int imgid, char *pathname, size_t
   sqlite3_stmt *stmt;
 
   *pathname = '\0';
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get_reader(darktable.db),
                               "SELECT folder || '" G_DIR_SEPARATOR_S "' || filename FROM main.images i, main.film_rolls f "
                               "WHERE i.film_id = f.id AND i.id = ?1",
                               -1, &stmt, NULL);
@@ -614,6 +615,9 @@ int32_t dt_image_duplicate_with_version(const int32_t imgid, const int32_t newve
 
 void dt_image_remove(const int32_t imgid)
 {
+  // a queued sidecar write can't find the image anymore once it's gone from the db
+  dt_image_sidecar_flush(imgid);
+
   // if a local copy exists, remove it
 
   if(dt_image_local_copy_reset(imgid)) return;
@@ -1138,6 +1142,8 @@ int32_t dt_image_move(const int32_t imgid, const int32_t filmid)
   gchar oldimg[PATH_MAX] = { 0 };
   gchar newimg[PATH_MAX] = { 0 };
   gboolean from_cache = FALSE;
+  // the sidecar is moved along with the image, a queued write mustn't recreate it in the old place
+  dt_image_sidecar_flush(imgid);
   dt_image_full_path(imgid, oldimg, sizeof(oldimg), &from_cache);
   gchar *newdir = NULL;
 
@@ -1538,7 +1544,7 @@ int dt_image_local_copy_reset(const int32_t imgid)
 
     // first sync the xmp with the original picture
 
-    dt_image_write_sidecar_file(imgid);
+    dt_image_write_sidecar_file_sync(imgid);
 
     // delete image from cache directory only if there is no other local cache image referencing it
     // for example duplicates are all referencing the same base picture.
@@ -1570,46 +1576,216 @@ int dt_image_local_copy_reset(const int32_t imgid)
 // xmp stuff
 // *******************************************************
 
-void dt_image_write_sidecar_file(int imgid)
+static void _write_sidecar_file(const int imgid)
 {
-  // TODO: compute hash and don't write if not needed!
-  // write .xmp file
-  if(imgid > 0 && dt_conf_get_bool("write_sidecar_files"))
-  {
-    char filename[PATH_MAX] = { 0 };
+  char filename[PATH_MAX] = { 0 };
 
-    // FIRST: check if the original file is present
-    gboolean from_cache = FALSE;
+  // FIRST: check if the original file is present
+  gboolean from_cache = FALSE;
+  dt_image_full_path(imgid, filename, sizeof(filename), &from_cache);
+
+  if (!g_file_test(filename, G_FILE_TEST_EXISTS))
+  {
+    // OTHERWISE: check if the local copy exists
+    from_cache = TRUE;
     dt_image_full_path(imgid, filename, sizeof(filename), &from_cache);
 
-    if (!g_file_test(filename, G_FILE_TEST_EXISTS))
-    {
-      // OTHERWISE: check if the local copy exists
-      from_cache = TRUE;
-      dt_image_full_path(imgid, filename, sizeof(filename), &from_cache);
+    //  nothing to do, the original is not accessible and there is no local copy
+    if (!from_cache) return;
+  }
+
+  dt_image_path_append_version(imgid, filename, sizeof(filename));
+  g_strlcat(filename, ".xmp", sizeof(filename));
+
+  if(!dt_exif_xmp_write(imgid, filename))
+  {
+    // put the timestamp into db. this can't be done in exif.cc since that code gets called
+    // for the copy exporter, too
+    sqlite3_stmt *stmt;
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "UPDATE main.images SET write_timestamp = STRFTIME('%s', 'now') WHERE id = ?1",
+                                -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+  }
+}
+
+// sidecar files are written by a background thread, so that slow (network) storage doesn't hold up the
+// caller. all requests for an image within DT_SIDECAR_WRITE_DELAY are coalesced into one write: the first
+// one decides when it happens, the write itself picks up everything that's in the database by then.
+#define DT_SIDECAR_WRITE_DELAY (G_USEC_PER_SEC / 2)
 
-      //  nothing to do, the original is not accessible and there is no local copy
-      if (!from_cache) return;
+typedef struct dt_image_sidecar_request_t
+{
+  int imgid;
+  gint64 due; // in g_get_real_time() microseconds
+} dt_image_sidecar_request_t;
+
+static struct
+{
+  dt_pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  gboolean running;
+  GHashTable *pending; // imgid -> its request in order
+  GQueue *order;       // requests sorted by due time. owns them, also the ones taken out of pending meanwhile.
+  int writing;         // the image the thread is writing right now
+  uint64_t requested, written;
+  guint max_depth;
+} _sidecar_writer = { .running = FALSE };
+
+static void *_sidecar_writer_thread(void *arg)
+{
+  dt_pthread_setname("sidecar");
+  dt_pthread_mutex_lock(&_sidecar_writer.lock);
+  while(TRUE)
+  {
+    dt_image_sidecar_request_t *req = g_queue_peek_head(_sidecar_writer.order);
+    if(!req)
+    {
+      if(!_sidecar_writer.running) break;
+      dt_pthread_cond_wait(&_sidecar_writer.cond, &_sidecar_writer.lock);
+      continue;
     }
 
-    dt_image_path_append_version(imgid, filename, sizeof(filename));
-    g_strlcat(filename, ".xmp", sizeof(filename));
+    // taken out of the queue by _sidecar_writer_take() meanwhile
+    if(g_hash_table_lookup(_sidecar_writer.pending, GINT_TO_POINTER(req->imgid)) != req)
+    {
+      g_free(g_queue_pop_head(_sidecar_writer.order));
+      continue;
+    }
 
-    if(!dt_exif_xmp_write(imgid, filename))
+    // when shutting down everything left is written right away
+    if(_sidecar_writer.running && req->due > g_get_real_time())
     {
-      // put the timestamp into db. this can't be done in exif.cc since that code gets called
-      // for the copy exporter, too
-      sqlite3_stmt *stmt;
-      DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                  "UPDATE main.images SET write_timestamp = STRFTIME('%s', 'now') WHERE id = ?1",
-                                  -1, &stmt, NULL);
-      DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
-      sqlite3_step(stmt);
-      sqlite3_finalize(stmt);
+      const struct timespec ts = { .tv_sec = req->due / G_USEC_PER_SEC,
+                                   .tv_nsec = (req->due % G_USEC_PER_SEC) * 1000 };
+      pthread_cond_timedwait(&_sidecar_writer.cond, &_sidecar_writer.lock.mutex, &ts);
+      continue;
     }
+
+    const int imgid = req->imgid;
+    g_hash_table_remove(_sidecar_writer.pending, GINT_TO_POINTER(imgid));
+    g_free(g_queue_pop_head(_sidecar_writer.order));
+    _sidecar_writer.writing = imgid;
+    dt_pthread_mutex_unlock(&_sidecar_writer.lock);
+
+    _write_sidecar_file(imgid);
+
+    dt_pthread_mutex_lock(&_sidecar_writer.lock);
+    _sidecar_writer.writing = 0;
+    _sidecar_writer.written++;
+    pthread_cond_broadcast(&_sidecar_writer.cond);
   }
+  dt_pthread_mutex_unlock(&_sidecar_writer.lock);
+  return NULL;
 }
 
+void dt_image_sidecar_writer_init()
+{
+  dt_pthread_mutex_init(&_sidecar_writer.lock, NULL);
+  pthread_cond_init(&_sidecar_writer.cond, NULL);
+  _sidecar_writer.pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+  _sidecar_writer.order = g_queue_new();
+  _sidecar_writer.running = TRUE;
+  if(dt_pthread_create(&_sidecar_writer.thread, _sidecar_writer_thread, NULL))
+  {
+    fprintf(stderr, "[sidecar] can't start the writer thread, writing sidecar files synchronously\n");
+    _sidecar_writer.running = FALSE;
+  }
+}
+
+void dt_image_sidecar_writer_cleanup()
+{
+  if(!_sidecar_writer.pending) return;
+
+  // the thread writes what's still queued before it finishes
+  dt_pthread_mutex_lock(&_sidecar_writer.lock);
+  const gboolean running = _sidecar_writer.running;
+  _sidecar_writer.running = FALSE;
+  pthread_cond_broadcast(&_sidecar_writer.cond);
+  dt_pthread_mutex_unlock(&_sidecar_writer.lock);
+  if(running) pthread_join(_sidecar_writer.thread, NULL);
+
+  dt_print(DT_DEBUG_PERF, "[sidecar] %" G_GUINT64_FORMAT " requests, %" G_GUINT64_FORMAT " files written, "
+                          "at most %u queued\n",
+           _sidecar_writer.requested, _sidecar_writer.written, _sidecar_writer.max_depth);
+
+  g_hash_table_destroy(_sidecar_writer.pending);
+  _sidecar_writer.pending = NULL;
+  g_queue_free_full(_sidecar_writer.order, g_free);
+  pthread_cond_destroy(&_sidecar_writer.cond);
+  dt_pthread_mutex_destroy(&_sidecar_writer.lock);
+}
+
+// take imgid out of the queue and wait for the thread in case it's writing it. returns whether the caller still
+// has to write the sidecar: it was queued, or the thread was in the middle of writing it and may have read the
+// database before the changes the caller wants on disk.
+static gboolean _sidecar_writer_take(const int imgid)
+{
+  if(!_sidecar_writer.running) return FALSE;
+
+  dt_pthread_mutex_lock(&_sidecar_writer.lock);
+  const gboolean queued = g_hash_table_remove(_sidecar_writer.pending, GINT_TO_POINTER(imgid));
+  const gboolean writing = _sidecar_writer.writing == imgid;
+  while(_sidecar_writer.writing == imgid) dt_pthread_cond_wait(&_sidecar_writer.cond, &_sidecar_writer.lock);
+  dt_pthread_mutex_unlock(&_sidecar_writer.lock);
+  return queued || writing;
+}
+
+void dt_image_write_sidecar_file(int imgid)
+{
+  if(imgid <= 0 || !dt_conf_get_bool("write_sidecar_files")) return;
+
+  if(!_sidecar_writer.running)
+  {
+    _write_sidecar_file(imgid);
+    return;
+  }
+
+  dt_pthread_mutex_lock(&_sidecar_writer.lock);
+  if(!_sidecar_writer.running)
+  {
+    // lost the race against dt_image_sidecar_writer_cleanup()
+    dt_pthread_mutex_unlock(&_sidecar_writer.lock);
+    _write_sidecar_file(imgid);
+    return;
+  }
+  _sidecar_writer.requested++;
+  if(!g_hash_table_contains(_sidecar_writer.pending, GINT_TO_POINTER(imgid)))
+  {
+    dt_image_sidecar_request_t *req = (dt_image_sidecar_request_t *)g_malloc(sizeof(dt_image_sidecar_request_t));
+    req->imgid = imgid;
+    req->due = g_get_real_time() + DT_SIDECAR_WRITE_DELAY;
+    g_hash_table_insert(_sidecar_writer.pending, GINT_TO_POINTER(imgid), req);
+    g_queue_push_tail(_sidecar_writer.order, req);
+    pthread_cond_broadcast(&_sidecar_writer.cond);
+  }
+  const guint depth = g_hash_table_size(_sidecar_writer.pending);
+  _sidecar_writer.max_depth = MAX(_sidecar_writer.max_depth, depth);
+  dt_pthread_mutex_unlock(&_sidecar_writer.lock);
+
+  if(dt_trace_enabled())
+  {
+    char args[64];
+    snprintf(args, sizeof(args), "\"imgid\": %d, \"depth\": %u", imgid, depth);
+    dt_trace_instant("sidecar", args, "queue sidecar");
+  }
+}
+
+void dt_image_write_sidecar_file_sync(int imgid)
+{
+  if(imgid <= 0 || !dt_conf_get_bool("write_sidecar_files")) return;
+
+  _sidecar_writer_take(imgid);
+  _write_sidecar_file(imgid);
+}
+
+void dt_image_sidecar_flush(const int imgid)
+{
+  if(_sidecar_writer_take(imgid)) _write_sidecar_file(imgid);
+}
 
 void dt_image_synch_xmp(const int selected)
 {
@@ -1622,15 +1798,32 @@ void dt_image_synch_xmp(const int selected)
     sqlite3_stmt *stmt;
     DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT imgid FROM main.selected_images", -1, &stmt,
                                 NULL);
-    while(sqlite3_step(stmt) == SQLITE_ROW)
-    {
-      const int imgid = sqlite3_column_int(stmt, 0);
-      dt_image_write_sidecar_file(imgid);
-    }
+    while(sqlite3_step(stmt) == SQLITE_ROW) dt_image_write_sidecar_file(sqlite3_column_int(stmt, 0));
     sqlite3_finalize(stmt);
   }
 }
 
+void dt_image_synch_xmps(const GList *img)
+{
+  for(const GList *iter = img; iter; iter = g_list_next(iter))
+    dt_image_write_sidecar_file(GPOINTER_TO_INT(iter->data));
+}
+
+void dt_image_list_to_memory(const GList *imgs)
+{
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "DELETE FROM memory.image_list", NULL, NULL, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                  "INSERT OR IGNORE INTO memory.image_list (imgid) VALUES (?1)", &stmt);
+  for(const GList *iter = imgs; iter; iter = g_list_next(iter))
+  {
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, GPOINTER_TO_INT(iter->data));
+    sqlite3_step(stmt);
+    DT_DEBUG_SQLITE3_RESET(stmt);
+  }
+  DT_DEBUG_SQLITE3_RELEASE(stmt);
+}
+
 void dt_image_synch_all_xmp(const gchar *pathname)
 {
   if(dt_conf_get_bool("write_sidecar_files"))
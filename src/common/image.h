@@ -285,8 +285,23 @@ gboolean dt_image_safe_remove(const int32_t imgid);
 /* try to sync .xmp for all local copies */
 void dt_image_local_copy_synch(void);
 // xmp functions:
+/** queue writing the sidecar file, see dt_image_sidecar_writer_init() */
 void dt_image_write_sidecar_file(int imgid);
+/** write the sidecar file right away in the calling thread */
+void dt_image_write_sidecar_file_sync(int imgid);
+/** write the sidecar file now if it is queued, before moving or removing files of the image */
+void dt_image_sidecar_flush(const int imgid);
 void dt_image_synch_xmp(const int selected);
+/** queue writing the sidecar files of many images at once */
+void dt_image_synch_xmps(const GList *img);
+/** start the thread writing sidecar files. repeated requests for an image within a short time result in one
+ * write. without it they are written synchronously. */
+void dt_image_sidecar_writer_init();
+/** write everything still queued and stop the thread */
+void dt_image_sidecar_writer_cleanup();
+/** fill memory.image_list with the ids of imgs, for statements on all of them at once. only use it inside a
+ * transaction, which keeps other threads off the table until it's released. */
+void dt_image_list_to_memory(const GList *imgs);
 void dt_image_synch_all_xmp(const gchar *pathname);
 
 // add an offset to the exif_datetime_taken field
@@ -0,0 +1,179 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2018 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/image_source.h"
+#include "common/darktable.h"
+
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// how many released sources are kept, and up to which total size
+#define DT_IMAGE_SOURCE_KEEP 2
+#define DT_IMAGE_SOURCE_KEEP_BYTES ((size_t)256 << 20)
+
+static struct
+{
+  dt_pthread_mutex_t lock;
+  GList *sources; // most recently used first, referenced ones and up to DT_IMAGE_SOURCE_KEEP released ones
+  uint64_t hits, reads;
+} _sources;
+
+static void _source_free(dt_image_source_t *src)
+{
+  dt_free_align((void *)src->data);
+  g_free(src->filename);
+  free(src);
+}
+
+// drop released sources beyond what we want to keep. has to be called with the lock held.
+static void _trim()
+{
+  int kept = 0;
+  size_t kept_bytes = 0;
+  GList *iter = _sources.sources;
+  while(iter)
+  {
+    GList *next = g_list_next(iter);
+    dt_image_source_t *src = (dt_image_source_t *)iter->data;
+    if(src->refs == 0)
+    {
+      if(kept < DT_IMAGE_SOURCE_KEEP && kept_bytes + src->size <= DT_IMAGE_SOURCE_KEEP_BYTES)
+      {
+        kept++;
+        kept_bytes += src->size;
+      }
+      else
+      {
+        _sources.sources = g_list_delete_link(_sources.sources, iter);
+        _source_free(src);
+      }
+    }
+    iter = next;
+  }
+}
+
+static dt_image_source_t *_read(const char *filename, const size_t size, const gint64 mtime)
+{
+  FILE *f = g_fopen(filename, "rb");
+  if(!f) return NULL;
+
+  uint8_t *data = dt_alloc_align(64, size + DT_IMAGE_SOURCE_PADDING);
+  if(!data || fread(data, 1, size, f) != size)
+  {
+    fprintf(stderr, "[image_source] can't read `%s'\n", filename);
+    dt_free_align(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  memset(data + size, 0, DT_IMAGE_SOURCE_PADDING);
+
+  dt_image_source_t *src = (dt_image_source_t *)calloc(1, sizeof(dt_image_source_t));
+  src->data = data;
+  src->size = size;
+  src->filename = g_strdup(filename);
+  src->mtime = mtime;
+  src->refs = 1;
+  return src;
+}
+
+void dt_image_source_init()
+{
+  dt_pthread_mutex_init(&_sources.lock, NULL);
+}
+
+void dt_image_source_cleanup()
+{
+  dt_print(DT_DEBUG_PERF, "[image_source] %" G_GUINT64_FORMAT " files read, %" G_GUINT64_FORMAT " reads saved\n",
+           _sources.reads, _sources.hits);
+  g_list_free_full(_sources.sources, (GDestroyNotify)_source_free);
+  _sources.sources = NULL;
+  dt_pthread_mutex_destroy(&_sources.lock);
+}
+
+// look for an up to date copy of the file and take a reference
+static dt_image_source_t *_find(const char *filename, const GStatBuf *st)
+{
+  const gint64 mtime = st->st_mtime;
+  dt_pthread_mutex_lock(&_sources.lock);
+  for(GList *iter = _sources.sources; iter; iter = g_list_next(iter))
+  {
+    dt_image_source_t *src = (dt_image_source_t *)iter->data;
+    if(strcmp(src->filename, filename)) continue;
+    if(src->size == (size_t)st->st_size && src->mtime == mtime)
+    {
+      src->refs++;
+      _sources.hits++;
+      _sources.sources = g_list_delete_link(_sources.sources, iter);
+      _sources.sources = g_list_prepend(_sources.sources, src);
+      dt_pthread_mutex_unlock(&_sources.lock);
+      return src;
+    }
+    // the file changed, current users keep their copy, new ones read it again
+    if(src->refs == 0)
+    {
+      _sources.sources = g_list_delete_link(_sources.sources, iter);
+      _source_free(src);
+    }
+    break;
+  }
+  dt_pthread_mutex_unlock(&_sources.lock);
+  return NULL;
+}
+
+dt_image_source_t *dt_image_source_find(const char *filename)
+{
+  GStatBuf st;
+  if(g_stat(filename, &st) || !S_ISREG(st.st_mode)) return NULL;
+  return _find(filename, &st);
+}
+
+dt_image_source_t *dt_image_source_get(const char *filename)
+{
+  GStatBuf st;
+  if(g_stat(filename, &st) || !S_ISREG(st.st_mode)) return NULL;
+
+  dt_image_source_t *src = _find(filename, &st);
+  if(src) return src;
+
+  // read outside of the lock, two threads asking for the same file at once just read it twice
+  src = _read(filename, st.st_size, st.st_mtime);
+  if(!src) return NULL;
+
+  dt_pthread_mutex_lock(&_sources.lock);
+  _sources.reads++;
+  _sources.sources = g_list_prepend(_sources.sources, src);
+  _trim();
+  dt_pthread_mutex_unlock(&_sources.lock);
+  return src;
+}
+
+void dt_image_source_release(dt_image_source_t *src)
+{
+  if(!src) return;
+  dt_pthread_mutex_lock(&_sources.lock);
+  src->refs--;
+  _trim();
+  dt_pthread_mutex_unlock(&_sources.lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
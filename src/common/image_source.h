@@ -0,0 +1,67 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2018 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <glib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * the contents of an image file, read once and shared by everybody who needs the whole file: exiv2,
+ * rawspeed and the embedded thumbnail extraction. on network storage this saves re-reading tens of
+ * megabytes per raw for every one of them.
+ *
+ * the last few released sources are kept around, so that e.g. the full decode following a failed
+ * thumbnail extraction finds the file in memory. they are dropped as soon as the file changes on disk.
+ */
+
+/** zero bytes following the data, for decoders reading a little past the end */
+#define DT_IMAGE_SOURCE_PADDING 64
+
+typedef struct dt_image_source_t
+{
+  const uint8_t *data; // the whole file, followed by DT_IMAGE_SOURCE_PADDING zero bytes
+  size_t size;         // without the padding
+  // private:
+  gchar *filename;
+  gint64 mtime;
+  int refs;
+} dt_image_source_t;
+
+void dt_image_source_init();
+void dt_image_source_cleanup();
+
+/** get the contents of filename, NULL if it can't be read. give it back with dt_image_source_release(). */
+dt_image_source_t *dt_image_source_get(const char *filename);
+/** like dt_image_source_get(), but only if the file is in memory already. for consumers which need just a
+ * small part of the file and are better off reading that themselves. */
+dt_image_source_t *dt_image_source_find(const char *filename);
+void dt_image_source_release(dt_image_source_t *src);
+
+#ifdef __cplusplus
+}
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
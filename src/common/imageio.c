@@ -25,6 +25,7 @@
 #include "common/debug.h"
 #include "common/exif.h"
 #include "common/image_cache.h"
+#include "common/image_source.h"
 #include "common/imageio.h"
 #include "common/imageio_module.h"
 #ifdef HAVE_OPENEXR
@@ -49,6 +50,7 @@
 #include "develop/blend.h"
 #include "develop/develop.h"
 #include "develop/imageop.h"
+#include "develop/imageop_math.h"
 
 #ifdef HAVE_GRAPHICSMAGICK
 #include <magick/api.h>
@@ -70,7 +72,8 @@
 
 // load a full-res thumbnail:
 int dt_imageio_large_thumbnail(const char *filename, uint8_t **buffer, int32_t *width, int32_t *height,
-                               dt_colorspaces_color_profile_type_t *color_space)
+                               dt_colorspaces_color_profile_type_t *color_space, const int32_t max_width,
+                               const int32_t max_height)
 {
   int res = 1;
 
@@ -78,14 +81,21 @@ int dt_imageio_large_thumbnail(const char *filename, uint8_t **buffer, int32_t *
   char *mime_type = NULL;
   size_t bufsize;
 
-  // get the biggest thumb from exif
-  if(dt_exif_get_thumbnail(filename, &buf, &bufsize, &mime_type)) goto error;
+  // get the biggest thumb from exif. exiv2 reads just the parts of the file it needs, unless somebody has
+  // the whole file in memory already.
+  dt_image_source_t *src = dt_image_source_find(filename);
+  const int failed = src ? dt_exif_get_thumbnail_from_data(filename, src->data, src->size, &buf, &bufsize,
+                                                           &mime_type)
+                         : dt_exif_get_thumbnail(filename, &buf, &bufsize, &mime_type);
+  dt_image_source_release(src);
+  if(failed) goto error;
 
   if(strcmp(mime_type, "image/jpeg") == 0)
   {
     // Decompress the JPG into our own memory format
     dt_imageio_jpeg_t jpg;
     if(dt_imageio_jpeg_decompress_header(buf, bufsize, &jpg)) goto error;
+    dt_imageio_jpeg_set_scale(&jpg, max_width, max_height);
     *buffer = (uint8_t *)malloc((size_t)sizeof(uint8_t) * jpg.width * jpg.height * 4);
     if(!*buffer) goto error;
 
@@ -577,6 +587,445 @@ int dt_imageio_export(const uint32_t imgid, const char *filename, dt_imageio_mod
                                         storage_params, num, total);
 }
 
+// whether the output ends up in sRGB, exif tells so
+static int _export_is_srgb(dt_develop_t *dev, const dt_colorspaces_color_profile_type_t icc_type)
+{
+  int sRGB = 1;
+  if(icc_type == DT_COLORSPACE_SRGB)
+  {
+    sRGB = 1;
+  }
+  else if(icc_type == DT_COLORSPACE_NONE)
+  {
+    GList *modules = dev->iop;
+    dt_iop_module_t *colorout = NULL;
+    while(modules)
+    {
+      colorout = (dt_iop_module_t *)modules->data;
+      if(colorout->get_p && strcmp(colorout->op, "colorout") == 0)
+      {
+        const dt_colorspaces_color_profile_type_t *type = colorout->get_p(colorout->params, "type");
+        sRGB = (!type || *type == DT_COLORSPACE_SRGB);
+        break; // colorout can't have > 1 instance
+      }
+      modules = g_list_next(modules);
+    }
+  }
+  else
+  {
+    sRGB = 0;
+  }
+  return sRGB;
+}
+
+// triangular dither noise in [-1, 1) for channel c of pixel k, from a hash of the position. it doesn't depend
+// on the order pixels are converted in, so the conversion stays parallel and gives the same file every time.
+static inline float _export_dither(const size_t k, const int c)
+{
+  uint32_t h = (uint32_t)(4 * k + c);
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return ((h & 0xffff) + (h >> 16)) * (1.0f / 65536.0f) - 1.0f;
+}
+
+// v scaled to 8 bits with the dither noise added. values already on a level, like everything from an 8-bit
+// source, are kept as they are: there is no banding to hide, and the noise would move them to the next one.
+static inline float _export_dither_8(const float v, const size_t k, const int c)
+{
+  const float x = v * 0xff;
+  return fabsf(x - rintf(x)) < 1e-3f ? x : x + _export_dither(k, c);
+}
+
+// convert pixels [begin, end) of float input to 8 or 16 bits per channel, swapping red and blue if requested.
+// first is the index of pixel 0 of in in the image, for the dither pattern. 8-bit output is rounded to the
+// nearest level, after adding dither noise if enabled. 16 bits are fine enough without. out may be the input buffer itself: the narrower output of
+// pixel k only overlaps the float input of pixel k * bpp / 32, so as long as all of that has been converted
+// before, the pixels of the range don't depend on each other.
+static void _export_convert_range(const float *const in, uint8_t *const buf, const size_t first,
+                                  const size_t begin, const size_t end, const int bpp, const int swap,
+                                  const int dither)
+{
+  const int r_in = swap ? 2 : 0, b_in = swap ? 0 : 2;
+  if(bpp == 8 && dither)
+  {
+#ifdef _OPENMP
+#pragma omp parallel for SIMD() default(none) schedule(static)
+#endif
+    for(size_t k = begin; k < end; k++)
+    {
+      const size_t pos = first + k;
+      const uint8_t r = CLAMP(_export_dither_8(in[4 * k + r_in], pos, 0) + 0.5f, 0, 0xff);
+      const uint8_t g = CLAMP(_export_dither_8(in[4 * k + 1], pos, 1) + 0.5f, 0, 0xff);
+      const uint8_t b = CLAMP(_export_dither_8(in[4 * k + b_in], pos, 2) + 0.5f, 0, 0xff);
+      buf[4 * k + 0] = r;
+      buf[4 * k + 1] = g;
+      buf[4 * k + 2] = b;
+    }
+  }
+  else if(bpp == 8)
+  {
+#ifdef _OPENMP
+#pragma omp parallel for SIMD() default(none) schedule(static)
+#endif
+    for(size_t k = begin; k < end; k++)
+    {
+      const uint8_t r = CLAMP(in[4 * k + r_in] * 0xff + 0.5f, 0, 0xff);
+      const uint8_t g = CLAMP(in[4 * k + 1] * 0xff + 0.5f, 0, 0xff);
+      const uint8_t b = CLAMP(in[4 * k + b_in] * 0xff + 0.5f, 0, 0xff);
+      buf[4 * k + 0] = r;
+      buf[4 * k + 1] = g;
+      buf[4 * k + 2] = b;
+    }
+  }
+  else
+  {
+    uint16_t *const buf16 = (uint16_t *)buf;
+#ifdef _OPENMP
+#pragma omp parallel for SIMD() default(none) schedule(static)
+#endif
+    for(size_t k = begin; k < end; k++)
+    {
+      const uint16_t r = CLAMP(in[4 * k + r_in] * 0x10000, 0, 0xffff);
+      const uint16_t g = CLAMP(in[4 * k + 1] * 0x10000, 0, 0xffff);
+      const uint16_t b = CLAMP(in[4 * k + b_in] * 0x10000, 0, 0xffff);
+      buf16[4 * k + 0] = r;
+      buf16[4 * k + 1] = g;
+      buf16[4 * k + 2] = b;
+    }
+  }
+}
+
+// in place float conversion without a second buffer: the ranges grow by 32 / bpp, which keeps every range
+// writing only over input of ranges done before it, and each range is converted in parallel.
+static void _export_convert_float(uint8_t *const buf, const size_t npixels, const int bpp, const int swap,
+                                  const int dither)
+{
+  const size_t grow = 32 / bpp;
+  _export_convert_range((const float *)buf, buf, 0, 0, MIN(npixels, 1), bpp, swap, dither);
+  for(size_t begin = 1; begin < npixels; begin *= grow)
+    _export_convert_range((const float *)buf, buf, 0, begin, MIN(npixels, begin * grow), bpp, swap, dither);
+}
+
+// convert the processed pixels in place to what a format with bpp bits per channel expects. 8-bit output
+// comes straight out of the pipe unless is_float is set, everything else is float.
+static void _export_convert(uint8_t *outbuf, const int processed_width, const int processed_height, const int bpp,
+                            const gboolean is_float, const int32_t display_byteorder, const int dither)
+{
+  const size_t npixels = (size_t)processed_width * processed_height;
+  if(bpp == 8)
+  {
+    if(is_float)
+    {
+      // ldr output: char, in display byte order if requested
+      _export_convert_float(outbuf, npixels, 8, display_byteorder, dither);
+    }
+    else if(!display_byteorder)
+    {
+      // processing output was 8-bit already, just flip byte order
+      uint8_t *const buf8 = outbuf;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+      for(size_t k = 0; k < npixels; k++)
+      {
+        uint8_t tmp = buf8[4 * k + 0];
+        buf8[4 * k + 0] = buf8[4 * k + 2];
+        buf8[4 * k + 2] = tmp;
+      }
+    }
+  }
+  else if(bpp == 16)
+  {
+    // uint16_t per color channel
+    _export_convert_float(outbuf, npixels, 16, 0, 0);
+  }
+  // else output float, no further harm done to the pixels :)
+}
+
+// hand the pixels to the format, a band of rows at a time if it can take them like that. float output of the
+// pipe is converted, clamped and dithered to what the format wants on the way: band by band straight into the
+// buffer given to the format when streaming, in place otherwise. either way there is no second image buffer.
+static int _export_write_pixels(const uint32_t imgid, const char *filename, dt_imageio_module_format_t *format,
+                                dt_imageio_module_data_t *format_params, uint8_t *outbuf,
+                                const gboolean is_float, const int32_t display_byteorder,
+                                dt_colorspaces_color_profile_type_t icc_type, const gchar *icc_filename,
+                                void *exif, int exif_len, const char *xmp, int xmp_len, int num, int total)
+{
+  const int width = format_params->width, height = format_params->height;
+  const int bpp = format->bpp(format_params);
+  const int dither = dt_conf_get_bool("plugins/imageio/export/dither");
+  if(!format->write_begin)
+  {
+    _export_convert(outbuf, width, height, bpp, is_float, display_byteorder, dither);
+    return format->write_image(format_params, filename, outbuf, icc_type, icc_filename, exif, exif_len, imgid,
+                               num, total);
+  }
+
+  int rows = 1;
+  void *handle = format->write_begin(format_params, filename, icc_type, icc_filename, exif, exif_len, xmp,
+                                     xmp_len, imgid, num, total, &rows);
+  if(!handle) return 1;
+  rows = MAX(rows, 1);
+
+  // bands of about 16MB float input, in whole multiples of what the format asks for
+  const int convert = is_float && (bpp == 8 || bpp == 16);
+  const int step = rows * MAX(1, (int)((16 << 20) / ((size_t)4 * sizeof(float) * width * rows)));
+  uint8_t *band = convert ? dt_alloc_align(64, (size_t)4 * step * width * bpp / 8) : NULL;
+  if(!convert) _export_convert(outbuf, width, height, bpp, is_float, display_byteorder, dither);
+
+  int res = convert && !band;
+  for(int y = 0; y < height && !res; y += step)
+  {
+    const int n = MIN(step, height - y);
+    const size_t offset = (size_t)4 * y * width;
+    if(convert)
+    {
+      _export_convert_range((const float *)outbuf + offset, band, (size_t)y * width, 0, (size_t)n * width, bpp,
+                            bpp == 8 && display_byteorder, dither);
+      res = format->write_rows(format_params, handle, band, y, n);
+    }
+    else
+      res = format->write_rows(format_params, handle, outbuf + offset * bpp / 8, y, n);
+  }
+  dt_free_align(band);
+  res |= format->write_end(format_params, handle);
+  return res;
+}
+
+// the xmp packet goes into the file while it is written if the format streams, see _export_finish()
+static gboolean _export_embeds_xmp(dt_imageio_module_format_t *format, dt_imageio_module_data_t *format_params)
+{
+  return format->write_begin && (format->flags(format_params) & FORMAT_FLAGS_SUPPORT_XMP);
+}
+
+// write one file, with exif data unless ignore_exif is set and with the xmp packet if copy_metadata is set and
+// the format embeds it. format_params->width and height give the size.
+static int _export_write(const uint32_t imgid, const char *filename, dt_imageio_module_format_t *format,
+                         dt_imageio_module_data_t *format_params, uint8_t *outbuf, const gboolean is_float,
+                         const int32_t display_byteorder, const int32_t ignore_exif, const gboolean copy_metadata,
+                         const int sRGB, dt_colorspaces_color_profile_type_t icc_type, const gchar *icc_filename,
+                         int num, int total)
+{
+  int length = 0;
+  uint8_t *exif_profile = NULL; // Exif data should be 65536 bytes max, but if original size is close to that,
+                                // adding new tags could make it go over that... so let it be and see what
+                                // happens when we write the image
+  if(!ignore_exif)
+  {
+    char pathname[PATH_MAX] = { 0 };
+    gboolean from_cache = TRUE;
+    dt_image_full_path(imgid, pathname, sizeof(pathname), &from_cache);
+    // last param is dng mode, it's false here
+    length = dt_exif_read_blob(&exif_profile, pathname, imgid, sRGB, format_params->width, format_params->height,
+                               0);
+  }
+
+  int xmp_len = 0;
+  char *xmp = copy_metadata && _export_embeds_xmp(format, format_params)
+                  ? dt_exif_xmp_export_packet(imgid, &xmp_len)
+                  : NULL;
+
+  const int res = _export_write_pixels(imgid, filename, format, format_params, outbuf, is_float,
+                                       display_byteorder, icc_type, icc_filename, exif_profile, length, xmp,
+                                       xmp_len, num, total);
+
+  g_free(xmp);
+  free(exif_profile);
+  return res;
+}
+
+// run the pipe for the final size. gamma makes 8-bit output, otherwise the pipe delivers floats.
+static void _export_process(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, const int processed_width,
+                            const int processed_height, const double scale, const gboolean high_quality,
+                            const gboolean gamma)
+{
+  if(high_quality)
+  {
+    /*
+     * if high quality processing was requested, downsampling will be done
+     * at the very end of the pipe (just before border and watermark)
+     */
+    dt_dev_pixelpipe_process_no_gamma(pipe, dev, 0, 0, processed_width, processed_height, scale);
+  }
+  else
+  {
+    // else, downsampling will be right after demosaic
+
+    // so we need to turn temporarily disable in-pipe late downsampling iop.
+
+    // find the finalscale module
+    dt_dev_pixelpipe_iop_t *finalscale = NULL;
+    {
+      GList *nodes = g_list_last(pipe->nodes);
+      while(nodes)
+      {
+        dt_dev_pixelpipe_iop_t *node = (dt_dev_pixelpipe_iop_t *)(nodes->data);
+        if(!strcmp(node->module->op, "finalscale"))
+        {
+          finalscale = node;
+          break;
+        }
+        nodes = g_list_previous(nodes);
+      }
+    }
+
+    if(finalscale) finalscale->enabled = 0;
+
+    if(gamma)
+      dt_dev_pixelpipe_process(pipe, dev, 0, 0, processed_width, processed_height, scale);
+    else
+      dt_dev_pixelpipe_process_no_gamma(pipe, dev, 0, 0, processed_width, processed_height, scale);
+
+    if(finalscale) finalscale->enabled = 1;
+  }
+}
+
+// attach xmp to the written file unless it has been embedded already, and tell lua and everybody else about it
+static void _export_finish(const uint32_t imgid, const char *filename, dt_imageio_module_format_t *format,
+                           dt_imageio_module_data_t *format_params, const int32_t thumbnail_export,
+                           const gboolean copy_metadata, dt_imageio_module_storage_t *storage,
+                           dt_imageio_module_data_t *storage_params)
+{
+  /* now write xmp into that container, if possible */
+  if(copy_metadata && (format->flags(format_params) & FORMAT_FLAGS_SUPPORT_XMP)
+     && !_export_embeds_xmp(format, format_params))
+  {
+    dt_exif_xmp_attach(imgid, filename);
+    // no need to cancel the export if this fail
+  }
+
+  if(!thumbnail_export && strcmp(format->mime(format_params), "memory")
+    && !(format->flags(format_params) & FORMAT_FLAGS_NO_TMPFILE))
+  {
+#ifdef USE_LUA
+    //Synchronous calling of lua intermediate-export-image events
+    dt_lua_lock();
+
+    lua_State *L = darktable.lua_state.state;
+
+    luaA_push(L, dt_lua_image_t, &imgid);
+
+    lua_pushstring(L, filename);
+
+    luaA_push_type(L, format->parameter_lua_type, format_params);
+ 
+    if (storage)
+      luaA_push_type(L, storage->parameter_lua_type, storage_params);
+    else
+      lua_pushnil(L);
+
+    dt_lua_event_trigger(L, "intermediate-export-image", 4);
+  
+    dt_lua_unlock();
+#endif
+
+    dt_control_signal_raise(darktable.signals, DT_SIGNAL_IMAGE_EXPORT_TMPFILE, imgid, filename, format,
+                            format_params, storage, storage_params);
+  }
+}
+
+// size of the output for the given maximum dimensions, relative to what the pipe would deliver
+static double _export_scale(const dt_imageio_module_data_t *format_params, const int processed_width,
+                            const int processed_height, const double max_scale)
+{
+  const int width = format_params->max_width;
+  const int height = format_params->max_height;
+  const double scalex = width > 0 ? fminf(width / (double)processed_width, max_scale) : 1.0;
+  const double scaley = height > 0 ? fminf(height / (double)processed_height, max_scale) : 1.0;
+  return fminf(scalex, scaley);
+}
+
+// add the history items of the style in format_params to dev, returns 1 on failure
+static int _export_apply_style(dt_develop_t *dev, dt_imageio_module_data_t *format_params)
+{
+  GList *style_items = dt_styles_get_item_list(format_params->style, TRUE, -1);
+  if(!style_items)
+  {
+    dt_control_log(_("cannot find the style '%s' to apply during export."), format_params->style);
+    return 1;
+  }
+
+  // remove everything above history_end
+  GList *history = g_list_nth(dev->history, dev->history_end);
+  while(history)
+  {
+    GList *next = g_list_next(history);
+    dt_dev_history_item_t *hist = (dt_dev_history_item_t *)(history->data);
+    free(hist->params);
+    free(hist->blend_params);
+    free(history->data);
+    dev->history = g_list_delete_link(dev->history, history);
+    history = next;
+  }
+
+  // Add each params
+  for(GList *iter = style_items; iter; iter = g_list_next(iter))
+  {
+    dt_style_item_t *s = (dt_style_item_t *)iter->data;
+
+    for(GList *module = dev->iop; module; module = g_list_next(module))
+    {
+      dt_iop_module_t *m = (dt_iop_module_t *)module->data;
+
+      if(!strcmp(m->op, s->operation))
+      {
+        dt_dev_history_item_t *h = malloc(sizeof(dt_dev_history_item_t));
+        dt_iop_module_t *style_module = m;
+
+        if((format_params->style_append && !(m->flags() & IOP_FLAGS_ONE_INSTANCE))
+           || m->multi_priority != s->multi_priority)
+        {
+          // dt_dev_module_duplicate() doesn't work here, it's trying too hard to be clever
+          style_module = (dt_iop_module_t *)calloc(1, sizeof(dt_iop_module_t));
+          if(style_module && !dt_iop_load_module(style_module, m->so, m->dev))
+          {
+            style_module->instance = m->instance;
+            style_module->multi_priority = s->multi_priority;
+            snprintf(style_module->multi_name, sizeof(style_module->multi_name), "%s", s->name);
+            dev->iop = g_list_insert_sorted(dev->iop, style_module, sort_plugins);
+          }
+          else
+          {
+            free(h);
+            g_list_free_full(style_items, dt_style_item_free);
+            return 1;
+          }
+        }
+
+        h->params = s->params;
+        h->blend_params = s->blendop_params;
+        h->enabled = s->enabled;
+        h->module = style_module;
+        h->multi_priority = s->multi_priority;
+        g_strlcpy(h->multi_name, s->name, sizeof(h->multi_name));
+
+        if(m->legacy_params && (s->module_version != m->version()))
+        {
+          void *new_params = malloc(m->params_size);
+          m->legacy_params(m, h->params, s->module_version, new_params, labs(m->version()));
+
+          free(h->params);
+          h->params = new_params;
+        }
+
+        dev->history_end++;
+        dev->history = g_list_append(dev->history, h);
+
+        // make sure that dt_style_item_free doesn't free data we still use
+        s->params = NULL;
+        s->blendop_params = NULL;
+
+        break;
+      }
+    }
+  }
+  g_list_free_full(style_items, dt_style_item_free);
+  return 0;
+}
+
 // internal function: to avoid exif blob reading + 8-bit byteorder flag + high-quality override
 int dt_imageio_export_with_flags(const uint32_t imgid, const char *filename,
                                  dt_imageio_module_format_t *format, dt_imageio_module_data_t *format_params,
@@ -630,89 +1079,7 @@ int dt_imageio_export_with_flags(const uint32_t imgid, const char *filename,
   }
 
   //  If a style is to be applied during export, add the iop params into the history
-  if(!thumbnail_export && format_params->style[0] != '\0')
-  {
-    GList *style_items = dt_styles_get_item_list(format_params->style, TRUE, -1);
-    if(!style_items)
-    {
-      dt_control_log(_("cannot find the style '%s' to apply during export."), format_params->style);
-      goto error;
-    }
-
-    // remove everything above history_end
-    GList *history = g_list_nth(dev.history, dev.history_end);
-    while(history)
-    {
-      GList *next = g_list_next(history);
-      dt_dev_history_item_t *hist = (dt_dev_history_item_t *)(history->data);
-      free(hist->params);
-      free(hist->blend_params);
-      free(history->data);
-      dev.history = g_list_delete_link(dev.history, history);
-      history = next;
-    }
-
-    // Add each params
-    for(GList *iter = style_items; iter; iter = g_list_next(iter))
-    {
-      dt_style_item_t *s = (dt_style_item_t *)iter->data;
-
-      for(GList *module = dev.iop; module; module = g_list_next(module))
-      {
-        dt_iop_module_t *m = (dt_iop_module_t *)module->data;
-
-        if(!strcmp(m->op, s->operation))
-        {
-          dt_dev_history_item_t *h = malloc(sizeof(dt_dev_history_item_t));
-          dt_iop_module_t *style_module = m;
-
-          if((format_params->style_append && !(m->flags() & IOP_FLAGS_ONE_INSTANCE)) || m->multi_priority != s->multi_priority)
-          {
-            // dt_dev_module_duplicate() doesn't work here, it's trying too hard to be clever
-            style_module = (dt_iop_module_t *)calloc(1, sizeof(dt_iop_module_t));
-            if(style_module && !dt_iop_load_module(style_module, m->so, m->dev))
-            {
-              style_module->instance = m->instance;
-              style_module->multi_priority = s->multi_priority;
-              snprintf(style_module->multi_name, sizeof(style_module->multi_name), "%s", s->name);
-              dev.iop = g_list_insert_sorted(dev.iop, style_module, sort_plugins);
-            }
-            else
-            {
-              free(h);
-              goto error;
-            }
-          }
-
-          h->params = s->params;
-          h->blend_params = s->blendop_params;
-          h->enabled = s->enabled;
-          h->module = style_module;
-          h->multi_priority = s->multi_priority;
-          g_strlcpy(h->multi_name, s->name, sizeof(h->multi_name));
-
-          if(m->legacy_params && (s->module_version != m->version()))
-          {
-            void *new_params = malloc(m->params_size);
-            m->legacy_params(m, h->params, s->module_version, new_params, labs(m->version()));
-
-            free(h->params);
-            h->params = new_params;
-          }
-
-          dev.history_end++;
-          dev.history = g_list_append(dev.history, h);
-
-          // make sure that dt_style_item_free doesn't free data we still use
-          s->params = NULL;
-          s->blendop_params = NULL;
-
-          break;
-        }
-      }
-    }
-    g_list_free_full(style_items, dt_style_item_free);
-  }
+  if(!thumbnail_export && format_params->style[0] != '\0' && _export_apply_style(&dev, format_params)) goto error;
 
   dt_dev_pixelpipe_set_icc(&pipe, icc_type, icc_filename, icc_intent);
   dt_dev_pixelpipe_set_input(&pipe, &dev, (float *)buf.buf, buf.width, buf.height, buf.iscale);
@@ -731,31 +1098,7 @@ int dt_imageio_export_with_flags(const uint32_t imgid, const char *filename,
   dt_show_times(&start, "[export] creating pixelpipe", NULL);
 
   // find output color profile for this image:
-  int sRGB = 1;
-  if(icc_type == DT_COLORSPACE_SRGB)
-  {
-    sRGB = 1;
-  }
-  else if(icc_type == DT_COLORSPACE_NONE)
-  {
-    GList *modules = dev.iop;
-    dt_iop_module_t *colorout = NULL;
-    while(modules)
-    {
-      colorout = (dt_iop_module_t *)modules->data;
-      if(colorout->get_p && strcmp(colorout->op, "colorout") == 0)
-      {
-        const dt_colorspaces_color_profile_type_t *type = colorout->get_p(colorout->params, "type");
-        sRGB = (!type || *type == DT_COLORSPACE_SRGB);
-        break; // colorout can't have > 1 instance
-      }
-      modules = g_list_next(modules);
-    }
-  }
-  else
-  {
-    sRGB = 0;
-  }
+  const int sRGB = _export_is_srgb(&dev, icc_type);
 
   // get only once at the beginning, in case the user changes it on the way:
   const gboolean high_quality_processing
@@ -764,11 +1107,7 @@ int dt_imageio_export_with_flags(const uint32_t imgid, const char *filename,
             ? FALSE
             : high_quality;
 
-  const int width = format_params->max_width;
-  const int height = format_params->max_height;
-  const double scalex = width > 0 ? fminf(width / (double)pipe.processed_width, max_scale) : 1.0;
-  const double scaley = height > 0 ? fminf(height / (double)pipe.processed_height, max_scale) : 1.0;
-  const double scale = fminf(scalex, scaley);
+  const double scale = _export_scale(format_params, pipe.processed_width, pipe.processed_height, max_scale);
 
   const int processed_width = scale * pipe.processed_width + .5f;
   const int processed_height = scale * pipe.processed_height + .5f;
@@ -776,186 +1115,192 @@ int dt_imageio_export_with_flags(const uint32_t imgid, const char *filename,
   const int bpp = format->bpp(format_params);
 
   dt_get_times(&start);
-  if(high_quality_processing)
-  {
-    /*
-     * if high quality processing was requested, downsampling will be done
-     * at the very end of the pipe (just before border and watermark)
-     */
-    dt_dev_pixelpipe_process_no_gamma(&pipe, &dev, 0, 0, processed_width, processed_height, scale);
-  }
-  else
-  {
-    // else, downsampling will be right after demosaic
+  // do the processing (8-bit with special treatment, to make sure we can use openmp further down):
+  _export_process(&pipe, &dev, processed_width, processed_height, scale, high_quality_processing, bpp == 8);
+  dt_show_times(&start, thumbnail_export ? "[dev_process_thumbnail] pixel pipeline processing"
+                                         : "[dev_process_export] pixel pipeline processing",
+                NULL);
 
-    // so we need to turn temporarily disable in-pipe late downsampling iop.
+  uint8_t *outbuf = pipe.backbuf;
 
-    // find the finalscale module
-    dt_dev_pixelpipe_iop_t *finalscale = NULL;
-    {
-      GList *nodes = g_list_last(pipe.nodes);
-      while(nodes)
-      {
-        dt_dev_pixelpipe_iop_t *node = (dt_dev_pixelpipe_iop_t *)(nodes->data);
-        if(!strcmp(node->module->op, "finalscale"))
-        {
-          finalscale = node;
-          break;
-        }
-        nodes = g_list_previous(nodes);
-      }
-    }
+  format_params->width = processed_width;
+  format_params->height = processed_height;
 
-    if(finalscale) finalscale->enabled = 0;
+  // downconversion to low-precision formats happens while writing
+  res = _export_write(imgid, filename, format, format_params, outbuf, high_quality_processing, display_byteorder,
+                      ignore_exif, copy_metadata, sRGB, icc_type, icc_filename, num, total);
 
-    // do the processing (8-bit with special treatment, to make sure we can use openmp further down):
-    if(bpp == 8)
-      dt_dev_pixelpipe_process(&pipe, &dev, 0, 0, processed_width, processed_height, scale);
-    else
-      dt_dev_pixelpipe_process_no_gamma(&pipe, &dev, 0, 0, processed_width, processed_height, scale);
+  dt_dev_pixelpipe_cleanup(&pipe);
+  dt_dev_cleanup(&dev);
+  dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
 
-    if(finalscale) finalscale->enabled = 1;
-  }
-  dt_show_times(&start, thumbnail_export ? "[dev_process_thumbnail] pixel pipeline processing"
-                                         : "[dev_process_export] pixel pipeline processing",
-                NULL);
+  _export_finish(imgid, filename, format, format_params, thumbnail_export, copy_metadata, storage, storage_params);
 
-  uint8_t *outbuf = pipe.backbuf;
+  return res;
 
-  // downconversion to low-precision formats:
-  if(bpp == 8)
+error:
+  dt_dev_pixelpipe_cleanup(&pipe);
+error_early:
+  dt_dev_cleanup(&dev);
+  dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
+  return 1;
+}
+
+int dt_imageio_export_renditions(const uint32_t imgid, dt_imageio_rendition_t *renditions, const int count,
+                                 const gboolean high_quality, const gboolean upscale, const gboolean copy_metadata,
+                                 dt_colorspaces_color_profile_type_t icc_type, const gchar *icc_filename,
+                                 dt_iop_color_intent_t icc_intent, dt_imageio_module_storage_t *storage,
+                                 dt_imageio_module_data_t *storage_params, int num, int total)
+{
+  if(count <= 0) return 1;
+  if(count == 1)
+    return dt_imageio_export(imgid, renditions[0].filename, renditions[0].format, renditions[0].format_params,
+                             high_quality, upscale || renditions[0].upscale, copy_metadata, icc_type, icc_filename,
+                             icc_intent, storage, storage_params, num, total);
+
+  int res = 0;
+
+  // copies don't need the pipe. the pipe has to deliver the precision of the most demanding format, as
+  // dithering depends on it.
+  int levels = 0, max_bpp = 0, pending = 0;
+  for(int k = 0; k < count; k++)
   {
-    if(display_byteorder)
+    dt_imageio_module_format_t *format = renditions[k].format;
+    dt_imageio_module_data_t *format_params = renditions[k].format_params;
+    if(strcmp(format->mime(format_params), "x-copy") == 0)
     {
-      if(high_quality_processing)
-      {
-        const float *const inbuf = (float *)outbuf;
-        for(size_t k = 0; k < (size_t)processed_width * processed_height; k++)
-        {
-          // convert in place, this is unfortunately very serial..
-          const uint8_t r = CLAMP(inbuf[4 * k + 2] * 0xff, 0, 0xff);
-          const uint8_t g = CLAMP(inbuf[4 * k + 1] * 0xff, 0, 0xff);
-          const uint8_t b = CLAMP(inbuf[4 * k + 0] * 0xff, 0, 0xff);
-          outbuf[4 * k + 0] = r;
-          outbuf[4 * k + 1] = g;
-          outbuf[4 * k + 2] = b;
-        }
-      }
-      // else processing output was 8-bit already, and no need to swap order
+      res |= format->write_image(format_params, renditions[k].filename, NULL, icc_type, icc_filename, NULL, 0,
+                                 imgid, num, total);
+      continue;
     }
-    else // need to flip
+    const int bpp = format->bpp(format_params);
+    if(bpp > max_bpp)
     {
-      // ldr output: char
-      if(high_quality_processing)
-      {
-        const float *const inbuf = (float *)outbuf;
-        for(size_t k = 0; k < (size_t)processed_width * processed_height; k++)
-        {
-          // convert in place, this is unfortunately very serial..
-          const uint8_t r = CLAMP(inbuf[4 * k + 0] * 0xff, 0, 0xff);
-          const uint8_t g = CLAMP(inbuf[4 * k + 1] * 0xff, 0, 0xff);
-          const uint8_t b = CLAMP(inbuf[4 * k + 2] * 0xff, 0, 0xff);
-          outbuf[4 * k + 0] = r;
-          outbuf[4 * k + 1] = g;
-          outbuf[4 * k + 2] = b;
-        }
-      }
-      else
-      { // !display_byteorder, need to swap:
-        uint8_t *const buf8 = pipe.backbuf;
-#ifdef _OPENMP
-#pragma omp parallel for default(none) schedule(static)
-#endif
-        // just flip byte order
-        for(size_t k = 0; k < (size_t)processed_width * processed_height; k++)
-        {
-          uint8_t tmp = buf8[4 * k + 0];
-          buf8[4 * k + 0] = buf8[4 * k + 2];
-          buf8[4 * k + 2] = tmp;
-        }
-      }
+      max_bpp = bpp;
+      levels = format->levels(format_params);
     }
+    pending++;
   }
-  else if(bpp == 16)
-  {
-    // uint16_t per color channel
-    float *buff = (float *)outbuf;
-    uint16_t *buf16 = (uint16_t *)outbuf;
-    for(int y = 0; y < processed_height; y++)
-      for(int x = 0; x < processed_width; x++)
-      {
-        // convert in place
-        const size_t k = (size_t)processed_width * y + x;
-        for(int i = 0; i < 3; i++) buf16[4 * k + i] = CLAMP(buff[4 * k + i] * 0x10000, 0, 0xffff);
-      }
-  }
-  // else output float, no further harm done to the pixels :)
+  if(!pending) return res;
 
-  format_params->width = processed_width;
-  format_params->height = processed_height;
+  dt_develop_t dev;
+  dt_dev_init(&dev, 0);
+  dt_dev_load_image(&dev, imgid);
 
-  if(!ignore_exif)
-  {
-    int length;
-    uint8_t *exif_profile = NULL; // Exif data should be 65536 bytes max, but if original size is close to that,
-                                  // adding new tags could make it go over that... so let it be and see what
-                                  // happens when we write the image
-    char pathname[PATH_MAX] = { 0 };
-    gboolean from_cache = TRUE;
-    dt_image_full_path(imgid, pathname, sizeof(pathname), &from_cache);
-    // last param is dng mode, it's false here
-    length = dt_exif_read_blob(&exif_profile, pathname, imgid, sRGB, processed_width, processed_height, 0);
+  dt_mipmap_buffer_t buf;
+  dt_mipmap_cache_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING, 'r');
 
-    res = format->write_image(format_params, filename, outbuf, icc_type, icc_filename, exif_profile, length, imgid,
-                              num, total);
+  const dt_image_t *img = &dev.image_storage;
+  double *scales = NULL;
 
-    free(exif_profile);
-  }
-  else
+  if(!buf.buf || !buf.width || !buf.height)
   {
-    res = format->write_image(format_params, filename, outbuf, icc_type, icc_filename, NULL, 0, imgid, num, total);
+    fprintf(stderr, "allocation failed???\n");
+    dt_control_log(_("image `%s' is not available!"), img->filename);
+    goto error_early;
   }
 
-  dt_dev_pixelpipe_cleanup(&pipe);
-  dt_dev_cleanup(&dev);
-  dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
-
-  /* now write xmp into that container, if possible */
-  if(copy_metadata && (format->flags(format_params) & FORMAT_FLAGS_SUPPORT_XMP))
+  dt_times_t start;
+  dt_get_times(&start);
+  dt_dev_pixelpipe_t pipe;
+  if(!dt_dev_pixelpipe_init_export(&pipe, img->width, img->height, levels))
   {
-    dt_exif_xmp_attach(imgid, filename);
-    // no need to cancel the export if this fail
+    dt_control_log(
+        _("failed to allocate memory for %s, please lower the threads used for export or buy more memory."),
+        C_("noun", "export"));
+    goto error;
   }
 
-  if(!thumbnail_export && strcmp(format->mime(format_params), "memory")
-    && !(format->flags(format_params) & FORMAT_FLAGS_NO_TMPFILE))
+  // the style comes with the first rendition
+  dt_imageio_module_data_t *first_params = renditions[0].format_params;
+  if(first_params->style[0] != '\0' && _export_apply_style(&dev, first_params)) goto error;
+
+  dt_dev_pixelpipe_set_icc(&pipe, icc_type, icc_filename, icc_intent);
+  dt_dev_pixelpipe_set_input(&pipe, &dev, (float *)buf.buf, buf.width, buf.height, buf.iscale);
+  dt_dev_pixelpipe_create_nodes(&pipe, &dev);
+  dt_dev_pixelpipe_synch_all(&pipe, &dev);
+  dt_dev_pixelpipe_get_dimensions(&pipe, &dev, pipe.iwidth, pipe.iheight, &pipe.processed_width,
+                                  &pipe.processed_height);
+
+  dt_show_times(&start, "[export] creating pixelpipe", NULL);
+
+  const int sRGB = _export_is_srgb(&dev, icc_type);
+
+  // the pipe runs once for the largest rendition, all others are downscaled from its output
+  scales = (double *)calloc(count, sizeof(double));
+  double scale = 0.0;
+  int largest = -1;
+  for(int k = 0; k < count; k++)
   {
-#ifdef USE_LUA
-    //Synchronous calling of lua intermediate-export-image events
-    dt_lua_lock();
+    if(strcmp(renditions[k].format->mime(renditions[k].format_params), "x-copy") == 0) continue;
+    const double max_scale = upscale || renditions[k].upscale ? 100.0 : 1.0;
+    scales[k] = _export_scale(renditions[k].format_params, pipe.processed_width, pipe.processed_height, max_scale);
+    if(scales[k] > scale)
+    {
+      scale = scales[k];
+      largest = k;
+    }
+  }
 
-    lua_State *L = darktable.lua_state.state;
+  if(largest < 0) goto error;
 
-    luaA_push(L, dt_lua_image_t, &imgid);
+  const int processed_width = scale * pipe.processed_width + .5f;
+  const int processed_height = scale * pipe.processed_height + .5f;
 
-    lua_pushstring(L, filename);
+  dt_get_times(&start);
+  _export_process(&pipe, &dev, processed_width, processed_height, scale, scale < 1.0 ? high_quality : FALSE,
+                  FALSE);
+  dt_show_times(&start, "[dev_process_export] pixel pipeline processing", NULL);
 
-    luaA_push_type(L, format->parameter_lua_type, format_params);
- 
-    if (storage)
-      luaA_push_type(L, storage->parameter_lua_type, storage_params);
-    else
-      lua_pushnil(L);
+  const float *const outbuf = (float *)pipe.backbuf;
 
-    dt_lua_event_trigger(L, "intermediate-export-image", 4);
-  
-    dt_lua_unlock();
-#endif
+  // the largest one comes last, it's converted in place
+  for(int i = 0; i < count; i++)
+  {
+    const int k = i < largest ? i : (i + 1 < count ? i + 1 : largest);
+    if(scales[k] == 0.0) continue;
+
+    dt_imageio_module_format_t *format = renditions[k].format;
+    dt_imageio_module_data_t *format_params = renditions[k].format_params;
+    uint8_t *rbuf = (uint8_t *)outbuf;
+    int width = processed_width, height = processed_height;
+    if(k != largest)
+    {
+      width = MIN(processed_width, (int)(scales[k] * pipe.processed_width + .5f));
+      height = MIN(processed_height, (int)(scales[k] * pipe.processed_height + .5f));
+      rbuf = dt_alloc_align(64, sizeof(float) * 4 * width * height);
+      if(!rbuf)
+      {
+        res = 1;
+        continue;
+      }
+      const dt_iop_roi_t roi_in = { .x = 0, .y = 0, .width = processed_width, .height = processed_height,
+                                    .scale = 1.0f };
+      const dt_iop_roi_t roi_out = { .x = 0, .y = 0, .width = width, .height = height,
+                                     .scale = scales[k] / scale };
+      dt_iop_clip_and_zoom((float *)rbuf, outbuf, &roi_out, &roi_in, width, processed_width);
+    }
 
-    dt_control_signal_raise(darktable.signals, DT_SIGNAL_IMAGE_EXPORT_TMPFILE, imgid, filename, format,
-                            format_params, storage, storage_params);
+    format_params->width = width;
+    format_params->height = height;
+    const int failed = _export_write(imgid, renditions[k].filename, format, format_params, rbuf, TRUE, 0, 0,
+                                     copy_metadata, sRGB, icc_type, icc_filename, num, total);
+    if(k != largest) dt_free_align(rbuf);
+    // don't hand out broken files
+    if(failed) scales[k] = 0.0;
+    res |= failed;
   }
 
+  dt_dev_pixelpipe_cleanup(&pipe);
+  dt_dev_cleanup(&dev);
+  dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
+
+  for(int k = 0; k < count; k++)
+    if(scales[k] != 0.0)
+      _export_finish(imgid, renditions[k].filename, renditions[k].format, renditions[k].format_params, 0,
+                     copy_metadata, storage, storage_params);
+
+  free(scales);
   return res;
 
 error:
@@ -963,10 +1308,10 @@ error:
 error_early:
   dt_dev_cleanup(&dev);
   dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
+  free(scales);
   return 1;
 }
 
-
 // fallback read method in case file could not be opened yet.
 // use GraphicsMagick (if supported) to read exotic LDRs
 dt_imageio_retval_t dt_imageio_open_exotic(dt_image_t *img, const char *filename,
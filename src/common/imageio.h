@@ -80,6 +80,24 @@ int dt_imageio_export_with_flags(const uint32_t imgid, const char *filename,
                                  dt_iop_color_intent_t icc_intent, dt_imageio_module_storage_t *storage,
                                  dt_imageio_module_data_t *storage_params, int num, int total);
 
+// one output of dt_imageio_export_renditions(). max_width and max_height of format_params pick the size,
+// width and height are set to what was written. upscale lets this one be upscaled even if the export isn't.
+typedef struct dt_imageio_rendition_t
+{
+  const char *filename;
+  struct dt_imageio_module_format_t *format;
+  struct dt_imageio_module_data_t *format_params;
+  gboolean upscale;
+} dt_imageio_rendition_t;
+
+// export several sizes and formats of one image, running the pixelpipe only once for the largest of them.
+// the others are downscaled from its output. the style is taken from the first rendition.
+int dt_imageio_export_renditions(const uint32_t imgid, dt_imageio_rendition_t *renditions, const int count,
+                                 const gboolean high_quality, const gboolean upscale, const gboolean copy_metadata,
+                                 dt_colorspaces_color_profile_type_t icc_type, const gchar *icc_filename,
+                                 dt_iop_color_intent_t icc_intent, dt_imageio_module_storage_t *storage,
+                                 dt_imageio_module_data_t *storage_params, int num, int total);
+
 size_t dt_imageio_write_pos(int i, int j, int wd, int ht, float fwd, float fht,
                             dt_image_orientation_t orientation);
 
@@ -99,8 +117,11 @@ void dt_imageio_flip_buffers_ui8_to_float(float *out, const uint8_t *in, const f
                                           const dt_image_orientation_t orientation);
 
 // allocate buffer and return 0 on success along with largest jpg thumbnail from raw.
+// jpgs are decoded at reduced scale if they will be fit into a box of max_width x max_height anyways,
+// pass 0 to get the full size.
 int dt_imageio_large_thumbnail(const char *filename, uint8_t **buffer, int32_t *width, int32_t *height,
-                               dt_colorspaces_color_profile_type_t *color_space);
+                               dt_colorspaces_color_profile_type_t *color_space, const int32_t max_width,
+                               const int32_t max_height);
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
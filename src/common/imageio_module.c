@@ -116,6 +116,10 @@ static int dt_imageio_load_module_format(dt_imageio_module_format_t *module, con
     module->levels = _default_format_levels;
   if(!g_module_symbol(module->module, "read_image", (gpointer) & (module->read_image)))
     module->read_image = NULL;
+  if(!g_module_symbol(module->module, "write_begin", (gpointer) & (module->write_begin))
+     || !g_module_symbol(module->module, "write_rows", (gpointer) & (module->write_rows))
+     || !g_module_symbol(module->module, "write_end", (gpointer) & (module->write_end)))
+    module->write_begin = NULL;
 
 #ifdef USE_LUA
   {
@@ -118,6 +118,13 @@ typedef struct dt_imageio_module_format_t
   int (*write_image)(dt_imageio_module_data_t *data, const char *filename, const void *in,
                      dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
                      void *exif, int exif_len, int imgid, int num, int total);
+  /* optional streaming interface, NULL if the format only has write_image(). write_begin() also embeds the
+   * xmp packet if not NULL. */
+  void *(*write_begin)(dt_imageio_module_data_t *data, const char *filename,
+                       dt_colorspaces_color_profile_type_t over_type, const char *over_filename, void *exif,
+                       int exif_len, const char *xmp, int xmp_len, int imgid, int num, int total, int *rows);
+  int (*write_rows)(dt_imageio_module_data_t *data, void *handle, const void *in, int y, int rows);
+  int (*write_end)(dt_imageio_module_data_t *data, void *handle);
   /* flag that describes the available precision/levels of output format. mainly used for dithering. */
   int (*levels)(dt_imageio_module_data_t *data);
 
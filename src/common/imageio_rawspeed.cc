@@ -31,6 +31,7 @@ extern "C" {
 #include "common/darktable.h"
 #include "common/exif.h"
 #include "common/file_location.h"
+#include "common/image_source.h"
 #include "common/imageio_rawspeed.h"
 #include "imageio.h"
 #include <stdint.h>
@@ -112,11 +113,13 @@ uint32_t dt_rawspeed_crop_dcraw_filters(uint32_t filters, uint32_t crop_x, uint3
 dt_imageio_retval_t dt_imageio_open_rawspeed(dt_image_t *img, const char *filename,
                                              dt_mipmap_buffer_t *mbuf)
 {
-  if(!img->exif_inited) (void)dt_exif_read(img, filename);
+  // the file is read once, for exiv2 and rawspeed both. declared first, so that it outlives the decoder on
+  // every way out of here.
+  std::unique_ptr<dt_image_source_t, decltype(&dt_image_source_release)> src(dt_image_source_get(filename),
+                                                                             &dt_image_source_release);
+  if(!src) return DT_IMAGEIO_FILE_NOT_FOUND;
 
-  char filen[PATH_MAX] = { 0 };
-  snprintf(filen, sizeof(filen), "%s", filename);
-  FileReader f(filen);
+  if(!img->exif_inited) (void)dt_exif_read_from_data(img, filename, src->data, src->size);
 
   std::unique_ptr<RawDecoder> d;
   std::unique_ptr<const Buffer> m;
@@ -125,7 +128,7 @@ dt_imageio_retval_t dt_imageio_open_rawspeed(dt_image_t *img, const char *filena
   {
     dt_rawspeed_load_meta();
 
-    m = f.readFile();
+    m.reset(new Buffer(src->data, src->size));
 
     RawParser t(m.get());
     d = t.getDecoder(meta);
@@ -220,6 +223,7 @@ dt_imageio_retval_t dt_imageio_open_rawspeed(dt_image_t *img, const char *filena
     /* free auto pointers on spot */
     d.reset();
     m.reset();
+    src.reset();
 
     // Grab the WB
     for(int i = 0; i < 4; i++) img->wb_coeffs[i] = r->metadata.wbCoeffs[i];
@@ -18,6 +18,7 @@
 
 #include "common/interpolation.h"
 #include "common/darktable.h"
+#include "common/threadpool.h"
 #include "control/conf.h"
 
 #include <assert.h>
@@ -1350,6 +1351,199 @@ static int prepare_resampling_plan(const struct dt_interpolation *itor, int in,
   return 0;
 }
 
+typedef struct _resample_pass_t
+{
+  float *out;
+  const dt_iop_roi_t *roi_out;
+  int32_t out_stride;
+  const float *in;
+  int32_t in_stride;
+  const int *hindex;
+  const int *hlength;
+  const int *vindex;
+  const int *vlength;
+  const int *vmeta;
+  const float *hkernel;
+  const float *vkernel;
+} _resample_pass_t;
+
+static void _resample_rows_plain(void *data, size_t begin, size_t end, int thread)
+{
+  const _resample_pass_t *const p = (const _resample_pass_t *)data;
+  float *const out = p->out;
+  const dt_iop_roi_t *const roi_out = p->roi_out;
+  const int32_t out_stride = p->out_stride;
+  const float *const in = p->in;
+  const int32_t in_stride = p->in_stride;
+  const int *const hindex = p->hindex;
+  const int *const hlength = p->hlength;
+  const float *const hkernel = p->hkernel;
+  const int *const vindex = p->vindex;
+  const int *const vlength = p->vlength;
+  const float *const vkernel = p->vkernel;
+  const int *const vmeta = p->vmeta;
+
+  for(int oy = begin; oy < end; oy++)
+  {
+    // Initialize column resampling indexes
+    int vlidx = vmeta[3 * oy + 0]; // V(ertical) L(ength) I(n)d(e)x
+    int vkidx = vmeta[3 * oy + 1]; // V(ertical) K(ernel) I(n)d(e)x
+    int viidx = vmeta[3 * oy + 2]; // V(ertical) I(ndex) I(n)d(e)x
+
+    // Initialize row resampling indexes
+    int hlidx = 0; // H(orizontal) L(ength) I(n)d(e)x
+    int hkidx = 0; // H(orizontal) K(ernel) I(n)d(e)x
+    int hiidx = 0; // H(orizontal) I(ndex) I(n)d(e)x
+
+    // Number of lines contributing to the output line
+    int vl = vlength[vlidx++]; // V(ertical) L(ength)
+
+    // Process each output column
+    for(int ox = 0; ox < roi_out->width; ox++)
+    {
+      debug_extra("output %p [% 4d % 4d]\n", out, ox, oy);
+
+      // This will hold the resulting pixel
+      float vs[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+      // Number of horizontal samples contributing to the output
+      int hl = hlength[hlidx++]; // H(orizontal) L(ength)
+
+      for(int iy = 0; iy < vl; iy++)
+      {
+        // This is our input line
+        const float *i = (float *)((char *)in + (size_t)in_stride * vindex[viidx++]);
+
+        float vhs[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+        for(int ix = 0; ix < hl; ix++)
+        {
+          // Apply the precomputed filter kernel
+          size_t baseidx = (size_t)hindex[hiidx++] * 4;
+          const float htap = hkernel[hkidx++];
+          for(int c = 0; c < 3; c++) vhs[c] += i[baseidx + c] * htap;
+        }
+
+        // Accumulate contribution from this line
+        const float vtap = vkernel[vkidx++];
+        for(int c = 0; c < 3; c++) vs[c] += vhs[c] * vtap;
+
+        // Reset horizontal resampling context
+        hkidx -= hl;
+        hiidx -= hl;
+      }
+
+      // Output pixel is ready
+      float *o = (float *)((char *)out + (size_t)oy * out_stride + (size_t)ox * 4 * sizeof(float));
+      for(int c = 0; c < 3; c++) o[c] = vs[c];
+
+      // Reset vertical resampling context
+      viidx -= vl;
+      vkidx -= vl;
+
+      // Progress in horizontal context
+      hiidx += hl;
+      hkidx += hl;
+    }
+
+    // Progress in vertical context
+    viidx += vl;
+    vkidx += vl;
+  }
+}
+
+#if defined(__SSE2__)
+static void _resample_rows_sse(void *data, size_t begin, size_t end, int thread)
+{
+  const _resample_pass_t *const p = (const _resample_pass_t *)data;
+  float *const out = p->out;
+  const dt_iop_roi_t *const roi_out = p->roi_out;
+  const int32_t out_stride = p->out_stride;
+  const float *const in = p->in;
+  const int32_t in_stride = p->in_stride;
+  const int *const hindex = p->hindex;
+  const int *const hlength = p->hlength;
+  const float *const hkernel = p->hkernel;
+  const int *const vindex = p->vindex;
+  const int *const vlength = p->vlength;
+  const float *const vkernel = p->vkernel;
+  const int *const vmeta = p->vmeta;
+
+  for(int oy = begin; oy < end; oy++)
+  {
+    // Initialize column resampling indexes
+    int vlidx = vmeta[3 * oy + 0]; // V(ertical) L(ength) I(n)d(e)x
+    int vkidx = vmeta[3 * oy + 1]; // V(ertical) K(ernel) I(n)d(e)x
+    int viidx = vmeta[3 * oy + 2]; // V(ertical) I(ndex) I(n)d(e)x
+
+    // Initialize row resampling indexes
+    int hlidx = 0; // H(orizontal) L(ength) I(n)d(e)x
+    int hkidx = 0; // H(orizontal) K(ernel) I(n)d(e)x
+    int hiidx = 0; // H(orizontal) I(ndex) I(n)d(e)x
+
+    // Number of lines contributing to the output line
+    int vl = vlength[vlidx++]; // V(ertical) L(ength)
+
+    // Process each output column
+    for(int ox = 0; ox < roi_out->width; ox++)
+    {
+      debug_extra("output %p [% 4d % 4d]\n", out, ox, oy);
+
+      // This will hold the resulting pixel
+      __m128 vs = _mm_setzero_ps();
+
+      // Number of horizontal samples contributing to the output
+      int hl = hlength[hlidx++]; // H(orizontal) L(ength)
+
+      for(int iy = 0; iy < vl; iy++)
+      {
+        // This is our input line
+        const float *i = (float *)((char *)in + (size_t)in_stride * vindex[viidx++]);
+
+        __m128 vhs = _mm_setzero_ps();
+
+        for(int ix = 0; ix < hl; ix++)
+        {
+          // Apply the precomputed filter kernel
+          size_t baseidx = (size_t)hindex[hiidx++] * 4;
+          float htap = hkernel[hkidx++];
+          __m128 vhtap = _mm_set_ps1(htap);
+          vhs = _mm_add_ps(vhs, _mm_mul_ps(*(__m128 *)&i[baseidx], vhtap));
+        }
+
+        // Accumulate contribution from this line
+        float vtap = vkernel[vkidx++];
+        __m128 vvtap = _mm_set_ps1(vtap);
+        vs = _mm_add_ps(vs, _mm_mul_ps(vhs, vvtap));
+
+        // Reset horizontal resampling context
+        hkidx -= hl;
+        hiidx -= hl;
+      }
+
+      // Output pixel is ready
+      float *o = (float *)((char *)out + (size_t)oy * out_stride + (size_t)ox * 4 * sizeof(float));
+      _mm_stream_ps(o, vs);
+
+      // Reset vertical resampling context
+      viidx -= vl;
+      vkidx -= vl;
+
+      // Progress in horizontal context
+      hiidx += hl;
+      hkidx += hl;
+    }
+
+    // Progress in vertical context
+//     viidx += vl;
+//     vkidx += vl;
+  }
+
+  // the streamed pixels have to be visible once the loop returns
+  _mm_sfence();
+}
+#endif
+
 static void dt_interpolation_resample_plain(const struct dt_interpolation *itor, float *out,
                                             const dt_iop_roi_t *const roi_out, const int32_t out_stride,
                                             const float *const in, const dt_iop_roi_t *const roi_in,
@@ -1422,77 +1616,10 @@ static void dt_interpolation_resample_plain(const struct dt_interpolation *itor,
   int64_t ts_resampling = getts();
 #endif
 
-// Process each output line
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(out, hindex, hlength, hkernel, vindex, vlength, vkernel, vmeta)
-#endif
-  for(int oy = 0; oy < roi_out->height; oy++)
-  {
-    // Initialize column resampling indexes
-    int vlidx = vmeta[3 * oy + 0]; // V(ertical) L(ength) I(n)d(e)x
-    int vkidx = vmeta[3 * oy + 1]; // V(ertical) K(ernel) I(n)d(e)x
-    int viidx = vmeta[3 * oy + 2]; // V(ertical) I(ndex) I(n)d(e)x
-
-    // Initialize row resampling indexes
-    int hlidx = 0; // H(orizontal) L(ength) I(n)d(e)x
-    int hkidx = 0; // H(orizontal) K(ernel) I(n)d(e)x
-    int hiidx = 0; // H(orizontal) I(ndex) I(n)d(e)x
-
-    // Number of lines contributing to the output line
-    int vl = vlength[vlidx++]; // V(ertical) L(ength)
-
-    // Process each output column
-    for(int ox = 0; ox < roi_out->width; ox++)
-    {
-      debug_extra("output %p [% 4d % 4d]\n", out, ox, oy);
-
-      // This will hold the resulting pixel
-      float vs[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
-
-      // Number of horizontal samples contributing to the output
-      int hl = hlength[hlidx++]; // H(orizontal) L(ength)
-
-      for(int iy = 0; iy < vl; iy++)
-      {
-        // This is our input line
-        const float *i = (float *)((char *)in + (size_t)in_stride * vindex[viidx++]);
-
-        float vhs[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
-
-        for(int ix = 0; ix < hl; ix++)
-        {
-          // Apply the precomputed filter kernel
-          size_t baseidx = (size_t)hindex[hiidx++] * 4;
-          const float htap = hkernel[hkidx++];
-          for(int c = 0; c < 3; c++) vhs[c] += i[baseidx + c] * htap;
-        }
-
-        // Accumulate contribution from this line
-        const float vtap = vkernel[vkidx++];
-        for(int c = 0; c < 3; c++) vs[c] += vhs[c] * vtap;
-
-        // Reset horizontal resampling context
-        hkidx -= hl;
-        hiidx -= hl;
-      }
-
-      // Output pixel is ready
-      float *o = (float *)((char *)out + (size_t)oy * out_stride + (size_t)ox * 4 * sizeof(float));
-      for(int c = 0; c < 3; c++) o[c] = vs[c];
-
-      // Reset vertical resampling context
-      viidx -= vl;
-      vkidx -= vl;
-
-      // Progress in horizontal context
-      hiidx += hl;
-      hkidx += hl;
-    }
-
-    // Progress in vertical context
-    viidx += vl;
-    vkidx += vl;
-  }
+  // Process each output line
+  _resample_pass_t p = { out, roi_out, out_stride, in, in_stride, hindex, hlength, vindex, vlength, vmeta,
+                         hkernel, vkernel };
+  dt_threadpool_for(roi_out->height, 1, _resample_rows_plain, &p);
 
 #if DEBUG_RESAMPLING_TIMING
   ts_resampling = getts() - ts_resampling;
@@ -1580,81 +1707,10 @@ static void dt_interpolation_resample_sse(const struct dt_interpolation *itor, f
   int64_t ts_resampling = getts();
 #endif
 
-// Process each output line
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(out, hindex, hlength, hkernel, vindex, vlength, vkernel, vmeta)
-#endif
-  for(int oy = 0; oy < roi_out->height; oy++)
-  {
-    // Initialize column resampling indexes
-    int vlidx = vmeta[3 * oy + 0]; // V(ertical) L(ength) I(n)d(e)x
-    int vkidx = vmeta[3 * oy + 1]; // V(ertical) K(ernel) I(n)d(e)x
-    int viidx = vmeta[3 * oy + 2]; // V(ertical) I(ndex) I(n)d(e)x
-
-    // Initialize row resampling indexes
-    int hlidx = 0; // H(orizontal) L(ength) I(n)d(e)x
-    int hkidx = 0; // H(orizontal) K(ernel) I(n)d(e)x
-    int hiidx = 0; // H(orizontal) I(ndex) I(n)d(e)x
-
-    // Number of lines contributing to the output line
-    int vl = vlength[vlidx++]; // V(ertical) L(ength)
-
-    // Process each output column
-    for(int ox = 0; ox < roi_out->width; ox++)
-    {
-      debug_extra("output %p [% 4d % 4d]\n", out, ox, oy);
-
-      // This will hold the resulting pixel
-      __m128 vs = _mm_setzero_ps();
-
-      // Number of horizontal samples contributing to the output
-      int hl = hlength[hlidx++]; // H(orizontal) L(ength)
-
-      for(int iy = 0; iy < vl; iy++)
-      {
-        // This is our input line
-        const float *i = (float *)((char *)in + (size_t)in_stride * vindex[viidx++]);
-
-        __m128 vhs = _mm_setzero_ps();
-
-        for(int ix = 0; ix < hl; ix++)
-        {
-          // Apply the precomputed filter kernel
-          size_t baseidx = (size_t)hindex[hiidx++] * 4;
-          float htap = hkernel[hkidx++];
-          __m128 vhtap = _mm_set_ps1(htap);
-          vhs = _mm_add_ps(vhs, _mm_mul_ps(*(__m128 *)&i[baseidx], vhtap));
-        }
-
-        // Accumulate contribution from this line
-        float vtap = vkernel[vkidx++];
-        __m128 vvtap = _mm_set_ps1(vtap);
-        vs = _mm_add_ps(vs, _mm_mul_ps(vhs, vvtap));
-
-        // Reset horizontal resampling context
-        hkidx -= hl;
-        hiidx -= hl;
-      }
-
-      // Output pixel is ready
-      float *o = (float *)((char *)out + (size_t)oy * out_stride + (size_t)ox * 4 * sizeof(float));
-      _mm_stream_ps(o, vs);
-
-      // Reset vertical resampling context
-      viidx -= vl;
-      vkidx -= vl;
-
-      // Progress in horizontal context
-      hiidx += hl;
-      hkidx += hl;
-    }
-
-    // Progress in vertical context
-//     viidx += vl;
-//     vkidx += vl;
-  }
-
-  _mm_sfence();
+  // Process each output line
+  _resample_pass_t p = { out, roi_out, out_stride, in, in_stride, hindex, hlength, vindex, vlength, vmeta,
+                         hkernel, vkernel };
+  dt_threadpool_for(roi_out->height, 1, _resample_rows_sse, &p);
 
 #if DEBUG_RESAMPLING_TIMING
   ts_resampling = getts() - ts_resampling;
@@ -25,6 +25,7 @@
 #include "common/imageio.h"
 #include "common/imageio_jpeg.h"
 #include "common/imageio_module.h"
+#include "common/trace.h"
 #include "control/conf.h"
 #include "control/jobs.h"
 #include "develop/imageop_math.h"
@@ -58,7 +59,9 @@ typedef enum dt_mipmap_buffer_dsc_flags
 {
   DT_MIPMAP_BUFFER_DSC_FLAG_NONE = 0,
   DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE = 1 << 0,
-  DT_MIPMAP_BUFFER_DSC_FLAG_INVALIDATE = 1 << 1
+  DT_MIPMAP_BUFFER_DSC_FLAG_INVALIDATE = 1 << 1,
+  // thumbnail is the embedded jpg, a job will replace it by the processed one
+  DT_MIPMAP_BUFFER_DSC_FLAG_PREVIEW = 1 << 2
 } dt_mipmap_buffer_dsc_flags;
 
 // the embedded Exif data to tag thumbnails as sRGB or AdobeRGB
@@ -86,6 +89,13 @@ struct dt_mipmap_buffer_dsc
   dt_mipmap_buffer_dsc_flags flags;
   dt_colorspaces_color_profile_type_t color_space;
 
+  // thumbnail converted for display, see dt_mipmap_cache_get_display_buffer()
+  uint8_t *display_buf;
+  size_t display_size;
+  int32_t display_valid;
+  int32_t display_managed;
+  uint32_t display_generation;
+
 #if __has_feature(address_sanitizer) || defined(__SANITIZE_ADDRESS__)
   // do not touch!
   // must be the last element.
@@ -115,6 +125,7 @@ static inline void dead_image_8(dt_mipmap_buffer_t *buf)
   dsc->width = dsc->height = 8;
   dsc->iscale = 1.0f;
   dsc->color_space = DT_COLORSPACE_DISPLAY;
+  dsc->display_valid = 0;
   assert(dsc->size > 64 * sizeof(uint32_t));
   const uint32_t X = 0xffffffffu;
   const uint32_t o = 0u;
@@ -238,7 +249,8 @@ static void _init_f(dt_mipmap_buffer_t *mipmap_buf, float *buf, uint32_t *width,
                     const uint32_t imgid);
 static void _init_8(uint8_t *buf, uint32_t *width, uint32_t *height, float *iscale,
                     dt_colorspaces_color_profile_type_t *color_space, const uint32_t imgid,
-                    const dt_mipmap_size_t size);
+                    const dt_mipmap_size_t size, int *preview);
+static dt_job_t *_refine_8_job_create(const uint32_t imgid, const dt_mipmap_size_t mip);
 
 // callback for the imageio core to allocate memory.
 // only needed for _F and _FULL buffers, as they change size
@@ -264,7 +276,7 @@ void *dt_mipmap_cache_alloc(dt_mipmap_buffer_t *buf, const dt_image_t *img)
 
     entry->data_size = 0;
 
-    entry->data = dt_alloc_align(64, buffer_size);
+    entry->data = dt_alloc_large(buffer_size);
 
     if(!entry->data)
     {
@@ -279,6 +291,8 @@ void *dt_mipmap_cache_alloc(dt_mipmap_buffer_t *buf, const dt_image_t *img)
 
     // set buffer size only if we're making it larger.
     dsc = (struct dt_mipmap_buffer_dsc *)entry->data;
+    dsc->display_buf = NULL;
+    dsc->display_size = 0;
   }
 
   dsc->size = buffer_size;
@@ -288,6 +302,7 @@ void *dt_mipmap_cache_alloc(dt_mipmap_buffer_t *buf, const dt_image_t *img)
   dsc->iscale = 1.0f;
   dsc->color_space = DT_COLORSPACE_NONE;
   dsc->flags = DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
+  dsc->display_valid = 0;
   buf->buf = (uint8_t *)(dsc + 1);
 
   // fprintf(stderr, "full buffer allocating img %u %d x %d = %u bytes (%p)\n", img->id, img->width,
@@ -335,6 +350,9 @@ void dt_mipmap_cache_allocate_dynamic(void *data, dt_cache_entry_t *entry)
     }
 
     dsc = entry->data;
+    dsc->display_buf = NULL;
+    dsc->display_size = 0;
+    dsc->display_valid = 0;
 
     if(mip <= DT_MIPMAP_F)
     {
@@ -442,7 +460,9 @@ void dt_mipmap_cache_deallocate_dynamic(void *data, dt_cache_entry_t *entry)
       {
         dt_mipmap_cache_unlink_ondisk_thumbnail(data, get_imgid(entry->key), mip);
       }
-      else if(cache->cachedir[0] && dt_conf_get_bool("cache_disk_backend"))
+      // embedded previews which weren't refined yet would stick on disk
+      else if(!(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_PREVIEW) && cache->cachedir[0]
+              && dt_conf_get_bool("cache_disk_backend"))
       {
         // serialize to disk
         char filename[PATH_MAX] = {0};
@@ -495,6 +515,7 @@ write_error:
         }
       }
     }
+    dt_free_align(dsc->display_buf);
   }
   dt_free_align(entry->data);
 }
@@ -509,6 +530,9 @@ static uint32_t nearest_power_of_two(const uint32_t value)
 void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
 {
   dt_mipmap_cache_get_filename(cache->cachedir, sizeof(cache->cachedir));
+  dt_pthread_mutex_init(&cache->display_lock, NULL);
+  dt_pthread_mutex_init(&cache->paint_lock, NULL);
+  cache->paint_requests = g_hash_table_new_full(NULL, NULL, NULL, g_free);
   // make sure static memory is initialized
   struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)dt_mipmap_cache_static_dead_image;
   dead_image_f((dt_mipmap_buffer_t *)(dsc + 1));
@@ -551,6 +575,10 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   cache->mip_thumbs.stats_misses = 0;
   cache->mip_thumbs.stats_fetches = 0;
   cache->mip_thumbs.stats_standin = 0;
+  cache->mip_thumbs.stats_previews = 0;
+  cache->mip_thumbs.stats_refined = 0;
+  cache->mip_thumbs.stats_painted = 0;
+  cache->mip_thumbs.stats_paint_us = 0;
   cache->mip_f.stats_requests = 0;
   cache->mip_f.stats_near_match = 0;
   cache->mip_f.stats_misses = 0;
@@ -590,6 +618,9 @@ void dt_mipmap_cache_cleanup(dt_mipmap_cache_t *cache)
   dt_cache_cleanup(&cache->mip_thumbs.cache);
   dt_cache_cleanup(&cache->mip_full.cache);
   dt_cache_cleanup(&cache->mip_f.cache);
+  dt_pthread_mutex_destroy(&cache->display_lock);
+  g_hash_table_destroy(cache->paint_requests);
+  dt_pthread_mutex_destroy(&cache->paint_lock);
 }
 
 void dt_mipmap_cache_print(dt_mipmap_cache_t *cache)
@@ -636,6 +667,10 @@ void dt_mipmap_cache_print(dt_mipmap_cache_t *cache)
          100.0 * cache->mip_full.stats_standin / (float)sum_standins,
          100.0 * cache->mip_full.stats_fetches / (float)sum_fetches,
          100.0 * cache->mip_full.stats_requests / (float)sum);
+  if(cache->mip_thumbs.stats_painted)
+    printf("[mipmap_cache] thumbs first painted after %.1f ms on average, %ld embedded previews, %ld refined\n",
+           cache->mip_thumbs.stats_paint_us / (1000.0 * cache->mip_thumbs.stats_painted),
+           cache->mip_thumbs.stats_previews, cache->mip_thumbs.stats_refined);
   printf("\n\n");
 }
 
@@ -645,6 +680,34 @@ static gboolean _raise_signal_mipmap_updated(gpointer user_data)
   return FALSE; // only call once
 }
 
+// remember when a thumbnail which isn't there yet has been asked for first
+static void _paint_requested(dt_mipmap_cache_t *cache, const uint32_t key)
+{
+  dt_pthread_mutex_lock(&cache->paint_lock);
+  if(!g_hash_table_contains(cache->paint_requests, GUINT_TO_POINTER(key)))
+  {
+    double *requested = g_malloc(sizeof(double));
+    *requested = dt_get_wtime();
+    g_hash_table_insert(cache->paint_requests, GUINT_TO_POINTER(key), requested);
+  }
+  dt_pthread_mutex_unlock(&cache->paint_lock);
+}
+
+// when the thumbnail has been asked for, or 0 if nobody is waiting for it, and forget about it
+static double _paint_request_take(dt_mipmap_cache_t *cache, const uint32_t key)
+{
+  double requested = 0.0;
+  dt_pthread_mutex_lock(&cache->paint_lock);
+  const double *r = (const double *)g_hash_table_lookup(cache->paint_requests, GUINT_TO_POINTER(key));
+  if(r)
+  {
+    requested = *r;
+    g_hash_table_remove(cache->paint_requests, GUINT_TO_POINTER(key));
+  }
+  dt_pthread_mutex_unlock(&cache->paint_lock);
+  return requested;
+}
+
 static dt_mipmap_cache_one_t *_get_cache(dt_mipmap_cache_t *cache, const dt_mipmap_size_t mip)
 {
   switch(mip)
@@ -678,6 +741,8 @@ void dt_mipmap_cache_get_with_caller(
     {
       ASAN_UNPOISON_MEMORY_REGION(entry->data, dt_mipmap_buffer_dsc_size);
       struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)entry->data;
+      // a writer might change the pixels
+      if(mode == 'w') dsc->display_valid = 0;
       buf->width = dsc->width;
       buf->height = dsc->height;
       buf->iscale = dsc->iscale;
@@ -730,6 +795,9 @@ void dt_mipmap_cache_get_with_caller(
     struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)entry->data;
     buf->cache_entry = entry;
 
+    // a writer might change the pixels
+    if(mode == 'w') dsc->display_valid = 0;
+
     int mipmap_generated = 0;
     if(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE)
     {
@@ -798,10 +866,36 @@ void dt_mipmap_cache_get_with_caller(
       {
         // 8-bit thumbs
         ASAN_UNPOISON_MEMORY_REGION(dsc + 1, dsc->size - sizeof(struct dt_mipmap_buffer_dsc));
-        _init_8((uint8_t *)(dsc + 1), &dsc->width, &dsc->height, &dsc->iscale, &buf->color_space, imgid, mip);
+        dt_trace_span_t span;
+        dt_trace_begin(&span);
+        const double start = dt_get_wtime();
+        int preview = 0;
+        _init_8((uint8_t *)(dsc + 1), &dsc->width, &dsc->height, &dsc->iscale, &buf->color_space, imgid, mip,
+                &preview);
+        const double end = dt_get_wtime(), paint = end - start;
+        // best effort requests waited for the load job as well
+        const double requested = _paint_request_take(cache, key);
+        __sync_fetch_and_add(&cache->mip_thumbs.stats_painted, 1);
+        __sync_fetch_and_add(&cache->mip_thumbs.stats_paint_us,
+                             (long int)((end - (requested > 0.0 ? requested : start)) * 1e6));
+        dt_trace_end(&span, "thumb", preview ? "\"stage\": \"preview\"" : NULL, "thumbnail %u mip %d", imgid, mip);
+        dt_print(DT_DEBUG_CACHE, "[mipmap_cache] thumbnail %u mip %d painted after %.3f secs%s\n", imgid, mip,
+                 paint, preview ? " from embedded preview" : "");
+        if(preview)
+        {
+          dsc->flags |= DT_MIPMAP_BUFFER_DSC_FLAG_PREVIEW;
+          __sync_fetch_and_add(&cache->mip_thumbs.stats_previews, 1);
+          dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_BG, _refine_8_job_create(imgid, mip));
+        }
       }
       dsc->color_space = buf->color_space;
       dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
+      dsc->display_valid = 0;
+    }
+    else if(mip < DT_MIPMAP_F)
+    {
+      // somebody else generated it in the meantime, a later generation is a new request
+      _paint_request_take(cache, key);
     }
 
     // image cache is leaving the write lock in place in case the image has been newly allocated.
@@ -879,6 +973,7 @@ void dt_mipmap_cache_get_with_caller(
       if(mip == k)
       {
         __sync_fetch_and_add(&(_get_cache(cache, mip)->stats_near_match), 1);
+        if(mip < DT_MIPMAP_F) _paint_requested(cache, key);
         dt_mipmap_cache_get(cache, buf, imgid, mip, DT_MIPMAP_PREFETCH, 'r');
       }
     }
@@ -933,6 +1028,112 @@ void dt_mipmap_cache_release_with_caller(dt_mipmap_cache_t *cache, dt_mipmap_buf
 }
 
 
+const uint8_t *dt_mipmap_cache_get_display_buffer(dt_mipmap_cache_t *cache, dt_mipmap_buffer_t *buf)
+{
+  if(!buf->buf || !buf->cache_entry || buf->size >= DT_MIPMAP_F) return NULL;
+
+  dt_cache_entry_t *entry = buf->cache_entry;
+  struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)entry->data;
+  const size_t size = (size_t)buf->width * buf->height * 4 * sizeof(uint8_t);
+
+  gboolean have_lock = FALSE;
+  cmsHTRANSFORM transform = NULL;
+
+  if(dt_conf_get_bool("cache_color_managed"))
+  {
+    pthread_rwlock_rdlock(&darktable.color_profiles->xprofile_lock);
+    have_lock = TRUE;
+
+    // we only color manage when a thumbnail is sRGB or AdobeRGB. everything else just gets dumped to the screen
+    if(buf->color_space == DT_COLORSPACE_SRGB && darktable.color_profiles->transform_srgb_to_display)
+    {
+      transform = darktable.color_profiles->transform_srgb_to_display;
+    }
+    else if(buf->color_space == DT_COLORSPACE_ADOBERGB
+            && darktable.color_profiles->transform_adobe_rgb_to_display)
+    {
+      transform = darktable.color_profiles->transform_adobe_rgb_to_display;
+    }
+    else
+    {
+      pthread_rwlock_unlock(&darktable.color_profiles->xprofile_lock);
+      have_lock = FALSE;
+      if(buf->color_space == DT_COLORSPACE_NONE)
+      {
+        fprintf(stderr, "oops, there seems to be a code path not setting the color space of thumbnails!\n");
+      }
+      else if(buf->color_space != DT_COLORSPACE_DISPLAY)
+      {
+        fprintf(stderr, "oops, there seems to be a code path setting an unhandled color space of thumbnails (%s)!\n",
+                dt_colorspaces_get_name(buf->color_space, "from file"));
+      }
+    }
+  }
+
+  const int managed = transform != NULL;
+  const uint32_t generation = managed ? darktable.color_profiles->display_transforms_generation : 0;
+
+  // the entry is only read locked, other readers might be in here, too
+  dt_pthread_mutex_lock(&cache->display_lock);
+
+  if(!dsc->display_valid || dsc->display_managed != managed || dsc->display_generation != generation)
+  {
+    if(dsc->display_size < size)
+    {
+      dt_free_align(dsc->display_buf);
+      dsc->display_buf = dt_alloc_align(64, size);
+      // account for the extra memory, so the cache quota stays meaningful
+      dt_cache_t *c = &_get_cache(cache, buf->size)->cache;
+      const size_t new_size = dsc->display_buf ? size : 0;
+      dt_pthread_mutex_lock(&c->lock);
+      c->cost = c->cost - dsc->display_size + new_size;
+      entry->cost = entry->cost - dsc->display_size + new_size;
+      dt_pthread_mutex_unlock(&c->lock);
+      dsc->display_size = new_size;
+    }
+
+    uint8_t *const display = dsc->display_buf;
+    if(display)
+    {
+      const uint8_t *const pixels = buf->buf;
+      const int32_t width = buf->width, height = buf->height;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+      for(int i = 0; i < height; i++)
+      {
+        const uint8_t *in = pixels + (size_t)i * width * 4;
+        uint8_t *out = display + (size_t)i * width * 4;
+
+        if(transform)
+        {
+          cmsDoTransform(transform, in, out, width);
+        }
+        else
+        {
+          for(int j = 0; j < width; j++, in += 4, out += 4)
+          {
+            out[0] = in[2];
+            out[1] = in[1];
+            out[2] = in[0];
+            out[3] = 0;
+          }
+        }
+      }
+      dsc->display_valid = 1;
+      dsc->display_managed = managed;
+      dsc->display_generation = generation;
+    }
+  }
+
+  const uint8_t *display = dsc->display_buf;
+  dt_pthread_mutex_unlock(&cache->display_lock);
+
+  if(have_lock) pthread_rwlock_unlock(&darktable.color_profiles->xprofile_lock);
+
+  return display;
+}
+
 // return the closest mipmap size
 dt_mipmap_size_t dt_mipmap_cache_get_matching_size(const dt_mipmap_cache_t *cache, const int32_t width,
                                                    const int32_t height)
@@ -1115,11 +1316,120 @@ static int _write_image(dt_imageio_module_data_t *data, const char *filename, co
   return 0;
 }
 
+// run the thumbnail pixelpipe, returns 0 on success
+static int _render_8(uint8_t *buf, const uint32_t wd, const uint32_t ht, uint32_t *width, uint32_t *height,
+                     const uint32_t imgid)
+{
+  dt_imageio_module_format_t format = { 0 };
+  _dummy_data_t dat;
+  format.bpp = _bpp;
+  format.write_image = _write_image;
+  format.levels = _levels;
+  dat.head.max_width = wd;
+  dat.head.max_height = ht;
+  dat.buf = buf;
+  // export with flags: ignore exif (don't load from disk), don't swap byte order, don't do hq processing,
+  // no upscaling and signal we want thumbnail export
+  const int res = dt_imageio_export_with_flags(imgid, "unused", &format, (dt_imageio_module_data_t *)&dat, 1, 0,
+                                               0, 0, 1, NULL, FALSE, DT_COLORSPACE_NONE, NULL, DT_INTENT_LAST,
+                                               NULL, NULL, 1, 1);
+  if(!res)
+  {
+    // might be smaller, or have a different aspect than what we got as input.
+    *width = dat.head.width;
+    *height = dat.head.height;
+  }
+  return res;
+}
+
+typedef struct dt_mipmap_refine_t
+{
+  uint32_t imgid;
+  dt_mipmap_size_t mip;
+} dt_mipmap_refine_t;
+
+// replaces an embedded preview in the cache by the processed thumbnail
+static int32_t _refine_8_job_run(dt_job_t *job)
+{
+  const dt_mipmap_refine_t *params = dt_control_job_get_params(job);
+  dt_mipmap_cache_t *cache = darktable.mipmap_cache;
+  const uint32_t imgid = params->imgid;
+  const dt_mipmap_size_t mip = params->mip;
+
+  // don't bother if it has been evicted or replaced in the meantime
+  dt_mipmap_buffer_t buf;
+  dt_mipmap_cache_get(cache, &buf, imgid, mip, DT_MIPMAP_TESTLOCK, 'r');
+  if(!buf.buf) return 0;
+  int wanted = ((struct dt_mipmap_buffer_dsc *)buf.buf - 1)->flags & DT_MIPMAP_BUFFER_DSC_FLAG_PREVIEW;
+  dt_mipmap_cache_release(cache, &buf);
+  if(!wanted) return 0;
+
+  const uint32_t wd = cache->max_width[mip], ht = cache->max_height[mip];
+  uint8_t *tmp = dt_alloc_align(64, sizeof(uint32_t) * wd * ht);
+  if(!tmp) return 1;
+  uint32_t width = 0, height = 0;
+  dt_trace_span_t span;
+  dt_trace_begin(&span);
+  const int res = _render_8(tmp, wd, ht, &width, &height, imgid);
+  dt_trace_end(&span, "thumb", "\"stage\": \"refine\"", "thumbnail %u mip %d", imgid, mip);
+
+  wanted = 0;
+  if(!res)
+  {
+    // a blocking get would generate it all over again if it has been evicted in the meantime. wait for
+    // whoever holds it instead, as long as it is there.
+    dt_cache_t *c = &_get_cache(cache, mip)->cache;
+    dt_mipmap_cache_get(cache, &buf, imgid, mip, DT_MIPMAP_TESTLOCK, 'w');
+    while(!buf.buf && dt_cache_contains(c, get_key(imgid, mip)))
+    {
+      g_usleep(1000);
+      dt_mipmap_cache_get(cache, &buf, imgid, mip, DT_MIPMAP_TESTLOCK, 'w');
+    }
+    struct dt_mipmap_buffer_dsc *dsc = buf.buf ? (struct dt_mipmap_buffer_dsc *)buf.buf - 1 : NULL;
+    if(dsc && (dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_PREVIEW))
+    {
+      memcpy(buf.buf, tmp, sizeof(uint32_t) * width * height);
+      dsc->width = width;
+      dsc->height = height;
+      dsc->iscale = 1.0f;
+      dsc->color_space = dt_mipmap_cache_get_colorspace();
+      dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_PREVIEW;
+      wanted = 1;
+    }
+    dt_mipmap_cache_release(cache, &buf);
+  }
+  dt_free_align(tmp);
+
+  if(wanted)
+  {
+    __sync_fetch_and_add(&cache->mip_thumbs.stats_refined, 1);
+    g_idle_add(_raise_signal_mipmap_updated, 0);
+  }
+  return 0;
+}
+
+static dt_job_t *_refine_8_job_create(const uint32_t imgid, const dt_mipmap_size_t mip)
+{
+  dt_job_t *job = dt_control_job_create(&_refine_8_job_run, "refine thumbnail %u mip %d", imgid, mip);
+  if(!job) return NULL;
+  dt_mipmap_refine_t *params = (dt_mipmap_refine_t *)calloc(1, sizeof(dt_mipmap_refine_t));
+  if(!params)
+  {
+    dt_control_job_dispose(job);
+    return NULL;
+  }
+  dt_control_job_set_params_with_size(job, params, sizeof(dt_mipmap_refine_t), free);
+  params->imgid = imgid;
+  params->mip = mip;
+  return job;
+}
+
 static void _init_8(uint8_t *buf, uint32_t *width, uint32_t *height, float *iscale,
                     dt_colorspaces_color_profile_type_t *color_space, const uint32_t imgid,
-                    const dt_mipmap_size_t size)
+                    const dt_mipmap_size_t size, int *preview)
 {
   *iscale = 1.0f;
+  *preview = 0;
   const uint32_t wd = *width, ht = *height;
   char filename[PATH_MAX] = { 0 };
   gboolean from_cache = TRUE;
@@ -1146,6 +1456,9 @@ static void _init_8(uint8_t *buf, uint32_t *width, uint32_t *height, float *isca
   if(!altered && !dt_conf_get_bool("never_use_embedded_thumb") && !incompatible)
   {
     const dt_image_orientation_t orientation = dt_image_get_orientation(imgid);
+    // let libjpeg decode the jpg just large enough for the thumbnail
+    const int swap = orientation != ORIENTATION_NULL && (orientation & ORIENTATION_SWAP_XY);
+    const uint32_t jpg_wd = swap ? ht : wd, jpg_ht = swap ? wd : ht;
 
     // try to load the embedded thumbnail in raw
     from_cache = TRUE;
@@ -1160,6 +1473,7 @@ static void _init_8(uint8_t *buf, uint32_t *width, uint32_t *height, float *isca
       dt_imageio_jpeg_t jpg;
       if(!dt_imageio_jpeg_read_header(filename, &jpg))
       {
+        dt_imageio_jpeg_set_scale(&jpg, jpg_wd, jpg_ht);
         uint8_t *tmp = (uint8_t *)malloc(sizeof(uint8_t) * jpg.width * jpg.height * 4);
         *color_space = dt_imageio_jpeg_read_color_space(&jpg);
         if(!dt_imageio_jpeg_read(&jpg, tmp))
@@ -1175,12 +1489,14 @@ static void _init_8(uint8_t *buf, uint32_t *width, uint32_t *height, float *isca
     {
       uint8_t *tmp = 0;
       int32_t thumb_width, thumb_height;
-      res = dt_imageio_large_thumbnail(filename, &tmp, &thumb_width, &thumb_height, color_space);
+      res = dt_imageio_large_thumbnail(filename, &tmp, &thumb_width, &thumb_height, color_space, jpg_wd, jpg_ht);
       if(!res)
       {
         // scale to fit
         dt_iop_flip_and_zoom_8(tmp, thumb_width, thumb_height, buf, wd, ht, orientation, width, height);
         free(tmp);
+        // show it right away, the processed thumbnail will replace it later
+        *preview = dt_conf_get_bool("refine_embedded_thumb");
       }
     }
   }
@@ -1208,23 +1524,9 @@ static void _init_8(uint8_t *buf, uint32_t *width, uint32_t *height, float *isca
   if(res)
   {
     // try the real thing: rawspeed + pixelpipe
-    dt_imageio_module_format_t format;
-    _dummy_data_t dat;
-    format.bpp = _bpp;
-    format.write_image = _write_image;
-    format.levels = _levels;
-    dat.head.max_width = wd;
-    dat.head.max_height = ht;
-    dat.buf = buf;
-    // export with flags: ignore exif (don't load from disk), don't swap byte order, don't do hq processing,
-    // no upscaling and signal we want thumbnail export
-    res = dt_imageio_export_with_flags(imgid, "unused", &format, (dt_imageio_module_data_t *)&dat, 1, 0, 0, 0, 1,
-                                       NULL, FALSE, DT_COLORSPACE_NONE, NULL, DT_INTENT_LAST, NULL, NULL, 1, 1);
+    res = _render_8(buf, wd, ht, width, height, imgid);
     if(!res)
     {
-      // might be smaller, or have a different aspect than what we got as input.
-      *width = dat.head.width;
-      *height = dat.head.height;
       *iscale = 1.0f;
       *color_space = dt_mipmap_cache_get_colorspace();
     }
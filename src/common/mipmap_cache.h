@@ -83,6 +83,10 @@ typedef struct dt_mipmap_cache_one_t
   long int stats_misses;     // nothing returned at all.
   long int stats_fetches;    // texture was fetched (either as a stand-in or as per request)
   long int stats_standin;    // texture used as stand-in
+  long int stats_previews;   // thumbnail shown from the embedded preview first
+  long int stats_refined;    // embedded preview replaced by the processed thumbnail
+  long int stats_painted;    // thumbnails generated, stats_paint_us is the sum over these
+  long int stats_paint_us;   // time from the request of a thumbnail until it had content, in microseconds
 } dt_mipmap_cache_one_t;
 
 typedef struct dt_mipmap_cache_t
@@ -99,6 +103,13 @@ typedef struct dt_mipmap_cache_t
   dt_mipmap_cache_one_t mip_f;
   dt_mipmap_cache_one_t mip_full;
   char cachedir[PATH_MAX]; // cached sha1sum filename for faster access
+
+  // serializes filling the display buffers of thumbnails
+  dt_pthread_mutex_t display_lock;
+
+  // when thumbnails which weren't there have been asked for, by cache key, for the paint time stats
+  dt_pthread_mutex_t paint_lock;
+  GHashTable *paint_requests;
 } dt_mipmap_cache_t;
 
 // dynamic memory allocation interface for imageio backend: a write locked
@@ -139,6 +150,11 @@ void dt_mipmap_cache_write_get_with_caller(
 void dt_mipmap_cache_release_with_caller(dt_mipmap_cache_t *cache, dt_mipmap_buffer_t *buf, const char *file,
                                          int line);
 
+// return the read locked 8-bit thumbnail converted to the display profile, in cairo's RGB24 layout.
+// the result is kept with the cache entry and only recomputed when the thumbnail or the display
+// profile changes. valid as long as buf is locked, NULL if buf is no 8-bit thumbnail.
+const uint8_t *dt_mipmap_cache_get_display_buffer(dt_mipmap_cache_t *cache, dt_mipmap_buffer_t *buf);
+
 // remove thumbnails, so they will be regenerated:
 void dt_mipmap_cache_remove(dt_mipmap_cache_t *cache, const uint32_t imgid);
 
@@ -30,6 +30,7 @@
 #include "common/heal.h"
 #include "common/nvidia_gpus.h"
 #include "common/opencl_drivers_blacklist.h"
+#include "common/trace.h"
 #include "control/conf.h"
 #include "control/control.h"
 #include "develop/blend.h"
@@ -2757,7 +2758,7 @@ cl_int dt_opencl_events_flush(const int devid, const int reset)
   if(reset)
   {
     // output profiling info if wanted
-    if(darktable.unmuted & DT_DEBUG_PERF) dt_opencl_events_profiling(devid, 1);
+    if(darktable.unmuted & (DT_DEBUG_PERF | DT_DEBUG_TRACE)) dt_opencl_events_profiling(devid, 1);
 
     // reset eventlist structures to empty state
     dt_opencl_events_reset(devid);
@@ -2842,6 +2843,18 @@ void dt_opencl_events_profiling(const int devid, const int aggregated)
              tags[i][0] == '\0' ? "<?>" : tags[i]);
     total += timings[i];
   }
+
+  // device clocks can't be related to the host's, so the kernels only go into the trace as summary
+  if(dt_trace_enabled())
+  {
+    for(int i = 0; i < items; i++)
+    {
+      if(i == 0 && timings[0] == 0.0f) continue;
+      char args[64];
+      snprintf(args, sizeof(args), "\"device\": %d, \"gpu_ms\": %.3f", devid, 1e3 * timings[i]);
+      dt_trace_instant("opencl", args, "%s", i == 0 ? "(unallocated)" : tags[i][0] == '\0' ? "<?>" : tags[i]);
+    }
+  }
   // aggregated timing info for items without tag (if any)
   if(timings[0] != 0.0f)
   {
@@ -25,6 +25,7 @@ dt_timer_t *dt_timer_start_with_name(const char *file, const char *function, con
   t->function = function;
   t->timer = g_timer_new();
   t->description = description;
+  dt_trace_begin(&t->span);
   return t;
 }
 
@@ -32,6 +33,7 @@ void dt_timer_stop_with_name(dt_timer_t *t)
 {
   g_assert(t != NULL);
   g_timer_stop(t->timer);
+  dt_trace_end(&t->span, "timer", NULL, "%s (%s)", t->description, t->function);
   gulong ms = 0;
   fprintf(stderr, "Timer %s in function %s took %.3f seconds to execute.\n", t->description, t->function,
           g_timer_elapsed(t->timer, &ms));
@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include "common/trace.h"
 #include "gui/gtk.h"
 
 
@@ -45,6 +46,7 @@ typedef struct dt_timer_t
   const char *function;
   const char *description;
   GTimer *timer;
+  dt_trace_span_t span;
 } dt_timer_t;
 
 dt_timer_t *dt_timer_start_with_name(const char *file, const char *function, const char *description);
@@ -24,7 +24,7 @@
 #include "gui/gtk.h"
 
 
-void dt_ratings_apply_to_image(int imgid, int rating)
+static void _ratings_apply_to_image(const int imgid, int rating, const dt_image_cache_write_mode_t mode)
 {
   dt_image_t *image = dt_image_cache_get(darktable.image_cache, imgid, 'w');
   // one star is a toggle, so you can easily reject images by removing the last star:
@@ -35,7 +35,12 @@ void dt_ratings_apply_to_image(int imgid, int rating)
 
   image->flags = (image->flags & ~0x7) | (0x7 & rating);
   // synch through:
-  dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_SAFE);
+  dt_image_cache_write_release(darktable.image_cache, image, mode);
+}
+
+void dt_ratings_apply_to_image(int imgid, int rating)
+{
+  _ratings_apply_to_image(imgid, rating, DT_IMAGE_CACHE_SAFE);
 
   dt_collection_hint_message(darktable.collection);
 }
@@ -50,22 +55,27 @@ void dt_ratings_apply_to_selection(int rating)
     else
       dt_control_log(ngettext("applying rating %d to %d image", "applying rating %d to %d images", count),
                      rating, count);
-#if 0 // not updating cache
-    gchar query[1024]= {0};
-    g_snprintf(query,sizeof(query), "UPDATE main.images SET flags=(flags & ~7) | (7 & %d) WHERE id IN "
-                                    "(SELECT imgid FROM main.selected_images)", rating);
-    DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), query, NULL, NULL, NULL);
-#endif
 
-    /* for each selected image update rating */
+    /* for each selected image update rating. the flags have to go through the image cache, but all of it
+     * is one transaction and the sidecar files are written afterwards in the background. */
+    GList *imgs = NULL;
     sqlite3_stmt *stmt;
+    dt_database_start_transaction(darktable.db);
     DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT imgid FROM main.selected_images", -1, &stmt,
                                 NULL);
     while(sqlite3_step(stmt) == SQLITE_ROW)
     {
-      dt_ratings_apply_to_image(sqlite3_column_int(stmt, 0), rating);
+      const int imgid = sqlite3_column_int(stmt, 0);
+      _ratings_apply_to_image(imgid, rating, DT_IMAGE_CACHE_RELAXED);
+      imgs = g_list_prepend(imgs, GINT_TO_POINTER(imgid));
     }
     sqlite3_finalize(stmt);
+    dt_database_release_transaction(darktable.db);
+
+    dt_image_synch_xmps(imgs);
+    g_list_free(imgs);
+
+    dt_collection_hint_message(darktable.collection);
 
     /* redraw view */
     /* dt_control_queue_redraw_center() */
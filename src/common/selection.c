@@ -124,34 +124,34 @@ void dt_selection_select_single(dt_selection_t *selection, uint32_t imgid)
 
 void dt_selection_toggle(dt_selection_t *selection, uint32_t imgid)
 {
-  gchar *query = NULL;
   sqlite3_stmt *stmt;
   gboolean exists = FALSE;
 
   if(imgid == -1) return;
 
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "SELECT imgid FROM main.selected_images WHERE imgid=?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                  "SELECT imgid FROM main.selected_images WHERE imgid=?1", &stmt);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
 
   if(sqlite3_step(stmt) == SQLITE_ROW) exists = TRUE;
 
-  sqlite3_finalize(stmt);
+  DT_DEBUG_SQLITE3_RELEASE(stmt);
 
   if(exists)
   {
     selection->last_single_id = -1;
-    query = dt_util_dstrcat(query, "DELETE FROM main.selected_images WHERE imgid = %d", imgid);
+    DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                    "DELETE FROM main.selected_images WHERE imgid = ?1", &stmt);
   }
   else
   {
     selection->last_single_id = imgid;
-    query = dt_util_dstrcat(query, "INSERT OR IGNORE INTO main.selected_images VALUES (%d)", imgid);
+    DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                    "INSERT OR IGNORE INTO main.selected_images VALUES (?1)", &stmt);
   }
-
-  sqlite3_exec(dt_database_get(darktable.db), query, NULL, NULL, NULL);
-
-  g_free(query);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  sqlite3_step(stmt);
+  DT_DEBUG_SQLITE3_RELEASE(stmt);
 
   /* update hint message */
   dt_collection_hint_message(darktable.collection);
@@ -20,6 +20,7 @@
 #include "common/collection.h"
 #include "common/darktable.h"
 #include "common/debug.h"
+#include "common/image.h"
 #include "control/conf.h"
 #include "control/control.h"
 #include <glib.h>
@@ -107,7 +108,7 @@ guint dt_tag_remove(const guint tagid, gboolean final)
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
 
-    /* raise signal of tags change to refresh keywords module */
+    /* raise signal of tags change to refresh keywords module, collections filtered by tag recount on it */
     dt_control_signal_raise(darktable.signals, DT_SIGNAL_TAG_CHANGED);
   }
 
@@ -119,8 +120,8 @@ gchar *dt_tag_get_name(const guint tagid)
   int rt;
   char *name = NULL;
   sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT name FROM data.tags WHERE id= ?1", -1, &stmt,
-                              NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get_reader(darktable.db), "SELECT name FROM data.tags WHERE id= ?1",
+                              -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
   rt = sqlite3_step(stmt);
   if(rt == SQLITE_ROW) name = g_strdup((const char *)sqlite3_column_text(stmt, 0));
@@ -199,24 +200,24 @@ static void _attach_tag(guint tagid, gint imgid)
   sqlite3_stmt *stmt;
   if(imgid > 0)
   {
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "INSERT OR REPLACE INTO main.tagged_images (imgid, tagid) VALUES (?1, ?2)", -1,
-                                &stmt, NULL);
+    DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                    "INSERT OR REPLACE INTO main.tagged_images (imgid, tagid) VALUES (?1, ?2)",
+                                    &stmt);
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, tagid);
     sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    DT_DEBUG_SQLITE3_RELEASE(stmt);
   }
   else
   {
     // insert into tagged_images if not there already.
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "INSERT OR REPLACE INTO main.tagged_images SELECT imgid, ?1 "
-                                "FROM main.selected_images",
-                                -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                    "INSERT OR REPLACE INTO main.tagged_images (imgid, tagid) SELECT imgid, ?1 "
+                                    "FROM main.selected_images",
+                                    &stmt);
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
     sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    DT_DEBUG_SQLITE3_RELEASE(stmt);
   }
 }
 
@@ -226,7 +227,7 @@ void dt_tag_attach(guint tagid, gint imgid)
 
   dt_tag_update_used_tags();
 
-  dt_collection_update_query(darktable.collection);
+  dt_collection_update_images(darktable.collection, imgid);
 }
 
 void dt_tag_attach_list(GList *tags, gint imgid)
@@ -239,7 +240,7 @@ void dt_tag_attach_list(GList *tags, gint imgid)
 
   dt_tag_update_used_tags();
 
-  dt_collection_update_query(darktable.collection);
+  dt_collection_update_images(darktable.collection, imgid);
 }
 
 void dt_tag_attach_string_list(const gchar *tags, gint imgid)
@@ -267,7 +268,7 @@ void dt_tag_attach_string_list(const gchar *tags, gint imgid)
 
     dt_tag_update_used_tags();
 
-    dt_collection_update_query(darktable.collection);
+    dt_collection_update_images(darktable.collection, imgid);
   }
   g_strfreev(tokens);
 }
@@ -278,28 +279,73 @@ void dt_tag_detach(guint tagid, gint imgid)
   if(imgid > 0)
   {
     // remove from tagged_images
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "DELETE FROM main.tagged_images WHERE tagid = ?1 AND imgid = ?2", -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                    "DELETE FROM main.tagged_images WHERE tagid = ?1 AND imgid = ?2", &stmt);
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
     sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    DT_DEBUG_SQLITE3_RELEASE(stmt);
   }
   else
   {
     // remove from tagged_images
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "DELETE FROM main.tagged_images WHERE tagid = ?1 AND imgid IN "
-                                "(SELECT imgid FROM main.selected_images)",
-                                -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                    "DELETE FROM main.tagged_images WHERE tagid = ?1 AND imgid IN "
+                                    "(SELECT imgid FROM main.selected_images)",
+                                    &stmt);
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
     sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    DT_DEBUG_SQLITE3_RELEASE(stmt);
   }
 
   dt_tag_update_used_tags();
 
-  dt_collection_update_query(darktable.collection);
+  dt_collection_update_images(darktable.collection, imgid);
+}
+
+void dt_tag_attach_images(guint tagid, const GList *imgs, const gboolean update)
+{
+  if(!imgs) return;
+
+  sqlite3_stmt *stmt;
+  dt_database_start_transaction(darktable.db);
+  dt_image_list_to_memory(imgs);
+  DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                  "INSERT OR REPLACE INTO main.tagged_images (imgid, tagid) SELECT imgid, ?1 "
+                                  "FROM memory.image_list",
+                                  &stmt);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
+  sqlite3_step(stmt);
+  DT_DEBUG_SQLITE3_RELEASE(stmt);
+  dt_database_release_transaction(darktable.db);
+
+  if(update) dt_tag_update_images(imgs);
+}
+
+void dt_tag_detach_images(guint tagid, const GList *imgs, const gboolean update)
+{
+  if(!imgs) return;
+
+  sqlite3_stmt *stmt;
+  dt_database_start_transaction(darktable.db);
+  dt_image_list_to_memory(imgs);
+  DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                  "DELETE FROM main.tagged_images WHERE tagid = ?1 AND imgid IN "
+                                  "(SELECT imgid FROM memory.image_list)",
+                                  &stmt);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
+  sqlite3_step(stmt);
+  DT_DEBUG_SQLITE3_RELEASE(stmt);
+  dt_database_release_transaction(darktable.db);
+
+  if(update) dt_tag_update_images(imgs);
+}
+
+void dt_tag_update_images(const GList *imgs)
+{
+  dt_tag_update_used_tags();
+
+  dt_collection_update_image_list(darktable.collection, imgs);
 }
 
 void dt_tag_detach_by_string(const char *name, gint imgid)
@@ -316,7 +362,7 @@ void dt_tag_detach_by_string(const char *name, gint imgid)
 
   dt_tag_update_used_tags();
 
-  dt_collection_update_query(darktable.collection);
+  dt_collection_update_images(darktable.collection, imgid);
 }
 
 
@@ -325,30 +371,36 @@ uint32_t dt_tag_get_attached(gint imgid, GList **result, gboolean ignore_dt_tags
   sqlite3_stmt *stmt;
   if(imgid > 0)
   {
-    char query[1024] = { 0 };
-    snprintf(query, sizeof(query), "SELECT DISTINCT T.id, T.name FROM main.tagged_images AS I "
-                                   "JOIN data.tags T on T.id = I.tagid "
-                                   "WHERE I.imgid = %d %s ORDER BY T.name",
-             imgid, ignore_dt_tags ? "AND NOT T.name LIKE \"darktable|%\"" : "");
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), query, -1, &stmt, NULL);
+    if(ignore_dt_tags)
+      DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get_reader(darktable.db),
+                                      "SELECT DISTINCT T.id, T.name FROM main.tagged_images AS I "
+                                      "JOIN data.tags T on T.id = I.tagid "
+                                      "WHERE I.imgid = ?1 AND NOT T.name LIKE \"darktable|%\" ORDER BY T.name",
+                                      &stmt);
+    else
+      DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get_reader(darktable.db),
+                                      "SELECT DISTINCT T.id, T.name FROM main.tagged_images AS I "
+                                      "JOIN data.tags T on T.id = I.tagid "
+                                      "WHERE I.imgid = ?1 ORDER BY T.name",
+                                      &stmt);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
   }
   else
   {
     if(ignore_dt_tags)
-      DT_DEBUG_SQLITE3_PREPARE_V2(
-          dt_database_get(darktable.db),
-          "SELECT DISTINCT T.id, T.name "
-          "FROM main.tagged_images AS I, data.tags AS T "
-          "WHERE I.imgid IN (SELECT imgid FROM main.selected_images) "
-          "AND T.id = I.tagid AND NOT T.name LIKE \"darktable|%\" ORDER BY T.name",
-          -1, &stmt, NULL);
+      DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get_reader(darktable.db),
+                                      "SELECT DISTINCT T.id, T.name "
+                                      "FROM main.tagged_images AS I, data.tags AS T "
+                                      "WHERE I.imgid IN (SELECT imgid FROM main.selected_images) "
+                                      "AND T.id = I.tagid AND NOT T.name LIKE \"darktable|%\" ORDER BY T.name",
+                                      &stmt);
     else
-      DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                  "SELECT DISTINCT T.id, T.name "
-                                  "FROM main.tagged_images AS I, data.tags AS T "
-                                  "WHERE I.imgid IN (SELECT imgid FROM main.selected_images) "
-                                  "AND T.id = I.tagid ORDER BY T.name",
-                                  -1, &stmt, NULL);
+      DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get_reader(darktable.db),
+                                      "SELECT DISTINCT T.id, T.name "
+                                      "FROM main.tagged_images AS I, data.tags AS T "
+                                      "WHERE I.imgid IN (SELECT imgid FROM main.selected_images) "
+                                      "AND T.id = I.tagid ORDER BY T.name",
+                                      &stmt);
   }
 
   // Create result
@@ -361,7 +413,7 @@ uint32_t dt_tag_get_attached(gint imgid, GList **result, gboolean ignore_dt_tags
     *result = g_list_append(*result, t);
     count++;
   }
-  sqlite3_finalize(stmt);
+  DT_DEBUG_SQLITE3_RELEASE(stmt);
   return count;
 }
 
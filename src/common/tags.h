@@ -74,6 +74,16 @@ void dt_tag_attach_string_list(const gchar *tags, gint imgid);
  * tag from, if < 0 selected images are used. */
 void dt_tag_detach(guint tagid, gint imgid);
 
+/** attach a tag to a list of image ids with one statement. with update set, the used tags and the collection are
+ * updated once afterwards, otherwise the caller does that with dt_tag_update_images() */
+void dt_tag_attach_images(guint tagid, const GList *imgs, const gboolean update);
+
+/** detach a tag from a list of image ids with one statement, see dt_tag_attach_images() */
+void dt_tag_detach_images(guint tagid, const GList *imgs, const gboolean update);
+
+/** update the used tags and the collection after tags of the images have changed */
+void dt_tag_update_images(const GList *imgs);
+
 /** detach tags from images that matches name, it is valid to use % to match tag */
 void dt_tag_detach_by_string(const char *name, gint imgid);
 
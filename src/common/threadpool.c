@@ -0,0 +1,269 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2019 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/threadpool.h"
+#include "common/darktable.h"
+#include "common/dtpthread.h"
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct dt_threadpool_task_t
+{
+  dt_threadpool_loop_t body;
+  void *data;
+  size_t grain;
+  int threads;      // number of ranges, one for each thread which may take part
+  int joined;       // ranges handed out so far, the caller has the first one
+  int running;      // workers still working on the task
+  uint64_t *ranges; // next iteration in the low, end of the range in the high 32 bits
+} dt_threadpool_task_t;
+
+static struct
+{
+  dt_pthread_mutex_t lock;
+  pthread_cond_t work; // a task was posted, or the pool stops
+  pthread_cond_t done; // a worker left a task
+  GList *tasks;
+  pthread_t *workers;
+  int num_workers;
+  int running;
+  int pipes; // budgets currently taken
+} _pool = { .num_workers = 0 };
+
+// set in the workers and while a thread runs a loop body: loops started from there run inline
+static __thread int _nested = 0;
+// the share of the cores taken by the pipe processing on this thread, 0 if none
+static __thread int _budget = 0;
+static __thread int _budget_depth = 0;
+
+// takes the next chunk of a range, from the front for its owner or from the back for a thief
+static int _claim(uint64_t *range, const size_t grain, const int steal, size_t *begin, size_t *end)
+{
+  uint64_t old = *range;
+  for(;;)
+  {
+    const size_t front = old & 0xffffffffu;
+    const size_t back = old >> 32;
+    if(front >= back) return 0;
+    uint64_t next;
+    if(steal)
+    {
+      *begin = back - MIN(grain, back - front);
+      *end = back;
+      next = ((uint64_t)*begin << 32) | front;
+    }
+    else
+    {
+      *begin = front;
+      *end = front + MIN(grain, back - front);
+      next = ((uint64_t)back << 32) | *end;
+    }
+    const uint64_t seen = __sync_val_compare_and_swap(range, old, next);
+    if(seen == old) return 1;
+    old = seen;
+  }
+}
+
+static void _run(dt_threadpool_task_t *t, const int slot)
+{
+  size_t begin, end;
+  while(_claim(&t->ranges[slot], t->grain, 0, &begin, &end)) t->body(t->data, begin, end, slot);
+
+  // own range done, help the others. starting at the next one spreads the thieves out.
+  // a drained range never fills up again, so one pass over all of them is enough.
+  for(int k = 1; k < t->threads; k++)
+  {
+    uint64_t *victim = &t->ranges[(slot + k) % t->threads];
+    while(_claim(victim, t->grain, 1, &begin, &end)) t->body(t->data, begin, end, slot);
+  }
+}
+
+static void *_worker(void *arg)
+{
+  dt_pthread_setname("pool");
+  _nested = 1;
+#ifdef _OPENMP
+  // openmp code called from a loop body mustn't start a team of its own on every worker
+  omp_set_num_threads(1);
+#endif
+  dt_pthread_mutex_lock(&_pool.lock);
+  while(_pool.running)
+  {
+    dt_threadpool_task_t *t = NULL;
+    for(GList *l = _pool.tasks; l && !t; l = g_list_next(l))
+    {
+      dt_threadpool_task_t *candidate = (dt_threadpool_task_t *)l->data;
+      if(candidate->joined < candidate->threads) t = candidate;
+    }
+    if(!t)
+    {
+      dt_pthread_cond_wait(&_pool.work, &_pool.lock);
+      continue;
+    }
+
+    const int slot = t->joined++;
+    t->running++;
+    dt_pthread_mutex_unlock(&_pool.lock);
+
+    _run(t, slot);
+
+    dt_pthread_mutex_lock(&_pool.lock);
+    if(--t->running == 0) pthread_cond_broadcast(&_pool.done);
+  }
+  dt_pthread_mutex_unlock(&_pool.lock);
+  return NULL;
+}
+
+void dt_threadpool_init()
+{
+  dt_pthread_mutex_init(&_pool.lock, NULL);
+  pthread_cond_init(&_pool.work, NULL);
+  pthread_cond_init(&_pool.done, NULL);
+  _pool.tasks = NULL;
+  _pool.running = 1;
+
+#ifdef _OPENMP
+  const int threads = darktable.num_openmp_threads;
+#else
+  const int threads = g_get_num_processors();
+#endif
+  _pool.workers = (pthread_t *)calloc(MAX(threads - 1, 1), sizeof(pthread_t));
+  _pool.num_workers = 0;
+  for(int k = 0; k < threads - 1 && _pool.workers; k++)
+  {
+    if(dt_pthread_create(&_pool.workers[k], _worker, NULL))
+    {
+      fprintf(stderr, "[threadpool] can't start more than %d workers\n", k);
+      break;
+    }
+    _pool.num_workers++;
+  }
+}
+
+void dt_threadpool_cleanup()
+{
+  dt_pthread_mutex_lock(&_pool.lock);
+  _pool.running = 0;
+  pthread_cond_broadcast(&_pool.work);
+  dt_pthread_mutex_unlock(&_pool.lock);
+
+  for(int k = 0; k < _pool.num_workers; k++) pthread_join(_pool.workers[k], NULL);
+  free(_pool.workers);
+  _pool.workers = NULL;
+  _pool.num_workers = 0;
+
+  pthread_cond_destroy(&_pool.done);
+  pthread_cond_destroy(&_pool.work);
+  dt_pthread_mutex_destroy(&_pool.lock);
+}
+
+// an equal share of the cores for each pipe running right now
+static int _share()
+{
+  const int pipes = __atomic_load_n(&_pool.pipes, __ATOMIC_RELAXED);
+  return MAX(1, (_pool.num_workers + 1) / MAX(pipes, 1));
+}
+
+int dt_threadpool_num_threads()
+{
+  if(_nested) return 1;
+  return _budget ? _budget : _pool.num_workers + 1;
+}
+
+void dt_threadpool_for(size_t n, size_t grain, dt_threadpool_loop_t body, void *data)
+{
+  if(!n) return;
+  grain = MAX(grain, 1);
+
+  // pipes which started after the budget was last updated get their share, too. it only grows again with
+  // dt_threadpool_budget_update(), per-thread buffers are sized for the budget.
+  int threads = dt_threadpool_num_threads();
+  if(_budget) threads = MIN(threads, _share());
+  if((n + grain - 1) / grain < (size_t)threads) threads = (n + grain - 1) / grain;
+
+  int serial = threads < 2 || n > UINT32_MAX;
+#ifdef _OPENMP
+  serial |= omp_in_parallel();
+#endif
+  // without the ranges the loop runs inline, too
+  uint64_t *ranges = serial ? NULL : (uint64_t *)malloc(sizeof(uint64_t) * threads);
+  if(!ranges)
+  {
+    const int nested = _nested;
+    _nested = 1;
+    body(data, 0, n, 0);
+    _nested = nested;
+    return;
+  }
+  // split like a static schedule would
+  for(int k = 0; k < threads; k++)
+    ranges[k] = ((uint64_t)(n * (k + 1) / threads) << 32) | (uint64_t)(n * k / threads);
+
+  dt_threadpool_task_t t = { .body = body, .data = data, .grain = grain, .threads = threads, .joined = 1,
+                             .running = 0, .ranges = ranges };
+
+  dt_pthread_mutex_lock(&_pool.lock);
+  _pool.tasks = g_list_append(_pool.tasks, &t);
+  pthread_cond_broadcast(&_pool.work);
+  dt_pthread_mutex_unlock(&_pool.lock);
+
+  const int nested = _nested;
+  _nested = 1;
+  _run(&t, 0);
+  _nested = nested;
+
+  // everything is claimed now, wait for the workers still busy with their last chunk
+  dt_pthread_mutex_lock(&_pool.lock);
+  _pool.tasks = g_list_remove(_pool.tasks, &t);
+  while(t.running) dt_pthread_cond_wait(&_pool.done, &_pool.lock);
+  dt_pthread_mutex_unlock(&_pool.lock);
+
+  free(ranges);
+}
+
+void dt_threadpool_budget_begin()
+{
+  if(_budget_depth++) return;
+  __sync_add_and_fetch(&_pool.pipes, 1);
+  dt_threadpool_budget_update();
+}
+
+void dt_threadpool_budget_update()
+{
+  if(!_budget_depth) return;
+  _budget = _share();
+#ifdef _OPENMP
+  omp_set_num_threads(MIN(_budget, darktable.num_openmp_threads));
+#endif
+}
+
+void dt_threadpool_budget_end()
+{
+  if(--_budget_depth) return;
+  __sync_sub_and_fetch(&_pool.pipes, 1);
+  _budget = 0;
+#ifdef _OPENMP
+  omp_set_num_threads(darktable.num_openmp_threads);
+#endif
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
@@ -0,0 +1,69 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2019 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * one pool of worker threads shared by all the pipes running at the same time.
+ *
+ * a loop is split into one contiguous range per thread, the same way a static openmp schedule would do it.
+ * each thread works through its own range chunk by chunk and, once that is done, steals chunks from the end
+ * of the ranges of the others. so an unbalanced loop doesn't wait for the slowest thread, and the range a
+ * thread gets usually is the one it first touched (see dt_alloc_large()).
+ *
+ * every pipe processing on a thread of its own takes a budget: while several pipes run concurrently (full
+ * and preview in darkroom, or parallel exports) each of them gets an equal share of the cores, both for the
+ * loops here and for the openmp pragmas it runs. loops started from inside a loop body or an openmp region
+ * run serially on the calling thread, so nesting never oversubscribes.
+ *
+ * usage:
+ *   static void _process_rows(void *data, size_t begin, size_t end, int thread)
+ *   {
+ *     for(size_t j = begin; j < end; j++) ...
+ *   }
+ *   dt_threadpool_for(height, 4, _process_rows, &params);
+ */
+
+/** the body of a loop, called for the iterations [begin, end). thread is below dt_threadpool_num_threads()
+ * and unique among the threads working on the loop, so it can index per-thread buffers. */
+typedef void (*dt_threadpool_loop_t)(void *data, size_t begin, size_t end, int thread);
+
+/** start the workers, after darktable.num_openmp_threads is known */
+void dt_threadpool_init();
+/** stop and join the workers */
+void dt_threadpool_cleanup();
+
+/** run body over the iterations [0, n) in chunks of at least grain iterations. the calling thread takes
+ * part, the call returns once all iterations are done. */
+void dt_threadpool_for(size_t n, size_t grain, dt_threadpool_loop_t body, void *data);
+
+/** number of threads a loop started from the calling thread may use, for sizing per-thread buffers */
+int dt_threadpool_num_threads();
+
+/** take a share of the cores for a pipe processing on the calling thread, until dt_threadpool_budget_end() */
+void dt_threadpool_budget_begin();
+void dt_threadpool_budget_end();
+/** recompute the share of the pipe on the calling thread from the pipes running now, also for the openmp
+ * pragmas. called between modules, so a pipe gets the cores back which a pipe that finished left. */
+void dt_threadpool_budget_update();
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
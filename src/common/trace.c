@@ -0,0 +1,195 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2018 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/trace.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct
+{
+  dt_pthread_mutex_t lock;
+  FILE *f;
+  int first;
+  double start;
+  int num_threads;
+  int writers; // threads in _write_event(), dt_trace_cleanup() waits for them before it destroys the lock
+} _trace = { .f = NULL };
+
+// per thread state: small ids are nicer to look at in the viewer than pthread_t
+static __thread int _thread_id = 0;
+static __thread size_t _thread_bytes = 0;
+
+static int _get_thread_id()
+{
+  if(!_thread_id) _thread_id = __sync_add_and_fetch(&_trace.num_threads, 1);
+  return _thread_id;
+}
+
+static double _get_cpu_time()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  if(!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+  return 0.0;
+}
+
+static void _write_string(FILE *f, const char *s)
+{
+  fputc('"', f);
+  for(; *s; s++)
+  {
+    if(*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if((unsigned char)*s < 0x20)
+      fprintf(f, "\\u%04x", (unsigned char)*s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+// writes one event, timestamps in seconds since dt_trace_init()
+static void _write_event(const char phase, const char *category, const char *name, const double ts,
+                         const double dur, const char *args)
+{
+  const int tid = _get_thread_id();
+  // dt_trace_cleanup() disables tracing before it waits for the writers: a writer either sees that here and
+  // stays away from the lock, or it is waited for.
+  __sync_add_and_fetch(&_trace.writers, 1);
+  if(dt_trace_enabled())
+  {
+    dt_pthread_mutex_lock(&_trace.lock);
+    if(_trace.f)
+    {
+      FILE *f = _trace.f;
+      fprintf(f, "%s{\"name\": ", _trace.first ? "" : ",\n");
+      _write_string(f, name);
+      fprintf(f, ", \"cat\": \"%s\", \"ph\": \"%c\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f", category,
+              phase, (int)getpid(), tid, ts * 1e6);
+      if(phase == 'X') fprintf(f, ", \"dur\": %.3f", dur * 1e6);
+      if(phase == 'i') fprintf(f, ", \"s\": \"t\"");
+      if(args && *args) fprintf(f, ", \"args\": {%s}", args);
+      fprintf(f, "}");
+      _trace.first = 0;
+    }
+    dt_pthread_mutex_unlock(&_trace.lock);
+  }
+  __sync_sub_and_fetch(&_trace.writers, 1);
+}
+
+void dt_trace_init()
+{
+  dt_pthread_mutex_init(&_trace.lock, NULL);
+  if(!dt_trace_enabled()) return;
+
+  gchar *basename = g_strdup_printf("darktable-trace-%d.json", (int)getpid());
+  gchar *filename = g_build_filename(g_get_tmp_dir(), basename, NULL);
+  _trace.f = g_fopen(filename, "wb");
+  if(_trace.f)
+  {
+    fprintf(_trace.f, "[\n");
+    _trace.first = 1;
+    _trace.start = dt_get_wtime();
+    fprintf(stderr, "[trace] writing trace events to `%s'\n", filename);
+  }
+  else
+  {
+    fprintf(stderr, "[trace] can't open `%s' for writing, tracing disabled\n", filename);
+    darktable.unmuted &= ~DT_DEBUG_TRACE;
+  }
+  g_free(filename);
+  g_free(basename);
+}
+
+void dt_trace_cleanup()
+{
+  // disable tracing first, threads still running past this point don't write anymore
+  dt_pthread_mutex_lock(&_trace.lock);
+  __sync_fetch_and_and(&darktable.unmuted, ~DT_DEBUG_TRACE);
+  if(_trace.f)
+  {
+    fprintf(_trace.f, "\n]\n");
+    fclose(_trace.f);
+    _trace.f = NULL;
+  }
+  dt_pthread_mutex_unlock(&_trace.lock);
+
+  // the lock goes last, after the writers which got to it before tracing was disabled are done
+  while(__sync_fetch_and_add(&_trace.writers, 0)) g_usleep(100);
+  dt_pthread_mutex_destroy(&_trace.lock);
+}
+
+void dt_trace_begin(dt_trace_span_t *span)
+{
+  if(!dt_trace_enabled())
+  {
+    span->wall = 0.0;
+    return;
+  }
+  span->wall = dt_get_wtime();
+  span->cpu = _get_cpu_time();
+  span->bytes = _thread_bytes;
+}
+
+void dt_trace_end(const dt_trace_span_t *span, const char *category, const char *args, const char *name, ...)
+{
+  if(span->wall == 0.0 || !dt_trace_enabled()) return;
+
+  const double wall = dt_get_wtime();
+  const double cpu = _get_cpu_time() - span->cpu;
+  const size_t bytes = _thread_bytes - span->bytes;
+
+  char buf[256];
+  va_list ap;
+  va_start(ap, name);
+  vsnprintf(buf, sizeof(buf), name, ap);
+  va_end(ap);
+
+  gchar *all_args = g_strdup_printf("\"cpu_ms\": %.3f, \"bytes_allocated\": %zu%s%s", cpu * 1e3, bytes,
+                                    args && *args ? ", " : "", args ? args : "");
+  _write_event('X', category, buf, span->wall - _trace.start, wall - span->wall, all_args);
+  g_free(all_args);
+}
+
+void dt_trace_instant(const char *category, const char *args, const char *name, ...)
+{
+  if(!dt_trace_enabled()) return;
+
+  char buf[256];
+  va_list ap;
+  va_start(ap, name);
+  vsnprintf(buf, sizeof(buf), name, ap);
+  va_end(ap);
+
+  _write_event('i', category, buf, dt_get_wtime() - _trace.start, 0.0, args);
+}
+
+void dt_trace_alloc(size_t size)
+{
+  if(dt_trace_enabled()) _thread_bytes += size;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
@@ -0,0 +1,72 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2018 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common/darktable.h"
+
+/*
+ * timeline tracing, enabled with `-d trace'.
+ *
+ * spans (pixelpipe modules, tiles, jobs, timers, ...) are written as chrome trace events
+ * (https://github.com/catapult-project/catapult/wiki/Trace-Event-Format) to a json file,
+ * which can be loaded into chrome://tracing or https://ui.perfetto.dev. every span carries
+ * wall time, cpu time of its thread and the bytes allocated with dt_alloc_align() on that
+ * thread while it was open.
+ *
+ * usage:
+ *   dt_trace_span_t span;
+ *   dt_trace_begin(&span);
+ *   ...
+ *   dt_trace_end(&span, "pipe", "\"tile\": 3", "%s", module->op);
+ *
+ * args is either NULL or the inside of a json object, it is copied verbatim.
+ */
+
+typedef struct dt_trace_span_t
+{
+  double wall;  // start time, 0 if tracing was off at dt_trace_begin()
+  double cpu;   // thread cpu time at start
+  size_t bytes; // thread allocation counter at start
+} dt_trace_span_t;
+
+static inline int dt_trace_enabled()
+{
+  return darktable.unmuted & DT_DEBUG_TRACE;
+}
+
+/** open the trace file, called once `-d trace' has been parsed */
+void dt_trace_init();
+/** finish and close the trace file */
+void dt_trace_cleanup();
+
+/** remember start times of a span */
+void dt_trace_begin(dt_trace_span_t *span);
+/** write a complete event for a span started by dt_trace_begin() on the same thread */
+void dt_trace_end(const dt_trace_span_t *span, const char *category, const char *args, const char *name, ...)
+    __attribute__((format(printf, 4, 5)));
+/** write an instant event, e.g. a cache hit */
+void dt_trace_instant(const char *category, const char *args, const char *name, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/** account memory allocated by the calling thread, see dt_alloc_align() */
+void dt_trace_alloc(size_t size);
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
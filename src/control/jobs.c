@@ -21,6 +21,7 @@
 */
 
 #include "control/jobs.h"
+#include "common/trace.h"
 #include "control/control.h"
 
 #define DT_CONTROL_FG_PRIORITY 4
@@ -216,7 +217,10 @@ static int32_t dt_control_run_job_res(dt_control_t *control, int32_t res)
     dt_control_job_set_state(job, DT_JOB_STATE_RUNNING);
 
     /* execute job */
+    dt_trace_span_t span;
+    dt_trace_begin(&span);
     job->result = job->execute(job);
+    dt_trace_end(&span, "job", "\"queue\": \"reserved\"", "%s", job->description);
 
     dt_control_job_set_state(job, DT_JOB_STATE_FINISHED);
     dt_print(DT_DEBUG_CONTROL, "[run_job-] %02d %f ", res, dt_get_wtime());
@@ -301,7 +305,15 @@ static void dt_control_job_execute(_dt_job_t *job)
   dt_control_job_set_state(job, DT_JOB_STATE_RUNNING);
 
   /* execute job */
+  dt_trace_span_t span;
+  dt_trace_begin(&span);
   job->result = job->execute(job);
+  if(dt_trace_enabled())
+  {
+    char args[64];
+    snprintf(args, sizeof(args), "\"queue\": %d, \"priority\": %d", (int)job->queue, (int)job->priority);
+    dt_trace_end(&span, "job", args, "%s", job->description);
+  }
 
   dt_control_job_set_state(job, DT_JOB_STATE_FINISHED);
 
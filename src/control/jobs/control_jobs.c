@@ -32,6 +32,7 @@
 #include "common/mipmap_cache.h"
 #include "common/tags.h"
 #include "control/conf.h"
+#include "control/jobs/image_jobs.h"
 #include "develop/imageop_math.h"
 
 #include "gui/gtk.h"
@@ -1127,6 +1128,7 @@ static int32_t dt_control_local_copy_images_job_run(dt_job_t *job)
   int imgid = -1;
   dt_control_image_enumerator_t *params = (dt_control_image_enumerator_t *)dt_control_job_get_params(job);
   GList *t = params->index;
+  GList *done = NULL;
   guint tagid = 0;
   const guint total = g_list_length(t);
   double fraction = 0;
@@ -1148,16 +1150,8 @@ static int32_t dt_control_local_copy_images_job_run(dt_job_t *job)
   while(t && dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED)
   {
     imgid = GPOINTER_TO_INT(t->data);
-    if(is_copy)
-    {
-      if (dt_image_local_copy_set(imgid) == 0)
-        dt_tag_attach(tagid, imgid);
-    }
-    else
-    {
-      if (dt_image_local_copy_reset(imgid) == 0)
-        dt_tag_detach(tagid, imgid);
-    }
+    if((is_copy ? dt_image_local_copy_set(imgid) : dt_image_local_copy_reset(imgid)) == 0)
+      done = g_list_prepend(done, GINT_TO_POINTER(imgid));
     t = g_list_delete_link(t, t);
 
     fraction += 1.0 / total;
@@ -1165,6 +1159,13 @@ static int32_t dt_control_local_copy_images_job_run(dt_job_t *job)
   }
   params->index = NULL;
 
+  // tag all of them at once, that's a single update of the collection
+  if(is_copy)
+    dt_tag_attach_images(tagid, done, TRUE);
+  else
+    dt_tag_detach_images(tagid, done, TRUE);
+  g_list_free(done);
+
   dt_control_signal_raise(darktable.signals, DT_SIGNAL_FILMROLLS_CHANGED);
   return 0;
 }
@@ -1227,12 +1228,16 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
   g_strlcpy(fdata->style, settings->style, sizeof(fdata->style));
   fdata->style_append = settings->style_append;
   guint num = 0;
+  GList *exported = NULL;
   // Invariant: the tagid for 'darktable|changed' will not change while this function runs. Is this a
   // sensible assumption?
   guint tagid = 0, etagid = 0;
   dt_tag_new("darktable|changed", &tagid);
   dt_tag_new("darktable|exported", &etagid);
 
+  // decode the next raws while the current one goes through the pipe
+  dt_image_prefetch_t *prefetch = dt_image_prefetch_new(2);
+
   while(t && dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED)
   {
     if(!t)
@@ -1243,11 +1248,10 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
       t = g_list_delete_link(t, t);
       num = total - g_list_length(t);
     }
+    dt_image_prefetch_set(prefetch, t);
 
-    // remove 'changed' tag from image
-    dt_tag_detach(tagid, imgid);
-    // make sure the 'exported' tag is set on the image
-    dt_tag_attach(etagid, imgid);
+    // the 'changed' and 'exported' tags are updated for all images at once after the loop
+    exported = g_list_prepend(exported, GINT_TO_POINTER(imgid));
     // check if image still exists:
     char imgfilename[PATH_MAX] = { 0 };
     const dt_image_t *image = dt_image_cache_get(darktable.image_cache, (int32_t)imgid, 'r');
@@ -1275,8 +1279,15 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
     if(fraction > 1.0) fraction = 1.0;
     dt_control_job_set_progress(job, fraction);
   }
+  dt_image_prefetch_free(prefetch);
   params->index = NULL;
 
+  // remove 'changed' tag from the images and make sure the 'exported' tag is set, updating the collection once
+  dt_tag_detach_images(tagid, exported, FALSE);
+  dt_tag_attach_images(etagid, exported, FALSE);
+  if(exported) dt_tag_update_images(exported);
+  g_list_free(exported);
+
   if(mstorage->finalize_store) mstorage->finalize_store(mstorage, sdata);
 
 end:
@@ -17,9 +17,16 @@
 */
 #include "control/jobs/film_jobs.h"
 #include "common/darktable.h"
+#include "common/database.h"
+#include "common/exif.h"
 #include "common/film.h"
 #include <stdlib.h>
 
+// how many files the metadata readers may run ahead of the database writer,
+// and how many imported images are committed to the database at once
+#define DT_FILM_IMPORT_PREFETCH 64
+#define DT_FILM_IMPORT_BATCH 256
+
 typedef struct dt_film_import1_t
 {
   dt_film_t *film;
@@ -77,6 +84,32 @@ dt_job_t *dt_film_import1_create(dt_film_t *film)
   return job;
 }
 
+// metadata is read by a pool of workers, the import itself stays sequential
+typedef struct _import_prefetch_t
+{
+  GThreadPool *pool;
+  dt_pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  gchar **filenames;
+  int *done;
+} _import_prefetch_t;
+
+static void _import_prefetch_one(gpointer data, gpointer user_data)
+{
+  _import_prefetch_t *p = (_import_prefetch_t *)user_data;
+  const int k = GPOINTER_TO_INT(data) - 1;
+
+  dt_exif_prefetch(p->filenames[k]);
+  gchar *xmp = g_strconcat(p->filenames[k], ".xmp", NULL);
+  if(g_file_test(xmp, G_FILE_TEST_EXISTS)) dt_exif_prefetch(xmp);
+  g_free(xmp);
+
+  dt_pthread_mutex_lock(&p->mutex);
+  p->done[k] = 1;
+  pthread_cond_broadcast(&p->cond);
+  dt_pthread_mutex_unlock(&p->mutex);
+}
+
 static GList *_film_recursive_get_files(const gchar *path, gboolean recursive, GList **result)
 {
   gchar *fullname;
@@ -200,11 +233,37 @@ static void dt_film_import1(dt_job_t *job, dt_film_t *film)
   dt_control_job_set_progress_message(job, message);
 
 
+  /* read metadata in parallel, ahead of the import loop */
+  _import_prefetch_t prefetch;
+  dt_pthread_mutex_init(&prefetch.mutex, NULL);
+  pthread_cond_init(&prefetch.cond, NULL);
+  prefetch.filenames = malloc(sizeof(gchar *) * total);
+  prefetch.done = calloc(total, sizeof(int));
+  {
+    int k = 0;
+    for(GList *elt = images; elt; elt = g_list_next(elt)) prefetch.filenames[k++] = (gchar *)elt->data;
+  }
+  prefetch.pool
+      = g_thread_pool_new(_import_prefetch_one, &prefetch, CLAMP(dt_get_num_threads(), 1, 8), FALSE, NULL);
+  int queued = 0;
+
+  const double start = dt_get_wtime();
+  double last_update = start;
+  int imported = 0;
+
+  dt_database_start_transaction(darktable.db);
+
   /* loop thru the images and import to current film roll */
   dt_film_t *cfr = film;
   GList *image = g_list_first(images);
   do
   {
+    while(queued < (int)total && queued < imported + DT_FILM_IMPORT_PREFETCH)
+    {
+      g_thread_pool_push(prefetch.pool, GINT_TO_POINTER(queued + 1), NULL);
+      queued++;
+    }
+
     gchar *cdn = g_path_get_dirname((const gchar *)image->data);
 
     /* check if we need to initialize a new filmroll */
@@ -252,15 +311,53 @@ static void dt_film_import1(dt_job_t *job, dt_film_t *film)
 
     g_free(cdn);
 
+    /* wait for the metadata of this one */
+    dt_pthread_mutex_lock(&prefetch.mutex);
+    while(!prefetch.done[imported]) dt_pthread_cond_wait(&prefetch.cond, &prefetch.mutex);
+    dt_pthread_mutex_unlock(&prefetch.mutex);
+
     /* import image */
     dt_image_import(cfr->id, (const gchar *)image->data, FALSE);
 
+    /* in case it has been skipped, don't keep its metadata around */
+    dt_exif_prefetch_discard((const gchar *)image->data);
+    gchar *xmp = g_strconcat((const gchar *)image->data, ".xmp", NULL);
+    dt_exif_prefetch_discard(xmp);
+    g_free(xmp);
+
+    imported++;
+    /* commit the batch, earlier if somebody else waits for a transaction of its own, e.g. tagging on the gui */
+    if(imported % DT_FILM_IMPORT_BATCH == 0 || dt_database_transaction_waiting(darktable.db))
+    {
+      dt_database_release_transaction(darktable.db);
+      dt_database_start_transaction(darktable.db);
+    }
+
     fraction += 1.0 / total;
     dt_control_job_set_progress(job, fraction);
 
+    const double now = dt_get_wtime();
+    if(now - last_update > 0.5)
+    {
+      g_snprintf(message, sizeof(message) - 1, _("importing %d/%d images (%.1f images/s)"), imported, total,
+                 imported / (now - start));
+      dt_control_job_set_progress_message(job, message);
+      last_update = now;
+    }
 
   } while((image = g_list_next(image)) != NULL);
 
+  dt_database_release_transaction(darktable.db);
+
+  g_thread_pool_free(prefetch.pool, FALSE, TRUE);
+  pthread_cond_destroy(&prefetch.cond);
+  dt_pthread_mutex_destroy(&prefetch.mutex);
+  free(prefetch.filenames);
+  free(prefetch.done);
+
+  dt_print(DT_DEBUG_PERF, "[film_import] imported %d images in %.3f secs (%.1f images/s)\n", imported,
+           dt_get_wtime() - start, imported / MAX(dt_get_wtime() - start, 1e-6));
+
   g_list_free_full(images, g_free);
 
   // only redraw at the end, to not spam the cpu with exposure events
@@ -19,6 +19,8 @@
 #include "control/jobs/image_jobs.h"
 #include "common/darktable.h"
 #include "common/image_cache.h"
+#include "control/conf.h"
+#include "develop/format.h"
 
 typedef struct dt_image_load_t
 {
@@ -55,6 +57,154 @@ dt_job_t *dt_image_load_job_create(int32_t id, dt_mipmap_size_t mip)
   return job;
 }
 
+struct dt_image_prefetch_t
+{
+  dt_pthread_mutex_t lock;
+  int refs;           // the owner and every job still referring to us
+  int lookahead;      // number of images decoded ahead at most
+  size_t budget;      // bytes the decoded but not yet consumed full buffers may take
+  size_t bytes;       // bytes reserved for the images in wanted
+  GHashTable *wanted; // imgid -> estimated size of its full buffer
+};
+
+typedef struct dt_image_prefetch_job_t
+{
+  dt_image_prefetch_t *prefetch;
+  int32_t imgid;
+} dt_image_prefetch_job_t;
+
+static void _prefetch_unref(dt_image_prefetch_t *prefetch)
+{
+  dt_pthread_mutex_lock(&prefetch->lock);
+  const int last = --prefetch->refs == 0;
+  dt_pthread_mutex_unlock(&prefetch->lock);
+  if(!last) return;
+
+  g_hash_table_destroy(prefetch->wanted);
+  dt_pthread_mutex_destroy(&prefetch->lock);
+  free(prefetch);
+}
+
+static int32_t _prefetch_job_run(dt_job_t *job)
+{
+  dt_image_prefetch_job_t *params = dt_control_job_get_params(job);
+  dt_image_prefetch_t *prefetch = params->prefetch;
+
+  // the sequence might have moved on while we were waiting in the queue
+  dt_pthread_mutex_lock(&prefetch->lock);
+  const gboolean wanted = g_hash_table_contains(prefetch->wanted, GINT_TO_POINTER(params->imgid));
+  dt_pthread_mutex_unlock(&prefetch->lock);
+  if(!wanted) return 0;
+
+  dt_mipmap_buffer_t buf;
+  dt_mipmap_cache_get(darktable.mipmap_cache, &buf, params->imgid, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING, 'r');
+  dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
+  return 0;
+}
+
+static void _prefetch_job_cleanup(void *p)
+{
+  dt_image_prefetch_job_t *params = p;
+  _prefetch_unref(params->prefetch);
+  free(params);
+}
+
+// rough size of the full buffer, raws take 2 bytes per pixel, everything else up to 16
+static size_t _prefetch_estimate(const int32_t imgid)
+{
+  const dt_image_t *img = dt_image_cache_get(darktable.image_cache, imgid, 'r');
+  if(!img) return 0;
+  const size_t bpp = MAX(dt_iop_buffer_dsc_to_bpp(&img->buf_dsc), sizeof(uint16_t));
+  const size_t size = (size_t)img->width * img->height * bpp;
+  dt_image_cache_read_release(darktable.image_cache, img);
+  return size;
+}
+
+dt_image_prefetch_t *dt_image_prefetch_new(int lookahead)
+{
+  dt_image_prefetch_t *prefetch = (dt_image_prefetch_t *)calloc(1, sizeof(dt_image_prefetch_t));
+  if(!prefetch) return NULL;
+  dt_pthread_mutex_init(&prefetch->lock, NULL);
+  prefetch->refs = 1;
+  // every full buffer decoded ahead evicts one from the cache, leave half of them to the pipes
+  const int full_buffers = darktable.mipmap_cache->mip_full.cache.cost_quota;
+  prefetch->lookahead = MIN(lookahead, MAX(1, full_buffers / 2));
+  // a quarter of what the pixelpipes are allowed to use
+  prefetch->budget = (size_t)MAX(dt_conf_get_int("host_memory_limit"), 500) << 18;
+  prefetch->wanted = g_hash_table_new(NULL, NULL);
+  return prefetch;
+}
+
+void dt_image_prefetch_set(dt_image_prefetch_t *prefetch, const GList *imgids)
+{
+  if(!prefetch) return;
+
+  dt_pthread_mutex_lock(&prefetch->lock);
+
+  // forget about images that aren't coming up anymore, their queued jobs will do nothing
+  GHashTable *upcoming = g_hash_table_new(NULL, NULL);
+  int n = 0;
+  for(const GList *l = imgids; l && n < prefetch->lookahead; l = g_list_next(l), n++)
+    g_hash_table_add(upcoming, l->data);
+  GHashTableIter it;
+  gpointer key, value;
+  g_hash_table_iter_init(&it, prefetch->wanted);
+  while(g_hash_table_iter_next(&it, &key, &value))
+  {
+    if(g_hash_table_contains(upcoming, key)) continue;
+    prefetch->bytes -= GPOINTER_TO_SIZE(value);
+    g_hash_table_iter_remove(&it);
+  }
+  g_hash_table_destroy(upcoming);
+
+  // queue the next ones in order, as long as they fit into the budget
+  GList *jobs = NULL;
+  n = 0;
+  for(const GList *l = imgids; l && n < prefetch->lookahead; l = g_list_next(l), n++)
+  {
+    if(g_hash_table_contains(prefetch->wanted, l->data)) continue;
+
+    const int32_t imgid = GPOINTER_TO_INT(l->data);
+    const size_t size = _prefetch_estimate(imgid);
+    if(!size || prefetch->bytes + size > prefetch->budget) break;
+
+    dt_job_t *job = dt_control_job_create(&_prefetch_job_run, "prefetch image %d", imgid);
+    if(!job) break;
+    dt_image_prefetch_job_t *params = (dt_image_prefetch_job_t *)calloc(1, sizeof(dt_image_prefetch_job_t));
+    if(!params)
+    {
+      dt_control_job_dispose(job);
+      break;
+    }
+    params->prefetch = prefetch;
+    params->imgid = imgid;
+    prefetch->refs++;
+    dt_control_job_set_params(job, params, _prefetch_job_cleanup);
+
+    g_hash_table_insert(prefetch->wanted, l->data, GSIZE_TO_POINTER(size));
+    prefetch->bytes += size;
+    jobs = g_list_prepend(jobs, job);
+  }
+
+  dt_pthread_mutex_unlock(&prefetch->lock);
+
+  // outside the lock, a full queue disposes jobs right away which drops their reference.
+  // the foreground queue is a stack, so push the farthest image first.
+  for(GList *l = jobs; l; l = g_list_next(l))
+    dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_FG, (dt_job_t *)l->data);
+  g_list_free(jobs);
+}
+
+void dt_image_prefetch_free(dt_image_prefetch_t *prefetch)
+{
+  if(!prefetch) return;
+  dt_pthread_mutex_lock(&prefetch->lock);
+  g_hash_table_remove_all(prefetch->wanted);
+  prefetch->bytes = 0;
+  dt_pthread_mutex_unlock(&prefetch->lock);
+  _prefetch_unref(prefetch);
+}
+
 typedef struct dt_image_import_t
 {
   uint32_t film_id;
@@ -25,6 +25,18 @@
 
 dt_job_t *dt_image_load_job_create(int32_t imgid, dt_mipmap_size_t mip);
 
+/** decodes the full buffers of the images coming up next in a known sequence (export, slideshow) in
+ * background jobs, so reading and decoding the raw overlaps with processing the current one. */
+typedef struct dt_image_prefetch_t dt_image_prefetch_t;
+
+/** start prefetching up to lookahead images ahead of the consumer */
+dt_image_prefetch_t *dt_image_prefetch_new(int lookahead);
+/** announce the images following the current one, in order (list of GINT_TO_POINTER(imgid)).
+ * replaces the previous sequence, images that dropped out of it aren't decoded anymore. */
+void dt_image_prefetch_set(dt_image_prefetch_t *prefetch, const GList *imgids);
+/** cancel everything still pending and drop the prefetcher */
+void dt_image_prefetch_free(dt_image_prefetch_t *prefetch);
+
 dt_job_t *dt_image_import_job_create(uint32_t filmid, const char *filename);
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
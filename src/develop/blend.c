@@ -19,11 +19,17 @@
 #include "blend.h"
 #include "common/gaussian.h"
 #include "common/math.h"
+#include "common/threadpool.h"
 #include "control/control.h"
 #include "develop/imageop.h"
 #include "develop/masks.h"
 #include "develop/tiling.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#endif
+
 #define CLAMP_RANGE(x, y, z) (CLAMP(x, y, z))
 
 typedef struct _blend_buffer_desc_t
@@ -2706,10 +2712,334 @@ static void display_channel(const _blend_buffer_desc_t *bd, const float *a, floa
 }
 
 
+#if defined(__SSE2__)
+/* sse versions of the conditional blend mask and of the most used blend modes. the functions taking the
+ * colorspace as their first argument are always inlined and only ever called with a constant for it, so each
+ * colorspace gets its own copy without any per pixel branching on it. the results are the same as the ones of
+ * the plain versions above. */
+
+static inline __m128 _blend_select_sse(const __m128 m, const __m128 x, const __m128 y)
+{
+  return _mm_or_ps(_mm_and_ps(m, x), _mm_andnot_ps(m, y));
+}
+
+static inline __m128 _blend_clamp_sse(const __m128 x, const __m128 min, const __m128 max)
+{
+  return _mm_min_ps(_mm_max_ps(x, min), max);
+}
+
+/* ta * (1 - o) + tb * o */
+static inline __m128 _blend_mix_sse(const __m128 ta, const __m128 tb, const __m128 o)
+{
+  return _mm_add_ps(_mm_mul_ps(ta, _mm_sub_ps(_mm_set1_ps(1.0f), o)), _mm_mul_ps(tb, o));
+}
+
+/* _blendif_factor() of four pixels, scaled holds one vector per blendif channel. only the channels below 8 are
+ * available, so this can't be used with LCh or HSL channels active. */
+static inline __m128 _blendif_factor_sse(const __m128 *scaled, const unsigned int channel_mask,
+                                         const unsigned int blendif, const float *parameters,
+                                         const unsigned int mask_combine)
+{
+  const int incl = mask_combine & DEVELOP_COMBINE_INCL;
+  const __m128 one = _mm_set1_ps(1.0f);
+  __m128 result = one;
+  // lanes in which the plain loop would have stopped early. they keep their value from then on.
+  __m128 done = _mm_setzero_ps();
+
+  for(int ch = 0; ch <= DEVELOP_BLENDIF_MAX; ch++)
+  {
+    if((channel_mask & (1 << ch)) == 0) continue;
+
+    if((blendif & (1 << ch)) == 0)
+    {
+      if(!(blendif & (1 << (ch + 16))) != !incl) result = _mm_and_ps(done, result);
+      continue;
+    }
+
+    done = _mm_or_ps(done, _mm_cmple_ps(result, _mm_set1_ps(0.000001f)));
+
+    const float *const p = parameters + 4 * ch;
+    const __m128 s = scaled[ch];
+    const __m128 p0 = _mm_set1_ps(p[0]);
+    const __m128 p1 = _mm_set1_ps(p[1]);
+    const __m128 p2 = _mm_set1_ps(p[2]);
+    const __m128 p3 = _mm_set1_ps(p[3]);
+    const __m128 rise = _mm_div_ps(_mm_sub_ps(s, p0), _mm_set1_ps(fmaxf(0.01f, p[1] - p[0])));
+    const __m128 fall = _mm_sub_ps(one, _mm_div_ps(_mm_sub_ps(s, p2), _mm_set1_ps(fmaxf(0.01f, p[3] - p[2]))));
+
+    __m128 factor = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(s, p2), _mm_cmplt_ps(s, p3)), fall);
+    factor = _blend_select_sse(_mm_and_ps(_mm_cmpgt_ps(s, p0), _mm_cmplt_ps(s, p1)), rise, factor);
+    factor = _blend_select_sse(_mm_and_ps(_mm_cmpge_ps(s, p1), _mm_cmple_ps(s, p2)), one, factor);
+
+    if(blendif & (1 << (ch + 16))) factor = _mm_sub_ps(one, factor); // inverted channel?
+    if(incl) factor = _mm_sub_ps(one, factor);
+
+    result = _blend_select_sse(done, result, _mm_mul_ps(result, factor));
+  }
+
+  return incl ? _mm_sub_ps(one, result) : result;
+}
+
+/* _blend_make_mask() for four channel Lab or rgb buffers, four pixels at a time */
+static inline __attribute__((always_inline)) void
+_blend_make_mask_cst_sse(const dt_iop_colorspace_type_t cst, const _blend_buffer_desc_t *bd,
+                         const unsigned int blendif, const float *blendif_parameters, const unsigned int mask_mode,
+                         const unsigned int mask_combine, const float gopacity, const float *a, const float *b,
+                         float *mask)
+{
+  const unsigned int channel_mask = cst == iop_cs_Lab ? DEVELOP_BLENDIF_Lab_MASK : DEVELOP_BLENDIF_RGB_MASK;
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const size_t width = bd->stride / 4;
+
+  size_t i = 0;
+  for(; i + 4 <= width; i += 4)
+  {
+    // input channels go to 0..3 and output channels to 4..7, in both colorspaces
+    __m128 scaled[DEVELOP_BLENDIF_SIZE];
+    for(int k = 0; k < 2; k++)
+    {
+      const float *const px = (k ? b : a) + 4 * i;
+      __m128 c0 = _mm_loadu_ps(px);
+      __m128 c1 = _mm_loadu_ps(px + 4);
+      __m128 c2 = _mm_loadu_ps(px + 8);
+      __m128 c3 = _mm_loadu_ps(px + 12);
+      _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+      __m128 *const s = scaled + 4 * k;
+      if(cst == iop_cs_Lab)
+      {
+        const __m128 offset = _mm_set1_ps(128.0f);
+        const __m128 range = _mm_set1_ps(256.0f);
+        s[0] = _blend_clamp_sse(_mm_div_ps(c0, _mm_set1_ps(100.0f)), zero, one);
+        s[1] = _blend_clamp_sse(_mm_div_ps(_mm_add_ps(c1, offset), range), zero, one);
+        s[2] = _blend_clamp_sse(_mm_div_ps(_mm_add_ps(c2, offset), range), zero, one);
+      }
+      else
+      {
+        const __m128 gray = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.3f), c0),
+                                                  _mm_mul_ps(_mm_set1_ps(0.59f), c1)),
+                                       _mm_mul_ps(_mm_set1_ps(0.11f), c2));
+        s[0] = _blend_clamp_sse(gray, zero, one);
+        s[1] = _blend_clamp_sse(c0, zero, one);
+        s[2] = _blend_clamp_sse(c1, zero, one);
+        s[3] = _blend_clamp_sse(c2, zero, one);
+      }
+    }
+
+    const __m128 conditional
+        = _blendif_factor_sse(scaled, channel_mask, blendif, blendif_parameters, mask_combine);
+    const __m128 form = _mm_loadu_ps(mask + i);
+    __m128 opacity = (mask_combine & DEVELOP_COMBINE_INCL)
+                         ? _mm_sub_ps(one, _mm_mul_ps(_mm_sub_ps(one, form), _mm_sub_ps(one, conditional)))
+                         : _mm_mul_ps(form, conditional);
+    if(mask_combine & DEVELOP_COMBINE_INV) opacity = _mm_sub_ps(one, opacity);
+    _mm_storeu_ps(mask + i, _mm_mul_ps(opacity, _mm_set1_ps(gopacity)));
+  }
+
+  // the pixels left over at the end of the row
+  const _blend_buffer_desc_t tail = { .cst = bd->cst, .stride = bd->stride - 4 * i, .ch = 4, .bch = bd->bch };
+  _blend_make_mask(&tail, blendif, blendif_parameters, mask_mode, mask_combine, gopacity, a + 4 * i, b + 4 * i,
+                   mask + i);
+}
+
+static void _blend_make_mask_Lab_sse(const _blend_buffer_desc_t *bd, const unsigned int blendif,
+                                     const float *blendif_parameters, const unsigned int mask_mode,
+                                     const unsigned int mask_combine, const float gopacity, const float *a,
+                                     const float *b, float *mask)
+{
+  _blend_make_mask_cst_sse(iop_cs_Lab, bd, blendif, blendif_parameters, mask_mode, mask_combine, gopacity, a, b,
+                           mask);
+}
+
+static void _blend_make_mask_rgb_sse(const _blend_buffer_desc_t *bd, const unsigned int blendif,
+                                     const float *blendif_parameters, const unsigned int mask_mode,
+                                     const unsigned int mask_combine, const float gopacity, const float *a,
+                                     const float *b, float *mask)
+{
+  _blend_make_mask_cst_sse(iop_cs_rgb, bd, blendif, blendif_parameters, mask_mode, mask_combine, gopacity, a, b,
+                           mask);
+}
+
+/* the pixel operations of the blend modes get one pixel of each buffer, scaled to the ranges of
+ * _blend_colorspace_channel_range() for Lab. they return the blended pixel, the caller takes care of the
+ * lightness-only flag, rescaling and alpha. */
+
+static inline __m128 _blend_min_sse(const dt_iop_colorspace_type_t cst)
+{
+  return cst == iop_cs_Lab ? _mm_set_ps(0.0f, -1.0f, -1.0f, 0.0f) : _mm_setzero_ps();
+}
+
+static inline __m128 _blend_normal_bounded_px_sse(const dt_iop_colorspace_type_t cst, const __m128 ta,
+                                                  const __m128 tb, const __m128 o)
+{
+  return _blend_clamp_sse(_blend_mix_sse(ta, tb, o), _blend_min_sse(cst), _mm_set1_ps(1.0f));
+}
+
+static inline __m128 _blend_normal_unbounded_px_sse(const dt_iop_colorspace_type_t cst, const __m128 ta,
+                                                    const __m128 tb, const __m128 o)
+{
+  return _blend_mix_sse(ta, tb, o);
+}
+
+static inline __m128 _blend_average_px_sse(const dt_iop_colorspace_type_t cst, const __m128 ta, const __m128 tb,
+                                           const __m128 o)
+{
+  const __m128 avg = _mm_div_ps(_mm_add_ps(ta, tb), _mm_set1_ps(2.0f));
+  return _blend_clamp_sse(_blend_mix_sse(ta, avg, o), _blend_min_sse(cst), _mm_set1_ps(1.0f));
+}
+
+static inline __m128 _blend_add_px_sse(const dt_iop_colorspace_type_t cst, const __m128 ta, const __m128 tb,
+                                       const __m128 o)
+{
+  return _blend_clamp_sse(_blend_mix_sse(ta, _mm_add_ps(ta, tb), o), _blend_min_sse(cst), _mm_set1_ps(1.0f));
+}
+
+/* lighten and darken: in Lab the chroma follows the change of lightness */
+static inline __m128 _blend_lighten_darken_px_sse(const dt_iop_colorspace_type_t cst, const __m128 ta,
+                                                  const __m128 tb, const __m128 o, const __m128 mixed)
+{
+  const __m128 min = _blend_min_sse(cst);
+  const __m128 max = _mm_set1_ps(1.0f);
+  const __m128 l = _blend_clamp_sse(_blend_mix_sse(ta, mixed, o), min, max);
+  if(cst != iop_cs_Lab) return l;
+
+  __m128 d = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(tb, l));
+  d = _mm_shuffle_ps(d, d, _MM_SHUFFLE(0, 0, 0, 0));
+  const __m128 c = _blend_clamp_sse(_blend_mix_sse(ta, _mm_mul_ps(_mm_set1_ps(0.5f), _mm_add_ps(ta, tb)), d), min,
+                                    max);
+  return _blend_select_sse(_mm_castsi128_ps(_mm_set_epi32(0, 0, 0, -1)), l, c);
+}
+
+static inline __m128 _blend_lighten_px_sse(const dt_iop_colorspace_type_t cst, const __m128 ta, const __m128 tb,
+                                           const __m128 o)
+{
+  return _blend_lighten_darken_px_sse(cst, ta, tb, o, _mm_max_ps(ta, tb));
+}
+
+static inline __m128 _blend_darken_px_sse(const dt_iop_colorspace_type_t cst, const __m128 ta, const __m128 tb,
+                                          const __m128 o)
+{
+  return _blend_lighten_darken_px_sse(cst, ta, tb, o, _mm_min_ps(ta, tb));
+}
+
+static inline __m128 _blend_multiply_px_sse(const dt_iop_colorspace_type_t cst, const __m128 ta, const __m128 tb,
+                                            const __m128 o)
+{
+  const __m128 min = _blend_min_sse(cst);
+  const __m128 max = _mm_set1_ps(1.0f);
+  if(cst != iop_cs_Lab) return _blend_clamp_sse(_blend_mix_sse(ta, _mm_mul_ps(ta, tb), o), min, max);
+
+  // lightness is multiplied, chroma scaled by the change of lightness
+  const __m128 la = _blend_clamp_sse(ta, _mm_setzero_ps(), max);
+  const __m128 lb = _blend_clamp_sse(tb, _mm_setzero_ps(), max);
+  const __m128 l = _blend_clamp_sse(_blend_mix_sse(la, _mm_mul_ps(la, lb), o), min, max);
+  const __m128 l0 = _mm_shuffle_ps(l, l, _MM_SHUFFLE(0, 0, 0, 0));
+  const __m128 ta0 = _mm_shuffle_ps(ta, ta, _MM_SHUFFLE(0, 0, 0, 0));
+  const __m128 lower = _mm_set1_ps(0.01f);
+  const __m128 div = _blend_select_sse(_mm_cmpgt_ps(ta0, lower), ta0, lower);
+  const __m128 c = _blend_clamp_sse(_blend_mix_sse(ta, _mm_div_ps(_mm_mul_ps(_mm_add_ps(ta, tb), l0), div), o),
+                                    min, max);
+  return _blend_select_sse(_mm_castsi128_ps(_mm_set_epi32(0, 0, 0, -1)), l, c);
+}
+
+typedef __m128(_blend_pixel_func_sse)(const dt_iop_colorspace_type_t cst, const __m128 ta, const __m128 tb,
+                                      const __m128 o);
+
+/* one row of four channel Lab or rgb pixels. op is a constant as well, and gets inlined. */
+static inline __attribute__((always_inline)) void _blend_row_cst_sse(const dt_iop_colorspace_type_t cst,
+                                                                     _blend_pixel_func_sse *const op,
+                                                                     const _blend_buffer_desc_t *bd,
+                                                                     const float *a, float *b, const float *mask,
+                                                                     int flag)
+{
+  const __m128 scale = _mm_set_ps(1.0f, 128.0f, 128.0f, 100.0f);
+  const __m128 chroma = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, 0));
+  const __m128 alpha = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+
+  for(size_t i = 0, j = 0; j < bd->stride; i++, j += 4)
+  {
+    const __m128 o = _mm_set1_ps(mask[i]);
+    __m128 ta = _mm_loadu_ps(a + j);
+    __m128 tb = _mm_loadu_ps(b + j);
+    if(cst == iop_cs_Lab)
+    {
+      ta = _mm_div_ps(ta, scale);
+      tb = _mm_div_ps(tb, scale);
+    }
+
+    __m128 res = op(cst, ta, tb, o);
+
+    if(cst == iop_cs_Lab)
+    {
+      if(flag) res = _blend_select_sse(chroma, ta, res);
+      res = _mm_mul_ps(res, scale);
+    }
+    _mm_storeu_ps(b + j, _blend_select_sse(alpha, o, res));
+  }
+}
+
+/* row function of a blend mode which falls back to the plain one for raw and other odd buffers */
+#define DT_BLEND_ROW_SSE(mode)                                                                                \
+  static void _blend_##mode##_sse(const _blend_buffer_desc_t *bd, const float *a, float *b, const float *mask, \
+                                  int flag)                                                                   \
+  {                                                                                                           \
+    if(bd->cst == iop_cs_Lab && bd->ch == 4)                                                                  \
+      _blend_row_cst_sse(iop_cs_Lab, _blend_##mode##_px_sse, bd, a, b, mask, flag);                           \
+    else if(bd->cst == iop_cs_rgb && bd->ch == 4)                                                             \
+      _blend_row_cst_sse(iop_cs_rgb, _blend_##mode##_px_sse, bd, a, b, mask, flag);                           \
+    else                                                                                                      \
+      _blend_##mode(bd, a, b, mask, flag);                                                                    \
+  }
+
+DT_BLEND_ROW_SSE(normal_bounded)
+DT_BLEND_ROW_SSE(normal_unbounded)
+DT_BLEND_ROW_SSE(lighten)
+DT_BLEND_ROW_SSE(darken)
+DT_BLEND_ROW_SSE(multiply)
+DT_BLEND_ROW_SSE(average)
+DT_BLEND_ROW_SSE(add)
+
+#undef DT_BLEND_ROW_SSE
+
+static _blend_row_func *_blend_choose_blend_func_sse(const unsigned int blend_mode)
+{
+  switch(blend_mode)
+  {
+    case DEVELOP_BLEND_LIGHTEN:
+      return _blend_lighten_sse;
+    case DEVELOP_BLEND_DARKEN:
+      return _blend_darken_sse;
+    case DEVELOP_BLEND_MULTIPLY:
+      return _blend_multiply_sse;
+    case DEVELOP_BLEND_AVERAGE:
+      return _blend_average_sse;
+    case DEVELOP_BLEND_ADD:
+      return _blend_add_sse;
+    case DEVELOP_BLEND_NORMAL:
+    case DEVELOP_BLEND_BOUNDED:
+      return _blend_normal_bounded_sse;
+    case DEVELOP_BLEND_NORMAL2:
+    case DEVELOP_BLEND_UNBOUNDED:
+      return _blend_normal_unbounded_sse;
+    default:
+      return NULL;
+  }
+}
+#endif
+
 _blend_row_func *dt_develop_choose_blend_func(const unsigned int blend_mode)
 {
   _blend_row_func *blend = NULL;
 
+#if defined(__SSE2__)
+  if(darktable.codepath.SSE2 && !darktable.codepath.OPENMP_SIMD)
+  {
+    blend = _blend_choose_blend_func_sse(blend_mode);
+    if(blend) return blend;
+  }
+#endif
+
   /* select the blend operator */
   switch(blend_mode)
   {
@@ -2820,6 +3150,77 @@ _blend_row_func *dt_develop_choose_blend_func(const unsigned int blend_mode)
   return blend;
 }
 
+typedef void(_blend_mask_func)(const _blend_buffer_desc_t *bd, const unsigned int blendif,
+                               const float *blendif_parameters, const unsigned int mask_mode,
+                               const unsigned int mask_combine, const float gopacity, const float *a,
+                               const float *b, float *mask);
+
+static _blend_mask_func *_blend_choose_mask_func(const dt_iop_colorspace_type_t cst, const int ch,
+                                                 const unsigned int blendif, const unsigned int mask_mode)
+{
+#if defined(__SSE2__)
+  // LCh and HSL channels stay with the plain version
+  if(darktable.codepath.SSE2 && !darktable.codepath.OPENMP_SIMD && ch == 4
+     && (mask_mode & DEVELOP_MASK_CONDITIONAL) && !(blendif & 0x7f00))
+  {
+    if(cst == iop_cs_Lab) return _blend_make_mask_Lab_sse;
+    if(cst == iop_cs_rgb) return _blend_make_mask_rgb_sse;
+  }
+#endif
+  return _blend_make_mask;
+}
+
+typedef struct _blend_rows_t
+{
+  const dt_develop_blend_params_t *d;
+  const void *ivoid;
+  void *ovoid;
+  float *mask;
+  int width, iwidth, xoffs, yoffs, ch, bch;
+  dt_iop_colorspace_type_t cst;
+  float opacity;
+  int fill_mask;               // start the mask rows with fill, else they hold the drawn mask already
+  float fill;
+  _blend_mask_func *make_mask; // combine with the parametric mask, NULL if the mask is final
+  _blend_row_func *blend;      // NULL to only compute the mask
+  int blendflag;
+  dt_dev_pixelpipe_display_mask_t mask_display;
+  dt_dev_pixelpipe_display_mask_t request_mask_display;
+} _blend_rows_t;
+
+/* mask and blend each row while it is in the cache, unless the whole mask has to be known first */
+static void _blend_rows(void *data, size_t begin, size_t end, int thread)
+{
+  const _blend_rows_t *const r = (const _blend_rows_t *)data;
+  const dt_develop_blend_params_t *const d = r->d;
+  const int ch = r->ch;
+  _blend_buffer_desc_t bd = { .cst = r->cst, .stride = (size_t)r->width * ch, .ch = ch, .bch = r->bch };
+  for(size_t y = begin; y < end; y++)
+  {
+    size_t iindex = ((size_t)(y + r->yoffs) * r->iwidth + r->xoffs) * ch;
+    size_t oindex = (size_t)y * r->width * ch;
+    float *in = (float *)r->ivoid + iindex;
+    float *out = (float *)r->ovoid + oindex;
+    float *m = r->mask + y * r->width;
+
+    if(r->fill_mask)
+      for(int x = 0; x < r->width; x++) m[x] = r->fill;
+
+    if(r->make_mask)
+      r->make_mask(&bd, d->blendif, d->blendif_parameters, d->mask_mode, d->mask_combine, r->opacity, in, out, m);
+
+    if(!r->blend) continue;
+
+    if(r->request_mask_display & DT_DEV_PIXELPIPE_DISPLAY_ANY)
+      display_channel(&bd, in, out, m, r->request_mask_display);
+    else
+      r->blend(&bd, in, out, m, r->blendflag);
+
+    if((r->mask_display & DT_DEV_PIXELPIPE_DISPLAY_MASK) && r->cst != iop_cs_RAW)
+      for(size_t j = 0; j < bd.stride; j += 4) out[j + 3] = in[j + 3];
+  }
+}
+
 void dt_develop_blend_process(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece,
                               const void *const ivoid, void *const ovoid, const struct dt_iop_roi_t *const roi_in,
                               const struct dt_iop_roi_t *const roi_out)
@@ -2893,17 +3294,19 @@ void dt_develop_blend_process(struct dt_iop_module_t *self, struct dt_dev_pixelp
 
   float *const mask = _mask;
 
-  if(mask_mode == DEVELOP_MASK_ENABLED)
-  {
-    /* blend uniformly (no drawn or parametric mask) */
+  _blend_rows_t rows = { .d = d, .ivoid = ivoid, .ovoid = ovoid, .mask = mask, .width = roi_out->width,
+                         .iwidth = iwidth, .xoffs = xoffs, .yoffs = yoffs, .ch = ch, .bch = bch, .cst = cst,
+                         .opacity = opacity, .fill_mask = 1, .fill = opacity, .make_mask = NULL, .blend = blend,
+                         .blendflag = blendflag, .mask_display = mask_display,
+                         .request_mask_display = request_mask_display };
 
-    const size_t buffsize = (size_t)roi_out->width * roi_out->height;
-#ifdef _OPENMP
-#pragma omp parallel for default(none)
-#endif
-    for(size_t i = 0; i < buffsize; i++) mask[i] = opacity;
-  }
-  else
+  /* check if mask should be suppressed temporarily (i.e. just set to global
+   * opacity value) */
+  const int suppress_mask = self->suppress_mask && self->dev->gui_attached && (self == self->dev->gui_module)
+                            && (piece->pipe == self->dev->pipe) && (mask_mode & DEVELOP_MASK_BOTH);
+
+  /* without a drawn or parametric mask, or with the mask suppressed, all rows get the global opacity */
+  if(mask_mode != DEVELOP_MASK_ENABLED && !suppress_mask)
   {
     /* we blend with a drawn and/or parametric mask */
 
@@ -2913,6 +3316,7 @@ void dt_develop_blend_process(struct dt_iop_module_t *self, struct dt_dev_pixelp
     if(form && (!(self->flags() & IOP_FLAGS_NO_MASKS)) && (d->mask_mode & DEVELOP_MASK_MASK))
     {
       dt_masks_group_render_roi(self, piece, form, roi_out, mask);
+      rows.fill_mask = 0;
 
       if(d->mask_combine & DEVELOP_COMBINE_MASKS_POS)
       {
@@ -2928,102 +3332,49 @@ void dt_develop_blend_process(struct dt_iop_module_t *self, struct dt_dev_pixelp
     {
       // no form defined but drawn mask active
       // we fill the buffer with 1.0f or 0.0f depending on mask_combine
-      const float fill = (d->mask_combine & DEVELOP_COMBINE_MASKS_POS) ? 0.0f : 1.0f;
-      const size_t buffsize = (size_t)roi_out->width * roi_out->height;
-#ifdef _OPENMP
-#pragma omp parallel for default(none)
-#endif
-      for(size_t i = 0; i < buffsize; i++) mask[i] = fill;
+      rows.fill = (d->mask_combine & DEVELOP_COMBINE_MASKS_POS) ? 0.0f : 1.0f;
     }
     else
     {
       // we fill the buffer with 1.0f or 0.0f depending on mask_combine
-      const float fill = (d->mask_combine & DEVELOP_COMBINE_INCL) ? 0.0f : 1.0f;
-      const size_t buffsize = (size_t)roi_out->width * roi_out->height;
-#ifdef _OPENMP
-#pragma omp parallel for default(none)
-#endif
-      for(size_t i = 0; i < buffsize; i++) mask[i] = fill;
+      rows.fill = (d->mask_combine & DEVELOP_COMBINE_INCL) ? 0.0f : 1.0f;
     }
 
-#ifdef _OPENMP
-#pragma omp parallel for default(none)
-#endif
-    for(size_t y = 0; y < roi_out->height; y++)
-    {
-
-      size_t iindex = ((size_t)(y + yoffs) * iwidth + xoffs) * ch;
-      size_t oindex = (size_t)y * roi_out->width * ch;
-      _blend_buffer_desc_t bd = { .cst = cst, .stride = (size_t)roi_out->width * ch, .ch = ch, .bch = bch };
-      float *in = (float *)ivoid + iindex;
-      float *out = (float *)ovoid + oindex;
-      float *m = (float *)mask + y * roi_out->width;
-      _blend_make_mask(&bd, d->blendif, d->blendif_parameters, d->mask_mode, d->mask_combine, opacity, in,
-                       out, m);
-    }
+    rows.make_mask = _blend_choose_mask_func(cst, ch, d->blendif, d->mask_mode);
 
     const int maskblur = fabsf(d->radius) <= 0.1f ? 0 : 1;
     const int gaussian = d->radius > 0.0f ? 1 : 0;
     const float radius = fabsf(d->radius);
 
-    if(maskblur)
+    if(maskblur && gaussian)
     {
-      if(gaussian)
-      {
-        const float sigma = radius * roi_out->scale / piece->iscale;
+      /* the blur needs the complete mask before any row can be blended */
+      rows.blend = NULL;
+      dt_threadpool_for(roi_out->height, 4, _blend_rows, &rows);
+      rows.fill_mask = 0;
+      rows.make_mask = NULL;
+      rows.blend = blend;
 
-        const float mmax[] = { 1.0f };
-        const float mmin[] = { 0.0f };
+      const float sigma = radius * roi_out->scale / piece->iscale;
 
-        dt_gaussian_t *g = dt_gaussian_init(roi_out->width, roi_out->height, 1, mmax, mmin, sigma, 0);
-        if(g)
-        {
-          dt_gaussian_blur(g, mask, mask);
-          dt_gaussian_free(g);
-        }
-      }
-      else
+      const float mmax[] = { 1.0f };
+      const float mmin[] = { 0.0f };
+
+      dt_gaussian_t *g = dt_gaussian_init(roi_out->width, roi_out->height, 1, mmax, mmin, sigma, 0);
+      if(g)
       {
-        // potential further blend algorithm (bilateral grid?)
+        dt_gaussian_blur(g, mask, mask);
+        dt_gaussian_free(g);
       }
     }
-
-    /* check if mask should be suppressed temporarily (i.e. just set to global
-     * opacity value) */
-    if(self->suppress_mask && self->dev->gui_attached && (self == self->dev->gui_module)
-       && (piece->pipe == self->dev->pipe) && (mask_mode & DEVELOP_MASK_BOTH))
+    else if(maskblur)
     {
-#ifdef _OPENMP
-#pragma omp parallel for default(none)
-#endif
-      for(size_t k = 0; k < (size_t)roi_out->height * roi_out->width; k++)
-      {
-        mask[k] = opacity;
-      }
+      // potential further blend algorithm (bilateral grid?)
     }
   }
 
-/* now apply blending with per-pixel opacity value as defined in mask */
-#ifdef _OPENMP
-#pragma omp parallel for default(none)
-#endif
-  for(size_t y = 0; y < roi_out->height; y++)
-  {
-    size_t iindex = ((size_t)(y + yoffs) * iwidth + xoffs) * ch;
-    size_t oindex = (size_t)y * roi_out->width * ch;
-    _blend_buffer_desc_t bd = { .cst = cst, .stride = (size_t)roi_out->width * ch, .ch = ch, .bch = bch };
-    float *in = (float *)ivoid + iindex;
-    float *out = (float *)ovoid + oindex;
-    float *m = (float *)mask + y * roi_out->width;
-
-    if(request_mask_display & DT_DEV_PIXELPIPE_DISPLAY_ANY)
-      display_channel(&bd, in, out, m, request_mask_display);
-    else
-      blend(&bd, in, out, m, blendflag);
-
-    if((mask_display & DT_DEV_PIXELPIPE_DISPLAY_MASK) && cst != iop_cs_RAW)
-      for(size_t j = 0; j < bd.stride; j += 4) out[j + 3] = in[j + 3];
-  }
+  /* now apply blending with per-pixel opacity value as defined in mask */
+  dt_threadpool_for(roi_out->height, 4, _blend_rows, &rows);
 
   /* register if _this_ module should expose mask or display channel */
   if(request_mask_display & (DT_DEV_PIXELPIPE_DISPLAY_MASK | DT_DEV_PIXELPIPE_DISPLAY_CHANNEL))
@@ -526,27 +526,27 @@ int dt_dev_write_history_item(const dt_image_t *image, dt_dev_history_item_t *h,
 {
   if(!image) return 1;
   sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "SELECT num FROM main.history WHERE imgid = ?1 AND num = ?2", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                  "SELECT num FROM main.history WHERE imgid = ?1 AND num = ?2", &stmt);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, image->id);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, num);
   if(sqlite3_step(stmt) != SQLITE_ROW)
   {
-    sqlite3_finalize(stmt);
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "INSERT INTO main.history (imgid, num) VALUES (?1, ?2)", -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_RELEASE(stmt);
+    DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                    "INSERT INTO main.history (imgid, num) VALUES (?1, ?2)", &stmt);
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, image->id);
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, num);
     sqlite3_step(stmt);
   }
   // printf("[dev write history item] writing %d - %s params %f %f\n", h->module->instance, h->module->op,
   // *(float *)h->params, *(((float *)h->params)+1));
-  sqlite3_finalize(stmt);
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "UPDATE main.history SET operation = ?1, op_params = ?2, module = ?3, enabled = ?4, "
-                              "blendop_params = ?7, blendop_version = ?8, multi_priority = ?9, multi_name = "
-                              "?10 WHERE imgid = ?5 AND num = ?6",
-                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_RELEASE(stmt);
+  DT_DEBUG_SQLITE3_PREPARE_CACHED(dt_database_get(darktable.db),
+                                  "UPDATE main.history SET operation = ?1, op_params = ?2, module = ?3, "
+                                  "enabled = ?4, blendop_params = ?7, blendop_version = ?8, multi_priority = ?9, "
+                                  "multi_name = ?10 WHERE imgid = ?5 AND num = ?6",
+                                  &stmt);
   DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, h->module->op, -1, SQLITE_TRANSIENT);
   DT_DEBUG_SQLITE3_BIND_BLOB(stmt, 2, h->params, h->module->params_size, SQLITE_TRANSIENT);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 3, h->module->version());
@@ -559,7 +559,7 @@ int dt_dev_write_history_item(const dt_image_t *image, dt_dev_history_item_t *h,
   DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 10, h->multi_name, -1, SQLITE_TRANSIENT);
 
   sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  DT_DEBUG_SQLITE3_RELEASE(stmt);
   return 0;
 }
 
@@ -1017,11 +1017,12 @@ void dt_dev_read_history(dt_develop_t *dev)
   // maybe prepend auto-presets to history before loading it:
   auto_apply_presets(dev);
 
+  // background jobs (thumbnails, export) read through their own connection
   sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT imgid, num, module, operation, "
-                                                             "op_params, enabled, blendop_params, "
-                                                             "blendop_version, multi_priority, multi_name "
-                                                             "FROM main.history WHERE imgid = ?1 ORDER BY num",
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get_reader(darktable.db),
+                              "SELECT imgid, num, module, operation, op_params, enabled, blendop_params, "
+                              "blendop_version, multi_priority, multi_name "
+                              "FROM main.history WHERE imgid = ?1 ORDER BY num",
                               -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dev->image_storage.id);
   dev->history_end = 0;
@@ -1188,8 +1189,8 @@ void dt_dev_read_history(dt_develop_t *dev)
   }
   sqlite3_finalize(stmt);
 
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT history_end FROM main.images WHERE id = ?1",
-                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get_reader(darktable.db),
+                              "SELECT history_end FROM main.images WHERE id = ?1", -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dev->image_storage.id);
   if(sqlite3_step(stmt) == SQLITE_ROW) // seriously, this should never fail
   {
@@ -21,6 +21,7 @@
 #include "develop/pixelpipe_hb.h"
 #include "libs/lib.h"
 #include <stdlib.h>
+#include <zlib.h>
 
 
 // TODO: make cache global (needs to be thread safe then)
@@ -32,6 +33,356 @@
 //   ping, pong, and priority buffer (focused plugin)
 // - drop read by the time another is requested (with priority, drop that, or alternating ping and pong?)
 
+// evicted cache lines are compressed in independent chunks, so they can be restored in parallel
+#define PACKED_CHUNK_SIZE (1 << 20)
+
+typedef struct dt_dev_pixelpipe_cache_packed_t
+{
+  uint64_t hash;
+  dt_iop_buffer_dsc_t dsc;
+  size_t bytes; // uncompressed
+  size_t size;  // memory used for all of this
+  int chunks;
+  size_t *offset; // chunks + 1 offsets into data
+  uint8_t *data;
+} dt_dev_pixelpipe_cache_packed_t;
+
+typedef struct dt_dev_pixelpipe_cache_store_t
+{
+  dt_pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int running;
+  // compressed lines, most recently used first, and the memory they use
+  GList *packed;
+  size_t packed_size, max_size;
+  // evicted line the thread is compressing, and the buffer it gave back after the previous one
+  void *pending;
+  size_t pending_size, pending_bytes;
+  uint64_t pending_hash;
+  dt_iop_buffer_dsc_t pending_dsc;
+  void *spare;
+  size_t spare_size;
+  // bumped on flush, so results of lines evicted before don't make it into the store
+  uint32_t generation;
+  // profiling:
+  uint64_t stored, restored, dropped;
+  size_t stored_in, stored_out;
+} dt_dev_pixelpipe_cache_store_t;
+
+// split 4 byte elements into byte planes, which deflate a lot better for float pixels
+static void _cache_shuffle(const uint8_t *in, uint8_t *out, const size_t n)
+{
+  const size_t elems = n / 4;
+  for(size_t i = 0; i < elems; i++)
+    for(int b = 0; b < 4; b++) out[b * elems + i] = in[4 * i + b];
+  memcpy(out + 4 * elems, in + 4 * elems, n - 4 * elems);
+}
+
+static void _cache_unshuffle(const uint8_t *in, uint8_t *out, const size_t n)
+{
+  const size_t elems = n / 4;
+  for(size_t i = 0; i < elems; i++)
+    for(int b = 0; b < 4; b++) out[4 * i + b] = in[b * elems + i];
+  memcpy(out + 4 * elems, in + 4 * elems, n - 4 * elems);
+}
+
+static void _cache_packed_free(dt_dev_pixelpipe_cache_packed_t *packed)
+{
+  if(!packed) return;
+  free(packed->offset);
+  free(packed->data);
+  free(packed);
+}
+
+// chunks which don't get smaller are stored as they are
+static dt_dev_pixelpipe_cache_packed_t *_cache_pack(const uint8_t *in, const size_t bytes)
+{
+  const int chunks = (bytes + PACKED_CHUNK_SIZE - 1) / PACKED_CHUNK_SIZE;
+  dt_dev_pixelpipe_cache_packed_t *packed = calloc(1, sizeof(dt_dev_pixelpipe_cache_packed_t));
+  uint8_t *planes = malloc(PACKED_CHUNK_SIZE);
+  if(packed)
+  {
+    packed->offset = calloc(chunks + 1, sizeof(size_t));
+    packed->data = malloc(bytes);
+  }
+  if(!packed || !packed->offset || !packed->data || !planes)
+  {
+    _cache_packed_free(packed);
+    free(planes);
+    return NULL;
+  }
+
+  size_t pos = 0;
+  for(int c = 0; c < chunks; c++)
+  {
+    const size_t n = MIN(PACKED_CHUNK_SIZE, bytes - (size_t)c * PACKED_CHUNK_SIZE);
+    const uint8_t *chunk = in + (size_t)c * PACKED_CHUNK_SIZE;
+    _cache_shuffle(chunk, planes, n);
+    uLongf len = n - 1;
+    if(n > 1 && compress2(packed->data + pos, &len, planes, n, 1) == Z_OK)
+      pos += len;
+    else
+    {
+      memcpy(packed->data + pos, chunk, n);
+      pos += n;
+    }
+    packed->offset[c + 1] = pos;
+  }
+  free(planes);
+
+  uint8_t *data = realloc(packed->data, MAX(pos, 1));
+  if(data) packed->data = data;
+  packed->bytes = bytes;
+  packed->chunks = chunks;
+  packed->size = sizeof(dt_dev_pixelpipe_cache_packed_t) + (chunks + 1) * sizeof(size_t) + pos;
+  return packed;
+}
+
+static int _cache_unpack(const dt_dev_pixelpipe_cache_packed_t *packed, uint8_t *out)
+{
+  int failed = 0;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(out, packed) reduction(| : failed) schedule(dynamic)
+#endif
+  for(int c = 0; c < packed->chunks; c++)
+  {
+    const size_t n = MIN(PACKED_CHUNK_SIZE, packed->bytes - (size_t)c * PACKED_CHUNK_SIZE);
+    const uint8_t *chunk = packed->data + packed->offset[c];
+    const size_t len = packed->offset[c + 1] - packed->offset[c];
+    uint8_t *dst = out + (size_t)c * PACKED_CHUNK_SIZE;
+    if(len == n)
+    {
+      memcpy(dst, chunk, n);
+      continue;
+    }
+    uint8_t *planes = malloc(n);
+    uLongf planes_len = n;
+    if(!planes || uncompress(planes, &planes_len, chunk, len) != Z_OK || planes_len != n)
+      failed = 1;
+    else
+      _cache_unshuffle(planes, dst, n);
+    free(planes);
+  }
+  return failed;
+}
+
+static GList *_cache_store_find(dt_dev_pixelpipe_cache_store_t *store, const uint64_t hash)
+{
+  for(GList *l = store->packed; l; l = g_list_next(l))
+    if(((dt_dev_pixelpipe_cache_packed_t *)l->data)->hash == hash) return l;
+  return NULL;
+}
+
+static void _cache_store_remove(dt_dev_pixelpipe_cache_store_t *store, GList *l)
+{
+  dt_dev_pixelpipe_cache_packed_t *packed = (dt_dev_pixelpipe_cache_packed_t *)l->data;
+  store->packed_size -= packed->size;
+  _cache_packed_free(packed);
+  store->packed = g_list_delete_link(store->packed, l);
+}
+
+static void _cache_store_touch(dt_dev_pixelpipe_cache_store_t *store, GList *l)
+{
+  store->packed = g_list_remove_link(store->packed, l);
+  store->packed = g_list_concat(l, store->packed);
+}
+
+static void *_cache_store_thread(void *arg)
+{
+  dt_dev_pixelpipe_cache_store_t *store = (dt_dev_pixelpipe_cache_store_t *)arg;
+  dt_pthread_setname("pipe cache");
+  dt_pthread_mutex_lock(&store->lock);
+  while(store->running)
+  {
+    if(!store->pending)
+    {
+      dt_pthread_cond_wait(&store->cond, &store->lock);
+      continue;
+    }
+
+    // nobody else touches the pending buffer until it's given back
+    const uint32_t generation = store->generation;
+    dt_pthread_mutex_unlock(&store->lock);
+
+    dt_dev_pixelpipe_cache_packed_t *packed = _cache_pack(store->pending, store->pending_bytes);
+
+    dt_pthread_mutex_lock(&store->lock);
+    if(packed && generation == store->generation)
+    {
+      packed->hash = store->pending_hash;
+      packed->dsc = store->pending_dsc;
+      GList *old = _cache_store_find(store, packed->hash);
+      if(old) _cache_store_remove(store, old);
+      store->packed = g_list_prepend(store->packed, packed);
+      store->packed_size += packed->size;
+      store->stored++;
+      store->stored_in += packed->bytes;
+      store->stored_out += packed->size;
+      while(store->packed_size > store->max_size) _cache_store_remove(store, g_list_last(store->packed));
+    }
+    else
+      _cache_packed_free(packed);
+
+    if(store->spare)
+      dt_free_align(store->pending);
+    else
+    {
+      store->spare = store->pending;
+      store->spare_size = store->pending_size;
+    }
+    store->pending = NULL;
+  }
+  dt_pthread_mutex_unlock(&store->lock);
+  return NULL;
+}
+
+void dt_dev_pixelpipe_cache_init_store(dt_dev_pixelpipe_cache_t *cache, size_t max_size)
+{
+  if(!max_size || cache->store) return;
+  dt_dev_pixelpipe_cache_store_t *store = calloc(1, sizeof(dt_dev_pixelpipe_cache_store_t));
+  if(!store) return;
+  dt_pthread_mutex_init(&store->lock, NULL);
+  pthread_cond_init(&store->cond, NULL);
+  store->max_size = max_size;
+  store->running = 1;
+  if(dt_pthread_create(&store->thread, _cache_store_thread, store))
+  {
+    fprintf(stderr, "[pixelpipe_cache] can't start the compression thread, not keeping evicted lines\n");
+    pthread_cond_destroy(&store->cond);
+    dt_pthread_mutex_destroy(&store->lock);
+    free(store);
+    return;
+  }
+  cache->store = store;
+}
+
+static void _cache_store_cleanup(dt_dev_pixelpipe_cache_t *cache)
+{
+  dt_dev_pixelpipe_cache_store_t *store = cache->store;
+  if(!store) return;
+
+  dt_pthread_mutex_lock(&store->lock);
+  store->running = 0;
+  pthread_cond_broadcast(&store->cond);
+  dt_pthread_mutex_unlock(&store->lock);
+  pthread_join(store->thread, NULL);
+
+  dt_print(DT_DEBUG_PERF, "[pixelpipe_cache] %" PRIu64 " evicted lines compressed to %.1f%%, %" PRIu64
+                          " restored, %" PRIu64 " dropped while busy\n",
+           store->stored, store->stored_in ? 100.0 * store->stored_out / store->stored_in : 0.0, store->restored,
+           store->dropped);
+
+  while(store->packed) _cache_store_remove(store, store->packed);
+  dt_free_align(store->pending);
+  dt_free_align(store->spare);
+  pthread_cond_destroy(&store->cond);
+  dt_pthread_mutex_destroy(&store->lock);
+  free(store);
+  cache->store = NULL;
+}
+
+// give the contents of cache line k to the compression thread, in exchange for the buffer it is done with.
+// if it's still busy with the previous line, the contents are lost as they would be without the store.
+static void _cache_store_evict(dt_dev_pixelpipe_cache_t *cache, const int k)
+{
+  dt_dev_pixelpipe_cache_store_t *store = cache->store;
+  if(cache->hash[k] == (uint64_t)-1 || !cache->bytes[k] || !cache->data[k]) return;
+
+  dt_pthread_mutex_lock(&store->lock);
+  GList *l = _cache_store_find(store, cache->hash[k]);
+  if(l)
+    _cache_store_touch(store, l);
+  else if(store->pending)
+    store->dropped++;
+  else
+  {
+    void *buf = store->spare;
+    size_t size = store->spare_size;
+    if(!buf)
+    {
+      buf = dt_alloc_large(cache->size[k]);
+      size = cache->size[k];
+    }
+    if(buf)
+    {
+      store->pending = cache->data[k];
+      store->pending_size = cache->size[k];
+      store->pending_bytes = cache->bytes[k];
+      store->pending_hash = cache->hash[k];
+      store->pending_dsc = cache->dsc[k];
+      store->spare = NULL;
+      cache->data[k] = buf;
+      cache->size[k] = size;
+      pthread_cond_broadcast(&store->cond);
+    }
+    else
+      store->dropped++;
+  }
+  dt_pthread_mutex_unlock(&store->lock);
+}
+
+// fill out with the contents of hash, if the store has them
+static int _cache_store_restore(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, void *out,
+                                const size_t bytes, dt_iop_buffer_dsc_t *dsc)
+{
+  dt_dev_pixelpipe_cache_store_t *store = cache->store;
+  int found = 0;
+  dt_pthread_mutex_lock(&store->lock);
+  if(store->pending && store->pending_hash == hash && store->pending_bytes == bytes)
+  {
+    // not compressed yet, but the thread only reads the buffer
+    memcpy(out, store->pending, bytes);
+    *dsc = store->pending_dsc;
+    found = 1;
+  }
+  else
+  {
+    GList *l = _cache_store_find(store, hash);
+    dt_dev_pixelpipe_cache_packed_t *packed = l ? (dt_dev_pixelpipe_cache_packed_t *)l->data : NULL;
+    if(packed && packed->bytes == bytes && !_cache_unpack(packed, out))
+    {
+      _cache_store_touch(store, l);
+      *dsc = packed->dsc;
+      found = 1;
+    }
+  }
+  if(found) store->restored++;
+  dt_pthread_mutex_unlock(&store->lock);
+  return found;
+}
+
+static int _cache_store_available(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
+{
+  dt_dev_pixelpipe_cache_store_t *store = cache->store;
+  if(!store) return 0;
+  dt_pthread_mutex_lock(&store->lock);
+  const int found = (store->pending && store->pending_hash == hash) || _cache_store_find(store, hash);
+  dt_pthread_mutex_unlock(&store->lock);
+  return found;
+}
+
+static void _cache_store_forget(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
+{
+  dt_dev_pixelpipe_cache_store_t *store = cache->store;
+  if(!store) return;
+  dt_pthread_mutex_lock(&store->lock);
+  GList *l = _cache_store_find(store, hash);
+  if(l) _cache_store_remove(store, l);
+  if(store->pending && store->pending_hash == hash) store->generation++;
+  dt_pthread_mutex_unlock(&store->lock);
+}
+
+static void _cache_store_flush(dt_dev_pixelpipe_cache_t *cache)
+{
+  dt_dev_pixelpipe_cache_store_t *store = cache->store;
+  if(!store) return;
+  dt_pthread_mutex_lock(&store->lock);
+  while(store->packed) _cache_store_remove(store, store->packed);
+  store->generation++;
+  dt_pthread_mutex_unlock(&store->lock);
+}
+
 int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, size_t size)
 {
   cache->entries = entries;
@@ -43,12 +394,14 @@ int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, si
 #endif
   cache->hash = (uint64_t *)calloc(entries, sizeof(uint64_t));
   cache->used = (int32_t *)calloc(entries, sizeof(int32_t));
+  cache->bytes = (size_t *)calloc(entries, sizeof(size_t));
+  cache->store = NULL;
   for(int k = 0; k < entries; k++)
   {
     cache->size[k] = size;
     if(size)
     { // allow 0 initial buffer size (yet unknown dimensions)
-      cache->data[k] = (void *)dt_alloc_align(16, size);
+      cache->data[k] = (void *)dt_alloc_large(size);
       if(!cache->data[k]) goto alloc_memory_fail;
 #ifdef _DEBUG
       memset(cache->data[k], 0x5d, size);
@@ -69,12 +422,14 @@ alloc_memory_fail:
 
 void dt_dev_pixelpipe_cache_cleanup(dt_dev_pixelpipe_cache_t *cache)
 {
+  _cache_store_cleanup(cache);
   for(int k = 0; k < cache->entries; k++) dt_free_align(cache->data[k]);
   free(cache->data);
   free(cache->dsc);
   free(cache->hash);
   free(cache->used);
   free(cache->size);
+  free(cache->bytes);
 }
 
 uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const dt_iop_roi_t *roi, dt_dev_pixelpipe_t *pipe, int module)
@@ -120,6 +475,34 @@ int dt_dev_pixelpipe_cache_available(dt_dev_pixelpipe_cache_t *cache, const uint
   return 0;
 }
 
+// kill the LRU entry max and hand it out for hash
+static void _cache_reserve(dt_dev_pixelpipe_cache_t *cache, const int max, const uint64_t hash, const size_t size,
+                           void **data, dt_iop_buffer_dsc_t **dsc, const int weight)
+{
+  // printf("[pixelpipe_cache_get] hash not found, returning slot %d/%d age %d\n", max, cache->entries,
+  // weight);
+  if(cache->store) _cache_store_evict(cache, max);
+  if(cache->size[max] < size)
+  {
+    dt_free_align(cache->data[max]);
+    cache->data[max] = (void *)dt_alloc_large(size);
+    cache->size[max] = size;
+  }
+  *data = cache->data[max];
+  const size_t sz = cache->size[max];
+
+  ASAN_POISON_MEMORY_REGION(*data, sz);
+  ASAN_UNPOISON_MEMORY_REGION(*data, size);
+
+  // first, update our copy, then update the pointer to point at our copy
+  cache->dsc[max] = **dsc;
+  *dsc = &cache->dsc[max];
+
+  cache->hash[max] = hash;
+  cache->used[max] = weight;
+  cache->bytes[max] = size;
+}
+
 int dt_dev_pixelpipe_cache_get_important(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size,
                                          void **data, dt_iop_buffer_dsc_t **dsc)
 {
@@ -164,27 +547,7 @@ int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const u
 
   if(!*data || sz < size)
   {
-    // kill LRU entry
-    // printf("[pixelpipe_cache_get] hash not found, returning slot %d/%d age %d\n", max, cache->entries,
-    // weight);
-    if(cache->size[max] < size)
-    {
-      dt_free_align(cache->data[max]);
-      cache->data[max] = (void *)dt_alloc_align(16, size);
-      cache->size[max] = size;
-    }
-    *data = cache->data[max];
-    sz = cache->size[max];
-
-    ASAN_POISON_MEMORY_REGION(*data, sz);
-    ASAN_UNPOISON_MEMORY_REGION(*data, size);
-
-    // first, update our copy, then update the pointer to point at our copy
-    cache->dsc[max] = **dsc;
-    *dsc = &cache->dsc[max];
-
-    cache->hash[max] = hash;
-    cache->used[max] = weight;
+    _cache_reserve(cache, max, hash, size, data, dsc, weight);
     cache->misses++;
     return 1;
   }
@@ -192,6 +555,31 @@ int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const u
     return 0;
 }
 
+int dt_dev_pixelpipe_cache_get_stored(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size,
+                                      void **data, dt_iop_buffer_dsc_t **dsc)
+{
+  // only a hint, the line may still be dropped before it's restored
+  if(!_cache_store_available(cache, hash)) return 1;
+
+  int max_used = -1, max = 0;
+  for(int k = 0; k < cache->entries; k++)
+  {
+    if(cache->used[k] > max_used)
+    {
+      max_used = cache->used[k];
+      max = k;
+    }
+    cache->used[k]++;
+  }
+  _cache_reserve(cache, max, hash, size, data, dsc, 0);
+  if(*data && _cache_store_restore(cache, hash, *data, size, *dsc)) return 0;
+
+  // gone in the meantime, don't leave an empty line behind that looks like a hit
+  cache->hash[max] = -1;
+  ASAN_POISON_MEMORY_REGION(cache->data[max], cache->size[max]);
+  return 1;
+}
+
 void dt_dev_pixelpipe_cache_flush(dt_dev_pixelpipe_cache_t *cache)
 {
   for(int k = 0; k < cache->entries; k++)
@@ -200,6 +588,7 @@ void dt_dev_pixelpipe_cache_flush(dt_dev_pixelpipe_cache_t *cache)
     cache->used[k] = 0;
     ASAN_POISON_MEMORY_REGION(cache->data[k], cache->size[k]);
   }
+  _cache_store_flush(cache);
 }
 
 void dt_dev_pixelpipe_cache_reweight(dt_dev_pixelpipe_cache_t *cache, void *data)
@@ -219,6 +608,7 @@ void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *da
   {
     if(cache->data[k] == data)
     {
+      _cache_store_forget(cache, cache->hash[k]);
       cache->hash[k] = -1;
       ASAN_POISON_MEMORY_REGION(cache->data[k], cache->size[k]);
     }
@@ -234,8 +624,18 @@ void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache)
     printf("\n");
   }
   printf("cache hit rate so far: %.3f\n", (cache->queries - cache->misses) / (float)cache->queries);
+  dt_dev_pixelpipe_cache_store_t *store = cache->store;
+  if(store)
+  {
+    dt_pthread_mutex_lock(&store->lock);
+    printf("compressed lines: %d using %.1f of %.1f MB, %" PRIu64 " restored\n", g_list_length(store->packed),
+           store->packed_size / (1024.0 * 1024.0), store->max_size / (1024.0 * 1024.0), store->restored);
+    dt_pthread_mutex_unlock(&store->lock);
+  }
 }
 
+#undef PACKED_CHUNK_SIZE
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
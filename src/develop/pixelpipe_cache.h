@@ -21,6 +21,7 @@
 #include <inttypes.h>
 
 struct dt_dev_pixelpipe_t;
+struct dt_dev_pixelpipe_cache_store_t;
 struct dt_iop_buffer_dsc_t;
 struct dt_iop_roi_t;
 
@@ -38,9 +39,12 @@ typedef struct dt_dev_pixelpipe_cache_t
   struct dt_iop_buffer_dsc_t *dsc;
   uint64_t *hash;
   int32_t *used;
+  size_t *bytes; // bytes of data[k] filled for hash[k]
 #ifdef HAVE_OPENCL
   void **gpu_mem;
 #endif
+  // compressed copies of evicted cache lines, NULL if disabled
+  struct dt_dev_pixelpipe_cache_store_t *store;
   // profiling:
   uint64_t queries;
   uint64_t misses;
@@ -52,6 +56,12 @@ typedef struct dt_dev_pixelpipe_cache_t
 int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, size_t size);
 void dt_dev_pixelpipe_cache_cleanup(dt_dev_pixelpipe_cache_t *cache);
 
+/** keep losslessly compressed copies of evicted cache lines, up to max_size bytes of them. they are
+  * compressed by a background thread and restored by dt_dev_pixelpipe_cache_get_stored(), which lets the
+  * pipe come back to many more intermediate results than it has cache lines.
+  * max_size 0 leaves this disabled. */
+void dt_dev_pixelpipe_cache_init_store(dt_dev_pixelpipe_cache_t *cache, size_t max_size);
+
 /** creates a hopefully unique hash from the complete module stack up to the module-th. */
 uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const struct dt_iop_roi_t *roi,
                                      struct dt_dev_pixelpipe_t *pipe, int module);
@@ -66,7 +76,13 @@ int dt_dev_pixelpipe_cache_get_important(dt_dev_pixelpipe_cache_t *cache, const
 int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size,
                                         void **data, struct dt_iop_buffer_dsc_t **dsc, int weight);
 
-/** test availability of a cache line without destroying another, if it is not found. */
+/** restores the evicted line for hash from the compressed store into a new cache line and returns 0. if
+  * the store doesn't (or no longer) hold it, no cache line is taken and a non-zero value is returned. */
+int dt_dev_pixelpipe_cache_get_stored(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size,
+                                      void **data, struct dt_iop_buffer_dsc_t **dsc);
+
+/** test availability of a cache line without destroying another, if it is not found. only resident lines
+  * count, evicted ones in the store have to be fetched with dt_dev_pixelpipe_cache_get_stored(). */
 int dt_dev_pixelpipe_cache_available(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash);
 
 /** invalidates all cachelines. */
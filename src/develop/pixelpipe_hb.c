@@ -22,6 +22,9 @@
 #include "common/histogram.h"
 #include "common/imageio.h"
 #include "common/opencl.h"
+#include "common/threadpool.h"
+#include "common/trace.h"
+#include "control/conf.h"
 #include "control/control.h"
 #include "control/signal.h"
 #include "develop/blend.h"
@@ -89,6 +92,167 @@ static char *_pipe_type_to_str(int pipe_type)
   return r;
 }
 
+typedef struct dt_dev_pixelpipe_scratch_buf_t
+{
+  void *buf;
+  size_t size;
+} dt_dev_pixelpipe_scratch_buf_t;
+
+typedef struct dt_dev_pixelpipe_scratch_t
+{
+  dt_pthread_mutex_t lock;
+  GList *free;      // dt_dev_pixelpipe_scratch_buf_t nobody borrowed, smallest first
+  GHashTable *used; // borrowed buffer -> its size
+  size_t free_size, used_size;
+  // the most memory a module of the current run needs besides input and output, from its tiling requirements
+  size_t estimate;
+  // profiling:
+  uint64_t reused, allocated;
+  size_t peak;
+} dt_dev_pixelpipe_scratch_t;
+
+static gint _scratch_buf_cmp(gconstpointer a, gconstpointer b)
+{
+  const size_t sa = ((const dt_dev_pixelpipe_scratch_buf_t *)a)->size;
+  const size_t sb = ((const dt_dev_pixelpipe_scratch_buf_t *)b)->size;
+  return (sa > sb) - (sa < sb);
+}
+
+static void _scratch_init(dt_dev_pixelpipe_t *pipe)
+{
+  dt_dev_pixelpipe_scratch_t *scratch = calloc(1, sizeof(dt_dev_pixelpipe_scratch_t));
+  if(scratch)
+  {
+    dt_pthread_mutex_init(&scratch->lock, NULL);
+    scratch->used = g_hash_table_new(g_direct_hash, g_direct_equal);
+  }
+  pipe->scratch = scratch;
+}
+
+static void _scratch_cleanup(dt_dev_pixelpipe_t *pipe)
+{
+  dt_dev_pixelpipe_scratch_t *scratch = pipe->scratch;
+  if(!scratch) return;
+  if(scratch->reused || scratch->allocated)
+    dt_print(DT_DEBUG_PERF, "[pixelpipe] [%s] scratch buffers: %" PRIu64 " reused, %" PRIu64 " allocated, "
+                            "peak %.1f MB\n",
+             _pipe_type_to_str(pipe->type), scratch->reused, scratch->allocated,
+             scratch->peak / (1024.0 * 1024.0));
+
+  for(GList *l = scratch->free; l; l = g_list_next(l))
+    dt_free_align(((dt_dev_pixelpipe_scratch_buf_t *)l->data)->buf);
+  g_list_free_full(scratch->free, g_free);
+  // only if a module forgot to give them back
+  GHashTableIter iter;
+  gpointer buf;
+  g_hash_table_iter_init(&iter, scratch->used);
+  while(g_hash_table_iter_next(&iter, &buf, NULL)) dt_free_align(buf);
+  g_hash_table_destroy(scratch->used);
+  dt_pthread_mutex_destroy(&scratch->lock);
+  free(scratch);
+  pipe->scratch = NULL;
+}
+
+// at the end of a run keep the free buffers the largest module of it could use again, largest first
+static void _scratch_trim(dt_dev_pixelpipe_t *pipe)
+{
+  dt_dev_pixelpipe_scratch_t *scratch = pipe->scratch;
+  if(!scratch) return;
+  dt_pthread_mutex_lock(&scratch->lock);
+  size_t kept = 0;
+  GList *l = g_list_last(scratch->free);
+  while(l)
+  {
+    GList *prev = g_list_previous(l);
+    dt_dev_pixelpipe_scratch_buf_t *b = (dt_dev_pixelpipe_scratch_buf_t *)l->data;
+    if(kept + b->size <= scratch->estimate)
+      kept += b->size;
+    else
+    {
+      scratch->free_size -= b->size;
+      dt_free_align(b->buf);
+      g_free(b);
+      scratch->free = g_list_delete_link(scratch->free, l);
+    }
+    l = prev;
+  }
+  scratch->estimate = 0;
+  dt_pthread_mutex_unlock(&scratch->lock);
+}
+
+void *dt_dev_pixelpipe_scratch_alloc(dt_dev_pixelpipe_t *pipe, size_t size)
+{
+  dt_dev_pixelpipe_scratch_t *scratch = pipe ? pipe->scratch : NULL;
+  if(!scratch) return dt_alloc_align(64, size);
+
+  dt_pthread_mutex_lock(&scratch->lock);
+  void *buf = NULL;
+  size_t buf_size = size;
+  // the smallest free buffer that fits, unless that wastes more than half of it
+  for(GList *l = scratch->free; l; l = g_list_next(l))
+  {
+    dt_dev_pixelpipe_scratch_buf_t *b = (dt_dev_pixelpipe_scratch_buf_t *)l->data;
+    if(b->size < size) continue;
+    if(b->size / 2 <= size)
+    {
+      buf = b->buf;
+      buf_size = b->size;
+      scratch->free_size -= b->size;
+      g_free(b);
+      scratch->free = g_list_delete_link(scratch->free, l);
+      scratch->reused++;
+    }
+    break;
+  }
+  if(!buf)
+  {
+    buf = dt_alloc_large(size);
+    if(buf) scratch->allocated++;
+  }
+  if(buf)
+  {
+    g_hash_table_insert(scratch->used, buf, GSIZE_TO_POINTER(buf_size));
+    scratch->used_size += buf_size;
+    scratch->peak = MAX(scratch->peak, scratch->used_size + scratch->free_size);
+  }
+  dt_pthread_mutex_unlock(&scratch->lock);
+  return buf;
+}
+
+void dt_dev_pixelpipe_scratch_free(dt_dev_pixelpipe_t *pipe, void *buf)
+{
+  if(!buf) return;
+  dt_dev_pixelpipe_scratch_t *scratch = pipe ? pipe->scratch : NULL;
+  if(!scratch)
+  {
+    dt_free_align(buf);
+    return;
+  }
+
+  dt_pthread_mutex_lock(&scratch->lock);
+  gpointer size;
+  if(g_hash_table_lookup_extended(scratch->used, buf, NULL, &size))
+  {
+    g_hash_table_remove(scratch->used, buf);
+    dt_dev_pixelpipe_scratch_buf_t *b = g_malloc(sizeof(dt_dev_pixelpipe_scratch_buf_t));
+    b->buf = buf;
+    b->size = GPOINTER_TO_SIZE(size);
+    scratch->used_size -= b->size;
+    scratch->free_size += b->size;
+    scratch->free = g_list_insert_sorted(scratch->free, b, _scratch_buf_cmp);
+  }
+  else
+    dt_free_align(buf);
+  dt_pthread_mutex_unlock(&scratch->lock);
+}
+
+// the darkroom pipes keep compressed copies of evicted cache lines, if there is memory for them
+static void _init_cache_store(dt_dev_pixelpipe_t *pipe)
+{
+  const int size = dt_conf_get_int("pixelpipe_cache_compressed");
+  if(size > 0) dt_dev_pixelpipe_cache_init_store(&pipe->cache, (size_t)size << 20);
+}
+
 int dt_dev_pixelpipe_init_export(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height, int levels)
 {
   int res = dt_dev_pixelpipe_init_cached(pipe, 4 * sizeof(float) * width * height, 2);
@@ -117,6 +281,7 @@ int dt_dev_pixelpipe_init_preview(dt_dev_pixelpipe_t *pipe)
   int res = dt_dev_pixelpipe_init_cached(
       pipe, 0, 5);
   pipe->type = DT_DEV_PIXELPIPE_PREVIEW;
+  if(res) _init_cache_store(pipe);
   return res;
 }
 
@@ -126,6 +291,7 @@ int dt_dev_pixelpipe_init(dt_dev_pixelpipe_t *pipe)
   int res = dt_dev_pixelpipe_init_cached(
       pipe, 0, 5);
   pipe->type = DT_DEV_PIXELPIPE_FULL;
+  if(res) _init_cache_store(pipe);
   return res;
 }
 
@@ -138,6 +304,7 @@ int dt_dev_pixelpipe_init_cached(dt_dev_pixelpipe_t *pipe, size_t size, int32_t
   pipe->nodes = NULL;
   pipe->backbuf_size = size;
   if(!dt_dev_pixelpipe_cache_init(&(pipe->cache), entries, pipe->backbuf_size)) return 0;
+  _scratch_init(pipe);
   pipe->cache_obsolete = 0;
   pipe->backbuf = NULL;
   pipe->processing = 0;
@@ -184,6 +351,7 @@ void dt_dev_pixelpipe_cleanup(dt_dev_pixelpipe_t *pipe)
   dt_dev_pixelpipe_cleanup_nodes(pipe);
   // so now it's safe to clean up cache:
   dt_dev_pixelpipe_cache_cleanup(&(pipe->cache));
+  _scratch_cleanup(pipe);
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
   dt_pthread_mutex_destroy(&(pipe->backbuf_mutex));
   dt_pthread_mutex_destroy(&(pipe->busy_mutex));
@@ -613,14 +781,29 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
     return 1;
   }
   uint64_t hash = dt_dev_pixelpipe_cache_hash(pipe->image.id, roi_out, pipe, pos);
+  int cached = 0;
   if(dt_dev_pixelpipe_cache_available(&(pipe->cache), hash))
   {
     // if(module) printf("found valid buf pos %d in cache for module %s %s %lu\n", pos, module->op, pipe ==
     // dev->preview_pipe ? "[preview]" : "", hash);
 
-    (void)dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output, out_format);
+    cached = !dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output, out_format);
+    // the line was too small and got reset, don't let the processing below take it for a hit
+    if(!cached) dt_dev_pixelpipe_cache_invalidate(&(pipe->cache), *output);
+  }
+  else
+    // maybe it was evicted and is still kept compressed
+    cached = !dt_dev_pixelpipe_cache_get_stored(&(pipe->cache), hash, bufsize, output, out_format);
 
+  if(cached)
+  {
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    if(dt_trace_enabled())
+    {
+      char args[64];
+      snprintf(args, sizeof(args), "\"pipe\": \"%s\", \"cache\": \"hit\"", _pipe_type_to_str(pipe->type));
+      dt_trace_instant("pipe", args, "%s", module ? module_name : "input");
+    }
     if(!modules) return 0;
     // go to post-collect directly:
     goto post_process_collect_info;
@@ -649,6 +832,8 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
     }
     dt_times_t start;
     dt_get_times(&start);
+    dt_trace_span_t span;
+    dt_trace_begin(&span);
     // we're looking for the full buffer
     {
       if(roi_out->scale == 1.0 && roi_out->x == 0 && roi_out->y == 0 && pipe->iwidth == roi_out->width
@@ -692,6 +877,13 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
     }
 
     dt_show_times(&start, "[dev_pixelpipe]", "initing base buffer [%s]", _pipe_type_to_str(pipe->type));
+    if(dt_trace_enabled())
+    {
+      char args[128];
+      snprintf(args, sizeof(args), "\"pipe\": \"%s\", \"cache\": \"miss\", \"width\": %d, \"height\": %d",
+               _pipe_type_to_str(pipe->type), roi_out->width, roi_out->height);
+      dt_trace_end(&span, "pipe", args, "input");
+    }
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
   }
   else
@@ -754,8 +946,13 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
       return 1;
     }
 
+    // other pipes may have started or finished since the last module
+    dt_threadpool_budget_update();
+
     dt_times_t start;
     dt_get_times(&start);
+    dt_trace_span_t span;
+    dt_trace_begin(&span);
 
     dt_pixelpipe_flow_t pixelpipe_flow = (PIXELPIPE_FLOW_NONE | PIXELPIPE_FLOW_HISTOGRAM_NONE);
 
@@ -819,6 +1016,16 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
 
     assert(tiling.factor > 0.0f);
 
+    // tiling requirements count input and output, the rest is what the module borrows as scratch memory
+    if(pipe->scratch)
+    {
+      const size_t bufsize_max = MAX((size_t)in_bpp * roi_in.width * roi_in.height, bufsize);
+      const size_t estimate = (size_t)(fmaxf(tiling.factor - 2.0f, 0.0f) * bufsize_max) + tiling.overhead;
+      dt_pthread_mutex_lock(&pipe->scratch->lock);
+      pipe->scratch->estimate = MAX(pipe->scratch->estimate, estimate);
+      dt_pthread_mutex_unlock(&pipe->scratch->lock);
+    }
+
     if(pipe->shutdown)
     {
       dt_pthread_mutex_unlock(&pipe->busy_mutex);
@@ -1692,6 +1899,18 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
     g_free(module_label);
     module_label = NULL;
 
+    if(dt_trace_enabled())
+    {
+      char args[256];
+      snprintf(args, sizeof(args),
+               "\"pipe\": \"%s\", \"cache\": \"miss\", \"device\": \"%s\", \"tiling\": %d, "
+               "\"width\": %d, \"height\": %d",
+               _pipe_type_to_str(pipe->type),
+               pixelpipe_flow & PIXELPIPE_FLOW_PROCESSED_ON_GPU ? "GPU" : "CPU",
+               (pixelpipe_flow & PIXELPIPE_FLOW_PROCESSED_WITH_TILING) ? 1 : 0, roi_out->width, roi_out->height);
+      dt_trace_end(&span, "pipe", args, "%s", module_name);
+    }
+
     // in case we get this buffer from the cache in the future, cache some stuff:
     **out_format = piece->dsc_out = pipe->dsc;
 
@@ -2261,6 +2480,12 @@ int dt_dev_pixelpipe_process(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, int x,
 
   if(pipe->devid >= 0) dt_opencl_events_reset(pipe->devid);
 
+  dt_trace_span_t span;
+  dt_trace_begin(&span);
+
+  // share the cores with the other pipes processing right now
+  dt_threadpool_budget_begin();
+
   dt_iop_roi_t roi = (dt_iop_roi_t){ x, y, width, height, scale };
   // printf("pixelpipe homebrew process start\n");
   if(darktable.unmuted & DT_DEBUG_DEV) dt_dev_pixelpipe_cache_print(&pipe->cache);
@@ -2334,6 +2559,16 @@ restart:
     dt_opencl_unlock_device(pipe->devid);
     pipe->devid = -1;
   }
+  _scratch_trim(pipe);
+  dt_threadpool_budget_end();
+  if(dt_trace_enabled())
+  {
+    char args[128];
+    snprintf(args, sizeof(args), "\"width\": %d, \"height\": %d, \"scale\": %f, \"aborted\": %d", width,
+             height, scale, err ? 1 : 0);
+    dt_trace_end(&span, "pipe", args, "pixelpipe [%s]", _pipe_type_to_str(pipe->type));
+  }
+
   // ... and in case of other errors ...
   if(err)
   {
@@ -130,6 +130,8 @@ typedef struct dt_dev_pixelpipe_t
   dt_colorspaces_color_profile_type_t icc_type;
   gchar *icc_filename;
   dt_iop_color_intent_t icc_intent;
+  // scratch buffers modules borrow during processing, kept between runs
+  struct dt_dev_pixelpipe_scratch_t *scratch;
 } dt_dev_pixelpipe_t;
 
 struct dt_develop_t;
@@ -190,6 +192,12 @@ void dt_dev_pixelpipe_disable_after(dt_dev_pixelpipe_t *pipe, const char *op);
 void dt_dev_pixelpipe_disable_before(dt_dev_pixelpipe_t *pipe, const char *op);
 
 
+// borrow a 64 byte aligned temporary buffer for processing from the pipe, to be given back with
+// dt_dev_pixelpipe_scratch_free() before process() returns. buffers are reused across modules, tiles and runs
+// instead of being allocated and faulted in again every time. the contents are undefined.
+void *dt_dev_pixelpipe_scratch_alloc(dt_dev_pixelpipe_t *pipe, size_t size);
+void dt_dev_pixelpipe_scratch_free(dt_dev_pixelpipe_t *pipe, void *buf);
+
 // TODO: future application: remove/add modules from list, load from disk, user programmable etc
 void dt_dev_pixelpipe_add_node(dt_dev_pixelpipe_t *pipe, struct dt_develop_t *dev, int n);
 void dt_dev_pixelpipe_remove_node(dt_dev_pixelpipe_t *pipe, struct dt_develop_t *dev, int n);
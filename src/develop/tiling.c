@@ -19,6 +19,7 @@
 
 #include "develop/tiling.h"
 #include "common/opencl.h"
+#include "common/trace.h"
 #include "control/control.h"
 #include "develop/blend.h"
 #include "develop/pixelpipe.h"
@@ -579,6 +580,17 @@ static int _fit_output_to_input_roi(struct dt_iop_module_t *self, struct dt_dev_
 }
 
 
+// one span per tile in the trace. for opencl this only covers enqueueing the kernels.
+static void _trace_tile(const dt_trace_span_t *span, const struct dt_iop_module_t *self, const char *path,
+                        const size_t tx, const size_t ty, const dt_iop_roi_t *roi)
+{
+  if(!dt_trace_enabled()) return;
+  char args[128];
+  snprintf(args, sizeof(args), "\"tiling\": \"%s\", \"tx\": %zu, \"ty\": %zu, \"width\": %d, \"height\": %d",
+           path, tx, ty, roi->width, roi->height);
+  dt_trace_end(span, "tiling", args, "%s tile", self->op);
+}
+
 /* simple tiling algorithm for roi_in == roi_out, i.e. for pixel to pixel modules/operations */
 static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece,
                                         const void *const ivoid, void *const ovoid,
@@ -762,7 +774,10 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
       for(int k = 0; k < 4; k++) piece->pipe->dsc.processed_maximum[k] = processed_maximum_saved[k];
 
       /* call process() of module */
+      dt_trace_span_t span;
+      dt_trace_begin(&span);
       self->process(self, piece, input, output, &iroi, &oroi);
+      _trace_tile(&span, self, "ptp", tx, ty, &oroi);
 
       /* aggregate resulting processed_maximum */
       /* TODO: check if there really can be differences between tiles and take
@@ -1106,7 +1121,10 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self, struct dt_
       for(int k = 0; k < 4; k++) piece->pipe->dsc.processed_maximum[k] = processed_maximum_saved[k];
 
       /* call process() of module */
+      dt_trace_span_t span;
+      dt_trace_begin(&span);
       self->process(self, piece, input, output, &iroi_full, &oroi_full);
+      _trace_tile(&span, self, "roi", tx, ty, &oroi_full);
 
       /* aggregate resulting processed_maximum */
       /* TODO: check if there really can be differences between tiles and take
@@ -1431,7 +1449,10 @@ static int _default_process_tiling_cl_ptp(struct dt_iop_module_t *self, struct d
       for(int k = 0; k < 4; k++) piece->pipe->dsc.processed_maximum[k] = processed_maximum_saved[k];
 
       /* call process_cl of module */
+      dt_trace_span_t span;
+      dt_trace_begin(&span);
       if(!self->process_cl(self, piece, input, output, &iroi, &oroi)) goto error;
+      _trace_tile(&span, self, "cl_ptp", tx, ty, &oroi);
 
       /* aggregate resulting processed_maximum */
       /* TODO: check if there really can be differences between tiles and take
@@ -1886,7 +1907,10 @@ static int _default_process_tiling_cl_roi(struct dt_iop_module_t *self, struct d
       for(int k = 0; k < 4; k++) piece->pipe->dsc.processed_maximum[k] = processed_maximum_saved[k];
 
       /* call process_cl of module */
+      dt_trace_span_t span;
+      dt_trace_begin(&span);
       if(!self->process_cl(self, piece, input, output, &iroi_full, &oroi_full)) goto error;
+      _trace_tile(&span, self, "cl_roi", tx, ty, &oroi_full);
 
       /* aggregate resulting processed_maximum */
       /* TODO: check if there really can be differences between tiles and take
@@ -23,6 +23,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <memory>
+#include <string>
 
 #include <OpenEXR/ImfChannelList.h>
 #include <OpenEXR/ImfFrameBuffer.h>
@@ -101,9 +102,17 @@ void cleanup(dt_imageio_module_format_t *self)
 {
 }
 
-int write_image(dt_imageio_module_data_t *tmp, const char *filename, const void *in_tmp,
-                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
-                void *exif, int exif_len, int imgid, int num, int total)
+// the tiles are written a row of tiles at a time, so a band has to be a multiple of the tile height
+#define TILE_SIZE 100
+
+typedef struct _exr_writer_t
+{
+  Imf::TiledOutputFile *file;
+} _exr_writer_t;
+
+void *write_begin(dt_imageio_module_data_t *tmp, const char *filename,
+                  dt_colorspaces_color_profile_type_t over_type, const char *over_filename, void *exif,
+                  int exif_len, const char *xmp, int xmp_len, int imgid, int num, int total, int *rows)
 {
   const dt_imageio_exr_t *exr = (dt_imageio_exr_t *)tmp;
 
@@ -121,8 +130,9 @@ int write_image(dt_imageio_module_data_t *tmp, const char *filename, const void
 
   header.insert("exif", Imf::BlobAttribute(exif_blob));
 
-  char *xmp_string = dt_exif_xmp_read_string(imgid);
-  if(xmp_string)
+  if(xmp)
+    header.insert("xmp", Imf::StringAttribute(std::string(xmp, xmp_len)));
+  else if(char *xmp_string = dt_exif_xmp_read_string(imgid))
   {
     header.insert("xmp", Imf::StringAttribute(xmp_string));
     g_free(xmp_string);
@@ -199,29 +209,80 @@ icc_end:
   header.channels().insert("G", Imf::Channel(Imf::PixelType::FLOAT));
   header.channels().insert("B", Imf::Channel(Imf::PixelType::FLOAT));
 
-  header.setTileDescription(Imf::TileDescription(100, 100, Imf::ONE_LEVEL));
+  header.setTileDescription(Imf::TileDescription(TILE_SIZE, TILE_SIZE, Imf::ONE_LEVEL));
 
-  Imf::TiledOutputFile file(filename, header);
+  _exr_writer_t *w = (_exr_writer_t *)malloc(sizeof(_exr_writer_t));
+  if(!w) return NULL;
+  try
+  {
+    w->file = new Imf::TiledOutputFile(filename, header);
+  }
+  catch(const std::exception &e)
+  {
+    fprintf(stderr, "[exr export] error writing %s: %s\n", filename, e.what());
+    free(w);
+    return NULL;
+  }
 
-  Imf::FrameBuffer data;
+  *rows = TILE_SIZE;
+  return w;
+}
 
-  const float *in = (const float *)in_tmp;
+int write_rows(dt_imageio_module_data_t *tmp, void *handle, const void *in_tmp, int y, int rows)
+{
+  const dt_imageio_exr_t *exr = (dt_imageio_exr_t *)tmp;
+  _exr_writer_t *w = (_exr_writer_t *)handle;
 
-  data.insert("R", Imf::Slice(Imf::PixelType::FLOAT, (char *)(in + 0), 4 * sizeof(float),
-                              4 * sizeof(float) * exr->width));
+  // the frame buffer is addressed with image coordinates, so the slices start y rows before the band
+  const size_t stride = 4 * sizeof(float) * exr->width;
+  const char *in = (const char *)in_tmp - stride * y;
 
-  data.insert("G", Imf::Slice(Imf::PixelType::FLOAT, (char *)(in + 1), 4 * sizeof(float),
-                              4 * sizeof(float) * exr->width));
+  Imf::FrameBuffer data;
+  data.insert("R", Imf::Slice(Imf::PixelType::FLOAT, (char *)in + 0 * sizeof(float), 4 * sizeof(float), stride));
+  data.insert("G", Imf::Slice(Imf::PixelType::FLOAT, (char *)in + 1 * sizeof(float), 4 * sizeof(float), stride));
+  data.insert("B", Imf::Slice(Imf::PixelType::FLOAT, (char *)in + 2 * sizeof(float), 4 * sizeof(float), stride));
 
-  data.insert("B", Imf::Slice(Imf::PixelType::FLOAT, (char *)(in + 2), 4 * sizeof(float),
-                              4 * sizeof(float) * exr->width));
+  // whole rows of tiles, the last band finishes the bottom ones
+  const int first = y / TILE_SIZE;
+  const int last = y + rows >= exr->height ? w->file->numYTiles() - 1 : (y + rows) / TILE_SIZE - 1;
+  if(last < first) return 0;
 
-  file.setFrameBuffer(data);
-  file.writeTiles(0, file.numXTiles() - 1, 0, file.numYTiles() - 1);
+  try
+  {
+    w->file->setFrameBuffer(data);
+    w->file->writeTiles(0, w->file->numXTiles() - 1, first, last);
+  }
+  catch(const std::exception &e)
+  {
+    fprintf(stderr, "[exr export] error writing tiles: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
 
+int write_end(dt_imageio_module_data_t *tmp, void *handle)
+{
+  _exr_writer_t *w = (_exr_writer_t *)handle;
+  // the destructor writes the tile offsets and closes the file
+  delete w->file;
+  free(w);
   return 0;
 }
 
+int write_image(dt_imageio_module_data_t *tmp, const char *filename, const void *in_tmp,
+                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
+                void *exif, int exif_len, int imgid, int num, int total)
+{
+  int rows;
+  void *w = write_begin(tmp, filename, over_type, over_filename, exif, exif_len, NULL, 0, imgid, num, total,
+                        &rows);
+  if(!w) return 1;
+  const int failed = write_rows(tmp, w, in_tmp, 0, tmp->height);
+  return write_end(tmp, w) | failed;
+}
+
+#undef TILE_SIZE
+
 size_t params_size(dt_imageio_module_format_t *self)
 {
   return sizeof(dt_imageio_exr_t);
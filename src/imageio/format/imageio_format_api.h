@@ -79,6 +79,17 @@ int bpp(struct dt_imageio_module_data_t *data);
 int write_image(struct dt_imageio_module_data_t *data, const char *filename, const void *in,
                 dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
                 void *exif, int exif_len, int imgid, int num, int total);
+/* optional streaming interface, write_image() is used for formats that don't have all three. write_begin()
+ * opens the file and returns a handle, or NULL on failure. *rows is set to the number of rows every
+ * write_rows() call but the last has to hand over, or any multiple of that. write_rows() gets rows [y, y + rows)
+ * from top to bottom in the layout write_image() gets the whole image in. write_end() finishes the file and
+ * frees the handle, it has to be called after a failed write_rows() as well. formats which support xmp embed
+ * the xmp packet given to write_begin() if it isn't NULL, instead of having it attached to the file later. */
+void *write_begin(struct dt_imageio_module_data_t *data, const char *filename,
+                  dt_colorspaces_color_profile_type_t over_type, const char *over_filename, void *exif,
+                  int exif_len, const char *xmp, int xmp_len, int imgid, int num, int total, int *rows);
+int write_rows(struct dt_imageio_module_data_t *data, void *handle, const void *in, int y, int rows);
+int write_end(struct dt_imageio_module_data_t *data, void *handle);
 /* flag that describes the available precision/levels of output format. mainly used for dithering. */
 int levels(struct dt_imageio_module_data_t *data);
 
@@ -154,6 +154,47 @@ static void info_callback(const char *msg, void *client_data)
   fprintf(stream, "[INFO] %s", msg);
 }
 
+// growing memory buffer as output stream, so exif can be added before the file is written
+typedef struct _j2k_mem_t
+{
+  uint8_t *data;
+  OPJ_SIZE_T size, alloc, pos;
+} _j2k_mem_t;
+
+static OPJ_SIZE_T _j2k_mem_write(void *buf, OPJ_SIZE_T len, void *user_data)
+{
+  _j2k_mem_t *m = (_j2k_mem_t *)user_data;
+  if(m->pos + len > m->alloc)
+  {
+    const OPJ_SIZE_T alloc = MAX(m->pos + len, 2 * m->alloc);
+    uint8_t *data = realloc(m->data, alloc);
+    if(!data) return (OPJ_SIZE_T)-1;
+    m->data = data;
+    m->alloc = alloc;
+  }
+  if(m->pos > m->size) memset(m->data + m->size, 0, m->pos - m->size);
+  memcpy(m->data + m->pos, buf, len);
+  m->pos += len;
+  m->size = MAX(m->size, m->pos);
+  return len;
+}
+
+static OPJ_OFF_T _j2k_mem_skip(OPJ_OFF_T len, void *user_data)
+{
+  _j2k_mem_t *m = (_j2k_mem_t *)user_data;
+  if(len < 0 && (OPJ_SIZE_T)-len > m->pos) return -1;
+  m->pos += len;
+  return len;
+}
+
+static OPJ_BOOL _j2k_mem_seek(OPJ_OFF_T pos, void *user_data)
+{
+  _j2k_mem_t *m = (_j2k_mem_t *)user_data;
+  if(pos < 0) return OPJ_FALSE;
+  m->pos = pos;
+  return OPJ_TRUE;
+}
+
 static int initialise_4K_poc(opj_poc_t *POC, int numres)
 {
   POC[0].tile = 1;
@@ -462,7 +503,22 @@ int write_image(dt_imageio_module_data_t *j2k_tmp, const char *filename, const v
 
   /* open a byte stream for writing */
   /* allocate memory for all tiles */
-  cstream = opj_stream_create_default_file_stream(parameters.outfile, OPJ_FALSE);
+  /* jp2 with exif is encoded to memory and written out together with the metadata */
+  _j2k_mem_t mem = { 0 };
+  const int exif_inline = exif && j2k->format == JP2_CFMT;
+  if(exif_inline)
+  {
+    cstream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_FALSE);
+    if(cstream)
+    {
+      opj_stream_set_write_function(cstream, _j2k_mem_write);
+      opj_stream_set_skip_function(cstream, _j2k_mem_skip);
+      opj_stream_set_seek_function(cstream, _j2k_mem_seek);
+      opj_stream_set_user_data(cstream, &mem, NULL);
+    }
+  }
+  else
+    cstream = opj_stream_create_default_file_stream(parameters.outfile, OPJ_FALSE);
   if(!cstream)
   {
     opj_destroy_codec(ccodec);
@@ -476,6 +532,7 @@ int write_image(dt_imageio_module_data_t *j2k_tmp, const char *filename, const v
     opj_stream_destroy(cstream);
     opj_destroy_codec(ccodec);
     opj_image_destroy(image);
+    free(mem.data);
     fprintf(stderr, "failed to encode image: opj_start_compress\n");
     return 1;
   }
@@ -486,6 +543,7 @@ int write_image(dt_imageio_module_data_t *j2k_tmp, const char *filename, const v
     opj_stream_destroy(cstream);
     opj_destroy_codec(ccodec);
     opj_image_destroy(image);
+    free(mem.data);
     fprintf(stderr, "failed to encode image: opj_encode\n");
     return 1;
   }
@@ -496,6 +554,7 @@ int write_image(dt_imageio_module_data_t *j2k_tmp, const char *filename, const v
     opj_stream_destroy(cstream);
     opj_destroy_codec(ccodec);
     opj_image_destroy(image);
+    free(mem.data);
     fprintf(stderr, "failed to encode image: opj_end_compress\n");
     return 1;
   }
@@ -504,7 +563,8 @@ int write_image(dt_imageio_module_data_t *j2k_tmp, const char *filename, const v
   opj_destroy_codec(ccodec);
 
   /* add exif data blob. seems to not work for j2k files :( */
-  if(exif && j2k->format == JP2_CFMT) rc = dt_exif_write_blob(exif, exif_len, filename, 1);
+  if(exif_inline) rc = dt_exif_write_blob_to_file(exif, exif_len, mem.data, mem.size, filename, 1);
+  free(mem.data);
 
   /* free image data */
   opj_image_destroy(image);
@@ -29,13 +29,16 @@
 #include "control/conf.h"
 #include "imageio/format/imageio_format_api.h"
 #include <inttypes.h>
+#include <limits.h>
 #include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 // this fixes a rather annoying, long time bug in libjpeg :(
 #undef HAVE_STDLIB_H
 #undef HAVE_STDDEF_H
 #include <jpeglib.h>
+#include <jerror.h>
 #undef HAVE_STDLIB_H
 #undef HAVE_STDDEF_H
 
@@ -313,40 +316,22 @@ read_icc_profile (j_decompress_ptr cinfo,
 #undef MAX_SEQ_NO
 
 
-int write_image(dt_imageio_module_data_t *jpg_tmp, const char *filename, const void *in_tmp,
-                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
-                void *exif, int exif_len, int imgid, int num, int total)
+// compression settings shared by the sequential writer and the parallel bands
+static void _jpeg_setup(const dt_imageio_jpeg_t *jpg, j_compress_ptr cinfo, const int height)
 {
-  dt_imageio_jpeg_t *jpg = (dt_imageio_jpeg_t *)jpg_tmp;
-  const uint8_t *in = (const uint8_t *)in_tmp;
-  struct dt_imageio_jpeg_error_mgr jerr;
-
-  jpg->cinfo.err = jpeg_std_error(&jerr.pub);
-  jerr.pub.error_exit = dt_imageio_jpeg_error_exit;
-  if(setjmp(jerr.setjmp_buffer))
-  {
-    jpeg_destroy_compress(&(jpg->cinfo));
-    return 1;
-  }
-  jpeg_create_compress(&(jpg->cinfo));
-  FILE *f = g_fopen(filename, "wb");
-  if(!f) return 1;
-  jpeg_stdio_dest(&(jpg->cinfo), f);
-
-  jpg->cinfo.image_width = jpg->width;
-  jpg->cinfo.image_height = jpg->height;
-  jpg->cinfo.input_components = 3;
-  jpg->cinfo.in_color_space = JCS_RGB;
-  jpeg_set_defaults(&(jpg->cinfo));
-  jpeg_set_quality(&(jpg->cinfo), jpg->quality, TRUE);
-  if(jpg->quality > 90) jpg->cinfo.comp_info[0].v_samp_factor = 1;
-  if(jpg->quality > 92) jpg->cinfo.comp_info[0].h_samp_factor = 1;
-  if(jpg->quality > 95) jpg->cinfo.dct_method = JDCT_FLOAT;
-  if(jpg->quality < 50) jpg->cinfo.dct_method = JDCT_IFAST;
-  if(jpg->quality < 80) jpg->cinfo.smoothing_factor = 20;
-  if(jpg->quality < 60) jpg->cinfo.smoothing_factor = 40;
-  if(jpg->quality < 40) jpg->cinfo.smoothing_factor = 60;
-  jpg->cinfo.optimize_coding = 1;
+  cinfo->image_width = jpg->width;
+  cinfo->image_height = height;
+  cinfo->input_components = 3;
+  cinfo->in_color_space = JCS_RGB;
+  jpeg_set_defaults(cinfo);
+  jpeg_set_quality(cinfo, jpg->quality, TRUE);
+  if(jpg->quality > 90) cinfo->comp_info[0].v_samp_factor = 1;
+  if(jpg->quality > 92) cinfo->comp_info[0].h_samp_factor = 1;
+  if(jpg->quality > 95) cinfo->dct_method = JDCT_FLOAT;
+  if(jpg->quality < 50) cinfo->dct_method = JDCT_IFAST;
+  if(jpg->quality < 80) cinfo->smoothing_factor = 20;
+  if(jpg->quality < 60) cinfo->smoothing_factor = 40;
+  if(jpg->quality < 40) cinfo->smoothing_factor = 60;
 
   // according to specs density_unit = 0, X_density = 1, Y_density = 1 should be fine and valid since it
   // describes an image with unknown unit and square pixels.
@@ -355,54 +340,849 @@ int write_image(dt_imageio_module_data_t *jpg_tmp, const char *filename, const v
   const int resolution = dt_conf_get_int("metadata/resolution");
   if(resolution > 0)
   {
-    jpg->cinfo.density_unit = 1;
-    jpg->cinfo.X_density = resolution;
-    jpg->cinfo.Y_density = resolution;
+    cinfo->density_unit = 1;
+    cinfo->X_density = resolution;
+    cinfo->Y_density = resolution;
   }
   else
   {
-    jpg->cinfo.density_unit = 0;
-    jpg->cinfo.X_density = 1;
-    jpg->cinfo.Y_density = 1;
+    cinfo->density_unit = 0;
+    cinfo->X_density = 1;
+    cinfo->Y_density = 1;
   }
+}
 
-  jpeg_start_compress(&(jpg->cinfo), TRUE);
+// exif goes into an APP1 marker right behind the JFIF header, so the file doesn't have to be rewritten.
+// blobs too large for a single marker are left to exiv2 once the file is done.
+// the namespace the app1 marker of the xmp packet starts with, including its terminating 0
+#define XMP_NAMESPACE "http://ns.adobe.com/xap/1.0/"
+#define XMP_NAMESPACE_LEN (sizeof(XMP_NAMESPACE))
+// the largest xmp packet which fits into one marker, larger ones are attached by exiv2 afterwards
+#define XMP_MAX_INLINE (65533 - XMP_NAMESPACE_LEN)
 
-  if(imgid > 0)
+static void _jpeg_write_markers(j_compress_ptr cinfo, void *exif, const int exif_len, const int exif_inline,
+                                const char *xmp, const int xmp_len, const uint8_t *icc, const uint32_t icc_len)
+{
+  if(exif_inline) jpeg_write_marker(cinfo, JPEG_APP0 + 1, exif, exif_len);
+  if(xmp)
   {
-    cmsHPROFILE out_profile = dt_colorspaces_get_output_profile(imgid, over_type, over_filename)->profile;
-    uint32_t len = 0;
-    cmsSaveProfileToMem(out_profile, 0, &len);
-    if(len > 0)
-    {
-      unsigned char *buf = malloc(len * sizeof(unsigned char));
-      cmsSaveProfileToMem(out_profile, buf, &len);
-      write_icc_profile(&(jpg->cinfo), buf, len);
-      free(buf);
-    }
+    jpeg_write_m_header(cinfo, JPEG_APP0 + 1, XMP_NAMESPACE_LEN + xmp_len);
+    for(size_t i = 0; i < XMP_NAMESPACE_LEN; i++) jpeg_write_m_byte(cinfo, XMP_NAMESPACE[i]);
+    for(int i = 0; i < xmp_len; i++) jpeg_write_m_byte(cinfo, xmp[i]);
   }
+  if(icc_len > 0) write_icc_profile(cinfo, icc, icc_len);
+}
 
-  uint8_t *row = malloc((size_t)3 * jpg->width * sizeof(uint8_t));
-  const uint8_t *buf;
-  while(jpg->cinfo.next_scanline < jpg->cinfo.image_height)
+// feed rows of the 4 channel input starting at in
+static void _jpeg_write_rows(j_compress_ptr cinfo, const uint8_t *in, const int width, const int rows,
+                             uint8_t *row)
+{
+  for(int y = 0; y < rows; y++)
   {
     JSAMPROW tmp[1];
-    buf = in + (size_t)jpg->cinfo.next_scanline * jpg->cinfo.image_width * 4;
-    for(int i = 0; i < jpg->width; i++)
+    const uint8_t *buf = in + (size_t)4 * y * width;
+    for(int i = 0; i < width; i++)
       for(int k = 0; k < 3; k++) row[3 * i + k] = buf[4 * i + k];
     tmp[0] = row;
-    jpeg_write_scanlines(&(jpg->cinfo), tmp, 1);
+    jpeg_write_scanlines(cinfo, tmp, 1);
   }
-  jpeg_finish_compress(&(jpg->cinfo));
+}
+
+// images with fewer pixels are encoded in one go
+#define PARALLEL_MIN_PIXELS (4 << 20)
+
+// the markers needed to take apart and stitch the bands of the parallel writer
+#define M_SOF0_MARKER 0xc0
+#define M_SOF1_MARKER 0xc1
+#define M_RST0_MARKER 0xd0
+#define M_SOS_MARKER 0xda
+#define M_DHT_MARKER 0xc4
+#define M_DRI_MARKER 0xdd
+
+// growing memory destination for the bands of the parallel writer
+typedef struct _jpeg_mem_dest_t
+{
+  struct jpeg_destination_mgr pub;
+  uint8_t *data;
+  size_t alloc, size;
+} _jpeg_mem_dest_t;
+
+static void _jpeg_mem_init_destination(j_compress_ptr cinfo)
+{
+  _jpeg_mem_dest_t *dest = (_jpeg_mem_dest_t *)cinfo->dest;
+  dest->pub.next_output_byte = dest->data;
+  dest->pub.free_in_buffer = dest->alloc;
+}
+
+static boolean _jpeg_mem_empty_output_buffer(j_compress_ptr cinfo)
+{
+  _jpeg_mem_dest_t *dest = (_jpeg_mem_dest_t *)cinfo->dest;
+  const size_t used = dest->alloc;
+  uint8_t *data = realloc(dest->data, 2 * dest->alloc);
+  if(!data) ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  dest->data = data;
+  dest->alloc *= 2;
+  dest->pub.next_output_byte = dest->data + used;
+  dest->pub.free_in_buffer = dest->alloc - used;
+  return TRUE;
+}
+
+static void _jpeg_mem_term_destination(j_compress_ptr cinfo)
+{
+  _jpeg_mem_dest_t *dest = (_jpeg_mem_dest_t *)cinfo->dest;
+  dest->size = dest->alloc - dest->pub.free_in_buffer;
+}
+
+// encode rows [y, y + rows), starting at in, as a complete jpeg of its own with the standard huffman tables of
+// jpeg_set_defaults(). only the first band carries the markers.
+static int _jpeg_encode_band(const dt_imageio_jpeg_t *jpg, const uint8_t *in, const int y, const int rows,
+                             void *exif, const int exif_len, const int exif_inline, const char *xmp,
+                             const int xmp_len, const uint8_t *icc, const uint32_t icc_len,
+                             _jpeg_mem_dest_t *dest)
+{
+  struct jpeg_compress_struct cinfo;
+  struct dt_imageio_jpeg_error_mgr jerr;
+  uint8_t *row = malloc((size_t)3 * jpg->width * sizeof(uint8_t));
+  if(!row) return 1;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = dt_imageio_jpeg_error_exit;
+  if(setjmp(jerr.setjmp_buffer))
+  {
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+    return 1;
+  }
+  jpeg_create_compress(&cinfo);
+
+  dest->alloc = MAX((size_t)3 * jpg->width * rows / 8, 65536);
+  dest->data = malloc(dest->alloc);
+  if(!dest->data) ERREXIT1(&cinfo, JERR_OUT_OF_MEMORY, 0);
+  dest->pub.init_destination = _jpeg_mem_init_destination;
+  dest->pub.empty_output_buffer = _jpeg_mem_empty_output_buffer;
+  dest->pub.term_destination = _jpeg_mem_term_destination;
+  cinfo.dest = &dest->pub;
+
+  _jpeg_setup(jpg, &cinfo, rows);
+  if(y > 0) cinfo.write_JFIF_header = FALSE;
+  jpeg_start_compress(&cinfo, TRUE);
+  if(y == 0) _jpeg_write_markers(&cinfo, exif, exif_len, exif_inline, xmp, xmp_len, icc, icc_len);
+  _jpeg_write_rows(&cinfo, in, jpg->width, rows, row);
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
   free(row);
-  jpeg_destroy_compress(&(jpg->cinfo));
-  fclose(f);
+  return 0;
+}
+
+// offset of the SOS marker of a jpeg written by _jpeg_encode_band(), and of the entropy coded data behind it
+static int _jpeg_find_scan(const _jpeg_mem_dest_t *band, size_t *sos, size_t *data)
+{
+  size_t pos = 2;
+  while(pos + 4 <= band->size && band->data[pos] == 0xff)
+  {
+    const size_t len = (band->data[pos + 2] << 8) | band->data[pos + 3];
+    if(band->data[pos + 1] == M_SOS_MARKER)
+    {
+      *sos = pos;
+      *data = pos + 2 + len;
+      // the scan has to run right up to the EOI marker
+      return *data > band->size - 2 || band->data[band->size - 2] != 0xff
+             || band->data[band->size - 1] != 0xd9;
+    }
+    pos += 2 + len;
+  }
+  return 1;
+}
+
+// huffman tables of a baseline scan, indexed by class * 4 + id. the bands are written with the standard
+// tables, their symbols are counted, and once all bands are done they are coded again with tables optimized
+// for the statistics of the whole image, like the sequential writer does with optimize_coding.
+typedef struct _jpeg_huff_t
+{
+  uint8_t bits[17];
+  uint8_t huffval[256];
+  // decoding
+  int32_t maxcode[18];
+  int32_t valoffset[18];
+  uint8_t look_nbits[256];
+  uint8_t look_sym[256];
+  // encoding
+  uint16_t code[256];
+  uint8_t size[256];
+} _jpeg_huff_t;
+
+typedef struct _jpeg_scan_t
+{
+  int ncomp, mcus;
+  int blocks[4];      // blocks per mcu of each component of the scan
+  int dc[4], ac[4];   // their tables
+  int present[8];
+  _jpeg_huff_t tables[8];
+} _jpeg_scan_t;
+
+typedef struct _jpeg_band_t
+{
+  _jpeg_mem_dest_t dest;
+  long counts[8][257];
+} _jpeg_band_t;
+
+// derive the lookup tables of a table given by bits and huffval, see section F.2.2.3 of the jpeg standard
+static int _jpeg_huff_derive(_jpeg_huff_t *t)
+{
+  memset(t->look_nbits, 0, sizeof(t->look_nbits));
+  memset(t->size, 0, sizeof(t->size));
+  int p = 0;
+  int32_t code = 0;
+  for(int l = 1; l <= 16; l++)
+  {
+    t->valoffset[l] = p - code;
+    for(int i = 0; i < t->bits[l]; i++, p++, code++)
+    {
+      const int sym = t->huffval[p];
+      t->code[sym] = code;
+      t->size[sym] = l;
+      if(l <= 8)
+        for(int k = 0; k < 1 << (8 - l); k++)
+        {
+          t->look_nbits[(code << (8 - l)) | k] = l;
+          t->look_sym[(code << (8 - l)) | k] = sym;
+        }
+    }
+    t->maxcode[l] = t->bits[l] ? code - 1 : -1;
+    if(code > (1 << l) || p > 256) return 1;
+    code <<= 1;
+  }
+  t->maxcode[17] = INT32_MAX;
+  return 0;
+}
+
+// optimal code lengths limited to 16 bits for the symbol counts, section K.2 of the jpeg standard
+static int _jpeg_huff_optimize(_jpeg_huff_t *t, const long *counts)
+{
+  long freq[257];
+  int codesize[257], others[257], bits[33] = { 0 };
+  memcpy(freq, counts, sizeof(long) * 256);
+  freq[256] = 1; // reserved, so that no code consists of ones only
+  for(int i = 0; i < 257; i++)
+  {
+    codesize[i] = 0;
+    others[i] = -1;
+  }
+
+  for(;;)
+  {
+    // the two least frequent symbols, c1 the larger one on ties
+    int c1 = -1, c2 = -1;
+    long v = LONG_MAX;
+    for(int i = 0; i < 257; i++)
+      if(freq[i] && freq[i] <= v)
+      {
+        v = freq[i];
+        c1 = i;
+      }
+    v = LONG_MAX;
+    for(int i = 0; i < 257; i++)
+      if(freq[i] && freq[i] <= v && i != c1)
+      {
+        v = freq[i];
+        c2 = i;
+      }
+    if(c2 < 0) break;
+
+    freq[c1] += freq[c2];
+    freq[c2] = 0;
+    codesize[c1]++;
+    while(others[c1] >= 0)
+    {
+      c1 = others[c1];
+      codesize[c1]++;
+    }
+    others[c1] = c2;
+    codesize[c2]++;
+    while(others[c2] >= 0)
+    {
+      c2 = others[c2];
+      codesize[c2]++;
+    }
+  }
+
+  for(int i = 0; i < 257; i++)
+    if(codesize[i])
+    {
+      if(codesize[i] > 32) return 1;
+      bits[codesize[i]]++;
+    }
+
+  int l = 32;
+  for(; l > 16; l--)
+    while(bits[l] > 0)
+    {
+      int j = l - 2;
+      while(bits[j] == 0) j--;
+      bits[l] -= 2;
+      bits[l - 1]++;
+      bits[j + 1] += 2;
+      bits[j]--;
+    }
+  while(bits[l] == 0) l--;
+  bits[l]--; // drop the reserved code point
+
+  memset(t->bits, 0, sizeof(t->bits));
+  for(int i = 1; i <= 16; i++) t->bits[i] = bits[i];
+  int p = 0;
+  for(int i = 1; i <= 32; i++)
+    for(int j = 0; j < 256; j++)
+      if(codesize[j] == i) t->huffval[p++] = j;
+  return _jpeg_huff_derive(t);
+}
+
+// tables, components and number of mcus of a band written by _jpeg_encode_band()
+static int _jpeg_parse_band(const _jpeg_mem_dest_t *band, const size_t sos, _jpeg_scan_t *scan)
+{
+  const uint8_t *b = band->data;
+  int width = 0, height = 0, ncomp = 0, max_h = 1, max_v = 1;
+  int ids[4] = { 0 }, h[4] = { 0 }, v[4] = { 0 };
+  memset(scan->present, 0, sizeof(scan->present));
+
+  for(size_t pos = 2; pos <= sos; pos += 2 + ((b[pos + 2] << 8) | b[pos + 3]))
+  {
+    const size_t len = (b[pos + 2] << 8) | b[pos + 3];
+    const uint8_t *seg = b + pos + 4;
+    if(b[pos + 1] == M_SOF0_MARKER || b[pos + 1] == M_SOF1_MARKER)
+    {
+      height = (seg[1] << 8) | seg[2];
+      width = (seg[3] << 8) | seg[4];
+      ncomp = seg[5];
+      if(ncomp < 2 || ncomp > 4) return 1;
+      for(int c = 0; c < ncomp; c++)
+      {
+        ids[c] = seg[6 + 3 * c];
+        h[c] = seg[7 + 3 * c] >> 4;
+        v[c] = seg[7 + 3 * c] & 15;
+        max_h = MAX(max_h, h[c]);
+        max_v = MAX(max_v, v[c]);
+      }
+    }
+    else if(b[pos + 1] == M_DHT_MARKER)
+    {
+      for(size_t k = 0; k + 17 <= len - 2;)
+      {
+        const int slot = (seg[k] >> 4) * 4 + (seg[k] & 3);
+        _jpeg_huff_t *t = scan->tables + slot;
+        int n = 0;
+        t->bits[0] = 0;
+        for(int l = 1; l <= 16; l++) n += t->bits[l] = seg[k + l];
+        if(n > 256 || k + 17 + n > len - 2) return 1;
+        memcpy(t->huffval, seg + k + 17, n);
+        if(_jpeg_huff_derive(t)) return 1;
+        scan->present[slot] = 1;
+        k += 17 + n;
+      }
+    }
+    else if(b[pos + 1] == M_SOS_MARKER)
+    {
+      scan->ncomp = seg[0];
+      if(scan->ncomp != ncomp) return 1;
+      for(int s = 0; s < scan->ncomp; s++)
+      {
+        int c = 0;
+        while(c < ncomp && ids[c] != seg[1 + 2 * s]) c++;
+        if(c == ncomp) return 1;
+        scan->blocks[s] = h[c] * v[c];
+        scan->dc[s] = seg[2 + 2 * s] >> 4;
+        scan->ac[s] = 4 + (seg[2 + 2 * s] & 3);
+        if(!scan->present[scan->dc[s]] || !scan->present[scan->ac[s]]) return 1;
+      }
+    }
+  }
+  scan->mcus = ((width + 8 * max_h - 1) / (8 * max_h)) * ((height + 8 * max_v - 1) / (8 * max_v));
+  return !width || !height;
+}
+
+typedef struct _jpeg_bits_t
+{
+  const uint8_t *in, *in_end;
+  uint8_t *out;
+  size_t out_size, out_alloc;
+  uint64_t buf;
+  int n;
+} _jpeg_bits_t;
+
+// refill the buffer with the entropy coded data, without the stuffed zero bytes, to more than 56 bits
+static inline void _jpeg_bits_fill(_jpeg_bits_t *b)
+{
+  while(b->n <= 56)
+  {
+    uint64_t c = 0;
+    if(b->in < b->in_end)
+    {
+      c = *b->in++;
+      if(c == 0xff && b->in < b->in_end && *b->in == 0) b->in++;
+    }
+    b->buf |= c << (56 - b->n);
+    b->n += 8;
+  }
+}
+
+// the next n bits, the buffer has to hold them already
+static inline uint32_t _jpeg_bits_get(_jpeg_bits_t *b, const int n)
+{
+  if(!n) return 0;
+  const uint32_t v = b->buf >> (64 - n);
+  b->buf <<= n;
+  b->n -= n;
+  return v;
+}
+
+static inline int _jpeg_bits_decode(_jpeg_bits_t *b, const _jpeg_huff_t *t)
+{
+  const int look = b->buf >> 56;
+  int l = t->look_nbits[look];
+  if(l)
+  {
+    b->buf <<= l;
+    b->n -= l;
+    return t->look_sym[look];
+  }
+  l = 9;
+  while(l <= 16 && (int32_t)(b->buf >> (64 - l)) > t->maxcode[l]) l++;
+  if(l > 16) return -1;
+  const int32_t code = _jpeg_bits_get(b, l);
+  return t->huffval[t->valoffset[l] + code];
+}
 
-  dt_exif_write_blob(exif, exif_len, filename, 1);
+// move the whole bytes of the buffer to the output, at most 6 of them with stuffing
+static inline int _jpeg_bits_flush(_jpeg_bits_t *b)
+{
+  if(b->out_size + 12 > b->out_alloc)
+  {
+    uint8_t *out = realloc(b->out, 2 * b->out_alloc);
+    if(!out) return 1;
+    b->out = out;
+    b->out_alloc *= 2;
+  }
+  while(b->n >= 8)
+  {
+    b->n -= 8;
+    const uint8_t c = b->buf >> b->n;
+    b->out[b->out_size++] = c;
+    if(c == 0xff) b->out[b->out_size++] = 0;
+  }
+  return 0;
+}
+
+static inline int _jpeg_bits_put(_jpeg_bits_t *b, const uint32_t v, const int n)
+{
+  b->buf = (b->buf << n) | v;
+  b->n += n;
+  return b->n >= 32 ? _jpeg_bits_flush(b) : 0;
+}
 
+// walk the blocks of the scan data of a band. with tables given the symbols are coded again with them,
+// otherwise they are counted.
+static int _jpeg_walk_scan(const _jpeg_scan_t *scan, const uint8_t *data, const size_t size, long counts[8][257],
+                           const _jpeg_huff_t *tables, _jpeg_bits_t *out)
+{
+  _jpeg_bits_t in = { .in = data, .in_end = data + size };
+  for(int m = 0; m < scan->mcus; m++)
+    for(int s = 0; s < scan->ncomp; s++)
+      for(int blk = 0; blk < scan->blocks[s]; blk++)
+      {
+        for(int k = 0; k < 64;)
+        {
+          // a code and its extra bits take up to 27 bits
+          _jpeg_bits_fill(&in);
+          const int slot = k ? scan->ac[s] : scan->dc[s];
+          const int sym = _jpeg_bits_decode(&in, scan->tables + slot);
+          if(sym < 0) return 1;
+          const int extra = sym & 15;
+          if(k == 0 && sym > 11) return 1;
+          const uint32_t v = _jpeg_bits_get(&in, k ? extra : sym);
+          if(tables)
+          {
+            const _jpeg_huff_t *t = tables + slot;
+            if(!t->size[sym] || _jpeg_bits_put(out, t->code[sym], t->size[sym])
+               || _jpeg_bits_put(out, v, k ? extra : sym))
+              return 1;
+          }
+          else
+            counts[slot][sym]++;
+
+          if(k == 0)
+            k = 1;
+          else if(extra)
+            k += (sym >> 4) + 1;
+          else if(sym == 0xf0)
+            k += 16;
+          else
+            break; // end of block
+        }
+      }
+  // pad the last byte with ones
+  if(tables)
+  {
+    const int pad = (8 - out->n % 8) % 8;
+    if(_jpeg_bits_put(out, (1 << pad) - 1, pad) || _jpeg_bits_flush(out)) return 1;
+  }
   return 0;
 }
 
+typedef struct _jpeg_writer_t
+{
+  struct jpeg_compress_struct cinfo;
+  struct dt_imageio_jpeg_error_mgr jerr;
+  FILE *f;
+  char *filename;
+  uint8_t *row;
+  uint8_t *icc;
+  uint32_t icc_len;
+  void *exif;
+  int exif_len, exif_inline;
+  // the xmp packet if it goes into a marker, otherwise the image it is attached for
+  const char *xmp;
+  int xmp_len, xmp_imgid;
+  // parallel writer: rows per band and the restart interval, 0 for the sequential one
+  int band_rows, restart_interval;
+  int nbands;
+  _jpeg_band_t *bands;
+  int started, failed;
+} _jpeg_writer_t;
+
+// encode horizontal bands concurrently with the standard tables and count the symbols of each of them. they
+// are kept in memory until write_end() knows the statistics of the whole image.
+static int _jpeg_encode_bands(const dt_imageio_jpeg_t *jpg, _jpeg_writer_t *w, const uint8_t *in, const int y,
+                              const int rows)
+{
+  const int band_rows = w->band_rows;
+  const int first = y / band_rows;
+  const int nbands = MIN((rows + band_rows - 1) / band_rows, w->nbands - first);
+  _jpeg_band_t *bands = w->bands + first;
+
+  int failed = 0;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(bands, in, jpg, w) schedule(dynamic) reduction(| : failed)
+#endif
+  for(int k = 0; k < nbands; k++)
+  {
+    const int r = k * band_rows;
+    _jpeg_band_t *band = bands + k;
+    _jpeg_scan_t *scan = malloc(sizeof(_jpeg_scan_t));
+    size_t sos = 0, data = 0;
+    failed |= !scan
+              || _jpeg_encode_band(jpg, in + (size_t)4 * r * jpg->width, y + r, MIN(band_rows, rows - r),
+                                   w->exif, w->exif_len, w->exif_inline, w->xmp, w->xmp_len, w->icc,
+                                   w->icc_len, &band->dest)
+              || _jpeg_find_scan(&band->dest, &sos, &data) || _jpeg_parse_band(&band->dest, sos, scan)
+              || _jpeg_walk_scan(scan, band->dest.data + data, band->dest.size - 2 - data, band->counts, NULL,
+                                 NULL);
+    free(scan);
+  }
+  return failed;
+}
+
+// stitch the bands into one baseline jpeg: the headers of the first band with the full height in the frame
+// header, the optimized tables and a restart interval of one band, then the entropy coded segments of all
+// bands separated by RSTn markers. every band starts with fresh dc predictions just like a decoder expects it
+// after a restart marker, so the result is a standard restart interval jpeg.
+static int _jpeg_write_bands(const dt_imageio_jpeg_t *jpg, _jpeg_writer_t *w)
+{
+  FILE *f = w->f;
+  _jpeg_band_t *bands = w->bands;
+  const int nbands = w->nbands;
+
+  // tables from the symbols of all bands. should that fail, the standard tables the bands have been written
+  // with are kept.
+  _jpeg_huff_t *tables = calloc(8, sizeof(_jpeg_huff_t));
+  _jpeg_scan_t *scan = malloc(sizeof(_jpeg_scan_t));
+  size_t sos = 0, data = 0;
+  if(!scan || _jpeg_find_scan(&bands[0].dest, &sos, &data) || _jpeg_parse_band(&bands[0].dest, sos, scan))
+  {
+    free(tables);
+    free(scan);
+    return 1;
+  }
+  for(int slot = 0; slot < 8 && tables; slot++)
+  {
+    if(!scan->present[slot]) continue;
+    long counts[257] = { 0 };
+    for(int k = 0; k < nbands; k++)
+      for(int i = 0; i < 256; i++) counts[i] += bands[k].counts[slot][i];
+    if(_jpeg_huff_optimize(tables + slot, counts))
+    {
+      free(tables);
+      tables = NULL;
+    }
+  }
+
+  // headers of the first band
+  uint8_t *b = bands[0].dest.data;
+  fwrite(b, 1, 2, f);
+  for(size_t pos = 2; pos < sos; pos += 2 + ((b[pos + 2] << 8) | b[pos + 3]))
+  {
+    const size_t len = (b[pos + 2] << 8) | b[pos + 3];
+    if(b[pos + 1] == M_SOF0_MARKER || b[pos + 1] == M_SOF1_MARKER)
+    {
+      // the frame header with the height of the whole image. the band keeps its own for parsing it again.
+      fwrite(b + pos, 1, 5, f);
+      const uint8_t height[2] = { jpg->height >> 8, jpg->height & 0xff };
+      fwrite(height, 1, sizeof(height), f);
+      fwrite(b + pos + 7, 1, len - 5, f);
+    }
+    else if(b[pos + 1] != M_DHT_MARKER || !tables)
+      fwrite(b + pos, 1, 2 + len, f);
+  }
+  if(tables)
+  {
+    // one segment with all tables: class and id, the 16 counts of codes per length, the symbols
+    size_t len = 2;
+    for(int slot = 0; slot < 8; slot++)
+      if(scan->present[slot])
+      {
+        len += 17;
+        for(int l = 1; l <= 16; l++) len += tables[slot].bits[l];
+      }
+    const uint8_t dht[4] = { 0xff, M_DHT_MARKER, len >> 8, len & 0xff };
+    fwrite(dht, 1, sizeof(dht), f);
+    for(int slot = 0; slot < 8; slot++)
+    {
+      if(!scan->present[slot]) continue;
+      int n = 0;
+      const uint8_t tc_th = ((slot / 4) << 4) | (slot % 4);
+      fwrite(&tc_th, 1, 1, f);
+      for(int l = 1; l <= 16; l++) n += tables[slot].bits[l];
+      fwrite(tables[slot].bits + 1, 1, 16, f);
+      fwrite(tables[slot].huffval, 1, n, f);
+    }
+  }
+  const uint8_t dri[6] = { 0xff, M_DRI_MARKER, 0, 4, w->restart_interval >> 8, w->restart_interval & 0xff };
+  fwrite(dri, 1, sizeof(dri), f);
+  fwrite(b + sos, 1, data - sos, f);
+  free(scan);
+
+  // code the scans of a batch of bands with the new tables concurrently, and write them
+  const int batch = tables ? 4 * dt_get_num_threads() : nbands;
+  _jpeg_bits_t *out = calloc(batch, sizeof(_jpeg_bits_t));
+  int failed = !out;
+  for(int first = 0; first < nbands && !failed; first += batch)
+  {
+    const int n = MIN(batch, nbands - first);
+    if(tables)
+    {
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(bands, first, out, tables) schedule(dynamic)                        \
+    reduction(| : failed)
+#endif
+      for(int k = 0; k < n; k++)
+      {
+        _jpeg_mem_dest_t *band = &bands[first + k].dest;
+        _jpeg_scan_t *bscan = malloc(sizeof(_jpeg_scan_t));
+        size_t bsos = 0, bdata = 0;
+        memset(out + k, 0, sizeof(_jpeg_bits_t));
+        out[k].out_alloc = band->size + 64;
+        out[k].out = malloc(out[k].out_alloc);
+        failed |= !bscan || !out[k].out || _jpeg_find_scan(band, &bsos, &bdata)
+                  || _jpeg_parse_band(band, bsos, bscan)
+                  || _jpeg_walk_scan(bscan, band->data + bdata, band->size - 2 - bdata, NULL, tables, out + k);
+        free(bscan);
+        // the band isn't needed anymore
+        free(band->data);
+        band->data = NULL;
+      }
+    }
+
+    for(int k = 0; k < n && !failed; k++)
+    {
+      const int band = first + k;
+      if(band > 0)
+      {
+        const uint8_t rst[2] = { 0xff, M_RST0_MARKER + ((band - 1) & 7) };
+        fwrite(rst, 1, sizeof(rst), f);
+      }
+      if(tables)
+        fwrite(out[k].out, 1, out[k].out_size, f);
+      else
+      {
+        _jpeg_mem_dest_t *dest = &bands[band].dest;
+        size_t bsos = 0, bdata = 0;
+        failed = _jpeg_find_scan(dest, &bsos, &bdata);
+        if(!failed) fwrite(dest->data + bdata, 1, dest->size - 2 - bdata, f);
+      }
+    }
+    for(int k = 0; k < n; k++)
+    {
+      free(out[k].out);
+      out[k].out = NULL;
+    }
+  }
+
+  const uint8_t eoi[2] = { 0xff, 0xd9 };
+  fwrite(eoi, 1, sizeof(eoi), f);
+  free(out);
+  free(tables);
+  return failed || ferror(f);
+}
+
+void *write_begin(dt_imageio_module_data_t *jpg_tmp, const char *filename,
+                  dt_colorspaces_color_profile_type_t over_type, const char *over_filename, void *exif,
+                  int exif_len, const char *xmp, int xmp_len, int imgid, int num, int total, int *rows)
+{
+  dt_imageio_jpeg_t *jpg = (dt_imageio_jpeg_t *)jpg_tmp;
+  _jpeg_writer_t *w = (_jpeg_writer_t *)calloc(1, sizeof(_jpeg_writer_t));
+  if(!w) return NULL;
+
+  if(imgid > 0)
+  {
+    cmsHPROFILE out_profile = dt_colorspaces_get_output_profile(imgid, over_type, over_filename)->profile;
+    cmsSaveProfileToMem(out_profile, 0, &w->icc_len);
+    if(w->icc_len > 0)
+    {
+      w->icc = malloc(w->icc_len * sizeof(unsigned char));
+      cmsSaveProfileToMem(out_profile, w->icc, &w->icc_len);
+    }
+  }
+  w->exif = exif;
+  w->exif_len = exif_len;
+  w->exif_inline = exif && exif_len > 0 && exif_len <= 65533;
+  if(xmp && xmp_len > 0 && (size_t)xmp_len <= XMP_MAX_INLINE)
+  {
+    w->xmp = xmp;
+    w->xmp_len = xmp_len;
+  }
+  else if(xmp && xmp_len > 0)
+    w->xmp_imgid = imgid;
+  w->filename = g_strdup(filename);
+  w->row = malloc((size_t)3 * jpg->width * sizeof(uint8_t));
+
+  w->cinfo.err = jpeg_std_error(&w->jerr.pub);
+  w->jerr.pub.error_exit = dt_imageio_jpeg_error_exit;
+  if(setjmp(w->jerr.setjmp_buffer))
+  {
+    w->failed = 1;
+    write_end(jpg_tmp, w);
+    return NULL;
+  }
+  jpeg_create_compress(&w->cinfo);
+  w->f = g_fopen(filename, "wb");
+  if(!w->f || !w->row)
+  {
+    w->failed = 1;
+    write_end(jpg_tmp, w);
+    return NULL;
+  }
+
+  _jpeg_setup(jpg, &w->cinfo, jpg->height);
+  w->cinfo.optimize_coding = 1;
+
+  // large images are cut into bands of whole mcu rows which are encoded in parallel. the restart interval
+  // counts mcus and is limited to 16 bits.
+  int max_h = 1, max_v = 1;
+  for(int c = 0; c < w->cinfo.num_components; c++)
+  {
+    max_h = MAX(max_h, w->cinfo.comp_info[c].h_samp_factor);
+    max_v = MAX(max_v, w->cinfo.comp_info[c].v_samp_factor);
+  }
+  const int mcus_per_row = (jpg->width + 8 * max_h - 1) / (8 * max_h);
+  const int mcu_rows = (jpg->height + 8 * max_v - 1) / (8 * max_v);
+  const int threads = dt_get_num_threads();
+  const int band_mcu_rows
+      = MIN(MAX((mcu_rows + 4 * threads - 1) / (4 * threads), 4), 65535 / MAX(mcus_per_row, 1));
+
+  if(threads > 1 && (size_t)jpg->width * jpg->height >= PARALLEL_MIN_PIXELS && band_mcu_rows > 0
+     && band_mcu_rows < mcu_rows)
+  {
+    w->band_rows = band_mcu_rows * 8 * max_v;
+    w->restart_interval = band_mcu_rows * mcus_per_row;
+    w->nbands = (jpg->height + w->band_rows - 1) / w->band_rows;
+    w->bands = calloc(w->nbands, sizeof(_jpeg_band_t));
+    if(!w->bands)
+    {
+      w->failed = 1;
+      write_end(jpg_tmp, w);
+      return NULL;
+    }
+    // a band for every thread per call
+    *rows = w->band_rows * threads;
+  }
+  else
+  {
+    jpeg_stdio_dest(&w->cinfo, w->f);
+    jpeg_start_compress(&w->cinfo, TRUE);
+    w->started = 1;
+    _jpeg_write_markers(&w->cinfo, exif, exif_len, w->exif_inline, w->xmp, w->xmp_len, w->icc, w->icc_len);
+    *rows = 1;
+  }
+  return w;
+}
+
+int write_rows(dt_imageio_module_data_t *jpg_tmp, void *handle, const void *in_tmp, int y, int rows)
+{
+  dt_imageio_jpeg_t *jpg = (dt_imageio_jpeg_t *)jpg_tmp;
+  _jpeg_writer_t *w = (_jpeg_writer_t *)handle;
+  if(w->failed) return 1;
+  if(w->band_rows)
+    w->failed = _jpeg_encode_bands(jpg, w, (const uint8_t *)in_tmp, y, rows);
+  else if(setjmp(w->jerr.setjmp_buffer))
+    w->failed = 1;
+  else
+    _jpeg_write_rows(&w->cinfo, (const uint8_t *)in_tmp, jpg->width, rows, w->row);
+  return w->failed;
+}
+
+int write_end(dt_imageio_module_data_t *jpg_tmp, void *handle)
+{
+  _jpeg_writer_t *w = (_jpeg_writer_t *)handle;
+  if(w->started && !w->failed)
+  {
+    if(setjmp(w->jerr.setjmp_buffer))
+      w->failed = 1;
+    else
+      jpeg_finish_compress(&w->cinfo);
+  }
+  else if(w->band_rows && !w->failed)
+    w->failed = _jpeg_write_bands((dt_imageio_jpeg_t *)jpg_tmp, w);
+  jpeg_destroy_compress(&w->cinfo);
+
+  if(w->f)
+  {
+    const int werr = ferror(w->f);
+    if(fclose(w->f) || werr) w->failed = 1;
+  }
+  if(!w->failed && w->exif && !w->exif_inline) dt_exif_write_blob(w->exif, w->exif_len, w->filename, 1);
+  if(!w->failed && w->xmp_imgid > 0) dt_exif_xmp_attach(w->xmp_imgid, w->filename);
+
+  const int failed = w->failed || !w->f;
+  for(int k = 0; k < w->nbands; k++) free(w->bands[k].dest.data);
+  free(w->bands);
+  g_free(w->filename);
+  free(w->row);
+  free(w->icc);
+  free(w);
+  return failed;
+}
+
+int write_image(dt_imageio_module_data_t *jpg_tmp, const char *filename, const void *in_tmp,
+                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
+                void *exif, int exif_len, int imgid, int num, int total)
+{
+  int rows;
+  void *w = write_begin(jpg_tmp, filename, over_type, over_filename, exif, exif_len, NULL, 0, imgid, num, total,
+                        &rows);
+  if(!w) return 1;
+  const int failed = write_rows(jpg_tmp, w, in_tmp, 0, ((dt_imageio_jpeg_t *)jpg_tmp)->height);
+  return write_end(jpg_tmp, w) | failed;
+}
+
+#undef PARALLEL_MIN_PIXELS
+#undef XMP_NAMESPACE
+#undef XMP_NAMESPACE_LEN
+#undef XMP_MAX_INLINE
+#undef M_SOF0_MARKER
+#undef M_SOF1_MARKER
+#undef M_RST0_MARKER
+#undef M_SOS_MARKER
+#undef M_DHT_MARKER
+#undef M_DRI_MARKER
+
 static int __attribute__((__unused__)) read_header(const char *filename, dt_imageio_jpeg_t *jpg)
 {
   jpg->f = g_fopen(filename, "rb");
@@ -28,50 +28,90 @@
 
 DT_MODULE(1)
 
-int write_image(dt_imageio_module_data_t *data, const char *filename, const void *ivoid,
-                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
-                void *exif, int exif_len, int imgid, int num, int total)
+typedef struct _pfm_writer_t
+{
+  FILE *f;
+  long header;
+  float *buf_line;
+} _pfm_writer_t;
+
+void *write_begin(dt_imageio_module_data_t *data, const char *filename,
+                  dt_colorspaces_color_profile_type_t over_type, const char *over_filename, void *exif,
+                  int exif_len, const char *xmp, int xmp_len, int imgid, int num, int total, int *rows)
 {
   const dt_imageio_module_data_t *const pfm = data;
-  int status = 0;
-  FILE *f = g_fopen(filename, "wb");
-  if(f)
+  _pfm_writer_t *w = (_pfm_writer_t *)malloc(sizeof(_pfm_writer_t));
+  if(!w) return NULL;
+  w->buf_line = dt_alloc_align(16, 3 * sizeof(float) * pfm->width);
+  w->f = w->buf_line ? g_fopen(filename, "wb") : NULL;
+  if(!w->f)
+  {
+    dt_free_align(w->buf_line);
+    free(w);
+    return NULL;
+  }
+  FILE *f = w->f;
+
+  // align pfm header to sse, assuming the file will
+  // be mmapped to page boundaries.
+  char header[1024];
+  snprintf(header, 1024, "PF\n%d %d\n-1.0", pfm->width, pfm->height);
+  size_t len = strlen(header);
+  fprintf(f, "PF\n%d %d\n-1.0", pfm->width, pfm->height);
+  ssize_t off = 0;
+  while((len + 1 + off) & 0xf) off++;
+  while(off-- > 0) fprintf(f, "0");
+  fprintf(f, "\n");
+
+  w->header = ftell(f);
+  *rows = 1;
+  return w;
+}
+
+int write_rows(dt_imageio_module_data_t *data, void *handle, const void *ivoid, int y, int rows)
+{
+  const dt_imageio_module_data_t *const pfm = data;
+  _pfm_writer_t *w = (_pfm_writer_t *)handle;
+
+  // NOTE: pfm has rows in reverse order, so the band ends up in one piece above the ones written before
+  const size_t rowsize = 3 * sizeof(float) * pfm->width;
+  if(fseek(w->f, w->header + (long)((pfm->height - y - rows) * rowsize), SEEK_SET)) return 1;
+  for(int j = rows - 1; j >= 0; j--)
   {
-    // align pfm header to sse, assuming the file will
-    // be mmapped to page boundaries.
-    char header[1024];
-    snprintf(header, 1024, "PF\n%d %d\n-1.0", pfm->width, pfm->height);
-    size_t len = strlen(header);
-    fprintf(f, "PF\n%d %d\n-1.0", pfm->width, pfm->height);
-    ssize_t off = 0;
-    while((len + 1 + off) & 0xf) off++;
-    while(off-- > 0) fprintf(f, "0");
-    fprintf(f, "\n");
-    void *buf_line = dt_alloc_align(16, 3 * sizeof(float) * pfm->width);
-    for(int j = 0; j < pfm->height; j++)
+    const float *in = (const float *)ivoid + 4 * (size_t)pfm->width * j;
+    float *out = w->buf_line;
+    for(int i = 0; i < pfm->width; i++, in += 4, out += 3)
     {
-      // NOTE: pfm has rows in reverse order
-      const int row_in = pfm->height - 1 - j;
-      const float *in = (const float *)ivoid + 4 * (size_t)pfm->width * row_in;
-      float *out = (float *)buf_line;
-      for(int i = 0; i < pfm->width; i++, in += 4, out += 3)
-      {
-        memcpy(out, in, 3 * sizeof(float));
-      }
-      // INFO: per-line fwrite call seems to perform best. LebedevRI, 18.04.2014
-      int cnt = fwrite(buf_line, 3 * sizeof(float), pfm->width, f);
-      if(cnt != pfm->width)
-        status = 1;
-      else
-        status = 0;
+      memcpy(out, in, 3 * sizeof(float));
     }
-    dt_free_align(buf_line);
-    buf_line = NULL;
-    fclose(f);
+    // INFO: per-line fwrite call seems to perform best. LebedevRI, 18.04.2014
+    int cnt = fwrite(w->buf_line, 3 * sizeof(float), pfm->width, w->f);
+    if(cnt != pfm->width) return 1;
   }
+  return 0;
+}
+
+int write_end(dt_imageio_module_data_t *data, void *handle)
+{
+  _pfm_writer_t *w = (_pfm_writer_t *)handle;
+  const int status = fclose(w->f) ? 1 : 0;
+  dt_free_align(w->buf_line);
+  free(w);
   return status;
 }
 
+int write_image(dt_imageio_module_data_t *data, const char *filename, const void *ivoid,
+                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
+                void *exif, int exif_len, int imgid, int num, int total)
+{
+  int rows;
+  void *w = write_begin(data, filename, over_type, over_filename, exif, exif_len, NULL, 0, imgid, num, total,
+                        &rows);
+  if(!w) return 1;
+  const int status = write_rows(data, w, ivoid, 0, data->height);
+  return write_end(data, w) | status;
+}
+
 size_t params_size(dt_imageio_module_format_t *self)
 {
   return sizeof(dt_imageio_module_data_t);
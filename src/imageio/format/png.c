@@ -122,41 +122,275 @@ static void PNGwriteRawProfile(png_struct *ping, png_info *ping_info, char *prof
   png_free(ping, text);
 }
 
-int write_image(dt_imageio_module_data_t *p_tmp, const char *filename, const void *ivoid,
-                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
-                void *exif, int exif_len, int imgid, int num, int total)
+// images with fewer pixels are encoded by libpng in one go
+#define PARALLEL_MIN_PIXELS (4 << 20)
+
+// row y of the 4 channel input as packed rgb, 16 bit samples in network byte order
+static void _png_pack_row(const void *ivoid, const int width, const int bpp, const int y, uint8_t *out)
 {
-  dt_imageio_png_t *p = (dt_imageio_png_t *)p_tmp;
-  const int width = p->width, height = p->height;
-  FILE *f = g_fopen(filename, "wb");
-  if(!f) return 1;
+  if(bpp > 8)
+  {
+    const uint16_t *in = (const uint16_t *)ivoid + (size_t)4 * y * width;
+    for(int x = 0; x < width; x++)
+      for(int k = 0; k < 3; k++)
+      {
+        out[6 * x + 2 * k] = in[4 * x + k] >> 8;
+        out[6 * x + 2 * k + 1] = in[4 * x + k] & 0xff;
+      }
+  }
+  else
+  {
+    const uint8_t *in = (const uint8_t *)ivoid + (size_t)4 * y * width;
+    for(int x = 0; x < width; x++)
+      for(int k = 0; k < 3; k++) out[3 * x + k] = in[4 * x + k];
+  }
+}
+
+static inline uint8_t _png_paeth(const int a, const int b, const int c)
+{
+  const int p = a + b - c;
+  const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if(pa <= pb && pa <= pc) return a;
+  return pb <= pc ? b : c;
+}
+
+// filter one row with all five filters and keep the one with the smallest sum of absolute (signed) bytes,
+// which is the heuristic libpng uses as well. out gets the filter type byte followed by the filtered row,
+// scratch has to hold 5 rows.
+static void _png_filter_row(const uint8_t *row, const uint8_t *prev, const size_t rowbytes, const int pixbytes,
+                            uint8_t *scratch, uint8_t *out)
+{
+  size_t best_sum = SIZE_MAX;
+  int best = 0;
+  for(int f = 0; f < 5; f++)
+  {
+    uint8_t *o = scratch + f * rowbytes;
+    size_t sum = 0;
+    for(size_t i = 0; i < rowbytes; i++)
+    {
+      const int a = i >= (size_t)pixbytes ? row[i - pixbytes] : 0;
+      const int b = prev[i];
+      const int c = i >= (size_t)pixbytes ? prev[i - pixbytes] : 0;
+      uint8_t v = row[i];
+      if(f == 1)
+        v -= a;
+      else if(f == 2)
+        v -= b;
+      else if(f == 3)
+        v -= (a + b) >> 1;
+      else if(f == 4)
+        v -= _png_paeth(a, b, c);
+      o[i] = v;
+      sum += v < 128 ? v : 256 - v;
+    }
+    if(sum < best_sum)
+    {
+      best_sum = sum;
+      best = f;
+    }
+  }
+  out[0] = best;
+  memcpy(out + 1, scratch + best * rowbytes, rowbytes);
+}
+
+typedef struct _png_group_t
+{
+  uint8_t *data;
+  size_t size;
+  uLong adler;
+} _png_group_t;
 
+typedef struct _png_writer_t
+{
+  FILE *f;
   png_structp png_ptr;
   png_infop info_ptr;
-
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if(!png_ptr)
+  // parallel writer: rows per group, 0 for the sequential one of libpng
+  int group_rows;
+  // the last packed row and the last 32k of filtered data handed to deflate so far, and their checksum
+  uint8_t *prev;
+  uint8_t window[32768];
+  size_t window_len;
+  uLong adler;
+  int failed;
+} _png_writer_t;
+
+// filter and deflate groups of rows concurrently and write the pieces as IDAT chunks. each group is a run of
+// raw deflate blocks primed with the last 32k before it as dictionary, ended by a sync flush so the next one
+// starts on a byte boundary. together with a zlib header in front and the combined adler32 behind them this
+// is a single valid zlib stream, so it doesn't matter how the rows are split into calls.
+static int _png_write_groups(const dt_imageio_png_t *p, _png_writer_t *w, const void *ivoid, const int y,
+                             const int rows)
+{
+  const int width = p->width, bpp = p->bpp, level = p->compression;
+  const int pixbytes = 3 * bpp / 8;
+  const size_t rowbytes = (size_t)pixbytes * width;
+  const size_t stride = rowbytes + 1;
+  const int group_rows = w->group_rows;
+  const int ngroups = (rows + group_rows - 1) / group_rows;
+  const int finish = y + rows >= p->height;
+
+  uint8_t *filtered = malloc(stride * rows);
+  _png_group_t *groups = calloc(ngroups, sizeof(_png_group_t));
+  if(!filtered || !groups)
   {
-    fclose(f);
+    free(filtered);
+    free(groups);
     return 1;
   }
 
-  info_ptr = png_create_info_struct(png_ptr);
-  if(!info_ptr)
+  int failed = 0;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(filtered, ivoid, w) schedule(dynamic) reduction(| : failed)
+#endif
+  for(int g = 0; g < ngroups; g++)
   {
-    fclose(f);
-    png_destroy_write_struct(&png_ptr, NULL);
-    return 1;
+    uint8_t *buf = calloc(7, rowbytes);
+    if(!buf)
+    {
+      failed = 1;
+      continue;
+    }
+    uint8_t *prev = buf, *row = buf + rowbytes;
+    const int y0 = g * group_rows;
+    if(y0 > 0)
+      _png_pack_row(ivoid, width, bpp, y0 - 1, prev);
+    else if(y > 0)
+      memcpy(prev, w->prev, rowbytes);
+    for(int r = y0; r < MIN(y0 + group_rows, rows); r++)
+    {
+      _png_pack_row(ivoid, width, bpp, r, row);
+      _png_filter_row(row, prev, rowbytes, pixbytes, buf + 2 * rowbytes, filtered + r * stride);
+      uint8_t *tmp = prev;
+      prev = row;
+      row = tmp;
+    }
+    free(buf);
   }
 
-  if(setjmp(png_jmpbuf(png_ptr)))
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(filtered, groups, w) schedule(dynamic) reduction(| : failed)
+#endif
+  for(int g = 0; g < ngroups; g++)
   {
-    fclose(f);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    return 1;
+    const int last = finish && g == ngroups - 1;
+    const size_t start = (size_t)g * group_rows * stride;
+    const size_t len = (size_t)MIN(group_rows, rows - g * group_rows) * stride;
+    z_stream zs = { 0 };
+    if(deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      failed = 1;
+      continue;
+    }
+    // groups are a lot larger than the window, only the first one of a call needs the previous call's data
+    if(g > 0)
+    {
+      const size_t dict = MIN(start, sizeof(w->window));
+      deflateSetDictionary(&zs, filtered + start - dict, dict);
+    }
+    else if(w->window_len)
+      deflateSetDictionary(&zs, w->window, w->window_len);
+
+    // room for the zlib header in the very first and the checksum in the very last group
+    const size_t head = y == 0 && g == 0 ? 2 : 0;
+    const size_t alloc = deflateBound(&zs, len) + 16 + head + 4;
+    _png_group_t *grp = groups + g;
+    grp->data = malloc(alloc);
+    if(!grp->data)
+    {
+      deflateEnd(&zs);
+      failed = 1;
+      continue;
+    }
+    zs.next_in = filtered + start;
+    zs.avail_in = len;
+    zs.next_out = grp->data + head;
+    zs.avail_out = alloc - head - 4;
+    const int rc = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if(rc != (last ? Z_STREAM_END : Z_OK) || zs.avail_in) failed = 1;
+    grp->size = zs.next_out - grp->data;
+    grp->adler = adler32(adler32(0L, Z_NULL, 0), filtered + start, len);
+    deflateEnd(&zs);
   }
 
-  png_init_io(png_ptr, f);
+  if(!failed)
+  {
+    if(y == 0)
+    {
+      // zlib header for a 32k window, the level hint is what deflateInit() would write
+      const int level_flags = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+      unsigned int header = (0x78 << 8) | (level_flags << 6);
+      header += 31 - header % 31;
+      groups[0].data[0] = header >> 8;
+      groups[0].data[1] = header & 0xff;
+    }
+
+    for(int g = 0; g < ngroups; g++)
+    {
+      const size_t len = (size_t)MIN(group_rows, rows - g * group_rows) * stride;
+      w->adler = adler32_combine(w->adler, groups[g].adler, len);
+    }
+    if(finish)
+    {
+      _png_group_t *last = groups + ngroups - 1;
+      for(int k = 0; k < 4; k++) last->data[last->size++] = (w->adler >> (24 - 8 * k)) & 0xff;
+    }
+
+    for(int g = 0; g < ngroups; g++)
+      png_write_chunk(w->png_ptr, (png_bytep)"IDAT", groups[g].data, groups[g].size);
+
+    // remember what the next call continues from
+    const size_t len = stride * rows;
+    if(len >= sizeof(w->window))
+    {
+      memcpy(w->window, filtered + len - sizeof(w->window), sizeof(w->window));
+      w->window_len = sizeof(w->window);
+    }
+    else
+    {
+      const size_t keep = MIN(w->window_len, sizeof(w->window) - len);
+      memmove(w->window, w->window + w->window_len - keep, keep);
+      memcpy(w->window + keep, filtered, len);
+      w->window_len = keep + len;
+    }
+    _png_pack_row(ivoid, width, bpp, rows - 1, w->prev);
+  }
+
+  for(int g = 0; g < ngroups; g++) free(groups[g].data);
+  free(groups);
+  free(filtered);
+  return failed;
+}
+
+void *write_begin(dt_imageio_module_data_t *p_tmp, const char *filename,
+                  dt_colorspaces_color_profile_type_t over_type, const char *over_filename, void *exif,
+                  int exif_len, const char *xmp, int xmp_len, int imgid, int num, int total, int *rows)
+{
+  dt_imageio_png_t *p = (dt_imageio_png_t *)p_tmp;
+  const int width = p->width, height = p->height;
+  _png_writer_t *w = (_png_writer_t *)calloc(1, sizeof(_png_writer_t));
+  if(!w) return NULL;
+
+  w->f = g_fopen(filename, "wb");
+  if(w->f) w->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if(w->png_ptr) w->info_ptr = png_create_info_struct(w->png_ptr);
+  if(!w->info_ptr)
+  {
+    w->failed = 1;
+    write_end(p_tmp, w);
+    return NULL;
+  }
+
+  if(setjmp(png_jmpbuf(w->png_ptr)))
+  {
+    w->failed = 1;
+    write_end(p_tmp, w);
+    return NULL;
+  }
+
+  png_structp png_ptr = w->png_ptr;
+  png_infop info_ptr = w->info_ptr;
+  png_init_io(png_ptr, w->f);
 
   png_set_compression_level(png_ptr, p->compression);
   png_set_compression_mem_level(png_ptr, 8);
@@ -197,38 +431,108 @@ int write_image(dt_imageio_module_data_t *p_tmp, const char *filename, const voi
   // write exif data
   PNGwriteRawProfile(png_ptr, info_ptr, "exif", exif, exif_len);
 
+  // embed the xmp packet the way exiv2 does, as uncompressed international text
+  if(xmp && xmp_len > 0)
+  {
+    png_text text = { 0 };
+    text.compression = PNG_ITXT_COMPRESSION_NONE;
+    text.key = (png_charp)"XML:com.adobe.xmp";
+    text.text = (png_charp)xmp;
+    png_set_text(png_ptr, info_ptr, &text, 1);
+  }
+
   png_write_info(png_ptr, info_ptr);
 
+  const int threads = dt_get_num_threads();
+  if(threads > 1 && (size_t)width * height >= PARALLEL_MIN_PIXELS)
+  {
+    const size_t stride = (size_t)3 * p->bpp / 8 * width + 1;
+    w->group_rows = MAX((height + 4 * threads - 1) / (4 * threads), (int)((1 << 18) / stride) + 1);
+    w->prev = malloc(stride);
+    w->adler = adler32(0L, Z_NULL, 0);
+    if(!w->prev)
+    {
+      w->failed = 1;
+      write_end(p_tmp, w);
+      return NULL;
+    }
+    // a group for every thread per call
+    *rows = w->group_rows * threads;
+    return w;
+  }
+
   /*
    * Get rid of filler (OR ALPHA) bytes, pack XRGB/RGBX/ARGB/RGBA into
    * RGB (4 channels -> 3 channels). The second parameter is not used.
    */
   png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
 
-  png_bytep *row_pointers = malloc((size_t)height * sizeof(png_bytep));
+  /* swap bytes of 16 bit files to most significant bit first */
+  if(p->bpp > 8) png_set_swap(png_ptr);
 
-  if(p->bpp > 8)
-  {
-    /* swap bytes of 16 bit files to most significant bit first */
-    png_set_swap(png_ptr);
+  *rows = 1;
+  return w;
+}
 
-    for(unsigned i = 0; i < height; i++) row_pointers[i] = (png_bytep)((uint16_t *)ivoid + (size_t)4 * i * width);
+int write_rows(dt_imageio_module_data_t *p_tmp, void *handle, const void *ivoid, int y, int rows)
+{
+  dt_imageio_png_t *p = (dt_imageio_png_t *)p_tmp;
+  _png_writer_t *w = (_png_writer_t *)handle;
+  if(w->failed) return 1;
+  if(setjmp(png_jmpbuf(w->png_ptr)))
+  {
+    w->failed = 1;
+    return 1;
   }
+
+  if(w->group_rows)
+    w->failed = _png_write_groups(p, w, ivoid, y, rows);
   else
+    for(int i = 0; i < rows; i++)
+      png_write_row(w->png_ptr, (png_bytep)ivoid + (size_t)4 * i * p->width * p->bpp / 8);
+  return w->failed;
+}
+
+int write_end(dt_imageio_module_data_t *p_tmp, void *handle)
+{
+  _png_writer_t *w = (_png_writer_t *)handle;
+  if(!w->failed)
   {
-    for(unsigned i = 0; i < height; i++) row_pointers[i] = (uint8_t *)ivoid + (size_t)4 * i * width;
+    if(setjmp(png_jmpbuf(w->png_ptr)))
+      w->failed = 1;
+    else if(w->group_rows)
+      png_write_chunk(w->png_ptr, (png_bytep)"IEND", NULL, 0);
+    else
+      png_write_end(w->png_ptr, w->info_ptr);
   }
+  png_destroy_write_struct(&w->png_ptr, &w->info_ptr);
 
-  png_write_image(png_ptr, row_pointers);
+  if(w->f)
+  {
+    const int werr = ferror(w->f);
+    if(fclose(w->f) || werr) w->failed = 1;
+  }
 
-  free(row_pointers);
+  const int failed = w->failed || !w->f;
+  free(w->prev);
+  free(w);
+  return failed;
+}
 
-  png_write_end(png_ptr, info_ptr);
-  png_destroy_write_struct(&png_ptr, &info_ptr);
-  fclose(f);
-  return 0;
+int write_image(dt_imageio_module_data_t *p_tmp, const char *filename, const void *ivoid,
+                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
+                void *exif, int exif_len, int imgid, int num, int total)
+{
+  int rows;
+  void *w = write_begin(p_tmp, filename, over_type, over_filename, exif, exif_len, NULL, 0, imgid, num, total,
+                        &rows);
+  if(!w) return 1;
+  const int failed = write_rows(p_tmp, w, ivoid, 0, ((dt_imageio_png_t *)p_tmp)->height);
+  return write_end(p_tmp, w) | failed;
 }
 
+#undef PARALLEL_MIN_PIXELS
+
 static int __attribute__((__unused__)) read_header(const char *filename, dt_imageio_module_data_t *p_tmp)
 {
   dt_imageio_png_t *png = (dt_imageio_png_t *)p_tmp;
@@ -33,32 +33,46 @@ void cleanup(dt_imageio_module_format_t *self)
 {
 }
 
-int write_image(dt_imageio_module_data_t *ppm, const char *filename, const void *in_tmp,
-                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
-                void *exif, int exif_len, int imgid, int num, int total)
+void *write_begin(dt_imageio_module_data_t *ppm, const char *filename,
+                  dt_colorspaces_color_profile_type_t over_type, const char *over_filename, void *exif,
+                  int exif_len, const char *xmp, int xmp_len, int imgid, int num, int total, int *rows)
 {
-  const uint16_t *in = (const uint16_t *)in_tmp;
-  int status = 0;
-  uint16_t *row = (uint16_t *)in;
-  uint16_t swapped[3];
   FILE *f = g_fopen(filename, "wb");
-  if(f)
+  if(!f) return NULL;
+  (void)fprintf(f, "P6\n%d %d\n65535\n", ppm->width, ppm->height);
+  *rows = 1;
+  return f;
+}
+
+int write_rows(dt_imageio_module_data_t *ppm, void *handle, const void *in_tmp, int y, int rows)
+{
+  FILE *f = (FILE *)handle;
+  const uint16_t *row = (const uint16_t *)in_tmp;
+  uint16_t swapped[3];
+  for(size_t k = 0; k < (size_t)rows * ppm->width; k++, row += 4)
   {
-    (void)fprintf(f, "P6\n%d %d\n65535\n", ppm->width, ppm->height);
-    for(int y = 0; y < ppm->height; y++)
-    {
-      for(int x = 0; x < ppm->width; x++)
-      {
-        for(int c = 0; c < 3; c++) swapped[c] = (0xff00 & (row[c] << 8)) | (row[c] >> 8);
-        int cnt = fwrite(&swapped, sizeof(uint16_t), 3, f);
-        if(cnt != 3) break;
-        row += 4;
-      }
-    }
-    fclose(f);
-    status = 0;
+    for(int c = 0; c < 3; c++) swapped[c] = (0xff00 & (row[c] << 8)) | (row[c] >> 8);
+    int cnt = fwrite(&swapped, sizeof(uint16_t), 3, f);
+    if(cnt != 3) return 1;
   }
-  return status;
+  return 0;
+}
+
+int write_end(dt_imageio_module_data_t *ppm, void *handle)
+{
+  return fclose((FILE *)handle) ? 1 : 0;
+}
+
+int write_image(dt_imageio_module_data_t *ppm, const char *filename, const void *in_tmp,
+                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
+                void *exif, int exif_len, int imgid, int num, int total)
+{
+  int rows;
+  void *f = write_begin(ppm, filename, over_type, over_filename, exif, exif_len, NULL, 0, imgid, num, total,
+                        &rows);
+  if(!f) return 1;
+  const int status = write_rows(ppm, f, in_tmp, 0, ppm->height);
+  return write_end(ppm, f) | status;
 }
 
 size_t params_size(dt_imageio_module_format_t *self)
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <tiffio.h>
+#include <zlib.h>
 
 DT_MODULE(3)
 
@@ -52,51 +53,379 @@ typedef struct dt_imageio_tiff_gui_t
   GtkWidget *compresslevel;
 } dt_imageio_tiff_gui_t;
 
+// since 4.5 libtiff tells how each tag wants its values, TIFFFieldSetGetSize() and TIFFFieldSetGetCountSize().
+// that is needed to set arbitrary exif tags.
+#if TIFFLIB_VERSION >= 20221213
+// bytes per value of the tiff data types up to TIFF_DOUBLE
+static const int _tiff_type_size[] = { 0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8 };
 
-int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const void *in_void,
-                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
-                void *exif, int exif_len, int imgid, int num, int total)
+// a tiff structure as in the exif blob, after its "Exif\0\0" header
+typedef struct _tiff_exif_t
 {
-  const dt_imageio_tiff_t *d = (dt_imageio_tiff_t *)d_tmp;
+  const uint8_t *data;
+  uint32_t size;
+  int big_endian;
+} _tiff_exif_t;
 
-  uint8_t *profile = NULL;
-  uint32_t profile_len = 0;
+static uint32_t _tiff_exif_get(const _tiff_exif_t *e, const uint32_t pos, const int bytes)
+{
+  uint32_t v = 0;
+  for(int k = 0; k < bytes; k++)
+    v |= (uint32_t)e->data[pos + k] << (8 * (e->big_endian ? bytes - 1 - k : k));
+  return v;
+}
 
-  TIFF *tif = NULL;
+static double _tiff_exif_value(const _tiff_exif_t *e, const uint16_t type, const uint32_t pos)
+{
+  switch(type)
+  {
+    case TIFF_SBYTE:
+      return (int8_t)e->data[pos];
+    case TIFF_SHORT:
+      return _tiff_exif_get(e, pos, 2);
+    case TIFF_SSHORT:
+      return (int16_t)_tiff_exif_get(e, pos, 2);
+    case TIFF_LONG:
+      return _tiff_exif_get(e, pos, 4);
+    case TIFF_SLONG:
+      return (int32_t)_tiff_exif_get(e, pos, 4);
+    case TIFF_RATIONAL:
+    {
+      const uint32_t den = _tiff_exif_get(e, pos + 4, 4);
+      return den ? (double)_tiff_exif_get(e, pos, 4) / den : 0.0;
+    }
+    case TIFF_SRATIONAL:
+    {
+      const int32_t den = (int32_t)_tiff_exif_get(e, pos + 4, 4);
+      return den ? (double)(int32_t)_tiff_exif_get(e, pos, 4) / den : 0.0;
+    }
+    case TIFF_FLOAT:
+    {
+      const uint32_t bits = _tiff_exif_get(e, pos, 4);
+      float f;
+      memcpy(&f, &bits, sizeof(f));
+      return f;
+    }
+    case TIFF_DOUBLE:
+    {
+      const uint64_t bits = (uint64_t)_tiff_exif_get(e, pos + (e->big_endian ? 4 : 0), 4)
+                            | (uint64_t)_tiff_exif_get(e, pos + (e->big_endian ? 0 : 4), 4) << 32;
+      double f;
+      memcpy(&f, &bits, sizeof(f));
+      return f;
+    }
+    default: // TIFF_BYTE, TIFF_UNDEFINED
+      return e->data[pos];
+  }
+}
 
-  void *rowdata = NULL;
+// set one entry of the blob in the current directory, converted to whatever libtiff expects for the tag
+static void _tiff_exif_set(TIFF *tif, const _tiff_exif_t *e, const uint32_t tag, const uint16_t type,
+                           const uint32_t count, const uint32_t pos)
+{
+  // tags libtiff doesn't know would need a field definition of their own, the exif ones are all there
+  const TIFFField *fip = TIFFFindField(tif, tag, TIFF_ANY);
+  if(!fip || TIFFFieldIsAnonymous(fip) || type == 0 || type > TIFF_DOUBLE) return;
+  const TIFFDataType field_type = TIFFFieldDataType(fip);
+  if(field_type == TIFF_ASCII)
+  {
+    if(type != TIFF_ASCII) return;
+    char *text = g_strndup((const char *)e->data + pos, count);
+    TIFFSetField(tif, tag, text);
+    g_free(text);
+    return;
+  }
 
-  int rc = 1; // default to error
+  const int size = TIFFFieldSetGetSize(fip);
+  const int count_size = TIFFFieldSetGetCountSize(fip);
+  const int read_count = TIFFFieldReadCount(fip);
+  if(type == TIFF_ASCII || (size != 1 && size != 2 && size != 4 && size != 8)) return;
+  // without a count libtiff takes exactly as many values as the tag has
+  if(!count_size && read_count > 1 && count < (uint32_t)read_count) return;
+  const uint32_t n = count_size ? count : (uint32_t)MAX(read_count, 1);
+  const int floating = field_type == TIFF_RATIONAL || field_type == TIFF_SRATIONAL || field_type == TIFF_FLOAT
+                       || field_type == TIFF_DOUBLE;
+
+  uint8_t *values = g_malloc0((size_t)MAX(n, 1) * size);
+  for(uint32_t k = 0; k < n; k++)
+  {
+    const double v = _tiff_exif_value(e, type, pos + k * _tiff_type_size[type]);
+    if(size == 1)
+      values[k] = (uint8_t)(int64_t)v;
+    else if(size == 2)
+      ((uint16_t *)values)[k] = (uint16_t)(int64_t)v;
+    else if(size == 4 && floating)
+      ((float *)values)[k] = v;
+    else if(size == 4)
+      ((uint32_t *)values)[k] = (uint32_t)(int64_t)v;
+    else if(floating)
+      ((double *)values)[k] = v;
+    else
+      ((uint64_t *)values)[k] = (uint64_t)(int64_t)v;
+  }
+
+  if(count_size == 2)
+    TIFFSetField(tif, tag, (uint16_t)n, values);
+  else if(count_size)
+    TIFFSetField(tif, tag, n, values);
+  else if(read_count > 1)
+    TIFFSetField(tif, tag, values);
+  else if(size == 1)
+    TIFFSetField(tif, tag, (int)values[0]);
+  else if(size == 2)
+    TIFFSetField(tif, tag, (int)((uint16_t *)values)[0]);
+  else if(size == 4 && floating)
+    TIFFSetField(tif, tag, (double)((float *)values)[0]);
+  else if(size == 4)
+    TIFFSetField(tif, tag, ((uint32_t *)values)[0]);
+  else if(floating)
+    TIFFSetField(tif, tag, ((double *)values)[0]);
+  else
+    TIFFSetField(tif, tag, ((uint64_t *)values)[0]);
+  g_free(values);
+}
 
+// set the entries of the ifd at offset in the current directory. returns the offsets of the exif and gps
+// ifds it points to, if any.
+static void _tiff_exif_set_ifd(TIFF *tif, const _tiff_exif_t *e, const uint32_t offset, const int compressed,
+                               uint32_t *exif_ifd, uint32_t *gps_ifd)
+{
+  if((uint64_t)offset + 2 > e->size) return;
+  const int entries = _tiff_exif_get(e, offset, 2);
+  for(int k = 0; k < entries; k++)
+  {
+    const uint32_t entry = offset + 2 + 12 * k;
+    if((uint64_t)entry + 12 > e->size) return;
+    const uint32_t tag = _tiff_exif_get(e, entry, 2);
+    const uint16_t type = _tiff_exif_get(e, entry + 2, 2);
+    const uint32_t count = _tiff_exif_get(e, entry + 4, 4);
+    if(type == 0 || type > TIFF_DOUBLE) continue;
+    const uint64_t bytes = (uint64_t)count * _tiff_type_size[type];
+    const uint32_t pos = bytes <= 4 ? entry + 8 : _tiff_exif_get(e, entry + 8, 4);
+    if((uint64_t)pos + bytes > e->size) continue;
+
+    switch(tag)
+    {
+      case TIFFTAG_EXIFIFD:
+        if(exif_ifd) *exif_ifd = _tiff_exif_get(e, entry + 8, 4);
+        break;
+      case TIFFTAG_GPSIFD:
+        if(gps_ifd) *gps_ifd = _tiff_exif_get(e, entry + 8, 4);
+        break;
+      // the image data is described by what we set up ourselves
+      case TIFFTAG_IMAGEWIDTH:
+      case TIFFTAG_IMAGELENGTH:
+      case TIFFTAG_BITSPERSAMPLE:
+      case TIFFTAG_COMPRESSION:
+      case TIFFTAG_PHOTOMETRIC:
+      case TIFFTAG_FILLORDER:
+      case TIFFTAG_STRIPOFFSETS:
+      case TIFFTAG_ORIENTATION:
+      case TIFFTAG_SAMPLESPERPIXEL:
+      case TIFFTAG_ROWSPERSTRIP:
+      case TIFFTAG_STRIPBYTECOUNTS:
+      case TIFFTAG_XRESOLUTION:
+      case TIFFTAG_YRESOLUTION:
+      case TIFFTAG_PLANARCONFIG:
+      case TIFFTAG_RESOLUTIONUNIT:
+      case TIFFTAG_PREDICTOR:
+      case TIFFTAG_SUBIFD:
+      case TIFFTAG_SAMPLEFORMAT:
+      case TIFFTAG_XMLPACKET:
+      case TIFFTAG_ICCPROFILE:
+      case EXIFTAG_INTEROPERABILITYIFD:
+        break;
+      // only compressed images may set PixelXDimension and PixelYDimension
+      case EXIFTAG_PIXELXDIMENSION:
+      case EXIFTAG_PIXELYDIMENSION:
+        if(compressed) _tiff_exif_set(tif, e, tag, type, count, pos);
+        break;
+      default:
+        _tiff_exif_set(tif, e, tag, type, count, pos);
+    }
+  }
+}
+
+// add the exif blob to the image directory, which hasn't been written yet, and write it together with
+// exif and gps ifds. the thumbnail ifd of the blob is left out, as exiv2 did when merging it.
+static int _tiff_write_exif(TIFF *tif, const uint8_t *blob, const int len, const int compressed)
+{
+  if(len < 14 || memcmp(blob, "Exif\0\0", 6)) return 1;
+  const _tiff_exif_t e = { blob + 6, len - 6, blob[6] == 'M' };
+  uint32_t exif_ifd = 0, gps_ifd = 0;
+  _tiff_exif_set_ifd(tif, &e, _tiff_exif_get(&e, 4, 4), compressed, &exif_ifd, &gps_ifd);
+
+  // the offsets are only known once the sub ifds are written, after the image directory
+  if(exif_ifd) TIFFSetField(tif, TIFFTAG_EXIFIFD, (uint64_t)0);
+  if(gps_ifd) TIFFSetField(tif, TIFFTAG_GPSIFD, (uint64_t)0);
+  if(!TIFFWriteDirectory(tif)) return 1;
+  if(!exif_ifd && !gps_ifd) return 0;
+
+  uint64_t exif_offset = 0, gps_offset = 0;
+  if(exif_ifd)
+  {
+    if(TIFFCreateEXIFDirectory(tif)) return 1;
+    _tiff_exif_set_ifd(tif, &e, exif_ifd, compressed, NULL, NULL);
+    if(!TIFFWriteCustomDirectory(tif, &exif_offset)) return 1;
+  }
+  if(gps_ifd)
+  {
+    if(TIFFCreateGPSDirectory(tif)) return 1;
+    _tiff_exif_set_ifd(tif, &e, gps_ifd, compressed, NULL, NULL);
+    if(!TIFFWriteCustomDirectory(tif, &gps_offset)) return 1;
+  }
+
+  if(!TIFFSetDirectory(tif, 0)) return 1;
+  if(exif_ifd) TIFFSetField(tif, TIFFTAG_EXIFIFD, exif_offset);
+  if(gps_ifd) TIFFSetField(tif, TIFFTAG_GPSIFD, gps_offset);
+  return !TIFFWriteDirectory(tif);
+}
+#endif
+
+// images with fewer pixels are compressed by libtiff row by row
+#define PARALLEL_MIN_PIXELS (4 << 20)
+
+// row y of the 4 channel input as packed rgb, with the predictor applied the way libtiff does it for a little
+// endian file on a little endian host. scratch has to hold one row.
+static void _tiff_pack_row(const dt_imageio_tiff_t *d, const void *in_void, const int predictor, const int y,
+                           uint8_t *out, uint8_t *scratch)
+{
+  const size_t n = (size_t)3 * d->width;
+  const int bytes = d->bpp / 8;
+  const uint8_t *in = (const uint8_t *)in_void + (size_t)4 * y * d->width * bytes;
+  for(int x = 0; x < d->width; x++) memcpy(out + (size_t)3 * x * bytes, in + (size_t)4 * x * bytes, 3 * bytes);
+
+  if(predictor == PREDICTOR_HORIZONTAL)
+  {
+    if(d->bpp == 32)
+      for(size_t i = n - 1; i >= 3; i--) ((uint32_t *)out)[i] -= ((uint32_t *)out)[i - 3];
+    else if(d->bpp == 16)
+      for(size_t i = n - 1; i >= 3; i--) ((uint16_t *)out)[i] -= ((uint16_t *)out)[i - 3];
+    else
+      for(size_t i = n - 1; i >= 3; i--) out[i] -= out[i - 3];
+  }
+  else if(predictor == PREDICTOR_FLOATINGPOINT)
+  {
+    // bytes of all samples are split into planes, most significant first, and then differenced
+    memcpy(scratch, out, n * bytes);
+    for(size_t i = 0; i < n; i++)
+      for(int b = 0; b < bytes; b++) out[(bytes - b - 1) * n + i] = scratch[bytes * i + b];
+    for(size_t i = n * bytes - 1; i >= 3; i--) out[i] -= out[i - 3];
+  }
+}
+
+typedef struct _tiff_writer_t
+{
+  TIFF *tif;
+  char *filename;
+  void *exif;
+  int exif_len;
+  uint8_t *profile;
+  uint8_t *rowdata;
+  // parallel writer: rows per strip and the predictor to apply, 0 for scanlines compressed by libtiff
+  int rows_per_strip;
+  uint16_t predictor;
+  int failed;
+} _tiff_writer_t;
+
+// deflate strips concurrently and hand them to libtiff as raw strips. strips are processed in batches to
+// keep the memory for the compressed data bounded. y has to be the first row of a strip.
+static int _tiff_write_strips(_tiff_writer_t *w, const dt_imageio_tiff_t *d, const void *in_void, const int y,
+                              const int rows)
+{
+  const int rows_per_strip = w->rows_per_strip;
+  const size_t rowsize = (size_t)3 * d->width * d->bpp / 8;
+  const int nstrips = (rows + rows_per_strip - 1) / rows_per_strip;
+  const int batch = 4 * dt_get_num_threads();
+  uint8_t **out = calloc(batch, sizeof(uint8_t *));
+  uLongf *out_len = calloc(batch, sizeof(uLongf));
+  int failed = !out || !out_len;
+
+  for(int s = 0; s < nstrips && !failed; s += batch)
+  {
+    const int n = MIN(batch, nstrips - s);
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(d, in_void, out, out_len, s, w) schedule(dynamic)                   \
+    reduction(| : failed)
+#endif
+    for(int k = 0; k < n; k++)
+    {
+      const int r0 = (s + k) * rows_per_strip;
+      const int strip_rows = MIN(rows_per_strip, rows - r0);
+      const size_t len = strip_rows * rowsize;
+      uint8_t *raw = malloc(len + rowsize);
+      out_len[k] = compressBound(len);
+      out[k] = malloc(out_len[k]);
+      if(!raw || !out[k])
+      {
+        free(raw);
+        failed = 1;
+        continue;
+      }
+      for(int r = 0; r < strip_rows; r++)
+        _tiff_pack_row(d, in_void, w->predictor, r0 + r, raw + r * rowsize, raw + len);
+      if(compress2(out[k], &out_len[k], raw, len, d->compresslevel) != Z_OK) failed = 1;
+      free(raw);
+    }
+
+    for(int k = 0; k < n; k++)
+    {
+      const int strip = y / rows_per_strip + s + k;
+      if(!failed && TIFFWriteRawStrip(w->tif, strip, out[k], out_len[k]) == -1) failed = 1;
+      free(out[k]);
+      out[k] = NULL;
+    }
+  }
+
+  free(out);
+  free(out_len);
+  return failed;
+}
+
+void *write_begin(dt_imageio_module_data_t *d_tmp, const char *filename,
+                  dt_colorspaces_color_profile_type_t over_type, const char *over_filename, void *exif,
+                  int exif_len, const char *xmp, int xmp_len, int imgid, int num, int total, int *rows)
+{
+  const dt_imageio_tiff_t *d = (dt_imageio_tiff_t *)d_tmp;
+  _tiff_writer_t *w = (_tiff_writer_t *)calloc(1, sizeof(_tiff_writer_t));
+  if(!w) return NULL;
+  w->filename = g_strdup(filename);
+  w->exif = exif;
+  w->exif_len = exif_len;
+
+  uint32_t profile_len = 0;
   if(imgid > 0)
   {
     cmsHPROFILE out_profile = dt_colorspaces_get_output_profile(imgid, over_type, over_filename)->profile;
     cmsSaveProfileToMem(out_profile, 0, &profile_len);
     if(profile_len > 0)
     {
-      profile = malloc(profile_len);
-      if(!profile)
+      w->profile = malloc(profile_len);
+      if(!w->profile)
       {
-        rc = 1;
-        goto exit;
+        w->failed = 1;
+        write_end(d_tmp, w);
+        return NULL;
       }
-      cmsSaveProfileToMem(out_profile, profile, &profile_len);
+      cmsSaveProfileToMem(out_profile, w->profile, &profile_len);
     }
   }
 
   // Create little endian tiff image
 #ifdef _WIN32
   wchar_t *wfilename = g_utf8_to_utf16(filename, -1, NULL, NULL, NULL);
-  tif = TIFFOpenW(wfilename, "wl");
+  w->tif = TIFFOpenW(wfilename, "wl");
   g_free(wfilename);
 #else
-  tif = TIFFOpen(filename, "wl");
+  w->tif = TIFFOpen(filename, "wl");
 #endif
-  if(!tif)
+  if(!w->tif)
   {
-    rc = 1;
-    goto exit;
+    w->failed = 1;
+    write_end(d_tmp, w);
+    return NULL;
   }
+  TIFF *tif = w->tif;
 
   // http://partners.adobe.com/public/developer/en/tiff/TIFFphotoshop.pdf (dated 2002)
   // "A proprietary ZIP/Flate compression code (0x80b2) has been used by some"
@@ -132,10 +461,11 @@ int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const voi
   }
 
   TIFFSetField(tif, TIFFTAG_FILLORDER, (uint16_t)FILLORDER_MSB2LSB);
-  if(profile != NULL)
+  if(w->profile != NULL)
   {
-    TIFFSetField(tif, TIFFTAG_ICCPROFILE, (uint32_t)profile_len, profile);
+    TIFFSetField(tif, TIFFTAG_ICCPROFILE, (uint32_t)profile_len, w->profile);
   }
+  if(xmp && xmp_len > 0) TIFFSetField(tif, TIFFTAG_XMLPACKET, (uint32_t)xmp_len, xmp);
   TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, (uint16_t)3);
   TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, (uint16_t)d->bpp);
   TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, (uint16_t)(d->bpp == 32 ? SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT));
@@ -143,7 +473,14 @@ int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const voi
   TIFFSetField(tif, TIFFTAG_IMAGELENGTH, (uint32_t)d->height);
   TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, (uint16_t)PHOTOMETRIC_RGB);
   TIFFSetField(tif, TIFFTAG_PLANARCONFIG, (uint16_t)PLANARCONFIG_CONTIG);
-  TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, (uint32_t)1);
+
+  // compressed strips of large images are deflated in parallel, in strips of about 256k
+  const size_t rowsize = (d->width * 3) * d->bpp / 8;
+  const int threads = dt_get_num_threads();
+  if(d->compress > 0 && G_BYTE_ORDER == G_LITTLE_ENDIAN && threads > 1
+     && (size_t)d->width * d->height >= PARALLEL_MIN_PIXELS)
+    w->rows_per_strip = (int)MAX(1, (1 << 18) / rowsize);
+  TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, (uint32_t)MAX(w->rows_per_strip, 1));
   TIFFSetField(tif, TIFFTAG_ORIENTATION, (uint16_t)ORIENTATION_TOPLEFT);
 
   int resolution = dt_conf_get_int("metadata/resolution");
@@ -154,95 +491,82 @@ int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const voi
     TIFFSetField(tif, TIFFTAG_RESOLUTIONUNIT, (uint16_t)RESUNIT_INCH);
   }
 
-  const size_t rowsize = (d->width * 3) * d->bpp / 8;
-  if((rowdata = malloc(rowsize)) == NULL)
+  if(w->rows_per_strip)
   {
-    rc = 1;
-    goto exit;
+    w->predictor = PREDICTOR_NONE;
+    TIFFGetField(tif, TIFFTAG_PREDICTOR, &w->predictor);
+    // a batch of strips per call
+    *rows = w->rows_per_strip * 4 * threads;
   }
-
-  if(d->bpp == 32)
+  else if((w->rowdata = malloc(rowsize)) == NULL)
   {
-    for(int y = 0; y < d->height; y++)
-    {
-      float *in = (float *)in_void + (size_t)4 * y * d->width;
-      float *out = (float *)rowdata;
-
-      for(int x = 0; x < d->width; x++, in += 4, out += 3)
-      {
-        memcpy(out, in, 3 * sizeof(float));
-      }
-
-      if(TIFFWriteScanline(tif, rowdata, y, 0) == -1)
-      {
-        rc = 1;
-        goto exit;
-      }
-    }
+    w->failed = 1;
+    write_end(d_tmp, w);
+    return NULL;
   }
-  else if(d->bpp == 16)
-  {
-    for(int y = 0; y < d->height; y++)
-    {
-      uint16_t *in = (uint16_t *)in_void + (size_t)4 * y * d->width;
-      uint16_t *out = (uint16_t *)rowdata;
+  else
+    *rows = 1;
+  return w;
+}
 
-      for(int x = 0; x < d->width; x++, in += 4, out += 3)
-      {
-        memcpy(out, in, 3 * sizeof(uint16_t));
-      }
+int write_rows(dt_imageio_module_data_t *d_tmp, void *handle, const void *in_void, int y, int rows)
+{
+  const dt_imageio_tiff_t *d = (dt_imageio_tiff_t *)d_tmp;
+  _tiff_writer_t *w = (_tiff_writer_t *)handle;
+  if(w->failed) return 1;
 
-      if(TIFFWriteScanline(tif, rowdata, y, 0) == -1)
-      {
-        rc = 1;
-        goto exit;
-      }
-    }
-  }
+  if(w->rows_per_strip)
+    w->failed = _tiff_write_strips(w, d, in_void, y, rows);
   else
-  {
-    for(int y = 0; y < d->height; y++)
+    for(int r = 0; r < rows && !w->failed; r++)
     {
-      uint8_t *in = (uint8_t *)in_void + (size_t)4 * y * d->width;
-      uint8_t *out = (uint8_t *)rowdata;
-
-      for(int x = 0; x < d->width; x++, in += 4, out += 3)
-      {
-        memcpy(out, in, 3 * sizeof(uint8_t));
-      }
-
-      if(TIFFWriteScanline(tif, rowdata, y, 0) == -1)
-      {
-        rc = 1;
-        goto exit;
-      }
+      _tiff_pack_row(d, in_void, PREDICTOR_NONE, r, w->rowdata, NULL);
+      if(TIFFWriteScanline(w->tif, w->rowdata, y + r, 0) == -1) w->failed = 1;
     }
-  }
+  return w->failed;
+}
 
-  // success
-  rc = 0;
+int write_end(dt_imageio_module_data_t *d_tmp, void *handle)
+{
+  const dt_imageio_tiff_t *d = (dt_imageio_tiff_t *)d_tmp;
+  _tiff_writer_t *w = (_tiff_writer_t *)handle;
 
-exit:
+  int rc = w->failed || !w->tif;
+#if TIFFLIB_VERSION >= 20221213
+  // exif and gps ifds are written by libtiff along with the image directory
+  if(!rc && w->exif) rc = _tiff_write_exif(w->tif, w->exif, w->exif_len, d->compress > 0);
+  if(w->tif) TIFFClose(w->tif);
+#else
   // close the file before adding exif data
-  if(tif)
+  if(w->tif) TIFFClose(w->tif);
+  if(!rc && w->exif)
   {
-    TIFFClose(tif);
-    tif = NULL;
-  }
-  if(!rc && exif)
-  {
-    rc = dt_exif_write_blob(exif, exif_len, filename, d->compress > 0);
+    rc = dt_exif_write_blob(w->exif, w->exif_len, w->filename, d->compress > 0);
     // Until we get symbolic error status codes, if rc is 1, return 0
     rc = (rc == 1) ? 0 : 1;
   }
-  free(profile);
-  profile = NULL;
-  free(rowdata);
-  rowdata = NULL;
-
+#endif
+  free(w->profile);
+  free(w->rowdata);
+  g_free(w->filename);
+  free(w);
   return rc;
 }
 
+int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const void *in_void,
+                dt_colorspaces_color_profile_type_t over_type, const char *over_filename,
+                void *exif, int exif_len, int imgid, int num, int total)
+{
+  int rows;
+  void *w = write_begin(d_tmp, filename, over_type, over_filename, exif, exif_len, NULL, 0, imgid, num, total,
+                        &rows);
+  if(!w) return 1;
+  const int failed = write_rows(d_tmp, w, in_void, 0, ((dt_imageio_tiff_t *)d_tmp)->height);
+  return write_end(d_tmp, w) | failed;
+}
+
+#undef PARALLEL_MIN_PIXELS
+
 #if 0
 int dt_imageio_tiff_read_header(const char *filename, dt_imageio_tiff_t *tiff)
 {
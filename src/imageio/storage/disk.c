@@ -199,6 +199,18 @@ void gui_reset(dt_imageio_module_storage_t *self)
   dt_bauhaus_combobox_set(d->overwrite, 0);
 }
 
+// <base><ext>, or unless overwriting <base>_<nn><ext> for the first one that doesn't exist yet, like the main file
+static gchar *_rendition_filename(const char *base, const char *ext, const gboolean overwrite)
+{
+  gchar *filename = g_strdup_printf("%s%s", base, ext);
+  for(int seq = 1; !overwrite && g_file_test(filename, G_FILE_TEST_EXISTS); seq++)
+  {
+    g_free(filename);
+    filename = g_strdup_printf("%s_%.2d%s", base, seq, ext);
+  }
+  return filename;
+}
+
 int store(dt_imageio_module_storage_t *self, dt_imageio_module_data_t *sdata, const int imgid,
           dt_imageio_module_format_t *format, dt_imageio_module_data_t *fdata, const int num, const int total,
           const gboolean high_quality, const gboolean upscale, dt_colorspaces_color_profile_type_t icc_type,
@@ -286,9 +298,44 @@ try_again:
   dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
   if(fail) return 1;
 
+  /* additional sizes rendered along with the image, like "1024x1024,320x320", end up in <name>_<w>x<h>.<ext> */
+  gchar *sizes = dt_conf_get_string("plugins/imageio/storage/disk/renditions");
+  gchar **size_list = g_strsplit(sizes ? sizes : "", ",", -1);
+  g_free(sizes);
+  dt_imageio_rendition_t *renditions = calloc(g_strv_length(size_list) + 1, sizeof(dt_imageio_rendition_t));
+  renditions[0] = (dt_imageio_rendition_t){ filename, format, fdata, FALSE };
+  int count = 1;
+  const char *ext_dot = strrchr(filename, '.');
+  const gboolean copy = !strcmp(format->mime(fdata), "x-copy");
+  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
+  for(gchar **size = size_list; *size && !copy; size++)
+  {
+    int width = 0, height = 0;
+    if(sscanf(*size, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) continue;
+    dt_imageio_module_data_t *data = format->get_params(format);
+    memcpy(data, fdata, format->params_size(format));
+    data->max_width = width;
+    data->max_height = height;
+    gchar *base = g_strdup_printf("%.*s_%dx%d", (int)(ext_dot - filename), filename, width, height);
+    renditions[count].filename = _rendition_filename(base, ext_dot, d->overwrite);
+    renditions[count].format = format;
+    renditions[count].format_params = data;
+    count++;
+    g_free(base);
+  }
+  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  g_strfreev(size_list);
+
   /* export image to file */
-  if(dt_imageio_export(imgid, filename, format, fdata, high_quality, upscale, TRUE, icc_type, icc_filename,
-                       icc_intent, self, sdata, num, total) != 0)
+  const int failed = dt_imageio_export_renditions(imgid, renditions, count, high_quality, upscale, TRUE, icc_type,
+                                                  icc_filename, icc_intent, self, sdata, num, total);
+  for(int k = 1; k < count; k++)
+  {
+    g_free((gchar *)renditions[k].filename);
+    format->free_params(format, renditions[k].format_params);
+  }
+  free(renditions);
+  if(failed)
   {
     fprintf(stderr, "[imageio_storage_disk] could not export to file: `%s'!\n", filename);
     dt_control_log(_("could not export to file `%s'!"), filename);
@@ -336,10 +336,28 @@ int store(dt_imageio_module_storage_t *self, dt_imageio_module_data_t *sdata, co
            esc_relthumbfilename,
            num, num-1, title ? title : "&nbsp;", description ? description : "&nbsp;");
 
-  // export image to file. need this to be able to access meaningful
-  // fdata->width and height below.
-  if(dt_imageio_export(imgid, filename, format, fdata, high_quality, upscale, FALSE, icc_type, icc_filename,
-                       icc_intent, self, sdata, num, total) != 0)
+  // the thumbnail is rendered along with the image, with reduced resolution and -thumb in its name
+  char thumbfilename[PATH_MAX] = { 0 };
+  g_strlcpy(thumbfilename, filename, sizeof(thumbfilename));
+  c = thumbfilename + strlen(thumbfilename);
+  for(; c > thumbfilename && *c != '.' && *c != '/'; c--)
+    ;
+  if(c <= thumbfilename || *c == '/') c = thumbfilename + strlen(thumbfilename);
+  sprintf(c, "-thumb.%s", ext);
+  dt_imageio_module_data_t *thumbdata = format->get_params(format);
+  memcpy(thumbdata, fdata, format->params_size(format));
+  thumbdata->max_width = 200;
+  thumbdata->max_height = 200;
+
+  // export image and thumbnail to files, running the pixelpipe only once. need this to be able to access
+  // meaningful fdata->width and height below.
+  // the thumbnail is always upscaled to its size, like the image is if upscale is set
+  dt_imageio_rendition_t renditions[2]
+      = { { filename, format, fdata, FALSE }, { thumbfilename, format, thumbdata, TRUE } };
+  const int failed = dt_imageio_export_renditions(imgid, renditions, 2, high_quality, upscale, FALSE, icc_type,
+                                                  icc_filename, icc_intent, self, sdata, num, total);
+  format->free_params(format, thumbdata);
+  if(failed)
   {
     fprintf(stderr, "[imageio_storage_gallery] could not export to file: `%s'!\n", filename);
     dt_control_log(_("could not export to file `%s'!"), filename);
@@ -363,30 +381,6 @@ int store(dt_imageio_module_storage_t *self, dt_imageio_module_data_t *sdata, co
   if(res_desc) g_list_free_full(res_desc, &g_free);
   d->l = g_list_insert_sorted(d->l, pair, (GCompareFunc)sort_pos);
 
-  /* also export thumbnail: */
-  // write with reduced resolution:
-  const int max_width = fdata->max_width;
-  const int max_height = fdata->max_height;
-  fdata->max_width = 200;
-  fdata->max_height = 200;
-  // alter filename with -thumb:
-  c = filename + strlen(filename);
-  for(; c > filename && *c != '.' && *c != '/'; c--)
-    ;
-  if(c <= filename || *c == '/') c = filename + strlen(filename);
-  ext = format->extension(fdata);
-  sprintf(c, "-thumb.%s", ext);
-  if(dt_imageio_export(imgid, filename, format, fdata, FALSE, TRUE, FALSE, icc_type, icc_filename, icc_intent, self,
-                       sdata, num, total) != 0)
-  {
-    fprintf(stderr, "[imageio_storage_gallery] could not export to file: `%s'!\n", filename);
-    dt_control_log(_("could not export to file `%s'!"), filename);
-    return 1;
-  }
-  // restore for next image:
-  fdata->max_width = max_width;
-  fdata->max_height = max_height;
-
   printf("[export_job] exported to `%s'\n", filename);
   dt_control_log(ngettext("%d/%d exported to `%s'", "%d/%d exported to `%s'", num),
                  num, total, filename);
@@ -115,7 +115,8 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
   const int ch = piece->colors;
 
   /* gather light by threshold */
-  float *blurlightness = calloc((size_t)roi_out->width * roi_out->height, sizeof(float));
+  float *blurlightness
+      = dt_dev_pixelpipe_scratch_alloc(piece->pipe, (size_t)roi_out->width * roi_out->height * sizeof(float));
   memcpy(out, in, (size_t)roi_out->width * roi_out->height * ch * sizeof(float));
 
   const int rad = 256.0f * (fmin(100.0f, data->size + 1.0f) / 100.0f);
@@ -132,7 +133,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
   {
     float *inp = ((float *)ivoid) + ch * k;
     const float L = inp[0] * scale;
-    if(L > data->threshold) blurlightness[k] = L;
+    blurlightness[k] = L > data->threshold ? L : 0.0f;
   }
 
 
@@ -141,7 +142,8 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
   const int hr = range / 2;
 
   const size_t size = roi_out->width > roi_out->height ? roi_out->width : roi_out->height;
-  float *const scanline_buf = malloc(size * dt_get_num_threads() * sizeof(float));
+  float *const scanline_buf
+      = dt_dev_pixelpipe_scratch_alloc(piece->pipe, size * dt_get_num_threads() * sizeof(float));
 
   for(int iteration = 0; iteration < BOX_ITERATIONS; iteration++)
   {
@@ -210,7 +212,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
       for(int y = 0; y < roi_out->height; y++) blurlightness[y * roi_out->width + x] = scanline[y];
     }
   }
-  free(scanline_buf);
+  dt_dev_pixelpipe_scratch_free(piece->pipe, scanline_buf);
 
 /* screen blend lightness with original */
 #ifdef _OPENMP
@@ -227,7 +229,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
 
   if(piece->pipe->mask_display & DT_DEV_PIXELPIPE_DISPLAY_MASK) dt_iop_alpha_copy(ivoid, ovoid, roi_out->width, roi_out->height);
 
-  free(blurlightness);
+  dt_dev_pixelpipe_scratch_free(piece->pipe, blurlightness);
 }
 
 #ifdef HAVE_OPENCL
@@ -44,10 +44,37 @@ typedef struct dt_iop_cacorrect_gui_data_t
 
 typedef struct dt_iop_cacorrect_data_t
 {
+  // scratch memory, kept across pipeline runs and only reallocated if the roi grows
+  float *Gtmp;
+  size_t Gtmp_size;
+  float *RawDataTmp;
+  size_t RawDataTmp_size;
+  char *blocks;
+  size_t blocks_size;
+  char *tiles; // one tile buffer per thread
+  size_t tiles_size;
 } dt_iop_cacorrect_data_t;
 
+// resolution of the cached CA shift field, in samples per dimension of the full image
+#define CA_FIT_GRID 32
+#define CA_FIT_CACHE_ENTRIES 4
+
+typedef struct dt_iop_cacorrect_fit_t
+{
+  int imgid;
+  uint64_t hash;  // params of all modules in front of us
+  uint64_t used;  // for lru replacement
+  float to_full;  // full image pixels per pixel of the roi the fit was made in, smaller is finer
+  // CA shift [y][x][colour][dir] in full image pixels, sampled on a regular grid covering the image
+  float shift[CA_FIT_GRID][CA_FIT_GRID][2][2];
+} dt_iop_cacorrect_fit_t;
+
 typedef struct dt_iop_cacorrect_global_data_t
 {
+  // fitted CA shift fields, shared by all pipes (full, preview, export) processing the same image
+  dt_pthread_mutex_t lock;
+  dt_iop_cacorrect_fit_t fit[CA_FIT_CACHE_ENTRIES];
+  uint64_t clock;
 } dt_iop_cacorrect_global_data_t;
 
 // this returns a translatable name
@@ -300,10 +327,122 @@ static inline void pixSort(float *a, float *b)
   }
 }
 
+/*==================================================================================
+ * darktable glue: scratch memory reuse and the per image cache of fitted CA shifts
+ *==================================================================================*/
+
+// returns a buffer of at least size bytes, reusing *buf if it is large enough already
+static void *_get_scratch(void **buf, size_t *allocated, const size_t size)
+{
+  if(*allocated < size)
+  {
+    dt_free_align(*buf);
+    *buf = dt_alloc_align(64, size);
+    *allocated = *buf ? size : 0;
+  }
+  return *buf;
+}
+
+// hash of all enabled modules in front of us, the fitted shifts only depend on those and the image
+static uint64_t _upstream_hash(const dt_dev_pixelpipe_iop_t *piece)
+{
+  uint64_t hash = 5381;
+  for(const GList *nodes = piece->pipe->nodes; nodes; nodes = g_list_next(nodes))
+  {
+    const dt_dev_pixelpipe_iop_t *p = (const dt_dev_pixelpipe_iop_t *)nodes->data;
+    if(p == piece) break;
+    if(p->enabled) hash = ((hash << 5) + hash) ^ p->hash;
+  }
+  return hash;
+}
+
+// a fit made at a lower resolution than ours (e.g. by the preview pipe) isn't good enough for us
+static gboolean _fit_cache_get(dt_iop_cacorrect_global_data_t *gd, const int imgid, const uint64_t hash,
+                               const float to_full, dt_iop_cacorrect_fit_t *fit)
+{
+  gboolean found = FALSE;
+  dt_pthread_mutex_lock(&gd->lock);
+  for(int k = 0; k < CA_FIT_CACHE_ENTRIES; k++)
+  {
+    if(gd->fit[k].imgid == imgid && gd->fit[k].hash == hash && gd->fit[k].to_full <= to_full * 1.001f)
+    {
+      gd->fit[k].used = ++gd->clock;
+      memcpy(fit, &gd->fit[k], sizeof(dt_iop_cacorrect_fit_t));
+      found = TRUE;
+      break;
+    }
+  }
+  dt_pthread_mutex_unlock(&gd->lock);
+  return found;
+}
+
+static void _fit_cache_put(dt_iop_cacorrect_global_data_t *gd, const dt_iop_cacorrect_fit_t *fit)
+{
+  dt_pthread_mutex_lock(&gd->lock);
+  int slot = 0;
+  for(int k = 0; k < CA_FIT_CACHE_ENTRIES; k++)
+  {
+    if(gd->fit[k].imgid == fit->imgid && gd->fit[k].hash == fit->hash)
+    {
+      slot = k;
+      break;
+    }
+    if(gd->fit[k].used < gd->fit[slot].used) slot = k;
+  }
+  // don't replace a finer fit of the same image by a coarser one
+  if(gd->fit[slot].imgid != fit->imgid || gd->fit[slot].hash != fit->hash || gd->fit[slot].to_full >= fit->to_full)
+    memcpy(&gd->fit[slot], fit, sizeof(dt_iop_cacorrect_fit_t));
+  gd->fit[slot].used = ++gd->clock;
+  dt_pthread_mutex_unlock(&gd->lock);
+}
+
+// bilinear lookup of the cached shift field at normalized image position (u, v). scale converts from full
+// image pixels to pixels of the current roi.
+static void _fit_sample(const dt_iop_cacorrect_fit_t *fit, const float u, const float v, const float scale,
+                        float shifts[2][2])
+{
+  const float x = CLAMPS(u, 0.0f, 1.0f) * (CA_FIT_GRID - 1);
+  const float y = CLAMPS(v, 0.0f, 1.0f) * (CA_FIT_GRID - 1);
+  const int x0 = MIN((int)x, CA_FIT_GRID - 2);
+  const int y0 = MIN((int)y, CA_FIT_GRID - 2);
+  const float fx = x - x0, fy = y - y0;
+  for(int c = 0; c < 2; c++)
+    for(int dir = 0; dir < 2; dir++)
+    {
+      const float top = intp(fx, fit->shift[y0][x0 + 1][c][dir], fit->shift[y0][x0][c][dir]);
+      const float bot = intp(fx, fit->shift[y0 + 1][x0 + 1][c][dir], fit->shift[y0 + 1][x0][c][dir]);
+      shifts[c][dir] = scale * intp(fy, bot, top);
+    }
+}
+
+// evaluate the fitted 2d polynomial at (possibly fractional) block coordinates
+static void _fit_eval(double fitparams[2][2][16], const int polyord, const double vblock, const double hblock,
+                      float shifts[2][2])
+{
+  shifts[0][0] = shifts[0][1] = 0;
+  shifts[1][0] = shifts[1][1] = 0;
+  double powVblock = 1.0;
+  for(int i = 0; i < polyord; i++)
+  {
+    double powHblock = powVblock;
+    for(int j = 0; j < polyord; j++)
+    {
+      shifts[0][0] += powHblock * fitparams[0][0][polyord * i + j];
+      shifts[0][1] += powHblock * fitparams[0][1][polyord * i + j];
+      shifts[1][0] += powHblock * fitparams[1][0][polyord * i + j];
+      shifts[1][1] += powHblock * fitparams[1][1][polyord * i + j];
+      powHblock *= hblock;
+    }
+    powVblock *= vblock;
+  }
+}
+
 // void RawImageSource::CA_correct_RT(const double cared, const double cablue, const double caautostrength)
 static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const float *const in2,
                        float *out, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
+  dt_iop_cacorrect_data_t *d = (dt_iop_cacorrect_data_t *)piece->data;
+  dt_iop_cacorrect_global_data_t *gd = (dt_iop_cacorrect_global_data_t *)self->data;
   const int width = roi_in->width;
   const int height = roi_in->height;
   const uint32_t filters = piece->pipe->dsc.filters;
@@ -336,13 +475,30 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
   //   }
 
   const gboolean autoCA = (cared == 0 && cablue == 0);
+
+  // the fit is done in block coordinates of the current roi. to share it between the preview and full
+  // pipes (and any zoom level) it is cached as shift field over the normalized full image, in full image
+  // pixels. it is only used again at the same or a lower resolution.
+  const int imgid = piece->pipe->image.id;
+  const uint64_t upstream = _upstream_hash(piece);
+  const float roi_full_width = piece->buf_in.width * roi_in->scale;
+  const float roi_full_height = piece->buf_in.height * roi_in->scale;
+  const gboolean full_frame = roi_in->x == 0 && roi_in->y == 0 && width >= roi_full_width - 1
+                              && height >= roi_full_height - 1;
+  // full image pixels per roi pixel
+  const float to_full = piece->iscale / roi_in->scale;
+  dt_iop_cacorrect_fit_t *fit = (dt_iop_cacorrect_fit_t *)malloc(sizeof(dt_iop_cacorrect_fit_t));
+  if(!fit) return;
+  const gboolean fitcached = autoCA && _fit_cache_get(gd, imgid, upstream, to_full, fit);
+
   // local variables
   //   const int width = W, height = H;
   // temporary array to store simple interpolation of G
-  float *Gtmp = (float(*))calloc((height) * (width), sizeof *Gtmp);
+  float *Gtmp = (float *)_get_scratch((void **)&d->Gtmp, &d->Gtmp_size, sizeof(float) * height * width);
 
   // temporary array to avoid race conflicts, only every second pixel needs to be saved here
-  float *RawDataTmp = (float *)malloc(height * width * sizeof(float) / 2 + 4);
+  float *RawDataTmp = (float *)_get_scratch((void **)&d->RawDataTmp, &d->RawDataTmp_size,
+                                            height * width * sizeof(float) / 2 + 4);
 
   float blockave[2][2] = { { 0, 0 }, { 0, 0 } }, blocksqave[2][2] = { { 0, 0 }, { 0, 0 } },
         blockdenom[2][2] = { { 0, 0 }, { 0, 0 } }, blockvar[2][2];
@@ -358,7 +514,21 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
   const int vblsz = ceil((float)(height + border2) / (ts - border2) + 2 + vz1);
   const int hblsz = ceil((float)(width + border2) / (ts - border2) + 2 + hz1);
 
-  char *buffer1 = (char *)calloc(vblsz * hblsz * (2 * 2 + 1), sizeof(float));
+  char *buffer1
+      = (char *)_get_scratch((void **)&d->blocks, &d->blocks_size, vblsz * hblsz * (2 * 2 + 1) * sizeof(float));
+
+  // working space for each thread, aligned to cache lines
+  const int buffersize = 3 * sizeof(float) * ts * ts + 6 * sizeof(float) * ts * tsh + 8 * 64 + 63;
+  const size_t bufferstride = (buffersize + 63) & ~(size_t)63;
+  char *tiles = (char *)_get_scratch((void **)&d->tiles, &d->tiles_size, bufferstride * omp_get_max_threads());
+
+  if(!Gtmp || !RawDataTmp || !buffer1 || !tiles)
+  {
+    fprintf(stderr, "[cacorrect] out of memory, skipping\n");
+    free(fit);
+    return;
+  }
+  memset(buffer1, 0, vblsz * hblsz * (2 * 2 + 1) * sizeof(float));
 
   // block CA shift values and weight assigned to block
   float *blockwt = (float *)buffer1;
@@ -394,8 +564,7 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
           blockdenomthr[2][2] = { { 0, 0 }, { 0, 0 } };
 
     // assign working space
-    const int buffersize = 3 * sizeof(float) * ts * ts + 6 * sizeof(float) * ts * tsh + 8 * 64 + 63;
-    char *buffer = (char *)malloc(buffersize);
+    char *buffer = tiles + bufferstride * dt_get_thread_num();
     char *data = (char *)(((uintptr_t)buffer + (uintptr_t)63) / 64 * 64);
 
     // shift the beginning of all arrays but the first by 64 bytes to avoid cache miss conflicts on CPUs which
@@ -615,6 +784,9 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
               }
             }
           }
+
+          // with a cached fit only the interpolated green is needed for the correction pass
+          if(fitcached) continue;
 //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 #ifdef __SSE2__
           vfloat zd25v = F2V(0.25f);
@@ -888,6 +1060,7 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
 #ifdef _OPENMP
 #pragma omp single
 #endif
+      if(!fitcached)
       {
         for(int dir = 0; dir < 2; dir++)
           for(int c = 0; c < 2; c++)
@@ -1068,6 +1241,28 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
         }
 
         // fitparams[polyord*i+j] gives the coefficients of (vblock^i hblock^j) in a polynomial fit for i,j<=4
+
+        // only a fit over the whole image is good for other rois, too
+        if(processpasstwo && full_frame)
+        {
+          fit->imgid = imgid;
+          fit->hash = upstream;
+          fit->to_full = to_full;
+          for(int gy = 0; gy < CA_FIT_GRID; gy++)
+            for(int gx = 0; gx < CA_FIT_GRID; gx++)
+            {
+              // position in the roi, and the block centered there
+              const double row = gy * (height - 1) / (double)(CA_FIT_GRID - 1);
+              const double col = gx * (width - 1) / (double)(CA_FIT_GRID - 1);
+              const double vblock = (row - tsh + border) / (ts - border2) + 1;
+              const double hblock = (col - tsh + border) / (ts - border2) + 1;
+              float shifts[2][2];
+              _fit_eval(fitparams, polyord, vblock, hblock, shifts);
+              for(int c = 0; c < 2; c++)
+                for(int dir = 0; dir < 2; dir++) fit->shift[gy][gx][c][dir] = shifts[c][dir] * to_full;
+            }
+          _fit_cache_put(gd, fit);
+        }
       }
       // end of initialization for CA correction pass
       // only executed if cared and cablue are zero
@@ -1257,24 +1452,12 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
           }
           else
           {
-            // CA auto correction; use CA diagnostic pass to set shift parameters
-            lblockshifts[0][0] = lblockshifts[0][1] = 0;
-            lblockshifts[1][0] = lblockshifts[1][1] = 0;
-            double powVblock = 1.0;
-            for(int i = 0; i < polyord; i++)
-            {
-              double powHblock = powVblock;
-              for(int j = 0; j < polyord; j++)
-              {
-                // printf("i= %d j= %d polycoeff= %f \n",i,j,fitparams[0][0][polyord*i+j]);
-                lblockshifts[0][0] += powHblock * fitparams[0][0][polyord * i + j];
-                lblockshifts[0][1] += powHblock * fitparams[0][1][polyord * i + j];
-                lblockshifts[1][0] += powHblock * fitparams[1][0][polyord * i + j];
-                lblockshifts[1][1] += powHblock * fitparams[1][1][polyord * i + j];
-                powHblock *= hblock;
-              }
-              powVblock *= vblock;
-            }
+            // CA auto correction; use CA diagnostic pass (or the cached fit) to set shift parameters
+            if(fitcached)
+              _fit_sample(fit, (roi_in->x + left + tsh) / roi_full_width,
+                          (roi_in->y + top + tsh) / roi_full_height, 1.0f / to_full, lblockshifts);
+            else
+              _fit_eval(fitparams, polyord, vblock, hblock, lblockshifts);
             const float bslim = 3.99; // max allowed CA shift
             lblockshifts[0][0] = LIM(lblockshifts[0][0], -bslim, bslim);
             lblockshifts[0][1] = LIM(lblockshifts[0][1], -bslim, bslim);
@@ -1415,9 +1598,14 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
           {
             int c = FC(rr + top, left + border + (FC(rr + top, 2, filters) & 1), filters);
 
-            for(int row = rr + top, cc = border + (FC(rr, 2, filters) & 1),
-                    indx = (row * width + cc + left) >> 1;
-                cc < cc1 - border; cc += 2, indx++)
+            int row = rr + top, cc = border + (FC(rr, 2, filters) & 1), indx = (row * width + cc + left) >> 1;
+#ifdef __SSE2__
+            for(; cc < cc1 - border - 7; cc += 8, indx += 4)
+            {
+              STVFU(RawDataTmp[indx], LC2VFU(&rgb[c][(rr)*ts + cc]));
+            }
+#endif
+            for(; cc < cc1 - border; cc += 2, indx++)
             {
               //               int col = cc + left;
               RawDataTmp[indx] = rgb[c][(rr)*ts + cc];
@@ -1452,20 +1640,23 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
 #endif
 
       for(int row = 0; row < height; row++)
-        for(int col = 0 + (FC(row, 0, filters) & 1), indx = (row * width + col) >> 1; col < width;
-            col += 2, indx++)
+      {
+        int col = 0 + (FC(row, 0, filters) & 1), indx = (row * width + col) >> 1;
+#ifdef __SSE2__
+        for(; col < width - 7; col += 8, indx += 4)
+        {
+          STC2VFU(out[row * width + col], LVFU(RawDataTmp[indx]));
+        }
+#endif
+        for(; col < width; col += 2, indx++)
         {
           out[row * width + col] = RawDataTmp[indx];
         }
+      }
     }
-
-    // clean up
-    free(buffer);
   }
 
-  free(Gtmp);
-  free(buffer1);
-  free(RawDataTmp);
+  free(fit);
 
   //   if(plistener)
   //   {
@@ -1506,11 +1697,26 @@ end:
   memcpy(module->default_params, &tmp, sizeof(dt_iop_cacorrect_params_t));
 }
 
+void init_global(dt_iop_module_so_t *module)
+{
+  dt_iop_cacorrect_global_data_t *gd
+      = (dt_iop_cacorrect_global_data_t *)calloc(1, sizeof(dt_iop_cacorrect_global_data_t));
+  module->data = gd;
+  dt_pthread_mutex_init(&gd->lock, NULL);
+  for(int k = 0; k < CA_FIT_CACHE_ENTRIES; k++) gd->fit[k].imgid = -1;
+}
+
+void cleanup_global(dt_iop_module_so_t *module)
+{
+  dt_iop_cacorrect_global_data_t *gd = (dt_iop_cacorrect_global_data_t *)module->data;
+  dt_pthread_mutex_destroy(&gd->lock);
+  free(module->data);
+  module->data = NULL;
+}
+
 /** init, cleanup, commit to pipeline */
 void init(dt_iop_module_t *module)
 {
-  // we don't need global data:
-  module->data = NULL; // malloc(sizeof(dt_iop_cacorrect_global_data_t));
   module->params = calloc(1, sizeof(dt_iop_cacorrect_params_t));
   module->default_params = calloc(1, sizeof(dt_iop_cacorrect_params_t));
   // our module is disabled by default
@@ -1527,8 +1733,6 @@ void cleanup(dt_iop_module_t *module)
 {
   free(module->params);
   module->params = NULL;
-  free(module->data); // just to be sure
-  module->data = NULL;
 }
 
 /** commit is the synch point between core and gui, so it copies params to pipe data. */
@@ -1543,12 +1747,17 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *params, dt_dev
 
 void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
-  piece->data = malloc(sizeof(dt_iop_cacorrect_data_t));
+  piece->data = calloc(1, sizeof(dt_iop_cacorrect_data_t));
   self->commit_params(self, self->default_params, pipe, piece);
 }
 
 void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
+  dt_iop_cacorrect_data_t *d = (dt_iop_cacorrect_data_t *)piece->data;
+  dt_free_align(d->Gtmp);
+  dt_free_align(d->RawDataTmp);
+  dt_free_align(d->blocks);
+  dt_free_align(d->tiles);
   free(piece->data);
   piece->data = NULL;
 }
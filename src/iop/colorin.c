@@ -53,6 +53,13 @@
 
 #define LUT_SAMPLES 0x10000
 
+// 3d lut replacing lcms2 for non-matrix profiles: grid sizes tried, and the largest acceptable
+// error (delta E 76) against lcms2 on random test colors
+#define CLUT_SIZE_SMALL 33
+#define CLUT_SIZE_LARGE 65
+#define CLUT_MAX_DE 1.5f
+#define CLUT_TEST_SAMPLES 4096
+
 DT_MODULE_INTROSPECTION(4, dt_iop_colorin_params_t)
 
 static void update_profile_list(dt_iop_module_t *self);
@@ -97,6 +104,8 @@ typedef struct dt_iop_colorin_data_t
   cmsHTRANSFORM *xform_cam_nrgb;
   cmsHTRANSFORM *xform_nrgb_Lab;
   float lut[3][LUT_SAMPLES];
+  float *clut;   // sampled lcms2 transform, clut_size^3 Lab pixels, or NULL
+  int clut_size;
   float cmatrix[9];
   float nmatrix[9];
   float lmatrix[9];
@@ -470,6 +479,206 @@ static inline void apply_blue_mapping(const float *const in, float *const out)
   }
 }
 
+// the whole lcms2 fallback for width pixels, works in place
+static void transform_lcms2(const dt_iop_colorin_data_t *const d, const float *const in, float *const out,
+                            const int width)
+{
+  // convert to (L,a/L,b/L) to be able to change L without changing saturation.
+  if(!d->nrgb)
+  {
+    cmsDoTransform(d->xform_cam_Lab, in, out, width);
+  }
+  else
+  {
+    cmsDoTransform(d->xform_cam_nrgb, in, out, width);
+
+    float *rgbptr = (float *)out;
+    for(int j = 0; j < width; j++, rgbptr += 4)
+    {
+      for(int c = 0; c < 3; c++)
+      {
+        rgbptr[c] = CLAMP(rgbptr[c], 0.0f, 1.0f);
+      }
+    }
+
+    cmsDoTransform(d->xform_nrgb_Lab, out, out, width);
+  }
+}
+
+static inline int clut_in_domain(const float *const in)
+{
+  return in[0] >= 0.0f && in[0] <= 1.0f && in[1] >= 0.0f && in[1] <= 1.0f && in[2] >= 0.0f && in[2] <= 1.0f;
+}
+
+// finds the tetrahedron around in (which has to be in [0,1]^3) and the barycentric weights of its
+// vertices. the grid is spaced in cbrt(rgb) to follow the perceptual nonlinearity of Lab.
+static inline void clut_tetrahedron(const float *const clut, const int N, const float *const in,
+                                    const float **c0, const float **c1, const float **c2, const float **c3,
+                                    float w[4])
+{
+  int i[3];
+  float f[3];
+  for(int c = 0; c < 3; c++)
+  {
+    const float u = cbrtf(in[c]) * (N - 1);
+    i[c] = MIN((int)u, N - 2);
+    f[c] = u - i[c];
+  }
+  const size_t sr = (size_t)4 * N * N, sg = (size_t)4 * N, sb = 4;
+  *c0 = clut + sr * i[0] + sg * i[1] + sb * i[2];
+  *c3 = *c0 + sr + sg + sb;
+  float w1, w2, w3;
+  if(f[0] >= f[1])
+  {
+    if(f[1] >= f[2])
+    {
+      *c1 = *c0 + sr, *c2 = *c0 + sr + sg, w1 = f[0], w2 = f[1], w3 = f[2];
+    }
+    else if(f[0] >= f[2])
+    {
+      *c1 = *c0 + sr, *c2 = *c0 + sr + sb, w1 = f[0], w2 = f[2], w3 = f[1];
+    }
+    else
+    {
+      *c1 = *c0 + sb, *c2 = *c0 + sr + sb, w1 = f[2], w2 = f[0], w3 = f[1];
+    }
+  }
+  else
+  {
+    if(f[0] >= f[2])
+    {
+      *c1 = *c0 + sg, *c2 = *c0 + sr + sg, w1 = f[1], w2 = f[0], w3 = f[2];
+    }
+    else if(f[1] >= f[2])
+    {
+      *c1 = *c0 + sg, *c2 = *c0 + sg + sb, w1 = f[1], w2 = f[2], w3 = f[0];
+    }
+    else
+    {
+      *c1 = *c0 + sb, *c2 = *c0 + sg + sb, w1 = f[2], w2 = f[1], w3 = f[0];
+    }
+  }
+  w[0] = 1.0f - w1;
+  w[1] = w1 - w2;
+  w[2] = w2 - w3;
+  w[3] = w3;
+}
+
+static inline void clut_lookup(const float *const clut, const int N, const float *const in, float *const out)
+{
+  const float *c0, *c1, *c2, *c3;
+  float w[4];
+  clut_tetrahedron(clut, N, in, &c0, &c1, &c2, &c3, w);
+  for(int c = 0; c < 3; c++) out[c] = w[0] * c0[c] + w[1] * c1[c] + w[2] * c2[c] + w[3] * c3[c];
+}
+
+// pixels outside of the lut's domain are gathered into a buffer of this many, calling lcms2 for each of them
+// alone would be slow
+#define CLUT_GATHER 256
+
+// runs lcms2 on the count gathered pixels in buf and scatters the results back to their places in out
+static void clut_scatter(const dt_iop_colorin_data_t *const d, float *const buf, const int *const index,
+                         const int count, float *const out)
+{
+  transform_lcms2(d, buf, buf, count);
+  for(int k = 0; k < count; k++)
+    for(int c = 0; c < 3; c++) out[4 * index[k] + c] = buf[4 * k + c];
+}
+
+// 3d lut for pixels inside [0,1]^3, lcms2 for the rest. works in place.
+static void process_clut_row(const dt_iop_colorin_data_t *const d, const float *const in, float *const out,
+                             const int width)
+{
+  float buf[4 * CLUT_GATHER];
+  int index[CLUT_GATHER];
+  int count = 0;
+  for(int j = 0; j < width; j++)
+  {
+    if(clut_in_domain(in + 4 * j))
+      clut_lookup(d->clut, d->clut_size, in + 4 * j, out + 4 * j);
+    else
+    {
+      for(int c = 0; c < 4; c++) buf[4 * count + c] = in[4 * j + c];
+      index[count++] = j;
+      if(count == CLUT_GATHER)
+      {
+        clut_scatter(d, buf, index, count, out);
+        count = 0;
+      }
+    }
+  }
+  if(count) clut_scatter(d, buf, index, count, out);
+}
+
+// samples the lcms2 transform into a 3d lut. returns the lut if it matches lcms2 well enough.
+static float *create_clut(const dt_iop_colorin_data_t *const d, const int N)
+{
+  float *clut = dt_alloc_align(16, sizeof(float) * 4 * N * N * N);
+  if(!clut) return NULL;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int r = 0; r < N; r++)
+  {
+    float *row = clut + (size_t)4 * N * N * r;
+    for(int g = 0; g < N; g++)
+      for(int b = 0; b < N; b++)
+      {
+        float *px = row + (size_t)4 * (N * g + b);
+        const float u[3] = { r / (N - 1.0f), g / (N - 1.0f), b / (N - 1.0f) };
+        for(int c = 0; c < 3; c++) px[c] = u[c] * u[c] * u[c];
+        px[3] = 0.0f;
+      }
+    transform_lcms2(d, row, row, N * N);
+  }
+
+  // compare against lcms2 on pseudo random colors, uniformly distributed in cbrt(rgb)
+  float *test = dt_alloc_align(16, sizeof(float) * 4 * CLUT_TEST_SAMPLES);
+  float *exact = dt_alloc_align(16, sizeof(float) * 4 * CLUT_TEST_SAMPLES);
+  if(!test || !exact)
+  {
+    dt_free_align(test);
+    dt_free_align(exact);
+    dt_free_align(clut);
+    return NULL;
+  }
+  uint32_t state = 0x12345678u;
+  for(int k = 0; k < 4 * CLUT_TEST_SAMPLES; k++)
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    const float u = (state & 0xffffff) / (float)0xffffff;
+    test[k] = (k & 3) == 3 ? 0.0f : u * u * u;
+  }
+  transform_lcms2(d, test, exact, CLUT_TEST_SAMPLES);
+
+  double sum = 0.0;
+  float max = 0.0f;
+  for(int k = 0; k < CLUT_TEST_SAMPLES; k++)
+  {
+    float Lab[3];
+    clut_lookup(clut, N, test + 4 * k, Lab);
+    const float dL = Lab[0] - exact[4 * k], da = Lab[1] - exact[4 * k + 1], db = Lab[2] - exact[4 * k + 2];
+    const float dE = sqrtf(dL * dL + da * da + db * db);
+    sum += dE;
+    max = fmaxf(max, dE);
+  }
+  dt_free_align(test);
+  dt_free_align(exact);
+
+  dt_print(DT_DEBUG_DEV, "[colorin] %d^3 lut for lcms2 transform: mean dE %f, max dE %f%s\n", N,
+           sum / CLUT_TEST_SAMPLES, max, max > CLUT_MAX_DE ? ", rejected" : "");
+
+  if(!(max <= CLUT_MAX_DE))
+  {
+    dt_free_align(clut);
+    return NULL;
+  }
+  return clut;
+}
+
 static void process_cmatrix_bm(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece,
                                const void *const ivoid, void *const ovoid, const dt_iop_roi_t *const roi_in,
                                const dt_iop_roi_t *const roi_out)
@@ -766,26 +975,10 @@ static void process_lcms2_bm(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_
       apply_blue_mapping(in, camptr);
     }
 
-    // convert to (L,a/L,b/L) to be able to change L without changing saturation.
-    if(!d->nrgb)
-    {
-      cmsDoTransform(d->xform_cam_Lab, out, out, roi_out->width);
-    }
+    if(d->clut)
+      process_clut_row(d, out, out, roi_out->width);
     else
-    {
-      cmsDoTransform(d->xform_cam_nrgb, out, out, roi_out->width);
-
-      float *rgbptr = (float *)out;
-      for(int j = 0; j < roi_out->width; j++, rgbptr += 4)
-      {
-        for(int c = 0; c < 3; c++)
-        {
-          rgbptr[c] = CLAMP(rgbptr[c], 0.0f, 1.0f);
-        }
-      }
-
-      cmsDoTransform(d->xform_nrgb_Lab, out, out, roi_out->width);
-    }
+      transform_lcms2(d, out, out, roi_out->width);
   }
 }
 
@@ -805,26 +998,10 @@ static void process_lcms2_proper(struct dt_iop_module_t *self, dt_dev_pixelpipe_
     const float *in = (const float *)ivoid + (size_t)ch * k * roi_out->width;
     float *out = (float *)ovoid + (size_t)ch * k * roi_out->width;
 
-    // convert to (L,a/L,b/L) to be able to change L without changing saturation.
-    if(!d->nrgb)
-    {
-      cmsDoTransform(d->xform_cam_Lab, in, out, roi_out->width);
-    }
+    if(d->clut)
+      process_clut_row(d, in, out, roi_out->width);
     else
-    {
-      cmsDoTransform(d->xform_cam_nrgb, in, out, roi_out->width);
-
-      float *rgbptr = (float *)out;
-      for(int j = 0; j < roi_out->width; j++, rgbptr += 4)
-      {
-        for(int c = 0; c < 3; c++)
-        {
-          rgbptr[c] = CLAMP(rgbptr[c], 0.0f, 1.0f);
-        }
-      }
-
-      cmsDoTransform(d->xform_nrgb_Lab, out, out, roi_out->width);
-    }
+      transform_lcms2(d, in, out, roi_out->width);
   }
 }
 
@@ -867,6 +1044,41 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
 }
 
 #if defined(__SSE2__)
+static inline __m128 clut_lookup_sse2(const float *const clut, const int N, const float *const in)
+{
+  const float *c0, *c1, *c2, *c3;
+  float w[4];
+  clut_tetrahedron(clut, N, in, &c0, &c1, &c2, &c3, w);
+  return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(w[0]), _mm_load_ps(c0)),
+                               _mm_mul_ps(_mm_set1_ps(w[1]), _mm_load_ps(c1))),
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(w[2]), _mm_load_ps(c2)),
+                               _mm_mul_ps(_mm_set1_ps(w[3]), _mm_load_ps(c3))));
+}
+
+static void process_sse2_clut_row(const dt_iop_colorin_data_t *const d, const float *const in,
+                                  float *const out, const int width)
+{
+  __attribute__((aligned(16))) float buf[4 * CLUT_GATHER];
+  int index[CLUT_GATHER];
+  int count = 0;
+  for(int j = 0; j < width; j++)
+  {
+    if(clut_in_domain(in + 4 * j))
+      _mm_store_ps(out + 4 * j, clut_lookup_sse2(d->clut, d->clut_size, in + 4 * j));
+    else
+    {
+      _mm_store_ps(buf + 4 * count, _mm_load_ps(in + 4 * j));
+      index[count++] = j;
+      if(count == CLUT_GATHER)
+      {
+        clut_scatter(d, buf, index, count, out);
+        count = 0;
+      }
+    }
+  }
+  if(count) clut_scatter(d, buf, index, count, out);
+}
+
 static void process_sse2_cmatrix_bm(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece,
                                     const void *const ivoid, void *const ovoid, const dt_iop_roi_t *const roi_in,
                                     const dt_iop_roi_t *const roi_out)
@@ -1142,6 +1354,12 @@ static void process_sse2_lcms2_bm(struct dt_iop_module_t *self, dt_dev_pixelpipe
       apply_blue_mapping(in, camptr);
     }
 
+    if(d->clut)
+    {
+      process_sse2_clut_row(d, out, out, roi_out->width);
+      continue;
+    }
+
     // convert to (L,a/L,b/L) to be able to change L without changing saturation.
     if(!d->nrgb)
     {
@@ -1184,6 +1402,12 @@ static void process_sse2_lcms2_proper(struct dt_iop_module_t *self, dt_dev_pixel
     const float *in = ((float *)ivoid) + (size_t)ch * k * roi_out->width;
     float *out = ((float *)ovoid) + (size_t)ch * k * roi_out->width;
 
+    if(d->clut)
+    {
+      process_sse2_clut_row(d, in, out, roi_out->width);
+      continue;
+    }
+
     // convert to (L,a/L,b/L) to be able to change L without changing saturation.
     if(!d->nrgb)
     {
@@ -1313,6 +1537,9 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     cmsDeleteTransform(d->xform_nrgb_Lab);
     d->xform_nrgb_Lab = NULL;
   }
+  dt_free_align(d->clut);
+  d->clut = NULL;
+  d->clut_size = 0;
 
   d->cmatrix[0] = d->nmatrix[0] = d->lmatrix[0] = NAN;
   d->lut[0][0] = -1.0f;
@@ -1537,6 +1764,18 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     else
       d->unbounded_coeffs[k][0] = -1.0f;
   }
+
+  // lcms2 is slow for lut based profiles, replace it by a 3d lut of the whole transform if that is
+  // accurate enough. only possible for rgb input, xyz has a different encoding range.
+  if(isnan(d->cmatrix[0]) && d->xform_cam_Lab && cmsGetColorSpace(d->input) == cmsSigRgbData)
+  {
+    const int sizes[2] = { CLUT_SIZE_SMALL, CLUT_SIZE_LARGE };
+    for(int k = 0; k < 2 && !d->clut; k++)
+    {
+      d->clut = create_clut(d, sizes[k]);
+      if(d->clut) d->clut_size = sizes[k];
+    }
+  }
 }
 
 void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
@@ -1548,6 +1787,8 @@ void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pi
   d->xform_cam_Lab = NULL;
   d->xform_cam_nrgb = NULL;
   d->xform_nrgb_Lab = NULL;
+  d->clut = NULL;
+  d->clut_size = 0;
   self->commit_params(self, self->default_params, pipe, piece);
 }
 
@@ -1570,6 +1811,8 @@ void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev
     cmsDeleteTransform(d->xform_nrgb_Lab);
     d->xform_nrgb_Lab = NULL;
   }
+  dt_free_align(d->clut);
+  d->clut = NULL;
 
   free(piece->data);
   piece->data = NULL;
@@ -301,7 +301,12 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
   const int hr = range / 2;
 
   const int size = roi_out->width > roi_out->height ? roi_out->width : roi_out->height;
-  float *scanline = calloc(size, sizeof(float));
+  float *const scanline = dt_dev_pixelpipe_scratch_alloc(piece->pipe, sizeof(float) * size);
+  if(scanline == NULL)
+  {
+    fprintf(stderr, "[highpass] failed to allocate temporary buffer\n");
+    return;
+  }
 
   for(int iteration = 0; iteration < BOX_ITERATIONS; iteration++)
   {
@@ -360,7 +365,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
     }
   }
 
-  free(scanline);
+  dt_dev_pixelpipe_scratch_free(piece->pipe, scanline);
 
   const float contrast_scale = ((data->contrast / 100.0) * 7.5);
 #ifdef _OPENMP
@@ -103,6 +103,35 @@ typedef struct dt_iop_lensfun_gui_data_t
   dt_pthread_mutex_t lock;
 } dt_iop_lensfun_gui_data_t;
 
+// initial distance of remap grid nodes in pixels, halved until the grid is accurate enough
+#define LENS_GRID_STEP 16
+// maximum deviation of the bilinearly interpolated coordinates from lensfun's, in pixels
+#define LENS_GRID_MAX_ERROR 0.05f
+#define LENS_GRID_CACHE_ENTRIES 4
+
+/**
+ * sparse samples of lensfun's subpixel distortion (6 floats: r, g and b source position) for the whole
+ * image plane at a given scale. coordinates in between are interpolated bilinearly.
+ * coords == NULL means the transform has to be evaluated by lensfun directly, either because it does not
+ * modify geometry at all or because the grid could not be made accurate enough.
+ */
+typedef struct dt_iop_lensfun_grid_t
+{
+  // key
+  uint64_t hash; // of the lens parameters
+  int inverse;
+  float orig_w, orig_h;
+
+  int modflags;
+  float x0, y0;      // position of the first node
+  int step;          // distance of the nodes in pixels
+  int width, height; // number of nodes
+  float *coords;
+
+  int refs; // protected by the cache lock, the cache itself holds one reference
+  uint64_t used;
+} dt_iop_lensfun_grid_t;
+
 typedef struct dt_iop_lensfun_global_data_t
 {
   lfDatabase *db;
@@ -111,6 +140,10 @@ typedef struct dt_iop_lensfun_global_data_t
   int kernel_lens_distort_lanczos2;
   int kernel_lens_distort_lanczos3;
   int kernel_lens_vignette;
+  // remap grids, shared by all pipes and by distort_(back)transform
+  dt_pthread_mutex_t grid_lock;
+  dt_iop_lensfun_grid_t *grid[LENS_GRID_CACHE_ENTRIES];
+  uint64_t grid_clock;
 } dt_iop_lensfun_global_data_t;
 
 typedef struct dt_iop_lensfun_data_t
@@ -125,6 +158,7 @@ typedef struct dt_iop_lensfun_data_t
   float distance;
   lfLensType target_geom;
   gboolean do_nan_checks;
+  uint64_t hash; // of everything above, to look up remap grids
 } dt_iop_lensfun_data_t;
 
 const char *name()
@@ -329,6 +363,207 @@ static char *_lens_sanitize(const char *orig_lens)
   }
 }
 
+static void _grid_free(dt_iop_lensfun_grid_t *grid)
+{
+  if(!grid) return;
+  dt_free_align(grid->coords);
+  free(grid);
+}
+
+// bilinear interpolation of the grid for width pixels starting at (x, y), same output layout as
+// lf_modifier_apply_subpixel_geometry_distortion()
+static void _grid_interpolate(const dt_iop_lensfun_grid_t *const grid, const float x, const float y,
+                              const int width, float *res)
+{
+  const float gy = (y - grid->y0) / grid->step;
+  const int j = CLAMP((int)floorf(gy), 0, grid->height - 2);
+  const float fy = gy - j;
+  const float *const row0 = grid->coords + (size_t)6 * grid->width * j;
+  const float *const row1 = row0 + (size_t)6 * grid->width;
+  for(int k = 0; k < width; k++, res += 6)
+  {
+    const float gx = (x + k - grid->x0) / grid->step;
+    const int i = CLAMP((int)floorf(gx), 0, grid->width - 2);
+    const float fx = gx - i;
+    const float *const a = row0 + 6 * i;
+    const float *const b = row1 + 6 * i;
+    for(int c = 0; c < 6; c++)
+    {
+      const float top = a[c] + fx * (a[c + 6] - a[c]);
+      const float bot = b[c] + fx * (b[c + 6] - b[c]);
+      res[c] = top + fy * (bot - top);
+    }
+  }
+}
+
+static gboolean _grid_covers(const dt_iop_lensfun_grid_t *const grid, const float x, const float y)
+{
+  return x >= grid->x0 && x <= grid->x0 + (grid->width - 1) * grid->step && y >= grid->y0
+         && y <= grid->y0 + (grid->height - 1) * grid->step;
+}
+
+// evaluate lensfun on the nodes of a grid with the given step, returns the coords or NULL
+static float *_grid_sample(lfModifier *modifier, dt_iop_lensfun_grid_t *grid, const int step)
+{
+  grid->step = step;
+  grid->x0 = grid->y0 = -step;
+  grid->width = ceilf(grid->orig_w / step) + 3;
+  grid->height = ceilf(grid->orig_h / step) + 3;
+  float *const coords = dt_alloc_align(16, sizeof(float) * 6 * grid->width * grid->height);
+  if(!coords) return NULL;
+
+  int finite = 1;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(min : finite) schedule(static)
+#endif
+  for(int j = 0; j < grid->height; j++)
+  {
+    float *res = coords + (size_t)6 * grid->width * j;
+    for(int i = 0; i < grid->width; i++, res += 6)
+    {
+      lf_modifier_apply_subpixel_geometry_distortion(modifier, grid->x0 + i * step, grid->y0 + j * step, 1, 1,
+                                                     res);
+      for(int c = 0; c < 6; c++) finite = MIN(finite, isfinite(res[c]) ? 1 : 0);
+    }
+  }
+  if(!finite)
+  {
+    // NAN coordinates can't be interpolated
+    dt_free_align(coords);
+    return NULL;
+  }
+  return coords;
+}
+
+// maximum deviation of the grid from lensfun in the centers of the cells. only every fourth row of cells is
+// checked, the error is smooth enough for that.
+static float _grid_error(lfModifier *modifier, const dt_iop_lensfun_grid_t *const grid)
+{
+  float err = 0.0f;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(max : err) schedule(static)
+#endif
+  for(int j = 0; j < grid->height - 1; j += 4)
+  {
+    const float y = grid->y0 + (j + 0.5f) * grid->step;
+    for(int i = 0; i < grid->width - 1; i++)
+    {
+      const float x = grid->x0 + (i + 0.5f) * grid->step;
+      float exact[6], approx[6];
+      lf_modifier_apply_subpixel_geometry_distortion(modifier, x, y, 1, 1, exact);
+      _grid_interpolate(grid, x, y, 1, approx);
+      for(int c = 0; c < 6; c++) err = MAX(err, fabsf(exact[c] - approx[c]));
+    }
+  }
+  return err;
+}
+
+static dt_iop_lensfun_grid_t *_grid_build(const dt_iop_lensfun_data_t *const d, const float orig_w,
+                                          const float orig_h, const int inverse)
+{
+  dt_iop_lensfun_grid_t *grid = (dt_iop_lensfun_grid_t *)calloc(1, sizeof(dt_iop_lensfun_grid_t));
+  if(!grid) return NULL;
+  grid->hash = d->hash;
+  grid->inverse = inverse;
+  grid->orig_w = orig_w;
+  grid->orig_h = orig_h;
+
+  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
+  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+  grid->modflags = lf_modifier_initialize(modifier, d->lens, LF_PF_F32, d->focal, d->aperture, d->distance,
+                                          d->scale, d->target_geom, d->modify_flags, inverse);
+  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+
+  // lensfun returns NAN outside of the field of view for some geometry conversions, keep those exact.
+  if((grid->modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+     && !d->do_nan_checks)
+  {
+    for(int step = LENS_GRID_STEP; step >= 2 && !grid->coords; step /= 2)
+    {
+      grid->coords = _grid_sample(modifier, grid, step);
+      if(!grid->coords) break;
+      const float err = _grid_error(modifier, grid);
+      dt_print(DT_DEBUG_DEV, "[lens] remap grid %dx%d, step %d, max error %f px\n", grid->width,
+               grid->height, step, err);
+      if(err > LENS_GRID_MAX_ERROR)
+      {
+        dt_free_align(grid->coords);
+        grid->coords = NULL;
+      }
+    }
+  }
+  lf_modifier_destroy(modifier);
+  return grid;
+}
+
+// returns the remap grid for the given lens data and scale, computing it if not cached yet.
+// has to be released with _grid_release().
+static dt_iop_lensfun_grid_t *_grid_acquire(dt_iop_module_t *self, const dt_iop_lensfun_data_t *const d,
+                                            const float orig_w, const float orig_h, const int inverse)
+{
+  dt_iop_lensfun_global_data_t *gd = (dt_iop_lensfun_global_data_t *)self->data;
+
+  dt_pthread_mutex_lock(&gd->grid_lock);
+  for(int k = 0; k < LENS_GRID_CACHE_ENTRIES; k++)
+  {
+    dt_iop_lensfun_grid_t *grid = gd->grid[k];
+    if(grid && grid->hash == d->hash && grid->inverse == inverse && grid->orig_w == orig_w
+       && grid->orig_h == orig_h)
+    {
+      grid->refs++;
+      grid->used = ++gd->grid_clock;
+      dt_pthread_mutex_unlock(&gd->grid_lock);
+      return grid;
+    }
+  }
+  dt_pthread_mutex_unlock(&gd->grid_lock);
+
+  // not found, build it without holding the lock. another thread might do the same, that's fine.
+  dt_iop_lensfun_grid_t *grid = _grid_build(d, orig_w, orig_h, inverse);
+  if(!grid) return NULL;
+
+  dt_pthread_mutex_lock(&gd->grid_lock);
+  int slot = 0;
+  for(int k = 0; k < LENS_GRID_CACHE_ENTRIES; k++)
+  {
+    if(!gd->grid[k])
+    {
+      slot = k;
+      break;
+    }
+    if(gd->grid[k]->used < gd->grid[slot]->used) slot = k;
+  }
+  dt_iop_lensfun_grid_t *old = gd->grid[slot];
+  if(old && --old->refs > 0) old = NULL; // still in use, the last user frees it
+  gd->grid[slot] = grid;
+  grid->refs = 2; // cache and caller
+  grid->used = ++gd->grid_clock;
+  dt_pthread_mutex_unlock(&gd->grid_lock);
+
+  _grid_free(old);
+  return grid;
+}
+
+static void _grid_release(dt_iop_module_t *self, dt_iop_lensfun_grid_t *grid)
+{
+  if(!grid) return;
+  dt_iop_lensfun_global_data_t *gd = (dt_iop_lensfun_global_data_t *)self->data;
+  dt_pthread_mutex_lock(&gd->grid_lock);
+  const int refs = --grid->refs;
+  dt_pthread_mutex_unlock(&gd->grid_lock);
+  if(refs == 0) _grid_free(grid);
+}
+
+// distorted coordinates of width pixels starting at (x, y), from the grid if there is one
+static inline void _apply_distortion(const dt_iop_lensfun_grid_t *const grid, lfModifier *modifier,
+                                     const float x, const float y, const int width, float *res)
+{
+  if(grid && grid->coords)
+    _grid_interpolate(grid, x, y, width, res);
+  else
+    lf_modifier_apply_subpixel_geometry_distortion(modifier, x, y, width, 1, res);
+}
+
 void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid, void *const ovoid,
              const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
@@ -356,6 +591,10 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
                                d->target_geom, d->modify_flags, d->inverse);
   dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
 
+  dt_iop_lensfun_grid_t *grid = NULL;
+  if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    grid = _grid_acquire(self, d, orig_w, orig_h, d->inverse);
+
   const struct dt_interpolation *const interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
 
   if(d->inverse)
@@ -368,13 +607,12 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
       void *buf = dt_alloc_align(16, bufsize * dt_get_num_threads() * sizeof(float));
 
 #ifdef _OPENMP
-#pragma omp parallel for default(none) shared(buf, modifier) schedule(static)
+#pragma omp parallel for default(none) shared(buf, modifier, grid) schedule(static)
 #endif
       for(int y = 0; y < roi_out->height; y++)
       {
         float *bufptr = ((float *)buf) + (size_t)bufsize * dt_get_thread_num();
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, bufptr);
+        _apply_distortion(grid, modifier, roi_out->x, roi_out->y + y, roi_out->width, bufptr);
 
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + (size_t)y * roi_out->width * ch;
@@ -463,13 +701,12 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
       void *buf2 = dt_alloc_align(16, buf2size * sizeof(float) * dt_get_num_threads());
 
 #ifdef _OPENMP
-#pragma omp parallel for default(none) shared(buf2, buf, modifier) schedule(static)
+#pragma omp parallel for default(none) shared(buf2, buf, modifier, grid) schedule(static)
 #endif
       for(int y = 0; y < roi_out->height; y++)
       {
         float *buf2ptr = ((float *)buf2) + (size_t)buf2size * dt_get_thread_num();
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, buf2ptr);
+        _apply_distortion(grid, modifier, roi_out->x, roi_out->y + y, roi_out->width, buf2ptr);
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + (size_t)y * roi_out->width * ch;
         for(int x = 0; x < roi_out->width; x++, buf2ptr += 6, out += ch)
@@ -514,6 +751,7 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
     }
     dt_free_align(buf);
   }
+  _grid_release(self, grid);
   lf_modifier_destroy(modifier);
 
   if(self->dev->gui_attached && g && piece->pipe->type == DT_DEV_PIXELPIPE_PREVIEW)
@@ -538,6 +776,7 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
 
   float *tmpbuf = NULL;
   lfModifier *modifier = NULL;
+  dt_iop_lensfun_grid_t *grid = NULL;
 
   const int devid = piece->pipe->devid;
   const int iwidth = roi_in->width;
@@ -608,19 +847,21 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
                                         d->scale, d->target_geom, d->modify_flags, d->inverse);
   dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
 
+  if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    grid = _grid_acquire(self, d, orig_w, orig_h, d->inverse);
+
   if(d->inverse)
   {
     // reverse direction (useful for renderings)
     if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
 #ifdef _OPENMP
-#pragma omp parallel for default(none) shared(tmpbuf, d, modifier) schedule(static)
+#pragma omp parallel for default(none) shared(tmpbuf, d, modifier, grid) schedule(static)
 #endif
       for(int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + (size_t)y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, pi);
+        _apply_distortion(grid, modifier, roi_out->x, roi_out->y + y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -723,13 +964,12 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
     if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
 #ifdef _OPENMP
-#pragma omp parallel for default(none) shared(tmpbuf, d, modifier) schedule(static)
+#pragma omp parallel for default(none) shared(tmpbuf, d, modifier, grid) schedule(static)
 #endif
       for(int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + (size_t)y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, pi);
+        _apply_distortion(grid, modifier, roi_out->x, roi_out->y + y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -767,6 +1007,7 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
   dt_opencl_release_mem_object(dev_tmpbuf);
   dt_opencl_release_mem_object(dev_tmp);
   if(tmpbuf != NULL) dt_free_align(tmpbuf);
+  _grid_release(self, grid);
   if(modifier != NULL) lf_modifier_destroy(modifier);
   return TRUE;
 
@@ -774,6 +1015,7 @@ error:
   dt_opencl_release_mem_object(dev_tmp);
   dt_opencl_release_mem_object(dev_tmpbuf);
   if(tmpbuf != NULL) dt_free_align(tmpbuf);
+  _grid_release(self, grid);
   if(modifier != NULL) lf_modifier_destroy(modifier);
   dt_print(DT_DEBUG_OPENCL, "[opencl_lens] couldn't enqueue kernel! %d\n", err);
   return FALSE;
@@ -793,31 +1035,49 @@ void tiling_callback(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t
   return;
 }
 
-int distort_transform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, float *points, size_t points_count)
+static void _distort_points(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, float *points,
+                            size_t points_count, const int inverse)
 {
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
-
-  if(!d->lens || !d->lens->Maker || d->crop <= 0.0f) return 0;
-
   const float orig_w = piece->buf_in.width, orig_h = piece->buf_in.height;
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+  dt_iop_lensfun_grid_t *grid = _grid_acquire(self, d, orig_w, orig_h, inverse);
+  if(!grid) return;
 
-  int modflags = lf_modifier_initialize(modifier, d->lens, LF_PF_F32, d->focal, d->aperture, d->distance,
-                                        d->scale, d->target_geom, d->modify_flags, !d->inverse);
-  float *buf = malloc(2 * 3 * sizeof(float));
-
-  for(size_t i = 0; i < points_count * 2; i += 2)
+  if(grid->modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
   {
-    if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    // only needed for points the grid can't answer
+    lfModifier *modifier = NULL;
+    float buf[6];
+
+    for(size_t i = 0; i < points_count * 2; i += 2)
     {
-      lf_modifier_apply_subpixel_geometry_distortion(modifier, points[i], points[i + 1], 1, 1, buf);
+      if(grid->coords && _grid_covers(grid, points[i], points[i + 1]))
+        _grid_interpolate(grid, points[i], points[i + 1], 1, buf);
+      else
+      {
+        if(!modifier)
+        {
+          modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+          lf_modifier_initialize(modifier, d->lens, LF_PF_F32, d->focal, d->aperture, d->distance, d->scale,
+                                 d->target_geom, d->modify_flags, inverse);
+        }
+        lf_modifier_apply_subpixel_geometry_distortion(modifier, points[i], points[i + 1], 1, 1, buf);
+      }
       points[i] = buf[0];
       points[i + 1] = buf[3];
     }
+    if(modifier) lf_modifier_destroy(modifier);
   }
-  free(buf);
-  lf_modifier_destroy(modifier);
+  _grid_release(self, grid);
+}
 
+int distort_transform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, float *points, size_t points_count)
+{
+  dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+
+  if(!d->lens || !d->lens->Maker || d->crop <= 0.0f) return 0;
+
+  _distort_points(self, piece, points, points_count, !d->inverse);
   return 1;
 }
 int distort_backtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, float *points,
@@ -826,24 +1086,7 @@ int distort_backtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece,
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
   if(!d->lens || !d->lens->Maker || d->crop <= 0.0f) return 0;
 
-  const float orig_w = piece->buf_in.width, orig_h = piece->buf_in.height;
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  int modflags = lf_modifier_initialize(modifier, d->lens, LF_PF_F32, d->focal, d->aperture, d->distance,
-                                        d->scale, d->target_geom, d->modify_flags, d->inverse);
-  float *buf = malloc(2 * 3 * sizeof(float));
-
-  for(size_t i = 0; i < points_count * 2; i += 2)
-  {
-    if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
-    {
-      lf_modifier_apply_subpixel_geometry_distortion(modifier, points[i], points[i + 1], 1, 1, buf);
-      points[i] = buf[0];
-      points[i + 1] = buf[3];
-    }
-  }
-  free(buf);
-  lf_modifier_destroy(modifier);
+  _distort_points(self, piece, points, points_count, d->inverse);
   return 1;
 }
 
@@ -871,6 +1114,7 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
 
   if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
   {
+    dt_iop_lensfun_grid_t *grid = _grid_acquire(self, d, orig_w, orig_h, d->inverse);
     const int xoff = roi_in->x;
     const int yoff = roi_in->y;
     const int width = roi_in->width;
@@ -886,32 +1130,33 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
     float *const buf = dt_alloc_align(16, nbpoints * 2 * 3 * sizeof(float));
 
 #ifdef _OPENMP
-#pragma omp parallel default(none) shared(modifier) reduction(min : xm, ym) reduction(max : xM, yM)
+#pragma omp parallel default(none) shared(modifier, grid) reduction(min : xm, ym) reduction(max : xM, yM)
 #endif
     {
 #ifdef _OPENMP
 #pragma omp for schedule(static)
 #endif
       for(int i = 0; i < awidth; i++)
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, xoff + i * xstep, yoff, 1, 1, buf + 6 * i);
+        _apply_distortion(grid, modifier, xoff + i * xstep, yoff, 1, buf + 6 * i);
 
 #ifdef _OPENMP
 #pragma omp for schedule(static)
 #endif
       for(int i = 0; i < awidth; i++)
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, xoff + i * xstep, yoff + (height - 1), 1, 1, buf + 6 * (awidth + i));
+        _apply_distortion(grid, modifier, xoff + i * xstep, yoff + (height - 1), 1, buf + 6 * (awidth + i));
 
 #ifdef _OPENMP
 #pragma omp for schedule(static)
 #endif
       for(int j = 0; j < aheight; j++)
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, xoff, yoff + j * ystep, 1, 1, buf + 6 * (2 * awidth + j));
+        _apply_distortion(grid, modifier, xoff, yoff + j * ystep, 1, buf + 6 * (2 * awidth + j));
 
 #ifdef _OPENMP
 #pragma omp for schedule(static)
 #endif
       for(int j = 0; j < aheight; j++)
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, xoff + (width - 1), yoff + j * ystep, 1, 1, buf + 6 * (2 * awidth + aheight + j));
+        _apply_distortion(grid, modifier, xoff + (width - 1), yoff + j * ystep, 1,
+                          buf + 6 * (2 * awidth + aheight + j));
 
 #ifdef _OPENMP
 #pragma omp barrier
@@ -932,6 +1177,7 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
     }
 
     dt_free_align(buf);
+    _grid_release(self, grid);
 
     // LensFun can return NAN coords, so we need to handle them carefully.
     if(!isfinite(xm) || !(0 <= xm && xm < orig_w)) xm = 0;
@@ -1039,6 +1285,14 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
   {
     d->do_nan_checks = FALSE;
   }
+
+  // the lens is fully determined by the params and the camera's crop factor
+  uint64_t hash = 5381;
+  const char *str = (const char *)p;
+  for(size_t i = 0; i < sizeof(dt_iop_lensfun_params_t); i++) hash = ((hash << 5) + hash) ^ str[i];
+  str = (const char *)&d->crop;
+  for(size_t i = 0; i < sizeof(float); i++) hash = ((hash << 5) + hash) ^ str[i];
+  d->hash = hash;
 }
 
 void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
@@ -1066,6 +1320,7 @@ void init_global(dt_iop_module_so_t *module)
   dt_iop_lensfun_global_data_t *gd
       = (dt_iop_lensfun_global_data_t *)calloc(1, sizeof(dt_iop_lensfun_global_data_t));
   module->data = gd;
+  dt_pthread_mutex_init(&gd->grid_lock, NULL);
   gd->kernel_lens_distort_bilinear = dt_opencl_create_kernel(program, "lens_distort_bilinear");
   gd->kernel_lens_distort_bicubic = dt_opencl_create_kernel(program, "lens_distort_bicubic");
   gd->kernel_lens_distort_lanczos2 = dt_opencl_create_kernel(program, "lens_distort_lanczos2");
@@ -1261,6 +1516,8 @@ void cleanup_global(dt_iop_module_so_t *module)
   dt_opencl_free_kernel(gd->kernel_lens_distort_lanczos2);
   dt_opencl_free_kernel(gd->kernel_lens_distort_lanczos3);
   dt_opencl_free_kernel(gd->kernel_lens_vignette);
+  for(int k = 0; k < LENS_GRID_CACHE_ENTRIES; k++) _grid_free(gd->grid[k]);
+  dt_pthread_mutex_destroy(&gd->grid_lock);
   free(module->data);
   module->data = NULL;
 }
@@ -396,10 +396,16 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
 
   if(data->lowpass_algo == LOWPASS_ALGO_GAUSSIAN)
   {
-    dt_gaussian_t *g = dt_gaussian_init(width, height, ch, Labmax, Labmin, sigma, order);
-    if(!g) return;
+    float *const buf = dt_dev_pixelpipe_scratch_alloc(piece->pipe, sizeof(float) * ch * width * height);
+    dt_gaussian_t *g = dt_gaussian_init_buffer(width, height, ch, Labmax, Labmin, sigma, order, buf);
+    if(!g)
+    {
+      dt_dev_pixelpipe_scratch_free(piece->pipe, buf);
+      return;
+    }
     dt_gaussian_blur_4c(g, in, out);
     dt_gaussian_free(g);
+    dt_dev_pixelpipe_scratch_free(piece->pipe, buf);
   }
   else
   {
@@ -294,7 +294,8 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
     return;
   }
 
-  float *const tmp = dt_alloc_align(16, (size_t)sizeof(float) * roi_out->width * roi_out->height);
+  float *const tmp
+      = dt_dev_pixelpipe_scratch_alloc(piece->pipe, (size_t)sizeof(float) * roi_out->width * roi_out->height);
   if(tmp == NULL)
   {
     fprintf(stderr, "[sharpen] failed to allocate temporary buffer\n");
@@ -415,7 +416,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
     memcpy(((float *)ovoid) + (size_t)ch * j * roi_out->width,
            ((float *)ivoid) + (size_t)ch * j * roi_in->width, (size_t)ch * sizeof(float) * roi_out->width);
 
-  dt_free_align(tmp);
+  dt_dev_pixelpipe_scratch_free(piece->pipe, tmp);
 
 #ifdef _OPENMP
 #pragma omp parallel for default(none) schedule(static)
@@ -478,7 +479,8 @@ void process_sse2(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
     return;
   }
 
-  float *const tmp = dt_alloc_align(16, (size_t)sizeof(float) * roi_out->width * roi_out->height);
+  float *const tmp
+      = dt_dev_pixelpipe_scratch_alloc(piece->pipe, (size_t)sizeof(float) * roi_out->width * roi_out->height);
   if(tmp == NULL)
   {
     fprintf(stderr, "[sharpen] failed to allocate temporary buffer\n");
@@ -603,7 +605,7 @@ void process_sse2(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
     memcpy(((float *)ovoid) + (size_t)ch * j * roi_out->width,
            ((float *)ivoid) + (size_t)ch * j * roi_in->width, (size_t)ch * sizeof(float) * roi_out->width);
 
-  dt_free_align(tmp);
+  dt_dev_pixelpipe_scratch_free(piece->pipe, tmp);
 
 #ifdef _OPENMP
 #pragma omp parallel for default(none) schedule(static)
@@ -205,15 +205,7 @@ static void detach_selected_tag(dt_lib_module_t *self, dt_lib_tagging_t *d)
 
   dt_tag_detach(tagid, imgsel);
 
-  // we have to check the conf option as dt_image_synch_xmp() doesn't when called for a single image
-  if(dt_conf_get_bool("write_sidecar_files"))
-  {
-    for(GList *image_iter = affected_images; image_iter; image_iter = g_list_next(image_iter))
-    {
-      int imgid = GPOINTER_TO_INT(image_iter->data);
-      dt_image_synch_xmp(imgid);
-    }
-  }
+  dt_image_synch_xmps(affected_images);
 
   g_list_free(affected_images);
 
@@ -343,15 +335,8 @@ static void delete_button_clicked(GtkButton *button, gpointer user_data)
 
   dt_tag_remove(tagid, TRUE);
 
-  GList *list_iter;
-  if((list_iter = g_list_first(tagged_images)) != NULL)
-  {
-    do
-    {
-      dt_image_synch_xmp(GPOINTER_TO_INT(list_iter->data));
-    } while((list_iter = g_list_next(list_iter)) != NULL);
-  }
-  g_list_free(g_list_first(tagged_images));
+  dt_image_synch_xmps(tagged_images);
+  g_list_free(tagged_images);
 
   update(self, 0);
   update(self, 1);
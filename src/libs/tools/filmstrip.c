@@ -501,27 +501,19 @@ static gboolean _lib_filmstrip_scroll_callback(GtkWidget *w, GdkEventScroll *e,
   return TRUE;
 }
 
-static gboolean _lib_filmstrip_imgid_in_collection(const dt_collection_t *collection, const int imgid)
+static gboolean _lib_filmstrip_imgid_in_collection(const int imgid)
 {
   sqlite3_stmt *stmt;
   gboolean image_in_collection = TRUE;
-  const char *query = dt_collection_get_query(collection);
 
-  char *count_query = g_strdup_printf("SELECT count(id) FROM (%s) WHERE id = ?3", query);
-
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), count_query, -1, &stmt, NULL);
-  if((collection->params.query_flags & COLLECTION_QUERY_USE_LIMIT)
-     && !(collection->params.query_flags & COLLECTION_QUERY_USE_ONLY_WHERE_EXT))
-  {
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, 0);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, -1);
-  }
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 3, imgid);
+  // the current collection is kept up to date in memory.collected_images
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "SELECT COUNT(*) FROM memory.collected_images WHERE imgid = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
 
   if(sqlite3_step(stmt) == SQLITE_ROW)
     image_in_collection = (sqlite3_column_int(stmt, 0) > 0);
   sqlite3_finalize(stmt);
-  g_free(count_query);
   return image_in_collection;
 }
 
@@ -577,10 +569,10 @@ static gboolean _lib_filmstrip_button_press_callback(GtkWidget *w, GdkEventButto
           dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_SAFE);
 
 
-          dt_collection_hint_message(darktable.collection); // More than this, we need to redraw all
+          dt_collection_update_images(darktable.collection, mouse_over_id);
 
           if(mouse_over_id == strip->activated_image)
-            if(_lib_filmstrip_imgid_in_collection(darktable.collection, mouse_over_id) == 0)
+            if(_lib_filmstrip_imgid_in_collection(mouse_over_id) == 0)
               dt_view_filmstrip_scroll_relative(0, offset);
 
           gtk_widget_queue_draw(darktable.view_manager->proxy.filmstrip.module->widget);
@@ -945,10 +937,10 @@ static gboolean _lib_filmstrip_ratings_key_accel_callback(GtkAccelGroup *accel_g
 
       dt_ratings_apply_to_image(mouse_over_id, num);
 
-      dt_collection_hint_message(darktable.collection); // More than this, we need to redraw all
+      dt_collection_update_images(darktable.collection, mouse_over_id);
 
       if(mouse_over_id == activated_image)
-        if(_lib_filmstrip_imgid_in_collection(darktable.collection, mouse_over_id) == 0)
+        if(_lib_filmstrip_imgid_in_collection(mouse_over_id) == 0)
           dt_view_filmstrip_scroll_relative(0, offset);
 
       /* redraw all */
@@ -17,6 +17,7 @@
 */
 
 #include "common/ratings.h"
+#include "common/collection.h"
 #include "common/debug.h"
 #include "control/control.h"
 #include "dtgtk/button.h"
@@ -205,6 +206,7 @@ static gboolean _lib_ratings_button_press_callback(GtkWidget *widget, GdkEventBu
       // d->current, 1); //FIXME: Change the message after release
     }
 
+    dt_collection_update_images(darktable.collection, mouse_over_id);
     dt_control_queue_redraw_center();
   }
   return TRUE;
@@ -170,6 +170,89 @@ static int write_image(lua_State *L)
   return 1;
 }
 
+// what luaL_optinteger() accepts, without raising an error
+static gboolean _is_opt_integer(lua_State *L, const int index)
+{
+  int isnum = 1;
+  if(!lua_isnoneornil(L, index)) lua_tointegerx(L, index, &isnum);
+  return isnum;
+}
+
+static int write_images(lua_State *L)
+{
+  /* check that param 1 is a module_format_t */
+  luaL_argcheck(L, dt_lua_isa(L, 1, dt_imageio_module_format_t), -1, "dt_imageio_module_format_t expected");
+
+  lua_getmetatable(L, 1);
+  lua_getfield(L, -1, "__luaA_Type");
+  luaA_Type format_type = luaL_checkinteger(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, -1, "__associated_object");
+  dt_imageio_module_format_t *format = lua_touserdata(L, -1);
+  lua_pop(L, 2);
+
+  /* check that param 2 is an image */
+  dt_lua_image_t imgid;
+  luaA_to(L, dt_lua_image_t, &imgid, 2);
+
+  /* param 3 is a list of { filename = ..., max_width = ..., max_height = ... } */
+  luaL_checktype(L, 3, LUA_TTABLE);
+  const int count = luaL_len(L, 3);
+  luaL_argcheck(L, count > 0, 3, "at least one rendition expected");
+
+  /* treat param 4 as an optional boolean */
+  const gboolean upscale = lua_toboolean(L, 4);
+
+  /* check all of it before allocating anything, lua errors don't return */
+  for(int k = 0; k < count; k++)
+  {
+    lua_rawgeti(L, 3, k + 1);
+    luaL_argcheck(L, lua_istable(L, -1), 3, "table of renditions expected");
+    lua_getfield(L, -1, "filename");
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 3, "filename of rendition expected");
+    lua_getfield(L, -2, "max_width");
+    luaL_argcheck(L, _is_opt_integer(L, -1), 3, "integer max_width expected");
+    lua_getfield(L, -3, "max_height");
+    luaL_argcheck(L, _is_opt_integer(L, -1), 3, "integer max_height expected");
+    lua_pop(L, 4);
+  }
+
+  dt_imageio_rendition_t *renditions = calloc(count, sizeof(dt_imageio_rendition_t));
+  if(!renditions) return luaL_error(L, "out of memory");
+  for(int k = 0; k < count; k++)
+  {
+    lua_rawgeti(L, 3, k + 1);
+    dt_imageio_module_data_t *fdata = format->get_params(format);
+    luaA_to_type(L, format_type, fdata, 1);
+    lua_getfield(L, -1, "filename");
+    renditions[k].filename = g_strdup(lua_tostring(L, -1));
+    lua_getfield(L, -2, "max_width");
+    if(!lua_isnil(L, -1)) fdata->max_width = lua_tointeger(L, -1);
+    lua_getfield(L, -3, "max_height");
+    if(!lua_isnil(L, -1)) fdata->max_height = lua_tointeger(L, -1);
+    lua_pop(L, 4);
+    renditions[k].format = format;
+    renditions[k].format_params = fdata;
+  }
+
+  dt_lua_unlock();
+  gboolean high_quality = dt_conf_get_bool("plugins/lighttable/export/high_quality_processing");
+  dt_colorspaces_color_profile_type_t icc_type = dt_conf_get_int("plugins/lighttable/export/icctype");
+  gchar *icc_filename = dt_conf_get_string("plugins/lighttable/export/iccprofile");
+  gboolean result = dt_imageio_export_renditions(imgid, renditions, count, high_quality, upscale, FALSE, icc_type,
+                                                 icc_filename, DT_INTENT_LAST, NULL, NULL, 1, 1);
+  g_free(icc_filename);
+  dt_lua_lock();
+  lua_pushboolean(L, result);
+  for(int k = 0; k < count; k++)
+  {
+    g_free((gchar *)renditions[k].filename);
+    format->free_params(format, renditions[k].format_params);
+  }
+  free(renditions);
+  return 1;
+}
+
 void dt_lua_register_format_type(lua_State *L, dt_imageio_module_format_t *module, luaA_Type type_id)
 {
   dt_lua_type_register_parent_type(L, type_id, luaA_type_find(L, "dt_imageio_module_format_t"));
@@ -209,6 +292,9 @@ int dt_lua_init_early_format(lua_State *L)
   lua_pushcfunction(L, write_image);
   lua_pushcclosure(L, dt_lua_type_member_common, 1);
   dt_lua_type_register_const(L, dt_imageio_module_format_t, "write_image");
+  lua_pushcfunction(L, write_images);
+  lua_pushcclosure(L, dt_lua_type_member_common, 1);
+  dt_lua_type_register_const(L, dt_imageio_module_format_t, "write_images");
 
   dt_lua_module_new(L, "format");
 
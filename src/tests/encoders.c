@@ -0,0 +1,357 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2022 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// the parallel jpeg, png and tiff writers against the sequential ones. an image larger than the formats'
+// PARALLEL_MIN_PIXELS goes through write_begin(), write_rows() and write_end() in several splits into
+// write_rows() calls, is decoded with libjpeg, libpng and libtiff and compared to the decoded output of the
+// sequential writer. that one is what the formats use on a single cpu, so the reference is written with the
+// thread pinned to one cpu. png and tiff are lossless and are compared to the input as well.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "common/darktable.h"
+#include "common/imageio_module.h"
+#include "control/conf.h"
+
+#include <glib/gstdio.h>
+#include <jpeglib.h>
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tiffio.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// a bit more than the 4 megapixels the formats start encoding in parallel at, with a height which doesn't
+// divide into whole bands, strips or mcu rows
+#define WIDTH 2311
+#define HEIGHT 1857
+
+typedef struct test_t
+{
+  const char *format, *name;
+  int bpp, quality, compress;
+  // decoded pixels equal the input
+  gboolean lossless;
+} test_t;
+
+static const test_t tests[] = {
+  { "jpeg", "jpeg quality 85, 4:2:0", 8, 85, 0, FALSE },
+  { "jpeg", "jpeg quality 97, 4:4:4", 8, 97, 0, FALSE },
+  { "png", "png 8 bit", 8, 0, 5, TRUE },
+  { "png", "png 16 bit", 16, 0, 1, TRUE },
+  { "tiff", "tiff 8 bit deflate", 8, 0, 1, TRUE },
+  { "tiff", "tiff 16 bit deflate with predictor", 16, 0, 2, TRUE },
+  { "tiff", "tiff 32 bit deflate with predictor", 32, 0, 3, TRUE },
+};
+
+// a gradient with some structure and noise, 4 channels per pixel like the pipe delivers them
+static void *make_input(const int bpp)
+{
+  const size_t n = (size_t)4 * WIDTH * HEIGHT;
+  void *in = malloc(n * bpp / 8);
+  for(size_t k = 0; k < n; k++)
+  {
+    const int x = (k / 4) % WIDTH, y = (k / 4) / WIDTH, c = k % 4;
+    uint32_t h = (uint32_t)k;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    const float v = CLAMP(0.5f * x / WIDTH + 0.3f * y / HEIGHT + 0.1f * c + ((x / 64 + y / 64) % 2) * 0.05f
+                              + (h & 0xff) / 8192.0f,
+                          0.0f, 1.0f);
+    if(bpp == 8)
+      ((uint8_t *)in)[k] = (uint8_t)(255.0f * v + 0.5f);
+    else if(bpp == 16)
+      ((uint16_t *)in)[k] = (uint16_t)(65535.0f * v + 0.5f);
+    else
+      ((float *)in)[k] = v;
+  }
+  return in;
+}
+
+// write the file in calls of split times the rows the format asks for, or all at once for split 0
+static int write_file(dt_imageio_module_format_t *format, dt_imageio_module_data_t *params, const char *filename,
+                      const void *in, const int bpp, const int split)
+{
+  int rows = 1;
+  void *handle = format->write_begin(params, filename, DT_COLORSPACE_NONE, NULL, NULL, 0, NULL, 0, 0, 1, 1,
+                                     &rows);
+  if(!handle) return 1;
+  const int step = split ? MAX(rows, 1) * split : HEIGHT;
+  int res = 0;
+  for(int y = 0; y < HEIGHT && !res; y += step)
+    res = format->write_rows(params, handle, (const uint8_t *)in + (size_t)4 * y * WIDTH * bpp / 8, y,
+                             MIN(step, HEIGHT - y));
+  return format->write_end(params, handle) | res;
+}
+
+// the decoded file as 3 channels of bpp bits in host byte order, NULL if it can't be read
+static void *read_jpeg(const char *filename)
+{
+  FILE *f = g_fopen(filename, "rb");
+  if(!f) return NULL;
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, f);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = JCS_RGB;
+  jpeg_start_decompress(&cinfo);
+  uint8_t *out = NULL;
+  if(cinfo.output_width == WIDTH && cinfo.output_height == HEIGHT && cinfo.output_components == 3)
+  {
+    out = malloc((size_t)3 * WIDTH * HEIGHT);
+    while(cinfo.output_scanline < cinfo.output_height)
+    {
+      JSAMPROW row = out + (size_t)3 * WIDTH * cinfo.output_scanline;
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+  }
+  jpeg_destroy_decompress(&cinfo);
+  fclose(f);
+  return out;
+}
+
+static void *read_png(const char *filename, const int bpp)
+{
+  FILE *f = g_fopen(filename, "rb");
+  if(!f) return NULL;
+  png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  uint8_t *volatile out = NULL;
+  if(setjmp(png_jmpbuf(png_ptr)))
+  {
+    free(out);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(f);
+    return NULL;
+  }
+  png_init_io(png_ptr, f);
+  png_read_info(png_ptr, info_ptr);
+  if(png_get_image_width(png_ptr, info_ptr) == WIDTH && png_get_image_height(png_ptr, info_ptr) == HEIGHT
+     && png_get_bit_depth(png_ptr, info_ptr) == bpp && png_get_channels(png_ptr, info_ptr) == 3)
+  {
+    if(bpp == 16 && G_BYTE_ORDER == G_LITTLE_ENDIAN) png_set_swap(png_ptr);
+    out = malloc((size_t)3 * WIDTH * HEIGHT * bpp / 8);
+    for(int y = 0; y < HEIGHT; y++) png_read_row(png_ptr, out + (size_t)3 * WIDTH * y * bpp / 8, NULL);
+    png_read_end(png_ptr, NULL);
+  }
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+  fclose(f);
+  return out;
+}
+
+static void *read_tiff(const char *filename, const int bpp)
+{
+  TIFF *tif = TIFFOpen(filename, "r");
+  if(!tif) return NULL;
+  uint32_t width = 0, height = 0;
+  uint16_t bits = 0, spp = 0;
+  TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+  TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+  TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+  TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+  uint8_t *out = NULL;
+  if(width == WIDTH && height == HEIGHT && bits == bpp && spp == 3)
+  {
+    out = malloc((size_t)3 * WIDTH * HEIGHT * bpp / 8);
+    for(int y = 0; y < HEIGHT && out; y++)
+      if(TIFFReadScanline(tif, out + (size_t)3 * WIDTH * y * bpp / 8, y, 0) == -1)
+      {
+        free(out);
+        out = NULL;
+      }
+  }
+  TIFFClose(tif);
+  return out;
+}
+
+static void *read_file(const test_t *test, const char *filename)
+{
+  if(!strcmp(test->format, "jpeg")) return read_jpeg(filename);
+  if(!strcmp(test->format, "png")) return read_png(filename, test->bpp);
+  return read_tiff(filename, test->bpp);
+}
+
+// the input without its fourth channel, like the decoded files
+static void *pack_input(const void *in, const int bpp)
+{
+  const size_t bytes = bpp / 8;
+  uint8_t *out = malloc((size_t)3 * WIDTH * HEIGHT * bytes);
+  for(size_t k = 0; k < (size_t)WIDTH * HEIGHT; k++)
+    memcpy(out + 3 * k * bytes, (const uint8_t *)in + 4 * k * bytes, 3 * bytes);
+  return out;
+}
+
+#ifdef __linux__
+static cpu_set_t cpus;
+#endif
+
+// pin the calling thread to one cpu, which makes the formats pick their sequential writer. returns FALSE if
+// that isn't possible here.
+static gboolean pin_to_one_cpu()
+{
+#ifdef __linux__
+  if(pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus)) return FALSE;
+  cpu_set_t one;
+  CPU_ZERO(&one);
+  for(int c = 0; c < CPU_SETSIZE; c++)
+    if(CPU_ISSET(c, &cpus))
+    {
+      CPU_SET(c, &one);
+      break;
+    }
+  return !pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &one) && dt_get_num_threads() == 1;
+#else
+  return FALSE;
+#endif
+}
+
+static void unpin()
+{
+#ifdef __linux__
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+#endif
+}
+
+static int run_test(const test_t *test, int *n_tests, int *n_failed)
+{
+  *n_tests = 0;
+  *n_failed = 0;
+
+  dt_imageio_module_format_t *format = dt_imageio_get_format_by_name(test->format);
+  if(!format || !format->write_begin)
+  {
+    printf("  [FAIL] the %s format module can't be found\n", test->format);
+    *n_tests = *n_failed = 1;
+    return 1;
+  }
+
+  if(!strcmp(test->format, "jpeg"))
+    dt_conf_set_int("plugins/imageio/format/jpeg/quality", test->quality);
+  else if(!strcmp(test->format, "png"))
+  {
+    dt_conf_set_int("plugins/imageio/format/png/bpp", test->bpp);
+    dt_conf_set_int("plugins/imageio/format/png/compression", test->compress);
+  }
+  else
+  {
+    dt_conf_set_int("plugins/imageio/format/tiff/bpp", test->bpp);
+    dt_conf_set_int("plugins/imageio/format/tiff/compress", test->compress);
+  }
+  dt_imageio_module_data_t *params = format->get_params(format);
+  params->width = WIDTH;
+  params->height = HEIGHT;
+
+  void *in = make_input(test->bpp);
+  const size_t size = (size_t)3 * WIDTH * HEIGHT * test->bpp / 8;
+  gchar *filename = g_build_filename(g_get_tmp_dir(), "darktable-test-encoders", NULL);
+
+  void *expected = NULL;
+  if(pin_to_one_cpu())
+  {
+    if(!write_file(format, params, filename, in, test->bpp, 1)) expected = read_file(test, filename);
+    unpin();
+    (*n_tests)++;
+    if(expected)
+      printf("  [OK] sequential writer\n");
+    else
+    {
+      (*n_failed)++;
+      printf("  [FAIL] sequential writer\n");
+    }
+  }
+  else
+    printf("  [SKIP] the sequential writer needs a single cpu, only checking lossless formats\n");
+
+  void *input = test->lossless ? pack_input(in, test->bpp) : NULL;
+  if(input && expected && memcmp(input, expected, size))
+  {
+    (*n_tests)++;
+    (*n_failed)++;
+    printf("  [FAIL] sequential writer differs from the input\n");
+  }
+
+  // the row multiples handed to write_rows() at once, 0 for everything in one call
+  const int splits[] = { 1, 2, 3, 0 };
+  for(int s = 0; s < (int)(sizeof(splits) / sizeof(splits[0])); s++)
+  {
+    (*n_tests)++;
+    void *out = write_file(format, params, filename, in, test->bpp, splits[s]) ? NULL : read_file(test, filename);
+    const char *error = !out ? "can't be written or read back"
+                        : expected && memcmp(out, expected, size) ? "differs from the sequential writer"
+                        : input && memcmp(out, input, size) ? "differs from the input"
+                        : NULL;
+    if(error)
+    {
+      (*n_failed)++;
+      printf("  [FAIL] split %d: %s\n", splits[s], error);
+    }
+    else
+      printf("  [OK] split %d\n", splits[s]);
+    free(out);
+  }
+
+  g_unlink(filename);
+  g_free(filename);
+  free(input);
+  free(expected);
+  free(in);
+  format->free_params(format, params);
+  return *n_failed > 0 ? 1 : 0;
+}
+
+int main()
+{
+  char *argv[] = {"darktable-test-encoders", "--library", ":memory:", "--conf", "write_sidecar_files=FALSE", NULL};
+  int argc = sizeof(argv) / sizeof(*argv) - 1;
+
+  // init dt without gui and without data.db:
+  if(dt_init(argc, argv, FALSE, FALSE, NULL)) exit(1);
+
+  int n_tests_overall = 0, n_failed_overall = 0, n_test_functions = 0, n_test_functions_failed = 0;
+  for(int k = 0; k < (int)(sizeof(tests) / sizeof(tests[0])); k++)
+  {
+    int n_tests, n_failed;
+    printf("%s\n", tests[k].name);
+    n_test_functions++;
+    n_test_functions_failed += run_test(&tests[k], &n_tests, &n_failed);
+    n_tests_overall += n_tests;
+    n_failed_overall += n_failed;
+    printf("%d / %d tests failed\n\n", n_failed, n_tests);
+  }
+
+  printf("%d / %d tests failed (%d / %d)\n", n_failed_overall, n_tests_overall, n_test_functions_failed,
+         n_test_functions);
+
+  dt_cleanup();
+
+  return n_failed_overall > 0;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
@@ -0,0 +1,220 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2022 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// round trip of the metadata the tiff format writes: an exif blob and an xmp packet go in through
+// write_begin(), exiv2 reads them back from the file. small images are written row by row, large ones in
+// parallel compressed strips, both are checked.
+
+extern "C" {
+#include "common/darktable.h"
+#include "common/imageio_module.h"
+#include "control/conf.h"
+
+#include <glib/gstdio.h>
+}
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <exiv2/exiv2.hpp>
+
+static int n_tests = 0, n_failed = 0;
+
+static void check(const bool ok, const char *what, const std::string &result, const std::string &expected)
+{
+  n_tests++;
+  if(ok)
+    printf("  [OK] %s: '%s'\n", what, result.c_str());
+  else
+  {
+    n_failed++;
+    printf("  [FAIL] %s: '%s', expected: '%s'\n", what, result.c_str(), expected.c_str());
+  }
+}
+
+static std::string exif_value(const Exiv2::ExifData &exifData, const char *key)
+{
+  Exiv2::ExifData::const_iterator pos = exifData.findKey(Exiv2::ExifKey(key));
+  return pos == exifData.end() ? std::string() : pos->toString();
+}
+
+// rationals are compared by value, libtiff picks its own numerator and denominator
+static void check_rational(const Exiv2::ExifData &exifData, const char *key, const float *expected, const int n)
+{
+  Exiv2::ExifData::const_iterator pos = exifData.findKey(Exiv2::ExifKey(key));
+  bool ok = pos != exifData.end() && pos->count() == n;
+  std::string values;
+  for(int k = 0; k < n; k++)
+  {
+    if(ok) ok = fabsf(pos->toFloat(k) - expected[k]) < 1e-4f * fabsf(expected[k]);
+    values += (k ? " " : "") + std::to_string(expected[k]);
+  }
+  check(ok, key, pos == exifData.end() ? std::string() : pos->toString(), values);
+}
+
+static std::string xmp_value(const Exiv2::XmpData &xmpData, const char *key)
+{
+  Exiv2::XmpData::const_iterator pos = xmpData.findKey(Exiv2::XmpKey(key));
+  return pos == xmpData.end() ? std::string() : pos->toString();
+}
+
+static int test_tiff(dt_imageio_module_format_t *format, const int width, const int height, const int bpp,
+                     const int compress, const Exiv2::Blob &exif, const std::string &xmp)
+{
+  printf("tiff %dx%d, %d bit, compression %d\n", width, height, bpp, compress);
+  const int failed_before = n_failed;
+
+  dt_conf_set_int("plugins/imageio/format/tiff/bpp", bpp);
+  dt_conf_set_int("plugins/imageio/format/tiff/compress", compress);
+  dt_imageio_module_data_t *params = (dt_imageio_module_data_t *)format->get_params(format);
+  params->width = width;
+  params->height = height;
+
+  // a gradient, 4 channels per pixel like the pipe delivers them
+  const size_t bytes = bpp / 8;
+  uint8_t *pixels = (uint8_t *)malloc((size_t)4 * width * height * bytes);
+  for(size_t k = 0; k < (size_t)4 * width * height; k++)
+  {
+    const float v = (float)(k % (4 * width)) / (4 * width);
+    if(bpp == 8)
+      pixels[k] = (uint8_t)(255.0f * v);
+    else if(bpp == 16)
+      ((uint16_t *)pixels)[k] = (uint16_t)(65535.0f * v);
+    else
+      ((float *)pixels)[k] = v;
+  }
+
+  gchar *filename = g_build_filename(g_get_tmp_dir(), "darktable-test-tiff.tif", NULL);
+  int rows = 1;
+  void *handle = format->write_begin(params, filename, DT_COLORSPACE_NONE, NULL, (void *)exif.data(),
+                                     (int)exif.size(), xmp.c_str(), (int)xmp.size(), 0, 1, 1, &rows);
+  int res = !handle;
+  if(handle)
+  {
+    for(int y = 0; y < height && !res; y += rows)
+      res = format->write_rows(params, handle, pixels + (size_t)4 * y * width * bytes, y, MIN(rows, height - y));
+    res |= format->write_end(params, handle);
+  }
+  check(!res, "write", res ? "failed" : "written", "written");
+
+  if(!res)
+  {
+    try
+    {
+      std::unique_ptr<Exiv2::Image> image(Exiv2::ImageFactory::open(filename));
+      image->readMetadata();
+      const Exiv2::ExifData &exifData = image->exifData();
+      const Exiv2::XmpData &xmpData = image->xmpData();
+      const struct
+      {
+        const char *key, *expected;
+      } exif_tests[] = { { "Exif.Image.Make", "darktable" },
+                         { "Exif.Image.Model", "test camera" },
+                         { "Exif.Photo.ISOSpeedRatings", "400" },
+                         { "Exif.GPSInfo.GPSLatitudeRef", "N" } };
+      for(size_t k = 0; k < sizeof(exif_tests) / sizeof(exif_tests[0]); k++)
+      {
+        const std::string value = exif_value(exifData, exif_tests[k].key);
+        check(value == exif_tests[k].expected, exif_tests[k].key, value, exif_tests[k].expected);
+      }
+      const float exposure = 1.0f / 250.0f, fnumber = 2.8f, latitude[3] = { 48.0f, 8.0f, 30.0f };
+      check_rational(exifData, "Exif.Photo.ExposureTime", &exposure, 1);
+      check_rational(exifData, "Exif.Photo.FNumber", &fnumber, 1);
+      check_rational(exifData, "Exif.GPSInfo.GPSLatitude", latitude, 3);
+      // the image directory describes the pixels written, not what the blob says
+      const std::string w = exif_value(exifData, "Exif.Image.ImageWidth");
+      check(w == std::to_string(width), "Exif.Image.ImageWidth", w, std::to_string(width));
+      const std::string title = xmp_value(xmpData, "Xmp.dc.title");
+      check(title == "lang=\"x-default\" round trip", "Xmp.dc.title", title, "lang=\"x-default\" round trip");
+      const std::string creator = xmp_value(xmpData, "Xmp.dc.creator");
+      check(creator == "darktable", "Xmp.dc.creator", creator, "darktable");
+    }
+    catch(Exiv2::AnyError &e)
+    {
+      check(false, "read", e.what(), "metadata");
+    }
+  }
+
+  g_unlink(filename);
+  g_free(filename);
+  free(pixels);
+  format->free_params(format, params);
+  printf("\n");
+  return n_failed > failed_before;
+}
+
+int main()
+{
+  char *argv[] = { (char *)"darktable-test-tiff", (char *)"--library", (char *)":memory:", (char *)"--conf",
+                   (char *)"write_sidecar_files=FALSE", NULL };
+  int argc = sizeof(argv) / sizeof(*argv) - 1;
+
+  // init dt without gui and without data.db:
+  if(dt_init(argc, argv, FALSE, FALSE, NULL)) exit(1);
+
+  dt_imageio_module_format_t *format = dt_imageio_get_format_by_name("tiff");
+  if(!format || !format->write_begin)
+  {
+    printf("the tiff format module can't be found\n");
+    dt_cleanup();
+    return 1;
+  }
+
+  // an exif blob like dt_exif_read_blob() makes them, with exif and gps sub ifds
+  Exiv2::ExifData exifData;
+  exifData["Exif.Image.Make"] = "darktable";
+  exifData["Exif.Image.Model"] = "test camera";
+  exifData["Exif.Image.ImageWidth"] = uint32_t(1);
+  exifData["Exif.Photo.ExposureTime"] = Exiv2::URational(1, 250);
+  exifData["Exif.Photo.ISOSpeedRatings"] = uint16_t(400);
+  exifData["Exif.Photo.FNumber"] = Exiv2::URational(28, 10);
+  exifData["Exif.GPSInfo.GPSVersionID"] = "2 2 0 0";
+  exifData["Exif.GPSInfo.GPSLatitudeRef"] = "N";
+  exifData["Exif.GPSInfo.GPSLatitude"] = "48/1 8/1 30/1";
+  Exiv2::Blob blob;
+  Exiv2::ExifParser::encode(blob, Exiv2::littleEndian, exifData);
+  const Exiv2::byte header[] = { 'E', 'x', 'i', 'f', 0, 0 };
+  blob.insert(blob.begin(), header, header + sizeof(header));
+
+  Exiv2::XmpData xmpData;
+  xmpData["Xmp.dc.title"] = "lang=\"x-default\" round trip";
+  xmpData["Xmp.dc.creator"] = "darktable";
+  std::string xmp;
+  Exiv2::XmpParser::encode(xmp, xmpData, Exiv2::XmpParser::useCompactFormat);
+
+  int n_failed_overall = 0;
+  n_failed_overall += test_tiff(format, 64, 48, 8, 0, blob, xmp);
+  n_failed_overall += test_tiff(format, 64, 48, 16, 1, blob, xmp);
+  n_failed_overall += test_tiff(format, 64, 48, 32, 3, blob, xmp);
+  // large enough for the parallel strips
+  n_failed_overall += test_tiff(format, 2048, 2100, 16, 2, blob, xmp);
+
+  printf("%d / %d tests failed (%d / 4)\n", n_failed, n_tests, n_failed_overall);
+
+  dt_cleanup();
+
+  return n_failed > 0;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
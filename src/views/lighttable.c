@@ -274,74 +274,24 @@ static void _update_collected_images(dt_view_t *self)
 {
   dt_library_t *lib = (dt_library_t *)self->data;
   sqlite3_stmt *stmt;
-  int32_t min_before = 0, min_after = 0;
 
-  /* check if we can get a query from collection */
-  gchar *query = g_strdup(dt_collection_get_query(darktable.collection));
-  if(!query) return;
-
-  // we have a new query for the collection of images to display. For speed reason we collect all images into
-  // a temporary (in-memory) table (collected_images).
-  //
-  // 0. get current lower rowid
-  if (lib->full_preview_id != -1)
-  {
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT MIN(rowid) FROM memory.collected_images",
-                                -1, &stmt, NULL);
-    if(sqlite3_step(stmt) == SQLITE_ROW)
-    {
-      min_before = sqlite3_column_int(stmt, 0);
-    }
-    sqlite3_finalize(stmt);
-  }
-
-  // 1. drop previous data
-
-  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "DELETE FROM memory.collected_images", NULL, NULL,
-                        NULL);
-  // reset autoincrement. need in star_key_accel_callback
-  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "DELETE FROM memory.sqlite_sequence WHERE "
-                                                       "name='collected_images'", NULL, NULL, NULL);
-
-  // 2. insert collected images into the temporary table
-
-  gchar *ins_query = NULL;
-  ins_query = dt_util_dstrcat(ins_query, "INSERT INTO memory.collected_images (imgid) %s", query);
-
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), ins_query, -1, &stmt, NULL);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, 0);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, -1);
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-
-  g_free(query);
-  g_free(ins_query);
-
-  // 3. get new low-bound, then update the full preview rowid accordingly
-  if (lib->full_preview_id != -1)
+  // the collection keeps all its images in a temporary (in-memory) table (collected_images), ordered by
+  // rowid. it is either refilled from scratch, with rowids starting at 1 again, or single rows are removed.
+  // so for the full preview we stay at the same position, taking the next image if ours went away.
+  if(lib->full_preview_id != -1)
   {
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT MIN(rowid) FROM memory.collected_images",
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "SELECT imgid, rowid FROM memory.collected_images WHERE rowid >= ?1 "
+                                "ORDER BY rowid LIMIT 1",
                                 -1, &stmt, NULL);
-    if(sqlite3_step(stmt) == SQLITE_ROW)
-    {
-      min_after = sqlite3_column_int(stmt, 0);
-    }
-    sqlite3_finalize(stmt);
-
-    // note that this adjustement is needed as for a memory table the rowid doesn't start to 1 after the DELETE
-    // above,
-    // but rowid is incremented each time we INSERT.
-    lib->full_preview_rowid += (min_after - min_before);
-
-    char col_query[128] = { 0 };
-    snprintf(col_query, sizeof(col_query), "SELECT imgid FROM memory.collected_images WHERE rowid=%d", lib->full_preview_rowid);
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), col_query, -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, lib->full_preview_rowid);
     if(sqlite3_step(stmt) == SQLITE_ROW)
     {
       int nid = sqlite3_column_int(stmt, 0);
-      if (nid != lib->full_preview_id)
+      lib->full_preview_rowid = sqlite3_column_int(stmt, 1);
+      if(nid != lib->full_preview_id)
       {
-        lib->full_preview_id = sqlite3_column_int(stmt, 0);
+        lib->full_preview_id = nid;
         dt_control_set_mouse_over_id(lib->full_preview_id);
       }
     }
@@ -1305,7 +1255,7 @@ static int expose_full_preview(dt_view_t *self, cairo_t *cr, int32_t width, int3
       if(!dt_imageio_large_thumbnail(filename, &lib->full_res_thumb,
                                                &lib->full_res_thumb_wd,
                                                &lib->full_res_thumb_ht,
-                                               &color_space)) {
+                                               &color_space, 0, 0)) {
         lib->full_res_thumb_orientation = ORIENTATION_NONE;
         lib->full_res_thumb_id = lib->full_preview_id;
       }
@@ -1573,9 +1523,8 @@ static gboolean star_key_accel_callback(GtkAccelGroup *accel_group, GObject *acc
     dt_ratings_apply_to_selection(num);
   else
     dt_ratings_apply_to_image(mouse_over_id, num);
-  _update_collected_images(self);
 
-  dt_collection_update_query(darktable.collection); // update the counter
+  dt_collection_update_images(darktable.collection, mouse_over_id); // update the counter
   if(lib->collection_count != dt_collection_get_count(darktable.collection))
   {
     // some images disappeared from collection. Selection is now invisible.
@@ -1584,11 +1533,13 @@ static gboolean star_key_accel_callback(GtkAccelGroup *accel_group, GObject *acc
     dt_selection_clear(darktable.selection);
     if(lib->using_arrows)
     {
-      // Jump where stored before
+      // Jump where stored before. rated images might just have been removed from the collected images,
+      // so take the next remaining one, or the last one if we were at the end.
       sqlite3_stmt *stmt;
       DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                  "SELECT imgid FROM memory.collected_images WHERE rowid=?1 OR rowid=?1 - 1 "
-                                  "ORDER BY rowid DESC LIMIT 1", -1, &stmt,
+                                  "SELECT imgid FROM memory.collected_images WHERE rowid >= ?1 "
+                                  "OR rowid = (SELECT MAX(rowid) FROM memory.collected_images) "
+                                  "ORDER BY rowid LIMIT 1", -1, &stmt,
                                   NULL);
       DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, next_image_rowid);
       if(sqlite3_step(stmt) == SQLITE_ROW)
@@ -1876,7 +1827,7 @@ int button_pressed(dt_view_t *self, double x, double y, double pressure, int whi
         }
         else
           dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_RELAXED);
-        _update_collected_images(self);
+        dt_collection_update_images(darktable.collection, mouse_over_id);
         break;
       }
       case DT_VIEW_GROUP:
@@ -24,6 +24,7 @@
 #include "common/imageio_module.h"
 #include "control/conf.h"
 #include "control/control.h"
+#include "control/jobs/image_jobs.h"
 #include "gui/accelerators.h"
 #include "gui/gtk.h"
 #include "views/view.h"
@@ -34,6 +35,9 @@
 
 DT_MODULE(1)
 
+// number of images decoded ahead
+#define SLIDESHOW_PREFETCH 2
+
 typedef enum dt_slideshow_event_t
 {
   s_request_step,
@@ -73,6 +77,9 @@ typedef struct dt_slideshow_t
 
   uint32_t auto_advance;
 
+  // decodes the images coming up next while the current one is processed
+  dt_image_prefetch_t *prefetch;
+
   // some magic to hide the mosue pointer
   guint mouse_timeout;
 } dt_slideshow_t;
@@ -139,7 +146,7 @@ static uint32_t next_random(dt_slideshow_t *d)
 // process image
 static int process_next_image(dt_slideshow_t *d)
 {
-  dt_imageio_module_format_t buf;
+  dt_imageio_module_format_t buf = { 0 };
   dt_slideshow_format_t dat;
   buf.mime = mime;
   buf.levels = levels;
@@ -155,7 +162,8 @@ static int process_next_image(dt_slideshow_t *d)
   const int32_t cnt = dt_collection_get_count(darktable.collection);
   if(!cnt) return 1;
   dt_pthread_mutex_lock(&d->lock);
-  d->back_num = d->front_num + d->step;
+  const int32_t step = d->step;
+  d->back_num = d->front_num + step;
   int32_t ran = d->back_num;
   dt_pthread_mutex_unlock(&d->lock);
   // enumerated all images? i.e. prefetching the one two after the limit, when viewing the one past the end.
@@ -181,6 +189,27 @@ static int process_next_image(dt_slideshow_t *d)
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, rand);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, rand + 1);
   if(sqlite3_step(stmt) == SQLITE_ROW) id = sqlite3_column_int(stmt, 0);
+
+  // in order, the images after this one are known already
+  if(!d->use_random)
+  {
+    GList *upcoming = NULL;
+    for(int k = SLIDESHOW_PREFETCH; k > 0; k--)
+    {
+      int32_t next = (rand + k * step) % cnt;
+      while(next < 0) next += cnt;
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, next);
+      DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, next + 1);
+      if(sqlite3_step(stmt) == SQLITE_ROW)
+        upcoming = g_list_prepend(upcoming, GINT_TO_POINTER(sqlite3_column_int(stmt, 0)));
+    }
+    dt_pthread_mutex_lock(&d->lock);
+    dt_image_prefetch_set(d->prefetch, upcoming);
+    dt_pthread_mutex_unlock(&d->lock);
+    g_list_free(upcoming);
+  }
   sqlite3_finalize(stmt);
 
   // this is a little slow, might be worth to do an option:
@@ -372,6 +401,7 @@ void enter(dt_view_t *self)
   d->buf2 = dt_alloc_align(64, sizeof(uint32_t) * d->width * d->height);
   d->front = d->buf1;
   d->back = d->buf2;
+  d->prefetch = dt_image_prefetch_new(SLIDESHOW_PREFETCH);
 
   // start in prefetching phase, do that by initing one state before
   // and stepping through that at the very end of this function
@@ -403,6 +433,8 @@ void leave(dt_view_t *self)
   dt_free_align(d->buf1);
   dt_free_align(d->buf2);
   d->buf1 = d->buf2 = d->front = d->back = 0;
+  dt_image_prefetch_free(d->prefetch);
+  d->prefetch = NULL;
   dt_pthread_mutex_unlock(&d->lock);
 }
 
@@ -978,71 +978,13 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
     float scale = 1.0;
 
     cairo_surface_t *surface = NULL;
-    uint8_t *rgbbuf = NULL;
     if(buf.buf)
     {
-      rgbbuf = (uint8_t *)calloc(buf.width * buf.height * 4, sizeof(uint8_t));
+      // converted to the display profile once and then kept in the mipmap cache, so scrolling
+      // through the collection doesn't need any color management.
+      uint8_t *rgbbuf = (uint8_t *)dt_mipmap_cache_get_display_buffer(darktable.mipmap_cache, &buf);
       if(rgbbuf)
       {
-        gboolean have_lock = FALSE;
-        cmsHTRANSFORM transform = NULL;
-
-        if(dt_conf_get_bool("cache_color_managed"))
-        {
-          pthread_rwlock_rdlock(&darktable.color_profiles->xprofile_lock);
-          have_lock = TRUE;
-
-          // we only color manage when a thumbnail is sRGB or AdobeRGB. everything else just gets dumped to the screen
-          if(buf.color_space == DT_COLORSPACE_SRGB &&
-             darktable.color_profiles->transform_srgb_to_display)
-          {
-            transform = darktable.color_profiles->transform_srgb_to_display;
-          }
-          else if(buf.color_space == DT_COLORSPACE_ADOBERGB &&
-                  darktable.color_profiles->transform_adobe_rgb_to_display)
-          {
-            transform = darktable.color_profiles->transform_adobe_rgb_to_display;
-          }
-          else
-          {
-            pthread_rwlock_unlock(&darktable.color_profiles->xprofile_lock);
-            have_lock = FALSE;
-            if(buf.color_space == DT_COLORSPACE_NONE)
-            {
-              fprintf(stderr, "oops, there seems to be a code path not setting the color space of thumbnails!\n");
-            }
-            else if(buf.color_space != DT_COLORSPACE_DISPLAY)
-            {
-              fprintf(stderr, "oops, there seems to be a code path setting an unhandled color space of thumbnails (%s)!\n",
-                      dt_colorspaces_get_name(buf.color_space, "from file"));
-            }
-          }
-        }
-
-#ifdef _OPENMP
-  #pragma omp parallel for schedule(static) default(none) shared(buf, rgbbuf, transform)
-#endif
-        for(int i = 0; i < buf.height; i++)
-        {
-          const uint8_t *in = buf.buf + i * buf.width * 4;
-          uint8_t *out = rgbbuf + i * buf.width * 4;
-
-          if(transform)
-          {
-            cmsDoTransform(transform, in, out, buf.width);
-          }
-          else
-          {
-            for(int j = 0; j < buf.width; j++, in += 4, out += 4)
-            {
-              out[0] = in[2];
-              out[1] = in[1];
-              out[2] = in[0];
-            }
-          }
-        }
-        if(have_lock) pthread_rwlock_unlock(&darktable.color_profiles->xprofile_lock);
-
         const int32_t stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, buf.width);
         surface
           = cairo_image_surface_create_for_data(rgbbuf, CAIRO_FORMAT_RGB24, buf.width, buf.height, stride);
@@ -1084,8 +1026,6 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
       cairo_rectangle(cr, 0, 0, buf.width, buf.height);
     }
 
-    free(rgbbuf);
-
     if (image_only)
     {
       cairo_restore(cr);
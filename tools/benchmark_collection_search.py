@@ -0,0 +1,191 @@
+#!/usr/bin/python3
+#
+# Benchmark of the collection text filters: times the plain LIKE filters against the ones going through the
+# trigram fts5 index (see _get_search_match() in src/common/collection.c) on a synthetic library.
+#
+# Usage: benchmark_collection_search.py [-n images] [-r runs] [-o library.db]
+#
+# The queries are built like collection.c builds them. sqlite's own "trigram" tokenizer (sqlite >= 3.34)
+# stands in for darktable's dt_trigram, which only exists inside darktable. The two only differ in case
+# folding of non-ascii characters, and the generated text is ascii.
+#
+
+import argparse
+import os
+import random
+import sqlite3
+import statistics
+import tempfile
+import time
+
+# from tools/metadata.txt
+CREATOR, PUBLISHER, TITLE, DESCRIPTION, RIGHTS = range(5)
+# DT_DATABASE_SEARCH_KEY_BITS in src/common/database.h
+KEY_BITS = 4
+
+LENSES = ["EF24-70mm f/2.8L II USM", "EF70-200mm f/4L IS USM", "EF50mm f/1.8 STM", "EF100mm f/2.8L Macro IS USM",
+          "AF-S Nikkor 24-120mm f/4G ED VR", "AF-S Nikkor 50mm f/1.4G", "AF-S DX Nikkor 18-55mm f/3.5-5.6G VR",
+          "FE 24-105mm F4 G OSS", "FE 85mm F1.8", "XF16-55mmF2.8 R LM WR", "XF35mmF1.4 R",
+          "M.Zuiko Digital ED 12-40mm F2.8 PRO", "Lumix G Vario 12-35mm F2.8", "Sigma 35mm F1.4 DG HSM | A",
+          "Tamron SP 70-200mm F/2.8 Di VC USD G2", "Samyang 14mm f/2.8 ED AS IF UMC"]
+WORDS = ["sunset", "mountain", "harbour", "portrait", "wedding", "forest", "river", "street", "market", "winter",
+         "summer", "festival", "cathedral", "lighthouse", "meadow", "canyon", "glacier", "village", "concert",
+         "garden", "bridge", "desert", "island", "station", "museum", "family", "birthday", "holiday", "storm",
+         "harvest"]
+NAMES = ["Anna Berg", "Jonas Keller", "Maria Lopez", "Kenji Sato", "Olivia Brown", "Lukas Novak", "Sofia Rossi",
+         "Pierre Martin", "Ewa Kowalska", "Daniel Smith"]
+
+
+def create(db, n):
+  rng = random.Random(1)
+  db.executescript("""
+    CREATE TABLE main.film_rolls (id INTEGER PRIMARY KEY, access_timestamp INTEGER, folder VARCHAR(1024));
+    CREATE TABLE main.images (id INTEGER PRIMARY KEY AUTOINCREMENT, film_id INTEGER, filename VARCHAR,
+                              lens VARCHAR, flags INTEGER);
+    CREATE TABLE main.meta_data (id INTEGER, key INTEGER, value VARCHAR);
+    CREATE INDEX main.metadata_index ON meta_data (id, key);
+    CREATE TABLE main.tagged_images (imgid INTEGER, tagid INTEGER, PRIMARY KEY (imgid, tagid));
+    CREATE TABLE data.tags (id INTEGER PRIMARY KEY, name VARCHAR);
+  """)
+  rolls = max(1, n // 250)
+  db.executemany("INSERT INTO main.film_rolls (id, folder) VALUES (?1, ?2)",
+                 ((r, "/home/photos/%d/%02d/%s" % (2005 + r % 15, 1 + r % 12, rng.choice(WORDS)))
+                  for r in range(1, rolls + 1)))
+  db.executemany("INSERT INTO data.tags (id, name) VALUES (?1, ?2)",
+                 ((t, "places|%s|%s" % (WORDS[t % len(WORDS)], WORDS[(t * 7) % len(WORDS)]))
+                  for t in range(1, 301)))
+
+  def images():
+    for i in range(1, n + 1):
+      prefix = rng.choice(["IMG_", "DSC", "_MG_", "P"])
+      extension = rng.choice(["CR2", "NEF", "ARW", "RAF", "jpg"])
+      yield (i, 1 + (i - 1) * rolls // n, "%s%07d.%s" % (prefix, i, extension), rng.choice(LENSES),
+             rng.randrange(6))
+
+  def meta_data():
+    for i in range(1, n + 1):
+      if rng.random() < 0.9: yield (i, CREATOR, rng.choice(NAMES))
+      if rng.random() < 0.6: yield (i, TITLE, " ".join(rng.sample(WORDS, 2)))
+      if rng.random() < 0.3:
+        yield (i, DESCRIPTION, "%s near the %s, shot %d" % (rng.choice(WORDS), rng.choice(WORDS), i))
+      if rng.random() < 0.2: yield (i, RIGHTS, "CC BY-SA 4.0")
+
+  def tagged_images():
+    for i in range(1, n + 1):
+      for t in rng.sample(range(1, 301), rng.randrange(4)): yield (i, t)
+
+  db.executemany("INSERT INTO main.images (id, film_id, filename, lens, flags) VALUES (?1, ?2, ?3, ?4, ?5)",
+                 images())
+  db.executemany("INSERT INTO main.meta_data (id, key, value) VALUES (?1, ?2, ?3)", meta_data())
+  db.executemany("INSERT INTO main.tagged_images (imgid, tagid) VALUES (?1, ?2)", tagged_images())
+  db.commit()
+
+
+def index(db):
+  # what _create_search_index() in src/common/database.c does when it rebuilds the index
+  db.executescript("""
+    CREATE VIRTUAL TABLE main.images_fts USING fts5(lens, filename, tokenize = 'trigram');
+    CREATE VIRTUAL TABLE main.meta_data_fts USING fts5(value, tokenize = 'trigram');
+    INSERT INTO main.images_fts (rowid, lens, filename) SELECT id, lens, filename FROM main.images;
+    INSERT OR REPLACE INTO main.meta_data_fts (rowid, value) SELECT (id << %d) | key, value FROM main.meta_data;
+  """ % KEY_BITS)
+  db.commit()
+
+
+def search_match(column, pattern):
+  # _get_search_match(): every run of at least three characters between the wildcards becomes a phrase
+  runs = [r for r in pattern.replace("_", "%").split("%") if len(r) >= 3]
+  if not runs: return None
+  return " AND ".join('%s : "%s"' % (column, r.replace('"', '""')) for r in runs).replace("'", "''")
+
+
+def images_text_query(column, text, fts):
+  match = search_match(column, text) if fts else None
+  if match:
+    return "(id IN (SELECT rowid FROM main.images_fts WHERE images_fts MATCH '%s') AND %s LIKE '%%%s%%')" \
+           % (match, column, text)
+  return "(%s LIKE '%%%s%%')" % (column, text)
+
+
+def meta_data_query(key, text, fts):
+  match = search_match("value", text) if fts else None
+  if match:
+    return "(id IN (SELECT rowid >> %d FROM main.meta_data_fts WHERE meta_data_fts MATCH '%s' AND " \
+           "(rowid & %d) = %d AND value LIKE '%%%s%%'))" % (KEY_BITS, match, (1 << KEY_BITS) - 1, key, text)
+  return "(id IN (SELECT id FROM main.meta_data WHERE key = %d AND value LIKE '%%%s%%'))" % (key, text)
+
+
+def tag_query(text, fts):
+  return "(id IN (SELECT imgid FROM main.tagged_images AS a JOIN data.tags AS b ON a.tagid = b.id " \
+         "WHERE name LIKE '%%%s%%'))" % text
+
+
+def folder_query(text, fts):
+  return "(film_id IN (SELECT id FROM main.film_rolls WHERE folder LIKE '%%%s%%'))" % text
+
+
+QUERIES = [
+  ("filename", lambda t, f: images_text_query("filename", t, f), ["0123456", "DSC00", "NEF", "_MG_01%.CR2"]),
+  ("lens", lambda t, f: images_text_query("lens", t, f), ["70-200", "Macro", "f/1.4G", "XF"]),
+  ("title", lambda t, f: meta_data_query(TITLE, t, f), ["lighthouse", "sun", "winter%bridge"]),
+  ("description", lambda t, f: meta_data_query(DESCRIPTION, t, f), ["shot 4711", "cathedral", "near"]),
+  ("creator", lambda t, f: meta_data_query(CREATOR, t, f), ["Kenji", "Novak", "a"]),
+  ("tag", tag_query, ["harbour", "places|winter"]),
+  ("folder", folder_query, ["2011/1", "festival"]),
+]
+
+
+def measure(db, where, runs):
+  query = "SELECT COUNT(DISTINCT id) FROM main.images WHERE %s" % where
+  times = []
+  for _ in range(runs):
+    start = time.perf_counter()
+    count = db.execute(query).fetchone()[0]
+    times.append((time.perf_counter() - start) * 1000.0)
+  return count, statistics.median(times)
+
+
+def main():
+  parser = argparse.ArgumentParser(description="time collection text filters with and without the search index")
+  parser.add_argument("-n", "--images", type=int, default=500000, help="number of images (default 500000)")
+  parser.add_argument("-r", "--runs", type=int, default=5, help="runs per query, the median is shown")
+  parser.add_argument("-o", "--output", help="keep the synthetic library in this file")
+  args = parser.parse_args()
+
+  if args.output:
+    path = args.output
+    if os.path.exists(path): os.remove(path)
+  else:
+    fd, path = tempfile.mkstemp(suffix=".db")
+    os.close(fd)
+  db = sqlite3.connect(path)
+  db.execute("ATTACH DATABASE ':memory:' AS data")
+  try:
+    start = time.perf_counter()
+    create(db, args.images)
+    print("created %d images in %.1f s" % (args.images, time.perf_counter() - start))
+    start = time.perf_counter()
+    index(db)
+    print("built the search index in %.1f s, like a rebuild at startup\n" % (time.perf_counter() - start))
+
+    print("%-12s %-16s %8s %10s %10s %8s" % ("property", "pattern", "images", "like ms", "fts ms", "speedup"))
+    for name, query, patterns in QUERIES:
+      for pattern in patterns:
+        count, like_ms = measure(db, query(pattern, False), args.runs)
+        fts_count, fts_ms = measure(db, query(pattern, True), args.runs)
+        if fts_count != count:
+          raise SystemExit("%s '%s': %d images with the index, %d without" % (name, pattern, fts_count, count))
+        indexed = query(pattern, True) != query(pattern, False)
+        print("%-12s %-16s %8d %10.1f %10s %8s" % (name, pattern, count, like_ms,
+                                                  "%.1f" % fts_ms if indexed else "-",
+                                                  "%.1fx" % (like_ms / max(fts_ms, 1e-3)) if indexed else "-"))
+  finally:
+    db.close()
+    if not args.output: os.remove(path)
+
+
+if __name__ == "__main__":
+  main()
+
+# modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+# vim: shiftwidth=2 expandtab tabstop=2 cindent